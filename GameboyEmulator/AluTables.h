@@ -0,0 +1,76 @@
+#pragma once
+#include <array>
+#include "Helpers.h"
+
+// Precomputed results for the 8-bit arithmetic ops
+// Each entry holds the result in the low byte and F in the high byte
+// ADD and SUB tables are indexed by carry-in << 16 | A << 8 | operand, CP uses SUB with carry-in 0
+// INC and DEC tables are indexed by the value, their C bit is always 0 since the op keeps the old carry
+struct SAluTables
+{
+	static constexpr U8 ZERO_FLAG = 1 << SRegisters::SFlagRegister::ZERO_FLAG_POSITION;
+	static constexpr U8 SUBTRACTION_FLAG = 1 << SRegisters::SFlagRegister::SUBTRACTION_FLAG_POSITION;
+	static constexpr U8 HALF_CARRY_FLAG = 1 << SRegisters::SFlagRegister::HALF_CARRY_FLAG_POSITION;
+	static constexpr U8 CARRY_FLAG = 1 << SRegisters::SFlagRegister::CARRY_FLAG_POSITION;
+
+	std::array<U16, 0x20000> Add{};
+	std::array<U16, 0x20000> Sub{};
+	std::array<U16, 0x100> Inc{};
+	std::array<U16, 0x100> Dec{};
+
+	// Tables are generated on first use, 512KB in total
+	static const SAluTables& Get()
+	{
+		static const SAluTables tables;
+		return tables;
+	}
+
+	[[nodiscard]] static constexpr U32 Index(const U8 a, const U8 value, const bool carry)
+	{
+		return static_cast<U32>(carry) << 16 | a << 8 | value;
+	}
+
+private:
+	SAluTables()
+	{
+		for (U32 carry = 0; carry < 2; ++carry)
+		{
+			for (U32 a = 0; a < 0x100; ++a)
+			{
+				for (U32 value = 0; value < 0x100; ++value)
+				{
+					const U32 index = carry << 16 | a << 8 | value;
+
+					const U32 sum = a + value + carry;
+					U8 f = 0;
+					f |= (sum & 0xFF) == 0 ? ZERO_FLAG : 0;
+					f |= (a & 0xF) + (value & 0xF) + carry > 0xF ? HALF_CARRY_FLAG : 0;
+					f |= sum > 0xFF ? CARRY_FLAG : 0;
+					Add[index] = static_cast<U16>(f << 8 | (sum & 0xFF));
+
+					const int difference = static_cast<int>(a) - static_cast<int>(value) - static_cast<int>(carry);
+					f = SUBTRACTION_FLAG;
+					f |= (difference & 0xFF) == 0 ? ZERO_FLAG : 0;
+					f |= static_cast<int>(a & 0xF) - static_cast<int>(value & 0xF) - static_cast<int>(carry) < 0 ? HALF_CARRY_FLAG : 0;
+					f |= difference < 0 ? CARRY_FLAG : 0;
+					Sub[index] = static_cast<U16>(f << 8 | (difference & 0xFF));
+				}
+			}
+		}
+
+		for (U32 value = 0; value < 0x100; ++value)
+		{
+			const U8 incremented = static_cast<U8>(value + 1);
+			U8 f = 0;
+			f |= incremented == 0 ? ZERO_FLAG : 0;
+			f |= (value & 0xF) == 0xF ? HALF_CARRY_FLAG : 0;
+			Inc[value] = static_cast<U16>(f << 8 | incremented);
+
+			const U8 decremented = static_cast<U8>(value - 1);
+			f = SUBTRACTION_FLAG;
+			f |= decremented == 0 ? ZERO_FLAG : 0;
+			f |= (value & 0xF) == 0 ? HALF_CARRY_FLAG : 0;
+			Dec[value] = static_cast<U16>(f << 8 | decremented);
+		}
+	}
+};
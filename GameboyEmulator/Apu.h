@@ -0,0 +1,861 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include "Helpers.h"
+#include "MemoryBus.h"
+#include "Scheduler.h"
+
+// One output sample, 16 bit signed like the WAV files that are written
+struct SStereoSample
+{
+	int16_t Left = 0;
+	int16_t Right = 0;
+};
+
+// Gets the samples of every batch the APU completes
+class IAudioSink
+{
+public:
+	virtual ~IAudioSink() = default;
+	virtual void OnSamples(const SStereoSample* samples, size_t count) = 0;
+
+	// Factor applied to the sample rate of the next batch
+	// A sink that is played at a fixed rate asks for a little more or less to keep its buffer half full
+	[[nodiscard]] virtual double GetRateRatio() const
+	{
+		return 1.0;
+	}
+};
+
+// Band-limited step synthesis of one output channel
+// The APU output only changes in steps at clock cycles, each step is added as a windowed sinc
+// placed between two output samples with 1/32 sample precision, so resampling from the
+// clock to the sample rate costs TAPS multiply-adds per step instead of a filter per cycle
+// Steps are stored as deltas and summed up as samples are read
+class CBandLimitedBuffer
+{
+public:
+	static constexpr U32 PHASE_BITS = 5;
+	static constexpr U32 PHASES = 1 << PHASE_BITS;
+	static constexpr U32 TAPS = 16;
+	// Samples a batch may hold, far more than a frame sequencer step at any sample rate up to 192 kHz
+	static constexpr size_t CAPACITY = 4096;
+
+	using Kernel = std::array<std::array<int32_t, TAPS>, PHASES>;
+
+	void SetRates(const double clockRate, const double sampleRate)
+	{
+		m_Factor = static_cast<U64>(sampleRate / clockRate * static_cast<double>(FRACTION_ONE) + 0.5);
+	}
+
+	// Adds a step of delta at clocks since the start of the batch
+	void AddDelta(const U64 clocks, const int32_t delta)
+	{
+		const U64 position = clocks * m_Factor + m_Offset;
+		const size_t index = static_cast<size_t>(position >> FRACTION_BITS);
+		// Only a save state from another batch length could place a step past the end
+		if (index + TAPS > m_Deltas.size())
+		{
+			return;
+		}
+		const std::array<int32_t, TAPS>& kernel = getKernel()[(position >> (FRACTION_BITS - PHASE_BITS)) & (PHASES - 1)];
+		int32_t* const deltas = m_Deltas.data() + index;
+		for (U32 tap = 0; tap < TAPS; ++tap)
+		{
+			deltas[tap] += kernel[tap] * delta;
+		}
+		m_Used = std::max(m_Used, index + TAPS);
+	}
+
+	// Makes the samples up to clocks since the start of the batch readable, the next batch starts there
+	void EndBatch(const U64 clocks)
+	{
+		m_Offset += clocks * m_Factor;
+	}
+
+	[[nodiscard]] size_t GetAvailable() const
+	{
+		return static_cast<size_t>(m_Offset >> FRACTION_BITS);
+	}
+
+	// Takes up to count samples off the front of both sides
+	// The two sums are a chain of dependent operations each, they are run side by side
+	static size_t ReadStereo(CBandLimitedBuffer& left, CBandLimitedBuffer& right, SStereoSample* out, size_t count)
+	{
+		count = std::min({ count, left.GetAvailable(), right.GetAvailable() });
+		int32_t leftSum = left.m_Sum;
+		int32_t rightSum = right.m_Sum;
+		for (size_t i = 0; i < count; ++i)
+		{
+			out[i].Left = integrate(leftSum, left.m_Deltas[i]);
+			out[i].Right = integrate(rightSum, right.m_Deltas[i]);
+		}
+		left.m_Sum = leftSum;
+		right.m_Sum = rightSum;
+		left.remove(count);
+		right.remove(count);
+		return count;
+	}
+
+	// Drops every step, the batch start keeps its position between two samples
+	void Clear()
+	{
+		std::fill(m_Deltas.begin(), m_Deltas.end(), 0);
+		m_Offset &= FRACTION_ONE - 1;
+		m_Used = 0;
+		m_Sum = 0;
+	}
+
+private:
+	static constexpr U32 FRACTION_BITS = 32;
+	static constexpr U64 FRACTION_ONE = 1ull << FRACTION_BITS;
+	static constexpr U32 DELTA_BITS = 15;
+	static constexpr U32 BASS_SHIFT = 9;
+
+	std::array<int32_t, CAPACITY + TAPS> m_Deltas{};
+	// Output samples per clock and the position of the batch start, 32.32 fixed point
+	U64 m_Factor = 0;
+	U64 m_Offset = 0;
+	// Deltas past the last one written are zero
+	size_t m_Used = 0;
+	int32_t m_Sum = 0;
+
+	// Adds the delta to the sum and returns the sample, the sum leaks towards zero for a high-pass at about 15 Hz
+	[[nodiscard]] static int16_t integrate(int32_t& sum, const int32_t delta)
+	{
+		sum += delta;
+		const int32_t sample = std::clamp(sum >> DELTA_BITS, -0x8000, 0x7FFF);
+		sum -= sample * (1 << (DELTA_BITS - BASS_SHIFT));
+		return static_cast<int16_t>(sample);
+	}
+
+	// Moves the deltas after the first count samples to the front
+	void remove(const size_t count)
+	{
+		const size_t used = std::max(m_Used, count);
+		std::memmove(m_Deltas.data(), m_Deltas.data() + count, (used - count) * sizeof(int32_t));
+		std::fill(m_Deltas.begin() + (used - count), m_Deltas.begin() + used, 0);
+		m_Used = used - count;
+		m_Offset -= static_cast<U64>(count) << FRACTION_BITS;
+	}
+
+	// Every phase sums to 1 << DELTA_BITS so a step of delta settles at exactly delta
+	[[nodiscard]] static const Kernel& getKernel()
+	{
+		static const Kernel kernel = [] {
+			constexpr double PI = 3.14159265358979323846;
+			// Cut off a little below the Nyquist frequency, the window does not fall off steeply
+			constexpr double CUTOFF = 0.9;
+			Kernel phases{};
+			for (U32 phase = 0; phase < PHASES; ++phase)
+			{
+				std::array<double, TAPS> taps{};
+				double total = 0.0;
+				for (U32 tap = 0; tap < TAPS; ++tap)
+				{
+					const double x = static_cast<double>(tap) - (TAPS / 2 - 1) - static_cast<double>(phase) / PHASES;
+					const double sinc = x == 0.0 ? 1.0 : std::sin(PI * CUTOFF * x) / (PI * CUTOFF * x);
+					const double window = 0.42 + 0.5 * std::cos(2.0 * PI * x / TAPS) + 0.08 * std::cos(4.0 * PI * x / TAPS);
+					taps[tap] = sinc * window;
+					total += taps[tap];
+				}
+				int32_t sum = 0;
+				for (U32 tap = 0; tap < TAPS; ++tap)
+				{
+					phases[phase][tap] = static_cast<int32_t>(std::lround(taps[tap] / total * (1 << DELTA_BITS)));
+					sum += phases[phase][tap];
+				}
+				// The rounding error goes to the center tap
+				phases[phase][TAPS / 2 - 1 + phase * 2 / PHASES] += (1 << DELTA_BITS) - sum;
+			}
+			return phases;
+		}();
+		return kernel;
+	}
+};
+
+// Sound controller, FF10-FF26 and the wave RAM at FF30-FF3F
+// Nothing is clocked per cycle: the channels are caught up when a register is written and at
+// the frame sequencer event every 8192 cycles, catching up walks the waveform steps of each
+// channel and adds a band-limited step to the output whenever its level changes
+// The frame sequencer event also ends a batch, its samples are handed to the sink at once
+// The frame sequencer runs from the clock rather than from DIV
+class CApu : public IIoDevice
+{
+public:
+	static constexpr U16 NR10_ADDRESS = 0xFF10;
+	static constexpr U16 NR11_ADDRESS = 0xFF11;
+	static constexpr U16 NR12_ADDRESS = 0xFF12;
+	static constexpr U16 NR13_ADDRESS = 0xFF13;
+	static constexpr U16 NR14_ADDRESS = 0xFF14;
+	static constexpr U16 NR21_ADDRESS = 0xFF16;
+	static constexpr U16 NR22_ADDRESS = 0xFF17;
+	static constexpr U16 NR23_ADDRESS = 0xFF18;
+	static constexpr U16 NR24_ADDRESS = 0xFF19;
+	static constexpr U16 NR30_ADDRESS = 0xFF1A;
+	static constexpr U16 NR31_ADDRESS = 0xFF1B;
+	static constexpr U16 NR32_ADDRESS = 0xFF1C;
+	static constexpr U16 NR33_ADDRESS = 0xFF1D;
+	static constexpr U16 NR34_ADDRESS = 0xFF1E;
+	static constexpr U16 NR41_ADDRESS = 0xFF20;
+	static constexpr U16 NR42_ADDRESS = 0xFF21;
+	static constexpr U16 NR43_ADDRESS = 0xFF22;
+	static constexpr U16 NR44_ADDRESS = 0xFF23;
+	static constexpr U16 NR50_ADDRESS = 0xFF24;
+	static constexpr U16 NR51_ADDRESS = 0xFF25;
+	static constexpr U16 NR52_ADDRESS = 0xFF26;
+	static constexpr U16 WAVE_START = 0xFF30;
+	static constexpr U16 WAVE_LAST = 0xFF3F;
+
+	static constexpr U32 CHANNEL_COUNT = 4;
+	// Cycles per frame sequencer step, 512 Hz
+	static constexpr U32 SEQUENCER_PERIOD = 8192;
+	static constexpr U32 DEFAULT_SAMPLE_RATE = 48000;
+
+	struct SStats
+	{
+		// Batches ended and samples handed to the sink
+		U64 Batches = 0;
+		U64 Samples = 0;
+		// Level changes added to the output
+		U64 Steps = 0;
+	};
+
+	// Internal state of a channel, part of the save state format
+	struct SChannel
+	{
+		// Cycle of the next step of the waveform
+		U64 NextStep = 0;
+		U16 Length = 0;
+		// Channel 1 frequency the sweep works on
+		U16 SweepShadow = 0;
+		U16 Lfsr = 0;
+		U8 Enabled = 0;
+		U8 Volume = 0;
+		U8 EnvelopeTimer = 0;
+		// Duty step or wave sample
+		U8 Position = 0;
+		U8 SweepTimer = 0;
+		U8 SweepEnabled = 0;
+		// 0 to 15, what the DAC is given
+		U8 Level = 0;
+		std::array<U8, 3> Padding{};
+	};
+
+	// Part of the save state format
+	struct SState
+	{
+		// FF10-FF3F as written, the wave RAM is the last 16 bytes
+		std::array<U8, 0x30> Registers{};
+		std::array<SChannel, CHANNEL_COUNT> Channels{};
+		U64 Sync = 0;
+		U64 BatchStart = 0;
+		U8 SequencerStep = 0;
+		std::array<U8, 7> Padding{};
+	};
+
+	CApu(CScheduler& scheduler, const U64& clock)
+		: m_Scheduler(scheduler), m_Clock(clock)
+	{
+		m_Scheduler.SetCallback(EEvent::ApuSequencer, &CApu::onSequencer, this);
+		m_Scheduler.Schedule(EEvent::ApuSequencer, SEQUENCER_PERIOD);
+		SetSampleRate(DEFAULT_SAMPLE_RATE);
+	}
+
+	CApu(const CApu&) = delete;
+	CApu& operator=(const CApu&) = delete;
+
+	// Levels only change at writes and sequencer steps, so nothing has to be caught up to read
+	U8 ReadIo(const U16 address) override
+	{
+		if (address >= WAVE_START)
+		{
+			return reg(address);
+		}
+		if (address == NR52_ADDRESS)
+		{
+			U8 status = isPowered() ? 0xF0 : 0x70;
+			for (U32 channel = 0; channel < CHANNEL_COUNT; ++channel)
+			{
+				status |= m_Channels[channel].Enabled << channel;
+			}
+			return status;
+		}
+		const U32 index = address - NR10_ADDRESS;
+		return index < READ_MASKS.size() ? reg(address) | READ_MASKS[index] : 0xFF;
+	}
+
+	void WriteIo(const U16 address, const U8 value) override
+	{
+		catchUp(m_Clock);
+		if (address >= WAVE_START)
+		{
+			reg(address) = value;
+			updateLevels();
+			return;
+		}
+		if (address == NR52_ADDRESS)
+		{
+			setPowered((value & 0x80) != 0);
+			return;
+		}
+		// Registers are read-only while the APU is off
+		if (!isPowered() || address > NR52_ADDRESS)
+		{
+			return;
+		}
+		reg(address) = value;
+		switch (address)
+		{
+		case NR11_ADDRESS:
+		case NR21_ADDRESS:
+		case NR41_ADDRESS:
+			m_Channels[getChannel(address)].Length = 64 - (value & 0x3F);
+			break;
+		case NR31_ADDRESS:
+			m_Channels[2].Length = 256 - value;
+			break;
+		case NR12_ADDRESS:
+		case NR22_ADDRESS:
+		case NR30_ADDRESS:
+		case NR42_ADDRESS:
+			// Turning the DAC off turns the channel off
+			if (!isDacOn(getChannel(address)))
+			{
+				m_Channels[getChannel(address)].Enabled = 0;
+			}
+			break;
+		case NR14_ADDRESS:
+		case NR24_ADDRESS:
+		case NR34_ADDRESS:
+		case NR44_ADDRESS:
+			if ((value & 0x80) != 0)
+			{
+				trigger(getChannel(address));
+			}
+			break;
+		case NR50_ADDRESS:
+		case NR51_ADDRESS:
+			updateGains();
+			break;
+		default:
+			break;
+		}
+		updateLevels();
+	}
+
+	// Samples are made for a sink only, without one the channels run but nothing is synthesized
+	void SetSampleSink(IAudioSink* sink)
+	{
+		catchUp(m_Clock);
+		m_Sink = sink;
+		m_Left.Clear();
+		m_Right.Clear();
+		m_RateRatio = 1.0;
+		updateRates();
+	}
+
+	void SetSampleRate(const U32 sampleRate)
+	{
+		m_SampleRate = sampleRate;
+		updateRates();
+	}
+
+	[[nodiscard]] U32 GetSampleRate() const
+	{
+		return m_SampleRate;
+	}
+
+	[[nodiscard]] const SStats& GetStats() const
+	{
+		return m_Stats;
+	}
+
+	void SaveState(SState& state) const
+	{
+		state.Registers = m_Registers;
+		state.Channels = m_Channels;
+		state.Sync = m_Sync;
+		state.BatchStart = m_BatchStart;
+		state.SequencerStep = m_SequencerStep;
+	}
+
+	// The sequencer event is restored with the scheduler, the output moves to the loaded levels
+	void LoadState(const SState& state)
+	{
+		m_Registers = state.Registers;
+		m_Channels = state.Channels;
+		m_Sync = state.Sync;
+		m_BatchStart = state.BatchStart;
+		m_SequencerStep = state.SequencerStep & 0b111;
+		updateGains();
+	}
+
+private:
+	static constexpr double CLOCK_RATE = 4194304.0;
+	// Four channels at level 15 and volume 8 stay below the 16 bit limit
+	static constexpr U32 VOLUME_UNIT = 64;
+	// OR-ed into reads of FF10-FF26, write-only bits read as 1
+	static constexpr std::array<U8, 0x17> READ_MASKS = {
+		0x80, 0x3F, 0x00, 0xFF, 0xBF,
+		0xFF, 0x3F, 0x00, 0xFF, 0xBF,
+		0x7F, 0xFF, 0x9F, 0xFF, 0xBF,
+		0xFF, 0xFF, 0x00, 0x00, 0xBF,
+		0x00, 0x00, 0x70
+	};
+	// Duty step outputs of the square channels, step 0 is the lowest bit
+	static constexpr std::array<U8, 4> DUTY_PATTERNS = { 0b00000001, 0b10000001, 0b10000111, 0b01111110 };
+	// Right shift of a wave sample by the NR32 volume code
+	static constexpr std::array<U8, 4> WAVE_SHIFTS = { 4, 0, 1, 2 };
+	// A square above this period is inaudible, it is held at its average level instead of stepped
+	static constexpr U32 MIN_AUDIBLE_SQUARE_PERIOD = (2048 - 2041) * 4;
+
+	CScheduler& m_Scheduler;
+	const U64& m_Clock;
+
+	std::array<U8, 0x30> m_Registers{};
+	std::array<SChannel, CHANNEL_COUNT> m_Channels{};
+	// The channels are caught up to m_Sync, steps are placed relative to m_BatchStart
+	U64 m_Sync = 0;
+	U64 m_BatchStart = 0;
+	U8 m_SequencerStep = 0;
+
+	// Output level of each channel on each side times its volume, what the buffers were given
+	std::array<int32_t, CHANNEL_COUNT> m_MixedLeft{};
+	std::array<int32_t, CHANNEL_COUNT> m_MixedRight{};
+	std::array<int32_t, CHANNEL_COUNT> m_GainLeft{};
+	std::array<int32_t, CHANNEL_COUNT> m_GainRight{};
+	CBandLimitedBuffer m_Left;
+	CBandLimitedBuffer m_Right;
+	std::vector<SStereoSample> m_Samples = std::vector<SStereoSample>(CBandLimitedBuffer::CAPACITY);
+	U32 m_SampleRate = DEFAULT_SAMPLE_RATE;
+	double m_RateRatio = 1.0;
+	IAudioSink* m_Sink = nullptr;
+	SStats m_Stats{};
+
+	[[nodiscard]] U8& reg(const U16 address)
+	{
+		return m_Registers[address - NR10_ADDRESS];
+	}
+
+	[[nodiscard]] U8 reg(const U16 address) const
+	{
+		return m_Registers[address - NR10_ADDRESS];
+	}
+
+	// NRx0 to NRx4 of a channel
+	[[nodiscard]] U8 channelReg(const U32 channel, const U32 index) const
+	{
+		return m_Registers[channel * 5 + index];
+	}
+
+	[[nodiscard]] static U32 getChannel(const U16 address)
+	{
+		return (address - NR10_ADDRESS) / 5;
+	}
+
+	[[nodiscard]] bool isPowered() const
+	{
+		return (reg(NR52_ADDRESS) & 0x80) != 0;
+	}
+
+	[[nodiscard]] bool isDacOn(const U32 channel) const
+	{
+		return channel == 2 ? (reg(NR30_ADDRESS) & 0x80) != 0 : (channelReg(channel, 2) & 0xF8) != 0;
+	}
+
+	[[nodiscard]] U32 getFrequency(const U32 channel) const
+	{
+		return channelReg(channel, 3) | (channelReg(channel, 4) & 0b111) << 8;
+	}
+
+	// Cycles per step of the waveform
+	[[nodiscard]] U32 getPeriod(const U32 channel) const
+	{
+		switch (channel)
+		{
+		case 2:
+			return (2048 - getFrequency(channel)) * 2;
+		case 3:
+		{
+			const U8 nr43 = reg(NR43_ADDRESS);
+			const U32 divisor = (nr43 & 0b111) == 0 ? 8 : (nr43 & 0b111) * 16;
+			return divisor << (nr43 >> 4);
+		}
+		default:
+			return (2048 - getFrequency(channel)) * 4;
+		}
+	}
+
+	[[nodiscard]] U8 getWaveSample(const U8 position) const
+	{
+		const U8 pair = reg(static_cast<U16>(WAVE_START + position / 2));
+		return (position & 1) == 0 ? pair >> 4 : pair & 0x0F;
+	}
+
+	// What the channel outputs now, 0 when it is off
+	[[nodiscard]] U8 getLevel(const U32 channel) const
+	{
+		const SChannel& state = m_Channels[channel];
+		if (state.Enabled == 0)
+		{
+			return 0;
+		}
+		switch (channel)
+		{
+		case 2:
+			return getWaveSample(state.Position) >> WAVE_SHIFTS[(reg(NR32_ADDRESS) >> 5) & 0b11];
+		case 3:
+			return (state.Lfsr & 1) == 0 ? state.Volume : 0;
+		default:
+			if (getPeriod(channel) < MIN_AUDIBLE_SQUARE_PERIOD)
+			{
+				return state.Volume / 2;
+			}
+			return (DUTY_PATTERNS[channelReg(channel, 1) >> 6] >> state.Position & 1) != 0 ? state.Volume : 0;
+		}
+	}
+
+	void setLevel(const U32 channel, const U8 level, const U64 timestamp)
+	{
+		m_Channels[channel].Level = level;
+		mix(channel, timestamp);
+	}
+
+	// Adds the change of the channel output on each side as a step
+	void mix(const U32 channel, const U64 timestamp)
+	{
+		const int32_t left = m_Channels[channel].Level * m_GainLeft[channel];
+		const int32_t right = m_Channels[channel].Level * m_GainRight[channel];
+		if (m_Sink != nullptr)
+		{
+			if (left != m_MixedLeft[channel])
+			{
+				m_Left.AddDelta(timestamp - m_BatchStart, left - m_MixedLeft[channel]);
+				++m_Stats.Steps;
+			}
+			if (right != m_MixedRight[channel])
+			{
+				m_Right.AddDelta(timestamp - m_BatchStart, right - m_MixedRight[channel]);
+				++m_Stats.Steps;
+			}
+		}
+		m_MixedLeft[channel] = left;
+		m_MixedRight[channel] = right;
+	}
+
+	// Master volume of each side times the NR51 panning
+	void updateGains()
+	{
+		const U8 nr50 = reg(NR50_ADDRESS);
+		const U8 nr51 = reg(NR51_ADDRESS);
+		for (U32 channel = 0; channel < CHANNEL_COUNT; ++channel)
+		{
+			m_GainLeft[channel] = (nr51 >> (channel + 4) & 1) != 0 ? ((nr50 >> 4 & 0b111) + 1) * VOLUME_UNIT : 0;
+			m_GainRight[channel] = (nr51 >> channel & 1) != 0 ? ((nr50 & 0b111) + 1) * VOLUME_UNIT : 0;
+			mix(channel, m_Sync);
+		}
+	}
+
+	void updateLevels()
+	{
+		for (U32 channel = 0; channel < CHANNEL_COUNT; ++channel)
+		{
+			const U8 level = getLevel(channel);
+			if (level != m_Channels[channel].Level)
+			{
+				setLevel(channel, level, m_Sync);
+			}
+		}
+	}
+
+	void updateRates()
+	{
+		const double sampleRate = m_SampleRate * m_RateRatio;
+		m_Left.SetRates(CLOCK_RATE, sampleRate);
+		m_Right.SetRates(CLOCK_RATE, sampleRate);
+	}
+
+	void setPowered(const bool powered)
+	{
+		if (powered == isPowered())
+		{
+			return;
+		}
+		if (!powered)
+		{
+			// Every register but the wave RAM is cleared
+			std::fill(m_Registers.begin(), m_Registers.begin() + (NR52_ADDRESS - NR10_ADDRESS), U8{ 0 });
+			for (SChannel& channel : m_Channels)
+			{
+				channel.Enabled = 0;
+			}
+			reg(NR52_ADDRESS) = 0;
+			updateGains();
+		}
+		else
+		{
+			reg(NR52_ADDRESS) = 0x80;
+			m_SequencerStep = 0;
+		}
+		updateLevels();
+	}
+
+	void trigger(const U32 channel)
+	{
+		SChannel& state = m_Channels[channel];
+		state.Enabled = isDacOn(channel);
+		if (state.Length == 0)
+		{
+			state.Length = channel == 2 ? 256 : 64;
+		}
+		state.NextStep = m_Sync + getPeriod(channel);
+		if (channel == 2)
+		{
+			state.Position = 0;
+			return;
+		}
+		const U8 envelope = channelReg(channel, 2);
+		state.Volume = envelope >> 4;
+		state.EnvelopeTimer = envelope & 0b111;
+		if (channel == 3)
+		{
+			state.Lfsr = 0x7FFF;
+		}
+		else if (channel == 0)
+		{
+			const U8 sweep = reg(NR10_ADDRESS);
+			state.SweepShadow = static_cast<U16>(getFrequency(0));
+			state.SweepTimer = getSweepPeriod();
+			state.SweepEnabled = (sweep & 0x70) != 0 || (sweep & 0b111) != 0;
+			if ((sweep & 0b111) != 0 && getSweepTarget() > 2047)
+			{
+				state.Enabled = 0;
+			}
+		}
+	}
+
+	// An NR10 period of 0 counts as 8
+	[[nodiscard]] U8 getSweepPeriod() const
+	{
+		const U8 period = reg(NR10_ADDRESS) >> 4 & 0b111;
+		return period == 0 ? 8 : period;
+	}
+
+	[[nodiscard]] U32 getSweepTarget() const
+	{
+		const U8 sweep = reg(NR10_ADDRESS);
+		const U32 shadow = m_Channels[0].SweepShadow;
+		const U32 change = shadow >> (sweep & 0b111);
+		return (sweep & 0b1000) != 0 ? shadow - change : shadow + change;
+	}
+
+	void clockLength()
+	{
+		for (U32 channel = 0; channel < CHANNEL_COUNT; ++channel)
+		{
+			SChannel& state = m_Channels[channel];
+			if ((channelReg(channel, 4) & 0x40) != 0 && state.Length > 0 && --state.Length == 0)
+			{
+				state.Enabled = 0;
+			}
+		}
+	}
+
+	void clockSweep()
+	{
+		SChannel& state = m_Channels[0];
+		if (--state.SweepTimer > 0)
+		{
+			return;
+		}
+		state.SweepTimer = getSweepPeriod();
+		const U8 sweep = reg(NR10_ADDRESS);
+		if (state.SweepEnabled == 0 || (sweep & 0x70) == 0)
+		{
+			return;
+		}
+		const U32 target = getSweepTarget();
+		if (target > 2047)
+		{
+			state.Enabled = 0;
+			return;
+		}
+		if ((sweep & 0b111) != 0)
+		{
+			state.SweepShadow = static_cast<U16>(target);
+			reg(NR13_ADDRESS) = static_cast<U8>(target);
+			reg(NR14_ADDRESS) = static_cast<U8>((reg(NR14_ADDRESS) & ~0b111) | target >> 8);
+			// The next frequency is checked at once
+			if (getSweepTarget() > 2047)
+			{
+				state.Enabled = 0;
+			}
+		}
+	}
+
+	void clockEnvelopes()
+	{
+		for (const U32 channel : { 0u, 1u, 3u })
+		{
+			SChannel& state = m_Channels[channel];
+			const U8 envelope = channelReg(channel, 2);
+			const U8 period = envelope & 0b111;
+			if (period == 0 || --state.EnvelopeTimer > 0)
+			{
+				continue;
+			}
+			state.EnvelopeTimer = period;
+			if ((envelope & 0b1000) != 0 && state.Volume < 15)
+			{
+				++state.Volume;
+			}
+			else if ((envelope & 0b1000) == 0 && state.Volume > 0)
+			{
+				--state.Volume;
+			}
+		}
+	}
+
+	// Steps every channel up to now
+	void catchUp(const U64 now)
+	{
+		if (now <= m_Sync)
+		{
+			return;
+		}
+		runSquare(0, now);
+		runSquare(1, now);
+		runWave(now);
+		runNoise(now);
+		m_Sync = now;
+	}
+
+	void runSquare(const U32 channel, const U64 now)
+	{
+		SChannel& state = m_Channels[channel];
+		if (state.Enabled == 0 || state.NextStep >= now)
+		{
+			return;
+		}
+		const U32 period = getPeriod(channel);
+		if (period < MIN_AUDIBLE_SQUARE_PERIOD)
+		{
+			const U64 steps = (now - state.NextStep + period - 1) / period;
+			state.Position = static_cast<U8>((state.Position + steps) & 0b111);
+			state.NextStep += steps * period;
+			return;
+		}
+		const U8 duty = DUTY_PATTERNS[channelReg(channel, 1) >> 6];
+		for (; state.NextStep < now; state.NextStep += period)
+		{
+			state.Position = (state.Position + 1) & 0b111;
+			const U8 level = (duty >> state.Position & 1) != 0 ? state.Volume : 0;
+			if (level != state.Level)
+			{
+				setLevel(channel, level, state.NextStep);
+			}
+		}
+	}
+
+	void runWave(const U64 now)
+	{
+		SChannel& state = m_Channels[2];
+		if (state.Enabled == 0 || state.NextStep >= now)
+		{
+			return;
+		}
+		const U32 period = getPeriod(2);
+		const U8 shift = WAVE_SHIFTS[(reg(NR32_ADDRESS) >> 5) & 0b11];
+		for (; state.NextStep < now; state.NextStep += period)
+		{
+			state.Position = (state.Position + 1) & 0x1F;
+			const U8 level = getWaveSample(state.Position) >> shift;
+			if (level != state.Level)
+			{
+				setLevel(2, level, state.NextStep);
+			}
+		}
+	}
+
+	void runNoise(const U64 now)
+	{
+		SChannel& state = m_Channels[3];
+		if (state.Enabled == 0 || state.NextStep >= now)
+		{
+			return;
+		}
+		const U32 period = getPeriod(3);
+		const bool narrow = (reg(NR43_ADDRESS) & 0b1000) != 0;
+		U16 lfsr = state.Lfsr;
+		for (; state.NextStep < now; state.NextStep += period)
+		{
+			const U16 feedback = (lfsr ^ lfsr >> 1) & 1;
+			lfsr = static_cast<U16>(lfsr >> 1 | feedback << 14);
+			if (narrow)
+			{
+				lfsr = static_cast<U16>((lfsr & ~0x40) | feedback << 6);
+			}
+			const U8 level = (lfsr & 1) == 0 ? state.Volume : 0;
+			if (level != state.Level)
+			{
+				setLevel(3, level, state.NextStep);
+			}
+		}
+		state.Lfsr = lfsr;
+	}
+
+	// Hands the samples of the batch that ends at timestamp to the sink
+	void endBatch(const U64 timestamp)
+	{
+		++m_Stats.Batches;
+		if (m_Sink == nullptr)
+		{
+			m_BatchStart = timestamp;
+			return;
+		}
+		m_Left.EndBatch(timestamp - m_BatchStart);
+		m_Right.EndBatch(timestamp - m_BatchStart);
+		m_BatchStart = timestamp;
+		const size_t count = CBandLimitedBuffer::ReadStereo(m_Left, m_Right, m_Samples.data(), m_Samples.size());
+		m_Stats.Samples += count;
+		m_Sink->OnSamples(m_Samples.data(), count);
+
+		const double ratio = m_Sink->GetRateRatio();
+		if (ratio != m_RateRatio)
+		{
+			m_RateRatio = ratio;
+			updateRates();
+		}
+	}
+
+	// Length counters on even steps, the sweep on 2 and 6 and the envelopes on 7
+	static void onSequencer(void* context, const U64 timestamp)
+	{
+		CApu& apu = *static_cast<CApu*>(context);
+		apu.catchUp(timestamp);
+		if (apu.isPowered())
+		{
+			const U8 step = apu.m_SequencerStep;
+			if ((step & 1) == 0)
+			{
+				apu.clockLength();
+			}
+			if (step == 2 || step == 6)
+			{
+				apu.clockSweep();
+			}
+			if (step == 7)
+			{
+				apu.clockEnvelopes();
+			}
+			apu.m_SequencerStep = (step + 1) & 0b111;
+			apu.updateLevels();
+		}
+		apu.endBatch(timestamp);
+		apu.m_Scheduler.Schedule(EEvent::ApuSequencer, timestamp + SEQUENCER_PERIOD);
+	}
+};
@@ -0,0 +1,246 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "Apu.h"
+#include "Helpers.h"
+
+enum class EWavError
+{
+	None,
+	OpenFailed,
+	WriteFailed
+};
+
+[[nodiscard]] inline const char* GetErrorMessage(const EWavError error)
+{
+	switch (error)
+	{
+	case EWavError::None:
+		return "no error";
+	case EWavError::OpenFailed:
+		return "could not create the file";
+	case EWavError::WriteFailed:
+		return "could not write the file";
+	default:
+		return "unknown error";
+	}
+}
+
+// Hands the samples of an APU to one consumer, an audio device callback, through a ring buffer
+// Each side owns one index and only reads the other, so neither side takes a lock
+// The rate ratio keeps the ring half full: the APU makes a little more samples while the ring
+// runs low and less while it fills up, so a device clock that is slower or faster than the
+// emulation is followed without dropping or repeating samples
+class CAudioRing : public IAudioSink
+{
+public:
+	// Largest change of the sample rate, too small to be heard as a change of pitch
+	static constexpr double MAX_RATE_DELTA = 0.005;
+
+	// The capacity is rounded up to a power of two
+	explicit CAudioRing(const size_t capacity)
+	{
+		size_t size = 1;
+		while (size < capacity)
+		{
+			size *= 2;
+		}
+		m_Samples.resize(size);
+		m_Mask = size - 1;
+	}
+
+	CAudioRing(const CAudioRing&) = delete;
+	CAudioRing& operator=(const CAudioRing&) = delete;
+
+	// Emulation thread, samples that do not fit are dropped and counted
+	void OnSamples(const SStereoSample* samples, const size_t count) override
+	{
+		const size_t write = m_Write.load(std::memory_order_relaxed);
+		const size_t free = m_Samples.size() - (write - m_Read.load(std::memory_order_acquire));
+		const size_t written = std::min(count, free);
+		for (size_t i = 0; i < written; ++i)
+		{
+			m_Samples[(write + i) & m_Mask] = samples[i];
+		}
+		m_Write.store(write + written, std::memory_order_release);
+		if (written < count)
+		{
+			m_Overflowed.fetch_add(count - written, std::memory_order_relaxed);
+		}
+	}
+
+	// Emulation thread
+	[[nodiscard]] double GetRateRatio() const override
+	{
+		const double fill = static_cast<double>(GetSize()) / static_cast<double>(m_Samples.size());
+		return 1.0 + MAX_RATE_DELTA * (1.0 - 2.0 * fill);
+	}
+
+	// Consumer thread, takes up to count samples and returns how many
+	// The device plays silence for the rest, which is counted in GetUnderflowed
+	size_t Read(SStereoSample* out, const size_t count)
+	{
+		const size_t read = m_Read.load(std::memory_order_relaxed);
+		const size_t available = m_Write.load(std::memory_order_acquire) - read;
+		const size_t taken = std::min(count, available);
+		for (size_t i = 0; i < taken; ++i)
+		{
+			out[i] = m_Samples[(read + i) & m_Mask];
+		}
+		m_Read.store(read + taken, std::memory_order_release);
+		if (taken < count)
+		{
+			m_Underflowed.fetch_add(count - taken, std::memory_order_relaxed);
+		}
+		return taken;
+	}
+
+	// Samples waiting to be read
+	[[nodiscard]] size_t GetSize() const
+	{
+		return m_Write.load(std::memory_order_acquire) - m_Read.load(std::memory_order_acquire);
+	}
+
+	[[nodiscard]] size_t GetCapacity() const
+	{
+		return m_Samples.size();
+	}
+
+	// Samples dropped because the ring was full
+	[[nodiscard]] U64 GetOverflowed() const
+	{
+		return m_Overflowed.load(std::memory_order_relaxed);
+	}
+
+	// Samples the consumer asked for that were not there
+	[[nodiscard]] U64 GetUnderflowed() const
+	{
+		return m_Underflowed.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::vector<SStereoSample> m_Samples;
+	size_t m_Mask = 0;
+	// Samples written and read since the start, they only grow and wrap together
+	alignas(64) std::atomic<size_t> m_Write{ 0 };
+	alignas(64) std::atomic<size_t> m_Read{ 0 };
+	std::atomic<U64> m_Overflowed{ 0 };
+	std::atomic<U64> m_Underflowed{ 0 };
+};
+
+// Writes the samples to a 16 bit stereo PCM WAV file, for running without an audio device
+// The sizes in the header are filled in by Close
+class CWavWriter : public IAudioSink
+{
+public:
+	static constexpr U32 HEADER_SIZE = 44;
+
+	CWavWriter() = default;
+
+	~CWavWriter()
+	{
+		Close();
+	}
+
+	CWavWriter(const CWavWriter&) = delete;
+	CWavWriter& operator=(const CWavWriter&) = delete;
+
+	[[nodiscard]] EWavError Open(const std::string& path, const U32 sampleRate)
+	{
+		Close();
+		m_File = std::fopen(path.c_str(), "wb");
+		if (m_File == nullptr)
+		{
+			return EWavError::OpenFailed;
+		}
+		m_SampleRate = sampleRate;
+		m_Written = 0;
+		m_Error = writeHeader() ? EWavError::None : EWavError::WriteFailed;
+		return m_Error;
+	}
+
+	// Finishes the header, returns the first error
+	EWavError Close()
+	{
+		if (m_File == nullptr)
+		{
+			return m_Error;
+		}
+		if (m_Error == EWavError::None && (std::fseek(m_File, 0, SEEK_SET) != 0 || !writeHeader()))
+		{
+			m_Error = EWavError::WriteFailed;
+		}
+		if (std::fclose(m_File) != 0 && m_Error == EWavError::None)
+		{
+			m_Error = EWavError::WriteFailed;
+		}
+		m_File = nullptr;
+		return m_Error;
+	}
+
+	[[nodiscard]] bool IsOpen() const
+	{
+		return m_File != nullptr;
+	}
+
+	void OnSamples(const SStereoSample* samples, const size_t count) override
+	{
+		static_assert(sizeof(SStereoSample) == 4, "WAV frames are two 16 bit samples");
+		if (m_File == nullptr || m_Error != EWavError::None)
+		{
+			return;
+		}
+		if (std::fwrite(samples, sizeof(SStereoSample), count, m_File) != count)
+		{
+			m_Error = EWavError::WriteFailed;
+			return;
+		}
+		m_Written += count;
+	}
+
+	// Stereo samples written
+	[[nodiscard]] U64 GetWritten() const
+	{
+		return m_Written;
+	}
+
+private:
+	FILE* m_File = nullptr;
+	U32 m_SampleRate = 0;
+	U64 m_Written = 0;
+	EWavError m_Error = EWavError::None;
+
+	// Little-endian like the host, with the data size written so far
+	[[nodiscard]] bool writeHeader()
+	{
+		const U32 dataSize = static_cast<U32>(std::min<U64>(m_Written * sizeof(SStereoSample), 0xFFFFFFFFu - HEADER_SIZE));
+		std::vector<U8> header;
+		const auto append = [&header](const U32 value, const U32 bytes) {
+			for (U32 i = 0; i < bytes; ++i)
+			{
+				header.push_back(static_cast<U8>(value >> (i * 8)));
+			}
+		};
+		const auto appendTag = [&header](const char* tag) {
+			header.insert(header.end(), tag, tag + 4);
+		};
+		appendTag("RIFF");
+		append(HEADER_SIZE - 8 + dataSize, 4);
+		appendTag("WAVE");
+		appendTag("fmt ");
+		append(16, 4);
+		// PCM, two channels
+		append(1, 2);
+		append(2, 2);
+		append(m_SampleRate, 4);
+		append(m_SampleRate * static_cast<U32>(sizeof(SStereoSample)), 4);
+		append(sizeof(SStereoSample), 2);
+		append(16, 2);
+		appendTag("data");
+		append(dataSize, 4);
+		return std::fwrite(header.data(), 1, header.size(), m_File) == header.size();
+	}
+};
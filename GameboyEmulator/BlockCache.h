@@ -0,0 +1,288 @@
+#pragma once
+#include <array>
+#include <vector>
+#include "Helpers.h"
+#include "MemoryBus.h"
+#include "Opcodes.h"
+
+// Pre-decoded runs of straight-line instructions keyed by their start address
+// A block ends after a jump, call, return, HALT or STOP, at MAX_INSTRUCTIONS, or before an
+// instruction that would reach past the page after the start page
+//
+// Blocks remember the host memory of the pages they were decoded from, if a bank switch
+// maps a different bank there the block is dropped the next time it is looked up
+// Pages in RAM with blocks in them are watched on the bus, a write covered by a block drops it
+// WRAM is also mapped at E000-FDFF, a block there or in C000-DDFF is watched through both
+class CBlockCache : public IWriteWatcher
+{
+public:
+	static constexpr U8 MAX_INSTRUCTIONS = 32;
+	static constexpr U16 NO_NATIVE_RUN = 0xFFFF;
+
+	struct SInstruction
+	{
+		OpcodeHandler Handler;
+		U16 Operand;
+		U8 Length;
+		U8 Opcode;
+		// Compiled run starting at this instruction, see CJit
+		U16 NativeRun;
+	};
+
+	struct SBlock
+	{
+		U16 Start = 0;
+		// One past the last byte, can be 0x10000
+		U32 End = 0;
+		std::array<const U8*, 2> Pages{};
+		U8 Count = 0;
+		std::array<SInstruction, MAX_INSTRUCTIONS> Instructions{};
+	};
+
+	struct SStats
+	{
+		U64 Hits = 0;
+		U64 Misses = 0;
+		U64 Invalidations = 0;
+	};
+
+	explicit CBlockCache(CMemoryBus& bus)
+		: m_Bus(bus), m_Index(0x10000, NO_BLOCK)
+	{
+		m_Bus.SetWriteWatcher(this);
+	}
+
+	~CBlockCache() override
+	{
+		for (U32 page = 0; page < CMemoryBus::PAGE_COUNT; ++page)
+		{
+			if (!m_PageBlocks[page].empty())
+			{
+				m_Bus.WatchPage(static_cast<U8>(page), false);
+			}
+		}
+		m_Bus.SetWriteWatcher(nullptr);
+	}
+
+	CBlockCache(const CBlockCache&) = delete;
+	CBlockCache& operator=(const CBlockCache&) = delete;
+
+	// Returns the block starting at pc, null if it has to be translated
+	[[nodiscard]] const SBlock* Find(const U16 pc)
+	{
+		const U32 id = m_Index[pc];
+		if (id == NO_BLOCK)
+		{
+			++m_Stats.Misses;
+			return nullptr;
+		}
+		const SBlock& block = m_Blocks[id];
+		if (block.Pages[0] != m_Bus.GetReadPage(block.Start >> 8) || block.Pages[1] != m_Bus.GetReadPage((block.End - 1) >> 8))
+		{
+			invalidate(id);
+			++m_Stats.Misses;
+			return nullptr;
+		}
+		++m_Stats.Hits;
+		return &block;
+	}
+
+	// Starts a new block at pc, Add instructions to it and then Commit it
+	SBlock& Allocate(const U16 pc)
+	{
+		if (m_FreeBlocks.empty())
+		{
+			m_FreeBlocks.push_back(static_cast<U32>(m_Blocks.size()));
+			m_Blocks.emplace_back();
+		}
+		m_Pending = m_FreeBlocks.back();
+		SBlock& block = m_Blocks[m_Pending];
+		block.Start = pc;
+		block.End = pc;
+		block.Count = 0;
+		return block;
+	}
+
+	// True if an instruction of length bytes still fits into the block
+	[[nodiscard]] static bool Fits(const SBlock& block, const U8 length)
+	{
+		const U32 end = block.End + length;
+		return block.Count < MAX_INSTRUCTIONS && end <= 0x10000 && ((end - 1) >> 8) <= (block.Start >> 8) + 1u;
+	}
+
+	static void Add(SBlock& block, const OpcodeHandler handler, const U16 operand, const U8 length, const U8 opcode)
+	{
+		block.Instructions[block.Count++] = { handler, operand, length, opcode, NO_NATIVE_RUN };
+		block.End += length;
+	}
+
+	const SBlock& Commit(SBlock& block)
+	{
+		const U32 id = m_Pending;
+		m_FreeBlocks.pop_back();
+		block.Pages = { m_Bus.GetReadPage(block.Start >> 8), m_Bus.GetReadPage((block.End - 1) >> 8) };
+		m_Index[block.Start] = id;
+
+		for (U32 page = block.Start >> 8; page <= (block.End - 1) >> 8; ++page)
+		{
+			// ROM can not be written, writes there are MBC registers
+			if (page < 0x80)
+			{
+				continue;
+			}
+			watch(page, id);
+			const U32 alias = getAliasPage(page);
+			if (alias != NO_PAGE)
+			{
+				watch(alias, id);
+			}
+		}
+		return block;
+	}
+
+	// Drops every block
+	void Clear()
+	{
+		for (U32 id = 0; id < m_Blocks.size(); ++id)
+		{
+			// Only live blocks are in the index
+			if (m_Index[m_Blocks[id].Start] == id)
+			{
+				invalidate(id);
+			}
+		}
+	}
+
+	// Drops the blocks in RAM and keeps the ones in ROM, which check their bank when they are found
+	void ClearWritable()
+	{
+		for (U32 page = 0x80; page < CMemoryBus::PAGE_COUNT; ++page)
+		{
+			while (!m_PageBlocks[page].empty())
+			{
+				invalidate(m_PageBlocks[page].back());
+			}
+		}
+	}
+
+	// Changes whenever a block is dropped
+	[[nodiscard]] U32 GetGeneration() const
+	{
+		return m_Generation;
+	}
+
+	[[nodiscard]] const SStats& GetStats() const
+	{
+		return m_Stats;
+	}
+
+	void OnWatchedWrite(const U16 address) override
+	{
+		// The same byte seen from the other mapping of WRAM, blocks of both are in the list
+		const U16 alias = getAliasPage(address >> 8) != NO_PAGE ? address ^ 0x2000 : address;
+		std::vector<U32>& blocks = m_PageBlocks[address >> 8];
+		for (size_t i = 0; i < blocks.size();)
+		{
+			const SBlock& block = m_Blocks[blocks[i]];
+			if ((address >= block.Start && address < block.End) || (alias >= block.Start && alias < block.End))
+			{
+				// Removes the block from this list too
+				invalidate(blocks[i]);
+				++m_Stats.Invalidations;
+			}
+			else
+			{
+				++i;
+			}
+		}
+	}
+
+	// A block ends after any instruction that changes PC other than by its length,
+	// or that stops the CPU
+	[[nodiscard]] static constexpr bool EndsBlock(const U8 opcode)
+	{
+		switch (opcode)
+		{
+		case 0x10: // STOP
+		case 0x76: // HALT
+		case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: // JR
+		case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA: case 0xE9: // JP
+		case 0xC4: case 0xCC: case 0xCD: case 0xD4: case 0xDC: // CALL
+		case 0xC0: case 0xC8: case 0xC9: case 0xD0: case 0xD8: case 0xD9: // RET
+		case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF: // RST
+		case 0xD3: case 0xDB: case 0xDD: case 0xE3: case 0xE4: case 0xEB: case 0xEC: case 0xED: case 0xF4: case 0xFC: case 0xFD: // Unused
+			return true;
+		default:
+			return false;
+		}
+	}
+
+private:
+	static constexpr U32 NO_BLOCK = 0xFFFFFFFF;
+	static constexpr U32 NO_PAGE = 0xFFFFFFFF;
+
+	CMemoryBus& m_Bus;
+	// Block id by start address
+	std::vector<U32> m_Index;
+	std::vector<SBlock> m_Blocks;
+	std::vector<U32> m_FreeBlocks;
+	// Blocks covering each page
+	std::array<std::vector<U32>, CMemoryBus::PAGE_COUNT> m_PageBlocks{};
+	U32 m_Pending = NO_BLOCK;
+	U32 m_Generation = 0;
+	SStats m_Stats{};
+
+	// The page mapping the same WRAM as page, NO_PAGE outside of C000-DDFF and E000-FDFF
+	[[nodiscard]] static constexpr U32 getAliasPage(const U32 page)
+	{
+		return (page >= 0xC0 && page < 0xDE) || (page >= 0xE0 && page < 0xFE) ? page ^ 0x20 : NO_PAGE;
+	}
+
+	void watch(const U32 page, const U32 id)
+	{
+		if (m_PageBlocks[page].empty())
+		{
+			m_Bus.WatchPage(static_cast<U8>(page), true);
+		}
+		m_PageBlocks[page].push_back(id);
+	}
+
+	void unwatch(const U32 page, const U32 id)
+	{
+		std::vector<U32>& blocks = m_PageBlocks[page];
+		for (size_t i = 0; i < blocks.size(); ++i)
+		{
+			if (blocks[i] == id)
+			{
+				blocks[i] = blocks.back();
+				blocks.pop_back();
+				break;
+			}
+		}
+		if (blocks.empty())
+		{
+			m_Bus.WatchPage(static_cast<U8>(page), false);
+		}
+	}
+
+	void invalidate(const U32 id)
+	{
+		const SBlock& block = m_Blocks[id];
+		m_Index[block.Start] = NO_BLOCK;
+		for (U32 page = block.Start >> 8; page <= (block.End - 1) >> 8; ++page)
+		{
+			if (page < 0x80)
+			{
+				continue;
+			}
+			unwatch(page, id);
+			const U32 alias = getAliasPage(page);
+			if (alias != NO_PAGE)
+			{
+				unwatch(alias, id);
+			}
+		}
+		m_FreeBlocks.push_back(id);
+		++m_Generation;
+	}
+};
@@ -0,0 +1,123 @@
+#include "Cartridge.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CCartridge::~CCartridge()
+{
+	Close();
+}
+
+ECartridgeError CCartridge::Open(const std::string& path)
+{
+	Close();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return ECartridgeError::OpenFailed;
+	}
+	m_File = file;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+	{
+		Close();
+		return ECartridgeError::TooSmall;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr)
+	{
+		Close();
+		return ECartridgeError::MapFailed;
+	}
+	m_Mapping = mapping;
+
+	const void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data == nullptr)
+	{
+		Close();
+		return ECartridgeError::MapFailed;
+	}
+	m_Data = static_cast<const U8*>(data);
+	m_Size = static_cast<size_t>(size.QuadPart);
+#else
+	const int file = open(path.c_str(), O_RDONLY);
+	if (file < 0)
+	{
+		return ECartridgeError::OpenFailed;
+	}
+
+	struct stat status;
+	if (fstat(file, &status) != 0 || status.st_size == 0)
+	{
+		close(file);
+		return ECartridgeError::TooSmall;
+	}
+
+	void* data = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_SHARED, file, 0);
+	// The mapping keeps the file referenced
+	close(file);
+	if (data == MAP_FAILED)
+	{
+		return ECartridgeError::MapFailed;
+	}
+	m_Data = static_cast<const U8*>(data);
+	m_Size = static_cast<size_t>(status.st_size);
+
+	// Parsing reads the whole image once for the global checksum
+	madvise(data, m_Size, MADV_WILLNEED);
+	madvise(data, m_Size, MADV_SEQUENTIAL);
+#endif
+
+	const ECartridgeError error = ParseHeader(m_Data, m_Size, m_Header);
+
+#ifndef _WIN32
+	// Bank accesses during emulation are not sequential
+	madvise(const_cast<U8*>(m_Data), m_Size, MADV_NORMAL);
+#endif
+
+	if (error != ECartridgeError::None)
+	{
+		Close();
+	}
+	return error;
+}
+
+void CCartridge::Close()
+{
+#ifdef _WIN32
+	if (m_Data != nullptr)
+	{
+		UnmapViewOfFile(m_Data);
+	}
+	if (m_Mapping != nullptr)
+	{
+		CloseHandle(m_Mapping);
+	}
+	if (m_File != nullptr)
+	{
+		CloseHandle(m_File);
+	}
+	m_Mapping = nullptr;
+	m_File = nullptr;
+#else
+	if (m_Data != nullptr)
+	{
+		munmap(const_cast<U8*>(m_Data), m_Size);
+	}
+#endif
+	m_Data = nullptr;
+	m_Size = 0;
+	m_Header = SCartridgeHeader{};
+}
@@ -0,0 +1,230 @@
+#pragma once
+#include <iterator>
+#include <string>
+#include "Helpers.h"
+#include "MemoryBus.h"
+
+enum class ECartridgeError
+{
+	None,
+	OpenFailed,
+	MapFailed,
+	TooSmall,
+	HeaderChecksum,
+	UnsupportedType,
+	UnsupportedRomSize,
+	UnsupportedRamSize,
+	SizeMismatch
+};
+
+[[nodiscard]] inline const char* GetErrorMessage(const ECartridgeError error)
+{
+	switch (error)
+	{
+	case ECartridgeError::None:
+		return "no error";
+	case ECartridgeError::OpenFailed:
+		return "could not open the file";
+	case ECartridgeError::MapFailed:
+		return "could not map the file";
+	case ECartridgeError::TooSmall:
+		return "file is too small to hold a cartridge header";
+	case ECartridgeError::HeaderChecksum:
+		return "header checksum does not match";
+	case ECartridgeError::UnsupportedType:
+		return "cartridge type is not supported";
+	case ECartridgeError::UnsupportedRomSize:
+		return "ROM size code is not valid";
+	case ECartridgeError::UnsupportedRamSize:
+		return "RAM size code is not valid";
+	case ECartridgeError::SizeMismatch:
+		return "file is smaller than the ROM size in the header";
+	default:
+		return "unknown error";
+	}
+}
+
+// Values read from the cartridge header at 0100-014F
+struct SCartridgeHeader
+{
+	static constexpr U16 TITLE_ADDRESS = 0x134;
+	static constexpr U16 TITLE_LENGTH = 16;
+	static constexpr U16 TYPE_ADDRESS = 0x147;
+	static constexpr U16 ROM_SIZE_ADDRESS = 0x148;
+	static constexpr U16 RAM_SIZE_ADDRESS = 0x149;
+	static constexpr U16 HEADER_CHECKSUM_ADDRESS = 0x14D;
+	static constexpr U16 GLOBAL_CHECKSUM_ADDRESS = 0x14E;
+	static constexpr U16 HEADER_END = 0x150;
+
+	std::string Title;
+	U8 Type = 0;
+	EMbcType MbcType = EMbcType::None;
+	bool HasBattery = false;
+	bool HasRtc = false;
+	size_t RomSize = 0;
+	size_t RamSize = 0;
+	U8 HeaderChecksum = 0;
+	U16 GlobalChecksum = 0;
+	// The boot ROM ignores the global checksum so a mismatch is not an error
+	bool GlobalChecksumValid = false;
+};
+
+// A ROM image mapped read-only into memory
+// The bus banks point straight into the mapping so the image is never copied
+// and processes running the same ROM share the page cache
+class CCartridge
+{
+public:
+	CCartridge() = default;
+	~CCartridge();
+
+	CCartridge(const CCartridge&) = delete;
+	CCartridge& operator=(const CCartridge&) = delete;
+
+	ECartridgeError Open(const std::string& path);
+	void Close();
+
+	[[nodiscard]] const U8* GetData() const
+	{
+		return m_Data;
+	}
+
+	[[nodiscard]] size_t GetSize() const
+	{
+		return m_Size;
+	}
+
+	[[nodiscard]] const SCartridgeHeader& GetHeader() const
+	{
+		return m_Header;
+	}
+
+	// Maps the ROM banks and cartridge RAM on the bus, the cartridge has to stay open while the bus uses it
+	void Insert(CMemoryBus& bus) const
+	{
+		bus.LoadRom(m_Data, m_Size, m_Header.MbcType, m_Header.RamSize);
+	}
+
+	// Reads and validates the header of a ROM image, also used for images that are not mapped from a file
+	static ECartridgeError ParseHeader(const U8* rom, const size_t size, SCartridgeHeader& header)
+	{
+		if (size < SCartridgeHeader::HEADER_END)
+		{
+			return ECartridgeError::TooSmall;
+		}
+
+		U8 checksum = 0;
+		for (U16 address = SCartridgeHeader::TITLE_ADDRESS; address < SCartridgeHeader::HEADER_CHECKSUM_ADDRESS; ++address)
+		{
+			checksum = checksum - rom[address] - 1;
+		}
+		header.HeaderChecksum = rom[SCartridgeHeader::HEADER_CHECKSUM_ADDRESS];
+		if (checksum != header.HeaderChecksum)
+		{
+			return ECartridgeError::HeaderChecksum;
+		}
+
+		// Titles are padded with zeros, the last byte is the CGB flag on newer cartridges
+		header.Title.clear();
+		for (U16 i = 0; i < SCartridgeHeader::TITLE_LENGTH; ++i)
+		{
+			const char character = static_cast<char>(rom[SCartridgeHeader::TITLE_ADDRESS + i]);
+			if (character == '\0' || (i == SCartridgeHeader::TITLE_LENGTH - 1 && (character & 0x80) != 0))
+			{
+				break;
+			}
+			header.Title += character;
+		}
+
+		header.Type = rom[SCartridgeHeader::TYPE_ADDRESS];
+		header.HasBattery = false;
+		header.HasRtc = false;
+		switch (header.Type)
+		{
+		case 0x00:
+		case 0x08:
+			header.MbcType = EMbcType::None;
+			break;
+		case 0x09:
+			header.MbcType = EMbcType::None;
+			header.HasBattery = true;
+			break;
+		case 0x01:
+		case 0x02:
+			header.MbcType = EMbcType::Mbc1;
+			break;
+		case 0x03:
+			header.MbcType = EMbcType::Mbc1;
+			header.HasBattery = true;
+			break;
+		case 0x0F:
+		case 0x10:
+			header.MbcType = EMbcType::Mbc3;
+			header.HasBattery = true;
+			header.HasRtc = true;
+			break;
+		case 0x11:
+		case 0x12:
+			header.MbcType = EMbcType::Mbc3;
+			break;
+		case 0x13:
+			header.MbcType = EMbcType::Mbc3;
+			header.HasBattery = true;
+			break;
+		case 0x19:
+		case 0x1A:
+		case 0x1C:
+		case 0x1D:
+			header.MbcType = EMbcType::Mbc5;
+			break;
+		case 0x1B:
+		case 0x1E:
+			header.MbcType = EMbcType::Mbc5;
+			header.HasBattery = true;
+			break;
+		default:
+			return ECartridgeError::UnsupportedType;
+		}
+
+		// 32KB shifted left by the size code
+		const U8 romSizeCode = rom[SCartridgeHeader::ROM_SIZE_ADDRESS];
+		if (romSizeCode > 8)
+		{
+			return ECartridgeError::UnsupportedRomSize;
+		}
+		header.RomSize = static_cast<size_t>(0x8000) << romSizeCode;
+		if (size < header.RomSize)
+		{
+			return ECartridgeError::SizeMismatch;
+		}
+
+		constexpr size_t RAM_SIZES[] = { 0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000 };
+		const U8 ramSizeCode = rom[SCartridgeHeader::RAM_SIZE_ADDRESS];
+		if (ramSizeCode >= std::size(RAM_SIZES))
+		{
+			return ECartridgeError::UnsupportedRamSize;
+		}
+		header.RamSize = RAM_SIZES[ramSizeCode];
+
+		// Big-endian sum of every byte in the ROM except the checksum itself
+		U16 globalChecksum = 0;
+		for (size_t i = 0; i < header.RomSize; ++i)
+		{
+			globalChecksum += rom[i];
+		}
+		globalChecksum -= rom[SCartridgeHeader::GLOBAL_CHECKSUM_ADDRESS] + rom[SCartridgeHeader::GLOBAL_CHECKSUM_ADDRESS + 1];
+		header.GlobalChecksum = static_cast<U16>(rom[SCartridgeHeader::GLOBAL_CHECKSUM_ADDRESS] << 8 | rom[SCartridgeHeader::GLOBAL_CHECKSUM_ADDRESS + 1]);
+		header.GlobalChecksumValid = globalChecksum == header.GlobalChecksum;
+
+		return ECartridgeError::None;
+	}
+
+private:
+	const U8* m_Data = nullptr;
+	size_t m_Size = 0;
+	SCartridgeHeader m_Header{};
+#ifdef _WIN32
+	void* m_File = nullptr;
+	void* m_Mapping = nullptr;
+#endif
+};
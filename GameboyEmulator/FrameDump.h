@@ -0,0 +1,406 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Helpers.h"
+#include "Ppu.h"
+
+enum class EFrameDumpError
+{
+	None,
+	OpenFailed,
+	WriteFailed
+};
+
+[[nodiscard]] inline const char* GetErrorMessage(const EFrameDumpError error)
+{
+	switch (error)
+	{
+	case EFrameDumpError::None:
+		return "no error";
+	case EFrameDumpError::OpenFailed:
+		return "could not create the directory or a file in it";
+	case EFrameDumpError::WriteFailed:
+		return "could not write a file";
+	default:
+		return "unknown error";
+	}
+}
+
+// What a new frame does when the consumer has not taken the previous one yet
+enum class EFrameOverflow
+{
+	// The emulation waits for the consumer, every frame is seen
+	Wait,
+	// The previous frame is replaced and counted in GetDropped, the emulation never waits
+	Drop
+};
+
+struct SPublishedFrame
+{
+	CPpu::Frame Pixels{};
+	U64 Number = 0;
+};
+
+// Hands the frames of a PPU to one consumer thread through three buffers
+// The producer fills one, the consumer reads another and the third holds the newest complete
+// frame. Either side swaps its buffer with the third one in a single atomic exchange, so a
+// frame is never read while it is written and neither side takes a lock
+class CFrameExchange : public IFrameSink
+{
+public:
+	explicit CFrameExchange(const EFrameOverflow overflow = EFrameOverflow::Drop)
+		: m_Overflow(overflow)
+	{
+	}
+
+	CFrameExchange(const CFrameExchange&) = delete;
+	CFrameExchange& operator=(const CFrameExchange&) = delete;
+
+	// Emulation thread
+	void OnFrame(const CPpu::Frame& frame, const U64 number) override
+	{
+		if (m_Overflow == EFrameOverflow::Wait)
+		{
+			while ((m_Middle.load(std::memory_order_acquire) & FRESH) != 0)
+			{
+				std::this_thread::yield();
+			}
+		}
+		SPublishedFrame& back = m_Buffers[m_Back];
+		back.Pixels = frame;
+		back.Number = number;
+		const U8 previous = m_Middle.exchange(static_cast<U8>(m_Back | FRESH), std::memory_order_acq_rel);
+		if ((previous & FRESH) != 0)
+		{
+			m_Dropped.fetch_add(1, std::memory_order_relaxed);
+		}
+		m_Back = previous & INDEX;
+	}
+
+	// Emulation thread, a consumer waiting in Acquire returns once it has taken the last frame
+	void Close()
+	{
+		m_Closed.store(true, std::memory_order_release);
+	}
+
+	// Consumer thread, the newest frame that was not taken yet or null
+	// The frame stays valid until the next call
+	[[nodiscard]] const SPublishedFrame* TryAcquire()
+	{
+		if ((m_Middle.load(std::memory_order_relaxed) & FRESH) == 0)
+		{
+			return nullptr;
+		}
+		m_Front = m_Middle.exchange(m_Front, std::memory_order_acq_rel) & INDEX;
+		return &m_Buffers[m_Front];
+	}
+
+	// Consumer thread, waits for a frame, null once the exchange is closed and empty
+	[[nodiscard]] const SPublishedFrame* Acquire()
+	{
+		while (true)
+		{
+			// Read before trying, a frame published before Close is seen by the last try
+			const bool closed = m_Closed.load(std::memory_order_acquire);
+			if (const SPublishedFrame* frame = TryAcquire())
+			{
+				return frame;
+			}
+			if (closed)
+			{
+				return nullptr;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+	}
+
+	// Frames replaced before the consumer took them
+	[[nodiscard]] U64 GetDropped() const
+	{
+		return m_Dropped.load(std::memory_order_relaxed);
+	}
+
+private:
+	static constexpr U8 INDEX = 0b11;
+	// Set while the middle buffer holds a frame the consumer has not taken
+	static constexpr U8 FRESH = 0b100;
+
+	std::array<SPublishedFrame, 3> m_Buffers{};
+	EFrameOverflow m_Overflow;
+	// Owned by the producer and the consumer, the middle one is swapped between them
+	U8 m_Back = 0;
+	alignas(64) std::atomic<U8> m_Middle{ 1 };
+	alignas(64) U8 m_Front = 2;
+	std::atomic<U64> m_Dropped{ 0 };
+	std::atomic<bool> m_Closed{ false };
+};
+
+enum class EFrameDumpFormat
+{
+	// The shades 0-3, one byte per pixel
+	Raw,
+	// 2 bit palette PNG in the colors of CPpu::DMG_COLORS
+	Png,
+	// One line per frame in hashes.txt with the frame number and HashFrame
+	Hash
+};
+
+// Writes the frames it is given into a directory on a thread of its own
+// Files are named after the frame number, frame_000042.png
+class CFrameDumper : public IFrameSink
+{
+public:
+	CFrameDumper() = default;
+
+	~CFrameDumper()
+	{
+		Close();
+	}
+
+	CFrameDumper(const CFrameDumper&) = delete;
+	CFrameDumper& operator=(const CFrameDumper&) = delete;
+
+	// FNV-1a over the frame as 64-bit little-endian words, stable for golden files
+	[[nodiscard]] static U64 HashFrame(const CPpu::Frame& frame)
+	{
+		static_assert(sizeof(CPpu::Frame) % sizeof(U64) == 0);
+		U64 hash = 0xCBF29CE484222325ull;
+		for (size_t i = 0; i < frame.size(); i += sizeof(U64))
+		{
+			U64 word;
+			std::memcpy(&word, frame.data() + i, sizeof(word));
+			hash = (hash ^ word) * 0x100000001B3ull;
+		}
+		return hash;
+	}
+
+	// Drop never holds up the emulation and counts the frames the writer could not keep up with,
+	// Wait keeps every frame and dumping then limits the speed of the emulation
+	[[nodiscard]] EFrameDumpError Open(const std::string& directory, const EFrameDumpFormat format,
+		const EFrameOverflow overflow = EFrameOverflow::Drop)
+	{
+		Close();
+		std::error_code error;
+		std::filesystem::create_directories(directory, error);
+		if (error)
+		{
+			return EFrameDumpError::OpenFailed;
+		}
+		if (format == EFrameDumpFormat::Hash)
+		{
+			m_HashFile = std::fopen((std::filesystem::path(directory) / "hashes.txt").string().c_str(), "w");
+			if (m_HashFile == nullptr)
+			{
+				return EFrameDumpError::OpenFailed;
+			}
+		}
+		m_Directory = directory;
+		m_Format = format;
+		m_Exchange = std::make_unique<CFrameExchange>(overflow);
+		m_Error = EFrameDumpError::None;
+		m_Dumped = 0;
+		m_Writer = std::thread([this] { write(); });
+		return EFrameDumpError::None;
+	}
+
+	// Waits until every frame that was handed over is written, returns the first error
+	EFrameDumpError Close()
+	{
+		if (m_Exchange == nullptr)
+		{
+			return m_Error;
+		}
+		m_Exchange->Close();
+		m_Writer.join();
+		m_Dropped = m_Exchange->GetDropped();
+		m_Exchange.reset();
+		if (m_HashFile != nullptr)
+		{
+			if (std::fclose(m_HashFile) != 0 && m_Error == EFrameDumpError::None)
+			{
+				m_Error = EFrameDumpError::WriteFailed;
+			}
+			m_HashFile = nullptr;
+		}
+		return m_Error;
+	}
+
+	[[nodiscard]] bool IsOpen() const
+	{
+		return m_Exchange != nullptr;
+	}
+
+	void OnFrame(const CPpu::Frame& frame, const U64 number) override
+	{
+		m_Exchange->OnFrame(frame, number);
+	}
+
+	// Both are final after Close
+	[[nodiscard]] U64 GetDumped() const
+	{
+		return m_Dumped;
+	}
+
+	[[nodiscard]] U64 GetDropped() const
+	{
+		return m_Dropped;
+	}
+
+	// A PNG of the frame with a 2 bit palette of colors, 0xAABBGGRR like CPpu::GetFrameRgba
+	// The image data is stored without compression, which needs no zlib
+	static std::vector<U8> EncodePng(const CPpu::Frame& frame, const std::array<U32, 4>& colors = CPpu::DMG_COLORS)
+	{
+		constexpr U32 rowSize = 1 + CPpu::SCREEN_WIDTH / 4;
+		std::vector<U8> image;
+		image.reserve(rowSize * CPpu::SCREEN_HEIGHT);
+		for (U32 y = 0; y < CPpu::SCREEN_HEIGHT; ++y)
+		{
+			// Filter type none, then 4 pixels per byte from the high bits down
+			image.push_back(0);
+			for (U32 x = 0; x < CPpu::SCREEN_WIDTH; x += 4)
+			{
+				const U8* pixels = frame.data() + y * CPpu::SCREEN_WIDTH + x;
+				image.push_back(static_cast<U8>(pixels[0] << 6 | pixels[1] << 4 | pixels[2] << 2 | pixels[3]));
+			}
+		}
+
+		std::vector<U8> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+		std::vector<U8> chunk;
+		appendBigEndian(chunk, CPpu::SCREEN_WIDTH);
+		appendBigEndian(chunk, CPpu::SCREEN_HEIGHT);
+		// Bit depth 2, palette colors, deflate, adaptive filtering, no interlacing
+		chunk.insert(chunk.end(), { 2, 3, 0, 0, 0 });
+		appendChunk(png, "IHDR", chunk);
+
+		chunk.clear();
+		for (const U32 color : colors)
+		{
+			chunk.insert(chunk.end(), { static_cast<U8>(color), static_cast<U8>(color >> 8), static_cast<U8>(color >> 16) });
+		}
+		appendChunk(png, "PLTE", chunk);
+
+		// A zlib stream of one stored deflate block, the image is smaller than its 64 KiB limit
+		static_assert(rowSize * CPpu::SCREEN_HEIGHT <= 0xFFFF);
+		const U16 length = static_cast<U16>(image.size());
+		chunk = { 0x78, 0x01, 0x01, static_cast<U8>(length), static_cast<U8>(length >> 8),
+			static_cast<U8>(~length), static_cast<U8>(~length >> 8) };
+		chunk.insert(chunk.end(), image.begin(), image.end());
+		appendBigEndian(chunk, adler32(image));
+		appendChunk(png, "IDAT", chunk);
+
+		chunk.clear();
+		appendChunk(png, "IEND", chunk);
+		return png;
+	}
+
+private:
+	std::string m_Directory;
+	EFrameDumpFormat m_Format = EFrameDumpFormat::Raw;
+	std::unique_ptr<CFrameExchange> m_Exchange;
+	std::thread m_Writer;
+	std::FILE* m_HashFile = nullptr;
+	// Written by the writer thread, read after it is joined
+	EFrameDumpError m_Error = EFrameDumpError::None;
+	U64 m_Dumped = 0;
+	U64 m_Dropped = 0;
+
+	// Runs on the writer thread
+	void write()
+	{
+		while (const SPublishedFrame* frame = m_Exchange->Acquire())
+		{
+			if (m_Error == EFrameDumpError::None)
+			{
+				m_Error = writeFrame(*frame);
+			}
+			++m_Dumped;
+		}
+	}
+
+	[[nodiscard]] EFrameDumpError writeFrame(const SPublishedFrame& frame) const
+	{
+		if (m_Format == EFrameDumpFormat::Hash)
+		{
+			return std::fprintf(m_HashFile, "%llu %016llx\n", static_cast<unsigned long long>(frame.Number),
+				static_cast<unsigned long long>(HashFrame(frame.Pixels))) > 0 ? EFrameDumpError::None : EFrameDumpError::WriteFailed;
+		}
+
+		char name[32];
+		std::snprintf(name, sizeof(name), "frame_%06llu.%s", static_cast<unsigned long long>(frame.Number),
+			m_Format == EFrameDumpFormat::Png ? "png" : "raw");
+		std::FILE* file = std::fopen((std::filesystem::path(m_Directory) / name).string().c_str(), "wb");
+		if (file == nullptr)
+		{
+			return EFrameDumpError::OpenFailed;
+		}
+		bool written;
+		if (m_Format == EFrameDumpFormat::Png)
+		{
+			const std::vector<U8> png = EncodePng(frame.Pixels);
+			written = std::fwrite(png.data(), png.size(), 1, file) == 1;
+		}
+		else
+		{
+			written = std::fwrite(frame.Pixels.data(), frame.Pixels.size(), 1, file) == 1;
+		}
+		return std::fclose(file) == 0 && written ? EFrameDumpError::None : EFrameDumpError::WriteFailed;
+	}
+
+	static void appendBigEndian(std::vector<U8>& out, const U32 value)
+	{
+		out.insert(out.end(), { static_cast<U8>(value >> 24), static_cast<U8>(value >> 16), static_cast<U8>(value >> 8), static_cast<U8>(value) });
+	}
+
+	// Length, type, data and the CRC of type and data
+	static void appendChunk(std::vector<U8>& png, const char* type, const std::vector<U8>& data)
+	{
+		appendBigEndian(png, static_cast<U32>(data.size()));
+		const size_t start = png.size();
+		png.insert(png.end(), type, type + 4);
+		png.insert(png.end(), data.begin(), data.end());
+		appendBigEndian(png, crc32(png.data() + start, png.size() - start));
+	}
+
+	[[nodiscard]] static U32 crc32(const U8* data, const size_t size)
+	{
+		static const std::array<U32, 256> table = [] {
+			std::array<U32, 256> entries{};
+			for (U32 i = 0; i < 256; ++i)
+			{
+				U32 crc = i;
+				for (int bit = 0; bit < 8; ++bit)
+				{
+					crc = (crc & 1) != 0 ? 0xEDB88320u ^ (crc >> 1) : crc >> 1;
+				}
+				entries[i] = crc;
+			}
+			return entries;
+		}();
+		U32 crc = 0xFFFFFFFFu;
+		for (size_t i = 0; i < size; ++i)
+		{
+			crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+		}
+		return crc ^ 0xFFFFFFFFu;
+	}
+
+	[[nodiscard]] static U32 adler32(const std::vector<U8>& data)
+	{
+		U32 a = 1;
+		U32 b = 0;
+		for (const U8 byte : data)
+		{
+			a = (a + byte) % 65521;
+			b = (b + a) % 65521;
+		}
+		return b << 16 | a;
+	}
+};
@@ -1,8 +1,68 @@
 #pragma once
+#include <cassert>
 #include <iostream>
 
 using U8 = uint8_t;
 using U16 = uint16_t;
+using U32 = uint32_t;
+using U64 = uint64_t;
+
+// Build options
+// GB_LAZY_FLAGS: ALU ops record their operands and the flags are only computed when read
+// GB_VERIFY_LAZY_FLAGS: lazy flags are also computed eagerly and compared (asserts on mismatch)
+// GB_TABLE_ALU: ADD/ADC/SUB/SBC/CP/INC/DEC read result and flags from precomputed tables
+// GB_THREADED_CORE: RunUntil dispatches through a computed goto loop, needs GCC or Clang
+// and falls back to the dispatch table elsewhere
+// GB_JIT: CProcessor::SetJitEnabled compiles register-only code to native code, x86-64 hosts only
+// GB_PROFILER: every executed instruction is counted by opcode and PC in CProcessor::Profiler
+// GB_SIMD: the PPU pixel kernels have SSE2 and AVX2 versions picked at run time, x86-64 hosts only
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#error "SRegisters aliases register pairs assuming a little-endian host"
+#endif
+
+#ifndef GB_LAZY_FLAGS
+#define GB_LAZY_FLAGS 1
+#endif
+#ifndef GB_VERIFY_LAZY_FLAGS
+#define GB_VERIFY_LAZY_FLAGS 0
+#endif
+#ifndef GB_TABLE_ALU
+#define GB_TABLE_ALU 0
+#endif
+#ifndef GB_THREADED_CORE
+#define GB_THREADED_CORE 0
+#endif
+#if GB_THREADED_CORE && !defined(__GNUC__)
+#undef GB_THREADED_CORE
+#define GB_THREADED_CORE 0
+#endif
+#if defined(__x86_64__) || defined(_M_X64)
+#ifndef GB_JIT
+#define GB_JIT 1
+#endif
+#else
+#undef GB_JIT
+#define GB_JIT 0
+#endif
+#ifndef GB_PROFILER
+#define GB_PROFILER 0
+#endif
+#if defined(__x86_64__) || defined(_M_X64)
+#ifndef GB_SIMD
+#define GB_SIMD 1
+#endif
+#else
+#undef GB_SIMD
+#define GB_SIMD 0
+#endif
+
+constexpr bool LAZY_FLAGS = GB_LAZY_FLAGS != 0;
+constexpr bool VERIFY_LAZY_FLAGS = GB_VERIFY_LAZY_FLAGS != 0;
+constexpr bool TABLE_ALU = GB_TABLE_ALU != 0;
+constexpr bool THREADED_CORE = GB_THREADED_CORE != 0;
+constexpr bool JIT = GB_JIT != 0;
+constexpr bool PROFILER = GB_PROFILER != 0;
+constexpr bool SIMD = GB_SIMD != 0;
 
 enum class EInstruction
 {
@@ -52,15 +112,61 @@ enum class ERegisterTarget
 	BC,
 	DE,
 	HL,
+	SP,
 	UNK
 };
 
+// The last flag-setting ALU operation, used to compute the flags on demand
+enum class EFlagOp : U8
+{
+	None, // Flags are already in F
+	Add,
+	Sub,
+	And,
+	Or, // Also XOR, both reset N, H and C
+	Inc,
+	Dec
+};
+
 struct SRegisters
 {
 private:
 	U8 F{};
+
+	// Lazy flag state
+	EFlagOp m_FlagOp = EFlagOp::None;
+	U8 m_FlagLhs{}, m_FlagRhs{};
+	U16 m_FlagResult{};
+	// INC and DEC do not affect carry
+	bool m_PreservedCarry{};
 public:
-	U8 A{}, B{}, C{}, D{}, E{}, H{}, L{};
+	// The 8-bit registers share storage with the BC, DE and HL pairs
+	// R8 is in opcode encoding order (B, C, D, E, H, L, (HL), A) with the bytes
+	// of each pair swapped so R16 reads them little-endian, see R8Index
+	// Slot 7 is where (HL) would be and is unused
+	union
+	{
+		U16 R16[4]{};
+		U8 R8[8];
+		struct
+		{
+			U8 C, B, E, D, L, H, A, Unused;
+		};
+	};
+	// Stack pointer and program counter
+	U16 SP{}, PC{};
+
+	// Index into R8 for the register encoded in opcode bits 0-2 or 3-5
+	[[nodiscard]] static constexpr U8 R8Index(const U8 encoding)
+	{
+		return encoding ^ 1;
+	}
+
+	// Index into R16 for BC, DE and HL as encoded in opcode bits 4-5
+	[[nodiscard]] static constexpr U8 R16Index(const U8 encoding)
+	{
+		return encoding;
+	}
 
 	// F will be the flags register, lower four bits will always be 0
 	// upper four bits will correspond to certain states
@@ -83,77 +189,272 @@ public:
 
 	[[nodiscard]] SFlagRegister GetFlags() const
 	{
+		const U8 f = GetF();
 		return SFlagRegister{
-			(F >> SFlagRegister::ZERO_FLAG_POSITION) & 0b1 ? true : false,
-			(F >> SFlagRegister::SUBTRACTION_FLAG_POSITION) & 0b1 ? true : false,
-			(F >> SFlagRegister::HALF_CARRY_FLAG_POSITION) & 0b1 ? true : false,
-			(F >> SFlagRegister::CARRY_FLAG_POSITION) & 0b1 ? true : false,
+			(f >> SFlagRegister::ZERO_FLAG_POSITION) & 0b1 ? true : false,
+			(f >> SFlagRegister::SUBTRACTION_FLAG_POSITION) & 0b1 ? true : false,
+			(f >> SFlagRegister::HALF_CARRY_FLAG_POSITION) & 0b1 ? true : false,
+			(f >> SFlagRegister::CARRY_FLAG_POSITION) & 0b1 ? true : false,
 		};
 	}
 
 	void SetFlags(const SFlagRegister fReg)
 	{
-		F = 0;
-		F |= fReg.Zero << SFlagRegister::ZERO_FLAG_POSITION;
-		F |= fReg.Subtraction << SFlagRegister::SUBTRACTION_FLAG_POSITION;
-		F |= fReg.HalfCarry << SFlagRegister::HALF_CARRY_FLAG_POSITION;
-		F |= fReg.Carry << SFlagRegister::CARRY_FLAG_POSITION;
+		m_FlagOp = EFlagOp::None;
+		F = packFlags(fReg);
+	}
+
+	// Used by the ALU ops, records the operation instead of packing F
+	// eagerFlags computes the same flags directly, it is used when lazy flags are off
+	// and to check the lazy result when GB_VERIFY_LAZY_FLAGS is set
+	// For ADD and SUB result is the unwrapped 16-bit result including the carry-in
+	template<typename TEagerFlags>
+	void RecordFlags(const EFlagOp op, const U8 lhs, const U8 rhs, const U16 result, TEagerFlags eagerFlags)
+	{
+		if constexpr (LAZY_FLAGS)
+		{
+			[[maybe_unused]] U8 expectedF = 0;
+			if constexpr (VERIFY_LAZY_FLAGS)
+			{
+				expectedF = packFlags(eagerFlags());
+			}
+			if (op == EFlagOp::Inc || op == EFlagOp::Dec)
+			{
+				m_PreservedCarry = GetCarry();
+			}
+			m_FlagOp = op;
+			m_FlagLhs = lhs;
+			m_FlagRhs = rhs;
+			m_FlagResult = result;
+			assert(!VERIFY_LAZY_FLAGS || GetF() == expectedF);
+		}
+		else
+		{
+			SetFlags(eagerFlags());
+		}
+	}
+
+	// Single flag reads for conditions, ADC/SBC and rotates through carry
+	// These only compute the flag that is asked for
+	[[nodiscard]] bool GetZero() const
+	{
+		if (m_FlagOp == EFlagOp::None)
+		{
+			return (F >> SFlagRegister::ZERO_FLAG_POSITION) & 0b1;
+		}
+		return static_cast<U8>(m_FlagResult) == 0;
+	}
+
+	[[nodiscard]] bool GetCarry() const
+	{
+		switch (m_FlagOp)
+		{
+		case EFlagOp::None:
+			return (F >> SFlagRegister::CARRY_FLAG_POSITION) & 0b1;
+		case EFlagOp::Add:
+		case EFlagOp::Sub:
+			return (m_FlagResult & 0x100) != 0;
+		case EFlagOp::Inc:
+		case EFlagOp::Dec:
+			return m_PreservedCarry;
+		default:
+			return false;
+		}
+	}
+
+	// Materializes F from the recorded operation
+	// Half carry is bit 4 of lhs ^ rhs ^ result, it works for both ADD and SUB with carry-in
+	[[nodiscard]] U8 GetF() const
+	{
+		if (m_FlagOp == EFlagOp::None)
+		{
+			return F;
+		}
+		SFlagRegister fReg;
+		fReg.Zero = static_cast<U8>(m_FlagResult) == 0;
+		switch (m_FlagOp)
+		{
+		case EFlagOp::Add:
+		case EFlagOp::Sub:
+			fReg.Subtraction = m_FlagOp == EFlagOp::Sub;
+			fReg.HalfCarry = ((m_FlagLhs ^ m_FlagRhs ^ m_FlagResult) & 0x10) != 0;
+			fReg.Carry = (m_FlagResult & 0x100) != 0;
+			break;
+		case EFlagOp::And:
+			fReg.HalfCarry = true;
+			break;
+		case EFlagOp::Inc:
+			fReg.HalfCarry = (m_FlagResult & 0xF) == 0;
+			fReg.Carry = m_PreservedCarry;
+			break;
+		case EFlagOp::Dec:
+			fReg.Subtraction = true;
+			fReg.HalfCarry = (m_FlagResult & 0xF) == 0xF;
+			fReg.Carry = m_PreservedCarry;
+			break;
+		default:
+			break;
+		}
+		return packFlags(fReg);
+	}
+
+	void SetF(const U8 f)
+	{
+		m_FlagOp = EFlagOp::None;
+		F = f;
+	}
+
+	// Register access resolved at compile time, used by the opcode handlers
+	template<ERegisterTarget Target>
+	[[nodiscard]] U8& Register()
+	{
+		static_assert(Target <= ERegisterTarget::L, "Not an 8-bit register");
+		if constexpr (Target == ERegisterTarget::A)
+		{
+			return A;
+		}
+		else if constexpr (Target == ERegisterTarget::B)
+		{
+			return B;
+		}
+		else if constexpr (Target == ERegisterTarget::C)
+		{
+			return C;
+		}
+		else if constexpr (Target == ERegisterTarget::D)
+		{
+			return D;
+		}
+		else if constexpr (Target == ERegisterTarget::E)
+		{
+			return E;
+		}
+		else if constexpr (Target == ERegisterTarget::H)
+		{
+			return H;
+		}
+		else
+		{
+			return L;
+		}
+	}
+
+	template<ERegisterTarget Target>
+	[[nodiscard]] U16 GetPair() const
+	{
+		static_assert(Target >= ERegisterTarget::AF && Target <= ERegisterTarget::SP, "Not a 16-bit register");
+		if constexpr (Target == ERegisterTarget::AF)
+		{
+			return GetAF();
+		}
+		else if constexpr (Target == ERegisterTarget::BC)
+		{
+			return GetBC();
+		}
+		else if constexpr (Target == ERegisterTarget::DE)
+		{
+			return GetDE();
+		}
+		else if constexpr (Target == ERegisterTarget::HL)
+		{
+			return GetHL();
+		}
+		else
+		{
+			return SP;
+		}
+	}
+
+	template<ERegisterTarget Target>
+	void SetPair(const U16 value)
+	{
+		static_assert(Target >= ERegisterTarget::AF && Target <= ERegisterTarget::SP, "Not a 16-bit register");
+		if constexpr (Target == ERegisterTarget::AF)
+		{
+			SetAF(value);
+		}
+		else if constexpr (Target == ERegisterTarget::BC)
+		{
+			SetBC(value);
+		}
+		else if constexpr (Target == ERegisterTarget::DE)
+		{
+			SetDE(value);
+		}
+		else if constexpr (Target == ERegisterTarget::HL)
+		{
+			SetHL(value);
+		}
+		else
+		{
+			SP = value;
+		}
 	}
 
 	// Somewhat of an hack that makes the Registers 16-bit
 	// For the instructions that allow 16-bit read/write
 	[[nodiscard]] U16 GetAF() const
 	{
-		return static_cast<U16>(A) << 8 | F;
+		return static_cast<U16>(A) << 8 | GetF();
 	}
 
 	[[nodiscard]] U16 GetBC() const
 	{
-		return static_cast<U16>(B) << 8 | C;
+		return R16[0];
 	}
 
 	[[nodiscard]] U16 GetDE() const
 	{
-		return static_cast<U16>(D) << 8 | E;
+		return R16[1];
 	}
 
 	[[nodiscard]] U16 GetHL() const
 	{
-		return static_cast<U16>(H) << 8 | L;
+		return R16[2];
 	}
 
 	void SetAF(const U16 val)
 	{
 		A = (val >> 8) & 0xFF;
 		F = val & 0xFF;
+		m_FlagOp = EFlagOp::None;
 	}
 
 	void SetBC(const U16 val)
 	{
-		B = (val >> 8) & 0xFF;
-		C = val & 0xFF;
+		R16[0] = val;
 	}
 
 	void SetDE(const U16 val)
 	{
-		D = (val >> 8) & 0xFF;
-		E = val & 0xFF;
+		R16[1] = val;
 	}
 
 	void SetHL(const U16 val)
 	{
-		H = (val >> 8) & 0xFF;
-		L = val & 0xFF;
+		R16[2] = val;
 	}
+
+private:
+	[[nodiscard]] static U8 packFlags(const SFlagRegister fReg)
+	{
+		U8 f = 0;
+		f |= fReg.Zero << SFlagRegister::ZERO_FLAG_POSITION;
+		f |= fReg.Subtraction << SFlagRegister::SUBTRACTION_FLAG_POSITION;
+		f |= fReg.HalfCarry << SFlagRegister::HALF_CARRY_FLAG_POSITION;
+		f |= fReg.Carry << SFlagRegister::CARRY_FLAG_POSITION;
+		return f;
+	}
+
 };
 
 // Check if int overflew
-static bool DidOverflow(const U8 a, const U8 b)
+inline bool DidOverflow(const U8 a, const U8 b)
 {
 	return (a + b > UINT8_MAX ? true : false);
 }
 
-static bool DidOverflow(const U16 a, const U16 b)
+inline bool DidOverflow(const U16 a, const U16 b)
 {
 	return (a + b > UINT16_MAX ? true : false);
 }
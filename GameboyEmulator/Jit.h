@@ -0,0 +1,647 @@
+#pragma once
+#include <array>
+#include <cstring>
+#include <initializer_list>
+#include <vector>
+#include "BlockCache.h"
+#include "Helpers.h"
+
+#if GB_JIT
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+// Compiles runs of register-only instructions inside cached blocks to x86-64 code
+// A run loads C, B, E, D, L, H and A into r8-r14 and F into bl, executes the instructions
+// with the host ALU and stores everything back. Z, H and C are taken from the host flags with
+// LAHF, x86 AF is the same nibble carry as H for 8-bit adds, subtracts, INC and DEC.
+// F is only rebuilt when a later instruction or the end of the run reads it
+//
+// Anything that touches memory, SP, PC or IME stays in the interpreter, so a run can not
+// cause I/O, raise an interrupt or modify code and is executed as a whole. Code written
+// to RAM is handled by the block cache, dropping a block also drops the use of its runs
+//
+// The arena is either writable or executable, code is built in a buffer and copied in
+// When it fills up everything is dropped and the block cache has to be cleared as well
+class CJit
+{
+public:
+	// Registers indexed like SRegisters::R8 and F in, F out
+	using NativeCode = U8 (*)(U8* registers, U8 f);
+
+	static constexpr size_t ARENA_SIZE = 1 << 20;
+	// More than the code for a block of MAX_INSTRUCTIONS of the longest instructions
+	static constexpr size_t MAX_BLOCK_CODE = 4096;
+	// A single instruction is faster to interpret than to enter and leave native code for
+	static constexpr U8 MIN_RUN_LENGTH = 2;
+
+	struct SRun
+	{
+		NativeCode Code = nullptr;
+		U16 Cycles = 0;
+		U8 Count = 0;
+		// Bytes of Game Boy code, PC advances by this much
+		U8 Length = 0;
+		U8 LastCycles = 0;
+	};
+
+	struct SStats
+	{
+		U64 Runs = 0;
+		U64 Instructions = 0;
+		U64 CodeBytes = 0;
+		U64 Flushes = 0;
+	};
+
+	CJit()
+	{
+#if GB_JIT
+#ifdef _WIN32
+		m_Code = static_cast<U8*>(VirtualAlloc(nullptr, ARENA_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+#else
+		void* code = mmap(nullptr, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		m_Code = code == MAP_FAILED ? nullptr : static_cast<U8*>(code);
+#endif
+#endif
+		m_Buffer.reserve(MAX_BLOCK_CODE);
+	}
+
+	~CJit()
+	{
+#if GB_JIT
+		if (m_Code != nullptr)
+		{
+#ifdef _WIN32
+			VirtualFree(m_Code, 0, MEM_RELEASE);
+#else
+			munmap(m_Code, ARENA_SIZE);
+#endif
+		}
+#endif
+	}
+
+	CJit(const CJit&) = delete;
+	CJit& operator=(const CJit&) = delete;
+
+	// False if the host has no JIT support or the arena could not be allocated
+	[[nodiscard]] bool IsAvailable() const
+	{
+		return m_Code != nullptr;
+	}
+
+	[[nodiscard]] bool HasRoomForBlock() const
+	{
+		return m_Used + MAX_BLOCK_CODE <= ARENA_SIZE && m_Runs.size() + CBlockCache::MAX_INSTRUCTIONS < CBlockCache::NO_NATIVE_RUN;
+	}
+
+	// Drops every run, blocks referring to them have to be dropped too
+	void Flush()
+	{
+		m_Used = 0;
+		m_Runs.clear();
+		++m_Stats.Flushes;
+	}
+
+	[[nodiscard]] const SRun& GetRun(const U16 index) const
+	{
+		return m_Runs[index];
+	}
+
+	[[nodiscard]] const SStats& GetStats() const
+	{
+		return m_Stats;
+	}
+
+	// Clock cycles of an instruction that can be compiled, 0 if it has to be interpreted
+	// Memory operands, SP, control flow, DAA and ADD HL, rr are left to the interpreter
+	[[nodiscard]] static constexpr U8 GetNativeCycles(const U8 opcode, const U16 operand)
+	{
+		const U8 x = opcode >> 6;
+		const U8 y = (opcode >> 3) & 0b111;
+		const U8 z = opcode & 0b111;
+		if (opcode == 0x00)
+		{
+			return 4;
+		}
+		if (opcode == 0xCB)
+		{
+			return (operand & 0b111) == 6 ? 0 : 8;
+		}
+		if (x == 0)
+		{
+			switch (z)
+			{
+			case 1:
+				// LD rr, nn
+				return (y & 1) == 0 && y != 6 ? 12 : 0;
+			case 3:
+				// INC rr / DEC rr
+				return (y >> 1) != 3 ? 8 : 0;
+			case 4:
+			case 5:
+				return y != 6 ? 4 : 0;
+			case 6:
+				return y != 6 ? 8 : 0;
+			case 7:
+				return y != 4 ? 4 : 0;
+			default:
+				return 0;
+			}
+		}
+		if (x == 1)
+		{
+			// Also excludes HALT
+			return y != 6 && z != 6 ? 4 : 0;
+		}
+		if (x == 2)
+		{
+			return z != 6 ? 4 : 0;
+		}
+		return z == 6 && x == 3 ? 8 : 0;
+	}
+
+	// Compiles every run of at least MIN_RUN_LENGTH compilable instructions in the block
+	// and links them from the first instruction of each run
+	// Needs HasRoomForBlock, the block must not be committed yet
+	void CompileBlock(CBlockCache::SBlock& block)
+	{
+		if (!IsAvailable())
+		{
+			return;
+		}
+		m_Buffer.clear();
+		const size_t firstRun = m_Runs.size();
+		std::vector<size_t> offsets;
+		U8 start = 0;
+		while (start < block.Count)
+		{
+			U8 end = start;
+			while (end < block.Count && GetNativeCycles(block.Instructions[end].Opcode, block.Instructions[end].Operand) != 0)
+			{
+				++end;
+			}
+			if (end - start >= MIN_RUN_LENGTH)
+			{
+				while (m_Buffer.size() % 16 != 0)
+				{
+					// int3
+					m_Buffer.push_back(0xCC);
+				}
+				offsets.push_back(m_Buffer.size());
+				block.Instructions[start].NativeRun = static_cast<U16>(m_Runs.size());
+				m_Runs.push_back(compileRun(&block.Instructions[start], end - start));
+			}
+			start = end == start ? end + 1 : end;
+		}
+		if (offsets.empty())
+		{
+			return;
+		}
+
+		setWritable(true);
+		std::memcpy(m_Code + m_Used, m_Buffer.data(), m_Buffer.size());
+		setWritable(false);
+		for (size_t i = 0; i < offsets.size(); ++i)
+		{
+			m_Runs[firstRun + i].Code = reinterpret_cast<NativeCode>(m_Code + m_Used + offsets[i]);
+		}
+		m_Used += (m_Buffer.size() + 15) & ~static_cast<size_t>(15);
+		m_Stats.CodeBytes += m_Buffer.size();
+	}
+
+private:
+	// Registers live in r8-r14 by SRegisters::R8 index
+	static constexpr U8 R8_BASE = 8;
+
+	// x86 register forms and /digit forms for ADD, ADC, SUB, SBC, AND, XOR, OR, CP
+	static constexpr U8 X86_ALU_OPCODES[8] = { 0x00, 0x10, 0x28, 0x18, 0x20, 0x30, 0x08, 0x38 };
+	static constexpr U8 X86_ALU_DIGITS[8] = { 0, 2, 5, 3, 4, 6, 1, 7 };
+	// ROL, ROR, RCL, RCR, SHL, SAR, (SWAP), SHR
+	static constexpr U8 X86_SHIFT_DIGITS[8] = { 0, 1, 2, 3, 4, 7, 0, 5 };
+
+	U8* m_Code = nullptr;
+	size_t m_Used = 0;
+	std::vector<SRun> m_Runs;
+	std::vector<U8> m_Buffer;
+	SStats m_Stats{};
+
+	void setWritable(const bool writable)
+	{
+#if GB_JIT
+#ifdef _WIN32
+		DWORD previous;
+		VirtualProtect(m_Code, ARENA_SIZE, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &previous);
+		if (!writable)
+		{
+			FlushInstructionCache(GetCurrentProcess(), m_Code, ARENA_SIZE);
+		}
+#else
+		mprotect(m_Code, ARENA_SIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC);
+#endif
+#else
+		(void)writable;
+#endif
+	}
+
+	// Host register holding a register by its opcode encoding
+	[[nodiscard]] static constexpr U8 hostRegister(const U8 encoding)
+	{
+		return R8_BASE + SRegisters::R8Index(encoding);
+	}
+
+	// Instructions that leave some flags as they were or use C need F to be up to date
+	[[nodiscard]] static constexpr bool readsFlags(const U8 opcode, const U16 operand)
+	{
+		const U8 x = opcode >> 6;
+		const U8 y = (opcode >> 3) & 0b111;
+		const U8 z = opcode & 0b111;
+		if (opcode == 0xCB)
+		{
+			const U8 cbX = (operand >> 6) & 0b11;
+			const U8 cbY = (operand >> 3) & 0b111;
+			return cbX == 1 || (cbX == 0 && (cbY == 2 || cbY == 3));
+		}
+		if (x == 0)
+		{
+			return z == 4 || z == 5 || (z == 7 && y >= 2);
+		}
+		return (x == 2 || (x == 3 && z == 6)) && (y == 1 || y == 3);
+	}
+
+	[[nodiscard]] static constexpr bool writesFlags(const U8 opcode, const U16 operand)
+	{
+		const U8 x = opcode >> 6;
+		const U8 z = opcode & 0b111;
+		if (opcode == 0xCB)
+		{
+			return ((operand >> 6) & 0b11) <= 1;
+		}
+		if (x == 0)
+		{
+			return z == 4 || z == 5 || z == 7;
+		}
+		return x == 2 || (x == 3 && z == 6);
+	}
+
+	// Keep part of F, they only read it when their own flags are needed
+	[[nodiscard]] static constexpr bool writesPartialFlags(const U8 opcode, const U16 operand)
+	{
+		if (opcode == 0xCB)
+		{
+			return ((operand >> 6) & 0b11) == 1;
+		}
+		return (opcode >> 6) == 0 && ((opcode & 0b111) == 4 || (opcode & 0b111) == 5 || opcode == 0x2F || opcode == 0x37 || opcode == 0x3F);
+	}
+
+	SRun compileRun(const CBlockCache::SInstruction* instructions, const U8 count)
+	{
+		// Walk backwards to find the instructions whose flags are read before being overwritten
+		std::array<bool, CBlockCache::MAX_INSTRUCTIONS> needsFlags{};
+		bool live = true;
+		for (U8 i = count; i-- > 0;)
+		{
+			const U8 opcode = instructions[i].Opcode;
+			const U16 operand = instructions[i].Operand;
+			if (!writesFlags(opcode, operand))
+			{
+				continue;
+			}
+			needsFlags[i] = live;
+			if (!writesPartialFlags(opcode, operand))
+			{
+				live = readsFlags(opcode, operand);
+			}
+		}
+
+		SRun run;
+		run.Count = count;
+		emitPrologue();
+		for (U8 i = 0; i < count; ++i)
+		{
+			emitInstruction(instructions[i].Opcode, instructions[i].Operand, needsFlags[i]);
+			run.LastCycles = GetNativeCycles(instructions[i].Opcode, instructions[i].Operand);
+			run.Cycles += run.LastCycles;
+			run.Length += instructions[i].Length;
+		}
+		emitEpilogue();
+
+		++m_Stats.Runs;
+		m_Stats.Instructions += count;
+		return run;
+	}
+
+	void emit(const std::initializer_list<U8> bytes)
+	{
+		m_Buffer.insert(m_Buffer.end(), bytes);
+	}
+
+	// REX is always emitted so byte registers 4-7 are spl-dil and never ah-bh
+	void emitRex(const U8 reg, const U8 rm)
+	{
+		emit({ static_cast<U8>(0x40 | (reg >> 3) << 2 | rm >> 3) });
+	}
+
+	// op r/m8, r8
+	void emitRegister(const U8 opcode, const U8 rm, const U8 reg)
+	{
+		emitRex(reg, rm);
+		emit({ opcode, static_cast<U8>(0xC0 | (reg & 0b111) << 3 | (rm & 0b111)) });
+	}
+
+	// op /digit r/m8
+	void emitGroup(const U8 opcode, const U8 digit, const U8 rm)
+	{
+		emitRex(0, rm);
+		emit({ opcode, static_cast<U8>(0xC0 | digit << 3 | (rm & 0b111)) });
+	}
+
+	// op /digit r/m8, imm8
+	void emitImmediate(const U8 opcode, const U8 digit, const U8 rm, const U8 immediate)
+	{
+		emitGroup(opcode, digit, rm);
+		emit({ immediate });
+	}
+
+	void emitMoveImmediate(const U8 reg, const U8 immediate)
+	{
+		emitRex(0, reg);
+		emit({ static_cast<U8>(0xB0 + (reg & 0b111)), immediate });
+	}
+
+	void emitPrologue()
+	{
+		// push rbx, r12-r15
+		emit({ 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 });
+#ifdef _WIN32
+		// mov r15, rcx / mov ebx, edx
+		emit({ 0x49, 0x89, 0xCF, 0x89, 0xD3 });
+#else
+		// mov r15, rdi / mov ebx, esi
+		emit({ 0x49, 0x89, 0xFF, 0x89, 0xF3 });
+#endif
+		for (U8 i = 0; i < 7; ++i)
+		{
+			// movzx r8d+i, byte [r15 + i]
+			emit({ 0x45, 0x0F, 0xB6, static_cast<U8>(0x47 | i << 3), i });
+		}
+	}
+
+	void emitEpilogue()
+	{
+		for (U8 i = 0; i < 7; ++i)
+		{
+			// mov [r15 + i], r8b+i
+			emit({ 0x45, 0x88, static_cast<U8>(0x47 | i << 3), i });
+		}
+		// mov eax, ebx, pop r15-r12, rbx, ret
+		emit({ 0x89, 0xD8, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3 });
+	}
+
+	// bt ebx, 4 copies C into the host carry
+	void emitLoadCarry()
+	{
+		emit({ 0x0F, 0xBA, 0xE3, 0x04 });
+	}
+
+	// F from ZF, AF and CF after an 8-bit add or subtract
+	void emitArithmeticFlags(const bool subtract)
+	{
+		// lahf, mov bl, ah, and bl, 0x51, mov al, bl, and al, 1, shl al, 4
+		emit({ 0x9F, 0x88, 0xE3, 0x80, 0xE3, 0x51, 0x88, 0xD8, 0x24, 0x01, 0xC0, 0xE0, 0x04 });
+		// and bl, 0x50, add bl, bl, or bl, al
+		emit({ 0x80, 0xE3, 0x50, 0x00, 0xDB, 0x08, 0xC3 });
+		if (subtract)
+		{
+			// or bl, 0x40
+			emit({ 0x80, 0xCB, 0x40 });
+		}
+	}
+
+	// INC and DEC keep C
+	void emitIncDecFlags(const bool decrement)
+	{
+		// lahf, and bl, 0x10, mov al, ah, and al, 0x50, add al, al, or bl, al
+		emit({ 0x9F, 0x80, 0xE3, 0x10, 0x88, 0xE0, 0x24, 0x50, 0x00, 0xC0, 0x08, 0xC3 });
+		if (decrement)
+		{
+			emit({ 0x80, 0xCB, 0x40 });
+		}
+	}
+
+	// Only Z, AND also sets H
+	void emitLogicFlags(const bool isAnd)
+	{
+		// lahf, mov bl, ah, and bl, 0x40, add bl, bl
+		emit({ 0x9F, 0x88, 0xE3, 0x80, 0xE3, 0x40, 0x00, 0xDB });
+		if (isAnd)
+		{
+			// or bl, 0x20
+			emit({ 0x80, 0xCB, 0x20 });
+		}
+	}
+
+	// Rotates on A only keep the carry
+	void emitCarryFlag()
+	{
+		// setc al, shl al, 4, mov bl, al
+		emit({ 0x0F, 0x92, 0xC0, 0xC0, 0xE0, 0x04, 0x88, 0xC3 });
+	}
+
+	// Z from the result and C from the host carry, rotates and shifts do not set ZF
+	void emitShiftFlags(const U8 reg)
+	{
+		// setc al, shl al, 4
+		emit({ 0x0F, 0x92, 0xC0, 0xC0, 0xE0, 0x04 });
+		// test reg, reg
+		emitRegister(0x84, reg, reg);
+		// setz bl, shl bl, 7, or bl, al
+		emit({ 0x0F, 0x94, 0xC3, 0xC0, 0xE3, 0x07, 0x08, 0xC3 });
+	}
+
+	void emitAlu(const U8 operation, const bool needsFlags)
+	{
+		if (!needsFlags)
+		{
+			return;
+		}
+		switch (operation)
+		{
+		case 0:
+		case 1:
+			emitArithmeticFlags(false);
+			break;
+		case 2:
+		case 3:
+		case 7:
+			emitArithmeticFlags(true);
+			break;
+		default:
+			emitLogicFlags(operation == 4);
+			break;
+		}
+	}
+
+	void emitInstruction(const U8 opcode, const U16 operand, const bool needsFlags)
+	{
+		const U8 x = opcode >> 6;
+		const U8 y = (opcode >> 3) & 0b111;
+		const U8 z = opcode & 0b111;
+		const U8 a = hostRegister(7);
+
+		if (opcode == 0x00)
+		{
+			return;
+		}
+		if (opcode == 0xCB)
+		{
+			emitCb(static_cast<U8>(operand), needsFlags);
+			return;
+		}
+		if (x == 0 && z == 1)
+		{
+			// LD rr, nn
+			emitMoveImmediate(hostRegister(y), static_cast<U8>(operand >> 8));
+			emitMoveImmediate(hostRegister(y + 1), static_cast<U8>(operand));
+		}
+		else if (x == 0 && z == 3)
+		{
+			// INC rr / DEC rr as add/adc or sub/sbb on the two halves
+			const U8 high = hostRegister(y & 0b110);
+			const U8 low = hostRegister((y & 0b110) + 1);
+			const bool increment = (y & 1) == 0;
+			emitImmediate(0x80, increment ? 0 : 5, low, 1);
+			emitImmediate(0x80, increment ? 2 : 3, high, 0);
+		}
+		else if (x == 0 && (z == 4 || z == 5))
+		{
+			// INC r / DEC r
+			emitGroup(0xFE, z == 4 ? 0 : 1, hostRegister(y));
+			if (needsFlags)
+			{
+				emitIncDecFlags(z == 5);
+			}
+		}
+		else if (x == 0 && z == 6)
+		{
+			emitMoveImmediate(hostRegister(y), static_cast<U8>(operand));
+		}
+		else if (x == 0 && z == 7)
+		{
+			emitAccumulator(y, needsFlags);
+		}
+		else if (x == 1)
+		{
+			if (y != z)
+			{
+				emitRegister(0x88, hostRegister(y), hostRegister(z));
+			}
+		}
+		else if (x == 2)
+		{
+			if (y == 1 || y == 3)
+			{
+				emitLoadCarry();
+			}
+			emitRegister(X86_ALU_OPCODES[y], a, hostRegister(z));
+			emitAlu(y, needsFlags);
+		}
+		else
+		{
+			// ALU A, n
+			if (y == 1 || y == 3)
+			{
+				emitLoadCarry();
+			}
+			emitImmediate(0x80, X86_ALU_DIGITS[y], a, static_cast<U8>(operand));
+			emitAlu(y, needsFlags);
+		}
+	}
+
+	// RLCA, RRCA, RLA, RRA, CPL, SCF, CCF
+	void emitAccumulator(const U8 y, const bool needsFlags)
+	{
+		const U8 a = hostRegister(7);
+		if (y <= 3)
+		{
+			if (y >= 2)
+			{
+				emitLoadCarry();
+			}
+			emitGroup(0xD0, X86_SHIFT_DIGITS[y], a);
+			if (needsFlags)
+			{
+				emitCarryFlag();
+			}
+		}
+		else if (y == 5)
+		{
+			// not a
+			emitGroup(0xF6, 2, a);
+			if (needsFlags)
+			{
+				// or bl, 0x60
+				emit({ 0x80, 0xCB, 0x60 });
+			}
+		}
+		else if (needsFlags && y == 6)
+		{
+			// and bl, 0x80, or bl, 0x10
+			emit({ 0x80, 0xE3, 0x80, 0x80, 0xCB, 0x10 });
+		}
+		else if (needsFlags)
+		{
+			// and bl, 0x90, xor bl, 0x10
+			emit({ 0x80, 0xE3, 0x90, 0x80, 0xF3, 0x10 });
+		}
+	}
+
+	void emitCb(const U8 opcode, const bool needsFlags)
+	{
+		const U8 x = opcode >> 6;
+		const U8 y = (opcode >> 3) & 0b111;
+		const U8 reg = hostRegister(opcode & 0b111);
+		if (x == 0)
+		{
+			if (y == 6)
+			{
+				// SWAP is a rotate by four, C is always reset
+				emitImmediate(0xC0, 0, reg, 4);
+				if (needsFlags)
+				{
+					// test reg, reg, setz bl, shl bl, 7
+					emitRegister(0x84, reg, reg);
+					emit({ 0x0F, 0x94, 0xC3, 0xC0, 0xE3, 0x07 });
+				}
+				return;
+			}
+			if (y == 2 || y == 3)
+			{
+				emitLoadCarry();
+			}
+			emitGroup(0xD0, X86_SHIFT_DIGITS[y], reg);
+			if (needsFlags)
+			{
+				emitShiftFlags(reg);
+			}
+		}
+		else if (x == 1)
+		{
+			if (needsFlags)
+			{
+				// test reg, 1 << y, setz al, shl al, 7, and bl, 0x10, or bl, 0x20, or bl, al
+				emitImmediate(0xF6, 0, reg, static_cast<U8>(1 << y));
+				emit({ 0x0F, 0x94, 0xC0, 0xC0, 0xE0, 0x07, 0x80, 0xE3, 0x10, 0x80, 0xCB, 0x20, 0x08, 0xC3 });
+			}
+		}
+		else
+		{
+			// RES is and, SET is or
+			emitImmediate(0x80, x == 2 ? 4 : 1, reg, static_cast<U8>(x == 2 ? ~(1 << y) : 1 << y));
+		}
+	}
+};
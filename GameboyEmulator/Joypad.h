@@ -0,0 +1,105 @@
+#pragma once
+#include <array>
+#include "Helpers.h"
+#include "MemoryBus.h"
+
+// P1 at FF00
+// The buttons held down are set from outside as a mask of BUTTON_ bits, the CPU selects the
+// direction keys, the action buttons or both with bits 4 and 5 and reads them active-low
+// A selected button going down requests the joypad interrupt
+class CJoypad : public IIoDevice
+{
+public:
+	static constexpr U16 P1_ADDRESS = 0xFF00;
+
+	static constexpr U8 BUTTON_RIGHT = 1 << 0;
+	static constexpr U8 BUTTON_LEFT = 1 << 1;
+	static constexpr U8 BUTTON_UP = 1 << 2;
+	static constexpr U8 BUTTON_DOWN = 1 << 3;
+	static constexpr U8 BUTTON_A = 1 << 4;
+	static constexpr U8 BUTTON_B = 1 << 5;
+	static constexpr U8 BUTTON_SELECT = 1 << 6;
+	static constexpr U8 BUTTON_START = 1 << 7;
+
+	// Part of the save state format
+	struct SState
+	{
+		U8 Select = 0;
+		U8 Buttons = 0;
+		std::array<U8, 6> Padding{};
+	};
+
+	explicit CJoypad(CMemoryBus& bus)
+		: m_Bus(bus)
+	{
+	}
+
+	U8 ReadIo(const U16 /*address*/) override
+	{
+		return 0xC0 | m_Select | getLines();
+	}
+
+	void WriteIo(const U16 /*address*/, const U8 value) override
+	{
+		const U8 before = getLines();
+		m_Select = value & SELECT_MASK;
+		requestOnPress(before);
+	}
+
+	void SetButtons(const U8 buttons)
+	{
+		const U8 before = getLines();
+		m_Buttons = buttons;
+		requestOnPress(before);
+	}
+
+	[[nodiscard]] U8 GetButtons() const
+	{
+		return m_Buttons;
+	}
+
+	void SaveState(SState& state) const
+	{
+		state.Select = m_Select;
+		state.Buttons = m_Buttons;
+	}
+
+	void LoadState(const SState& state)
+	{
+		m_Select = state.Select & SELECT_MASK;
+		m_Buttons = state.Buttons;
+	}
+
+private:
+	static constexpr U8 SELECT_MASK = 0b00110000;
+	static constexpr U8 SELECT_DIRECTIONS = 1 << 4;
+	static constexpr U8 SELECT_ACTIONS = 1 << 5;
+
+	CMemoryBus& m_Bus;
+	// Nothing is selected after power on
+	U8 m_Select = SELECT_MASK;
+	U8 m_Buttons = 0;
+
+	// Low nibble of P1, a 0 bit is a selected button that is down
+	[[nodiscard]] U8 getLines() const
+	{
+		U8 down = 0;
+		if ((m_Select & SELECT_DIRECTIONS) == 0)
+		{
+			down |= m_Buttons & 0x0F;
+		}
+		if ((m_Select & SELECT_ACTIONS) == 0)
+		{
+			down |= m_Buttons >> 4;
+		}
+		return ~down & 0x0F;
+	}
+
+	void requestOnPress(const U8 before)
+	{
+		if ((before & ~getLines()) != 0)
+		{
+			m_Bus.RequestInterrupt(EInterrupt::Joypad);
+		}
+	}
+};
@@ -0,0 +1,428 @@
+#pragma once
+#include <array>
+#include "Helpers.h"
+#include "Operations.h"
+#include "PixelKernels.h"
+
+// The registers of LANES machines stored one array per register, so that one SIMD register
+// holds the same register of every lane
+// F is always packed, lanes have no lazy flags, SP and PC are not part of it since every lane
+// runs the same instruction
+struct alignas(32) SLaneRegisters
+{
+	static constexpr U32 LANES = 32;
+	using Lanes = std::array<U8, LANES>;
+
+	Lanes A{}, F{}, B{}, C{}, D{}, E{}, H{}, L{};
+
+	// The register encoded in opcode bits 0-2 or 3-5, 6 is (HL) and has no array
+	[[nodiscard]] Lanes& R8(const U8 encoding)
+	{
+		assert(encoding != 6);
+		Lanes* const registers[8] = { &B, &C, &D, &E, &H, &L, nullptr, &A };
+		return *registers[encoding & 7];
+	}
+
+	[[nodiscard]] SRegisters GetLane(const U32 lane) const
+	{
+		SRegisters registers{};
+		registers.A = A[lane];
+		registers.SetF(F[lane]);
+		registers.B = B[lane];
+		registers.C = C[lane];
+		registers.D = D[lane];
+		registers.E = E[lane];
+		registers.H = H[lane];
+		registers.L = L[lane];
+		return registers;
+	}
+
+	void SetLane(const U32 lane, const SRegisters& registers)
+	{
+		A[lane] = registers.A;
+		F[lane] = registers.GetF();
+		B[lane] = registers.B;
+		C[lane] = registers.C;
+		D[lane] = registers.D;
+		E[lane] = registers.E;
+		H[lane] = registers.H;
+		L[lane] = registers.L;
+	}
+};
+
+// One ALU op on every lane at once, results and flags are the ones COperations gives
+struct SLaneKernels
+{
+	// A op value for each lane, CP only writes F
+	// values may be one of the arrays of registers, A included
+	void (*Add)(const SLaneRegisters::Lanes& values, SLaneRegisters& registers);
+	void (*Sub)(const SLaneRegisters::Lanes& values, SLaneRegisters& registers);
+	void (*AndOp)(const SLaneRegisters::Lanes& values, SLaneRegisters& registers);
+	void (*OrOp)(const SLaneRegisters::Lanes& values, SLaneRegisters& registers);
+	void (*XorOp)(const SLaneRegisters::Lanes& values, SLaneRegisters& registers);
+	void (*Cp)(const SLaneRegisters::Lanes& values, SLaneRegisters& registers);
+	// target is one of the arrays of registers, INC and DEC keep the carry in F
+	void (*Inc)(SLaneRegisters::Lanes& target, SLaneRegisters& registers);
+	void (*Dec)(SLaneRegisters::Lanes& target, SLaneRegisters& registers);
+	void (*Swap)(SLaneRegisters::Lanes& target, SLaneRegisters& registers);
+};
+
+// Runs register ALU instructions on all lanes of SLaneRegisters in lockstep
+// The kernels use the paths of the pixel kernels and are picked the same way
+class CLaneAlu
+{
+public:
+	// Unsupported paths fall back to scalar
+	[[nodiscard]] static const SLaneKernels& Get([[maybe_unused]] const EPixelPath path = CPixelKernels::GetBestPath())
+	{
+		static constexpr SLaneKernels SCALAR = {
+			&binaryScalar<&COperations::Add<>>, &binaryScalar<&COperations::Sub<>>, &binaryScalar<&COperations::AndOp>,
+			&binaryScalar<&COperations::OrOp>, &binaryScalar<&COperations::XorOp>, &binaryScalar<&COperations::Cp<>>,
+			&unaryScalar<&COperations::Inc<>>, &unaryScalar<&COperations::Dec<>>, &unaryScalar<&COperations::Swap>
+		};
+#if GB_SIMD
+		static constexpr SLaneKernels SSE2 = {
+			&binarySse2<EOp::Add>, &binarySse2<EOp::Sub>, &binarySse2<EOp::And>,
+			&binarySse2<EOp::Or>, &binarySse2<EOp::Xor>, &binarySse2<EOp::Cp>,
+			&unarySse2<EOp::Inc>, &unarySse2<EOp::Dec>, &unarySse2<EOp::Swap>
+		};
+		static constexpr SLaneKernels AVX2 = {
+			&binaryAvx2<EOp::Add>, &binaryAvx2<EOp::Sub>, &binaryAvx2<EOp::And>,
+			&binaryAvx2<EOp::Or>, &binaryAvx2<EOp::Xor>, &binaryAvx2<EOp::Cp>,
+			&unaryAvx2<EOp::Inc>, &unaryAvx2<EOp::Dec>, &unaryAvx2<EOp::Swap>
+		};
+		if (CPixelKernels::IsSupported(path))
+		{
+			if (path == EPixelPath::Avx2)
+			{
+				return AVX2;
+			}
+			if (path == EPixelPath::Sse2)
+			{
+				return SSE2;
+			}
+		}
+#endif
+		return SCALAR;
+	}
+
+	// ADD, SUB, AND, XOR, OR and CP with a register, INC, DEC and SWAP of a register
+	// Opcodes as given by CProcessor::Encode, (HL) and the carry-in ops are not lane ops
+	[[nodiscard]] static constexpr bool IsLaneOpcode(const U16 opcode)
+	{
+		const U8 low = opcode & 7;
+		if (opcode >> 8 == 0xCB)
+		{
+			return (opcode & 0xF8) == 0x30 && low != 6;
+		}
+		if (opcode < 0x40)
+		{
+			return (opcode & 0x06) == 0x04 && (opcode >> 3 & 7) != 6;
+		}
+		const U8 op = opcode >> 3 & 7;
+		return opcode >= 0x80 && opcode < 0xC0 && low != 6 && op != 1 && op != 3;
+	}
+
+	// Runs opcodes[lane] on each lane, false without changing anything if one is not a lane op
+	// Lanes running the opcode of lane 0 go through the kernels, the others diverged and run
+	// one at a time through COperations
+	[[nodiscard]] static bool Execute(const std::array<U16, SLaneRegisters::LANES>& opcodes, SLaneRegisters& registers, const SLaneKernels& kernels = Get())
+	{
+		if (!IsLaneOpcode(opcodes[0]))
+		{
+			return false;
+		}
+		// An or of all differences the compiler can vectorize, the common case is that none differ
+		U16 differences = 0;
+		for (const U16 opcode : opcodes)
+		{
+			differences |= opcode ^ opcodes[0];
+		}
+		if (differences == 0)
+		{
+			executeLanes(opcodes[0], registers, kernels);
+			return true;
+		}
+		U32 diverged = 0;
+		for (U32 lane = 0; lane < SLaneRegisters::LANES; ++lane)
+		{
+			if (opcodes[lane] != opcodes[0])
+			{
+				if (!IsLaneOpcode(opcodes[lane]))
+				{
+					return false;
+				}
+				diverged |= 1u << lane;
+			}
+		}
+		const SLaneRegisters before = registers;
+		executeLanes(opcodes[0], registers, kernels);
+		for (U32 lane = 0; lane < SLaneRegisters::LANES; ++lane)
+		{
+			if ((diverged >> lane & 1) != 0)
+			{
+				SRegisters scalar = before.GetLane(lane);
+				executeScalar(opcodes[lane], scalar);
+				registers.SetLane(lane, scalar);
+			}
+		}
+		return true;
+	}
+
+private:
+	enum class EOp
+	{
+		Add,
+		Sub,
+		And,
+		Or,
+		Xor,
+		Cp,
+		Inc,
+		Dec,
+		Swap
+	};
+
+	static void executeLanes(const U16 opcode, SLaneRegisters& registers, const SLaneKernels& kernels)
+	{
+		if (opcode >> 8 == 0xCB)
+		{
+			kernels.Swap(registers.R8(opcode & 7), registers);
+			return;
+		}
+		if (opcode < 0x40)
+		{
+			SLaneRegisters::Lanes& target = registers.R8(opcode >> 3 & 7);
+			(opcode & 1 ? kernels.Dec : kernels.Inc)(target, registers);
+			return;
+		}
+		const SLaneRegisters::Lanes& values = registers.R8(opcode & 7);
+		switch (opcode >> 3 & 7)
+		{
+		case 0:
+			kernels.Add(values, registers);
+			break;
+		case 2:
+			kernels.Sub(values, registers);
+			break;
+		case 4:
+			kernels.AndOp(values, registers);
+			break;
+		case 5:
+			kernels.XorOp(values, registers);
+			break;
+		case 6:
+			kernels.OrOp(values, registers);
+			break;
+		default:
+			kernels.Cp(values, registers);
+			break;
+		}
+	}
+
+	static void executeScalar(const U16 opcode, SRegisters& registers)
+	{
+		if (opcode >> 8 == 0xCB)
+		{
+			U8& target = registers.R8[SRegisters::R8Index(opcode & 7)];
+			target = COperations::Swap(target, registers);
+			return;
+		}
+		if (opcode < 0x40)
+		{
+			U8& target = registers.R8[SRegisters::R8Index(opcode >> 3 & 7)];
+			target = opcode & 1 ? COperations::Dec(target, registers) : COperations::Inc(target, registers);
+			return;
+		}
+		const U8 value = registers.R8[SRegisters::R8Index(opcode & 7)];
+		switch (opcode >> 3 & 7)
+		{
+		case 0:
+			COperations::Add(value, registers);
+			break;
+		case 2:
+			COperations::Sub(value, registers);
+			break;
+		case 4:
+			COperations::AndOp(value, registers);
+			break;
+		case 5:
+			COperations::XorOp(value, registers);
+			break;
+		case 6:
+			COperations::OrOp(value, registers);
+			break;
+		default:
+			COperations::Cp(value, registers);
+			break;
+		}
+	}
+
+	template<void (*Operation)(U8, SRegisters&)>
+	static void binaryScalar(const SLaneRegisters::Lanes& values, SLaneRegisters& registers)
+	{
+		for (U32 lane = 0; lane < SLaneRegisters::LANES; ++lane)
+		{
+			SRegisters scalar{};
+			scalar.A = registers.A[lane];
+			scalar.SetF(registers.F[lane]);
+			Operation(values[lane], scalar);
+			registers.A[lane] = scalar.A;
+			registers.F[lane] = scalar.GetF();
+		}
+	}
+
+	// A is not written back, target may be A
+	template<U8 (*Operation)(U8, SRegisters&)>
+	static void unaryScalar(SLaneRegisters::Lanes& target, SLaneRegisters& registers)
+	{
+		for (U32 lane = 0; lane < SLaneRegisters::LANES; ++lane)
+		{
+			SRegisters scalar{};
+			scalar.SetF(registers.F[lane]);
+			target[lane] = Operation(target[lane], scalar);
+			registers.F[lane] = scalar.GetF();
+		}
+	}
+
+#if GB_SIMD
+	// Z from the result, H and C where their masks are set, plus the fixed bits
+	static __m128i packFlagsSse2(const __m128i result, const __m128i halfCarry, const __m128i carry, const U8 fixed)
+	{
+		const __m128i zero = _mm_cmpeq_epi8(result, _mm_setzero_si128());
+		__m128i f = _mm_and_si128(zero, _mm_set1_epi8(static_cast<char>(SAluTables::ZERO_FLAG)));
+		f = _mm_or_si128(f, _mm_and_si128(halfCarry, _mm_set1_epi8(SAluTables::HALF_CARRY_FLAG)));
+		f = _mm_or_si128(f, _mm_and_si128(carry, _mm_set1_epi8(SAluTables::CARRY_FLAG)));
+		return _mm_or_si128(f, _mm_set1_epi8(static_cast<char>(fixed)));
+	}
+
+	// 16 lanes at a time
+	// Half carry is bit 4 of a ^ value ^ result, carry is an unsigned compare of the result
+	// with a for ADD and of value with a for SUB and CP
+	template<EOp Op>
+	static void binarySse2(const SLaneRegisters::Lanes& values, SLaneRegisters& registers)
+	{
+		const __m128i halfCarryBit = _mm_set1_epi8(0x10);
+		const __m128i ones = _mm_set1_epi8(-1);
+		for (U32 lane = 0; lane < SLaneRegisters::LANES; lane += 16)
+		{
+			const __m128i a = _mm_load_si128(reinterpret_cast<const __m128i*>(registers.A.data() + lane));
+			const __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values.data() + lane));
+			__m128i result;
+			__m128i f;
+			if constexpr (Op == EOp::Add || Op == EOp::Sub || Op == EOp::Cp)
+			{
+				result = Op == EOp::Add ? _mm_add_epi8(a, value) : _mm_sub_epi8(a, value);
+				const __m128i halfCarry = _mm_cmpeq_epi8(_mm_and_si128(_mm_xor_si128(_mm_xor_si128(a, value), result), halfCarryBit), halfCarryBit);
+				const __m128i carry = Op == EOp::Add ? _mm_xor_si128(_mm_cmpeq_epi8(_mm_max_epu8(a, result), result), ones)
+					: _mm_xor_si128(_mm_cmpeq_epi8(_mm_max_epu8(a, value), a), ones);
+				f = packFlagsSse2(result, halfCarry, carry, Op == EOp::Add ? 0 : SAluTables::SUBTRACTION_FLAG);
+			}
+			else
+			{
+				result = Op == EOp::And ? _mm_and_si128(a, value) : Op == EOp::Or ? _mm_or_si128(a, value) : _mm_xor_si128(a, value);
+				f = packFlagsSse2(result, _mm_setzero_si128(), _mm_setzero_si128(), Op == EOp::And ? SAluTables::HALF_CARRY_FLAG : 0);
+			}
+			if constexpr (Op != EOp::Cp)
+			{
+				_mm_store_si128(reinterpret_cast<__m128i*>(registers.A.data() + lane), result);
+			}
+			_mm_store_si128(reinterpret_cast<__m128i*>(registers.F.data() + lane), f);
+		}
+	}
+
+	// Without byte shifts SWAP shifts 16 bit words and masks off the bits that crossed a byte
+	template<EOp Op>
+	static void unarySse2(SLaneRegisters::Lanes& target, SLaneRegisters& registers)
+	{
+		const __m128i carryBit = _mm_set1_epi8(SAluTables::CARRY_FLAG);
+		const __m128i lowNibble = _mm_set1_epi8(0x0F);
+		for (U32 lane = 0; lane < SLaneRegisters::LANES; lane += 16)
+		{
+			const __m128i value = _mm_load_si128(reinterpret_cast<const __m128i*>(target.data() + lane));
+			__m128i result;
+			__m128i f;
+			if constexpr (Op == EOp::Swap)
+			{
+				result = _mm_or_si128(_mm_andnot_si128(lowNibble, _mm_slli_epi16(value, 4)), _mm_and_si128(_mm_srli_epi16(value, 4), lowNibble));
+				f = packFlagsSse2(result, _mm_setzero_si128(), _mm_setzero_si128(), 0);
+			}
+			else
+			{
+				const __m128i oldF = _mm_load_si128(reinterpret_cast<const __m128i*>(registers.F.data() + lane));
+				result = Op == EOp::Inc ? _mm_sub_epi8(value, _mm_set1_epi8(-1)) : _mm_add_epi8(value, _mm_set1_epi8(-1));
+				// INC carries out of the low nibble when it wraps to 0, DEC borrows when it wraps to F
+				const __m128i halfCarry = _mm_cmpeq_epi8(_mm_and_si128(result, lowNibble), Op == EOp::Inc ? _mm_setzero_si128() : lowNibble);
+				f = packFlagsSse2(result, halfCarry, _mm_setzero_si128(), Op == EOp::Inc ? 0 : SAluTables::SUBTRACTION_FLAG);
+				f = _mm_or_si128(f, _mm_and_si128(oldF, carryBit));
+			}
+			_mm_store_si128(reinterpret_cast<__m128i*>(target.data() + lane), result);
+			_mm_store_si128(reinterpret_cast<__m128i*>(registers.F.data() + lane), f);
+		}
+	}
+
+	GB_TARGET_AVX2 static __m256i packFlagsAvx2(const __m256i result, const __m256i halfCarry, const __m256i carry, const U8 fixed)
+	{
+		const __m256i zero = _mm256_cmpeq_epi8(result, _mm256_setzero_si256());
+		__m256i f = _mm256_and_si256(zero, _mm256_set1_epi8(static_cast<char>(SAluTables::ZERO_FLAG)));
+		f = _mm256_or_si256(f, _mm256_and_si256(halfCarry, _mm256_set1_epi8(SAluTables::HALF_CARRY_FLAG)));
+		f = _mm256_or_si256(f, _mm256_and_si256(carry, _mm256_set1_epi8(SAluTables::CARRY_FLAG)));
+		return _mm256_or_si256(f, _mm256_set1_epi8(static_cast<char>(fixed)));
+	}
+
+	// All 32 lanes in one register, the same steps as SSE2
+	template<EOp Op>
+	GB_TARGET_AVX2 static void binaryAvx2(const SLaneRegisters::Lanes& values, SLaneRegisters& registers)
+	{
+		static_assert(SLaneRegisters::LANES == 32, "One AVX2 register per array");
+		const __m256i halfCarryBit = _mm256_set1_epi8(0x10);
+		const __m256i ones = _mm256_set1_epi8(-1);
+		const __m256i a = _mm256_load_si256(reinterpret_cast<const __m256i*>(registers.A.data()));
+		const __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values.data()));
+		__m256i result;
+		__m256i f;
+		if constexpr (Op == EOp::Add || Op == EOp::Sub || Op == EOp::Cp)
+		{
+			result = Op == EOp::Add ? _mm256_add_epi8(a, value) : _mm256_sub_epi8(a, value);
+			const __m256i halfCarry = _mm256_cmpeq_epi8(_mm256_and_si256(_mm256_xor_si256(_mm256_xor_si256(a, value), result), halfCarryBit), halfCarryBit);
+			const __m256i carry = Op == EOp::Add ? _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(a, result), result), ones)
+				: _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(a, value), a), ones);
+			f = packFlagsAvx2(result, halfCarry, carry, Op == EOp::Add ? 0 : SAluTables::SUBTRACTION_FLAG);
+		}
+		else
+		{
+			result = Op == EOp::And ? _mm256_and_si256(a, value) : Op == EOp::Or ? _mm256_or_si256(a, value) : _mm256_xor_si256(a, value);
+			f = packFlagsAvx2(result, _mm256_setzero_si256(), _mm256_setzero_si256(), Op == EOp::And ? SAluTables::HALF_CARRY_FLAG : 0);
+		}
+		if constexpr (Op != EOp::Cp)
+		{
+			_mm256_store_si256(reinterpret_cast<__m256i*>(registers.A.data()), result);
+		}
+		_mm256_store_si256(reinterpret_cast<__m256i*>(registers.F.data()), f);
+	}
+
+	template<EOp Op>
+	GB_TARGET_AVX2 static void unaryAvx2(SLaneRegisters::Lanes& target, SLaneRegisters& registers)
+	{
+		const __m256i lowNibble = _mm256_set1_epi8(0x0F);
+		const __m256i value = _mm256_load_si256(reinterpret_cast<const __m256i*>(target.data()));
+		__m256i result;
+		__m256i f;
+		if constexpr (Op == EOp::Swap)
+		{
+			result = _mm256_or_si256(_mm256_andnot_si256(lowNibble, _mm256_slli_epi16(value, 4)), _mm256_and_si256(_mm256_srli_epi16(value, 4), lowNibble));
+			f = packFlagsAvx2(result, _mm256_setzero_si256(), _mm256_setzero_si256(), 0);
+		}
+		else
+		{
+			const __m256i oldF = _mm256_load_si256(reinterpret_cast<const __m256i*>(registers.F.data()));
+			result = Op == EOp::Inc ? _mm256_sub_epi8(value, _mm256_set1_epi8(-1)) : _mm256_add_epi8(value, _mm256_set1_epi8(-1));
+			const __m256i halfCarry = _mm256_cmpeq_epi8(_mm256_and_si256(result, lowNibble), Op == EOp::Inc ? _mm256_setzero_si256() : lowNibble);
+			f = packFlagsAvx2(result, halfCarry, _mm256_setzero_si256(), Op == EOp::Inc ? 0 : SAluTables::SUBTRACTION_FLAG);
+			f = _mm256_or_si256(f, _mm256_and_si256(oldF, _mm256_set1_epi8(SAluTables::CARRY_FLAG)));
+		}
+		_mm256_store_si256(reinterpret_cast<__m256i*>(target.data()), result);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(registers.F.data()), f);
+	}
+#endif
+};
@@ -0,0 +1,195 @@
+#pragma once
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "Cartridge.h"
+#include "Helpers.h"
+#include "Processor.h"
+#include "ThreadPool.h"
+
+// What each machine reports after a step
+enum class EObservation
+{
+	// The shades of the last frame, CPpu::Frame
+	Frame,
+	// Bytes read through the bus from a list of address ranges, back to back, frames are not drawn
+	Ram
+};
+
+struct SRamSlice
+{
+	U16 Address = 0;
+	U16 Size = 0;
+};
+
+// Machines running the same cartridge, stepped together a frame at a time on a thread pool
+// Every bus maps the one ROM image in place, only RAM and the rest of the state are per machine
+// The observations of all machines are written to one buffer allocated up front, machine i at
+// i * GetObservationSize(), and stay valid until the next step
+// Resetting loads a snapshot, which keeps the translated blocks in ROM
+class CMachineBatch
+{
+public:
+	// The ROM has to stay valid while the batch is used
+	CMachineBatch(CThreadPool& pool, const size_t count, const U8* rom, const size_t size, const EMbcType mbcType, const size_t ramSize)
+		: m_Pool(pool)
+	{
+		m_Machines.reserve(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			auto machine = std::make_unique<CProcessor>();
+			machine->Bus.LoadRom(rom, size, mbcType, ramSize);
+			// The fastest core, it runs the same as stepping
+			machine->SetBlockCacheEnabled(true);
+			machine->SetJitEnabled(true);
+			machine->Reset();
+			m_Machines.push_back(std::move(machine));
+		}
+		ObserveFrames();
+	}
+
+	CMachineBatch(CThreadPool& pool, const size_t count, const CCartridge& cartridge)
+		: CMachineBatch(pool, count, cartridge.GetData(), cartridge.GetSize(), cartridge.GetHeader().MbcType, cartridge.GetHeader().RamSize)
+	{
+	}
+
+	CMachineBatch(const CMachineBatch&) = delete;
+	CMachineBatch& operator=(const CMachineBatch&) = delete;
+
+	void ObserveFrames()
+	{
+		m_Observation = EObservation::Frame;
+		m_Slices.clear();
+		setObservationSize(sizeof(CPpu::Frame), 1);
+	}
+
+	// Frames are not drawn while RAM is observed
+	void ObserveRam(const std::vector<SRamSlice>& slices)
+	{
+		m_Observation = EObservation::Ram;
+		m_Slices = slices;
+		size_t size = 0;
+		for (const SRamSlice& slice : m_Slices)
+		{
+			size += slice.Size;
+		}
+		setObservationSize(size, CPpu::HEADLESS);
+	}
+
+	[[nodiscard]] EObservation GetObservation() const
+	{
+		return m_Observation;
+	}
+
+	[[nodiscard]] size_t GetCount() const
+	{
+		return m_Machines.size();
+	}
+
+	[[nodiscard]] CProcessor& GetMachine(const size_t index)
+	{
+		return *m_Machines[index];
+	}
+
+	[[nodiscard]] size_t GetObservationSize() const
+	{
+		return m_ObservationSize;
+	}
+
+	[[nodiscard]] const U8* GetObservations() const
+	{
+		return m_Observations.data();
+	}
+
+	[[nodiscard]] const U8* GetObservation(const size_t index) const
+	{
+		return m_Observations.data() + index * m_ObservationSize;
+	}
+
+	// Runs every machine for frames frames with the buttons held down, a CJoypad mask per machine
+	// or null for none, then writes the observations
+	void Step(const U8* buttons, const U32 frames = 1)
+	{
+		m_Pool.ParallelFor(m_Machines.size(), [this, buttons, frames](const size_t index, U32) {
+			CProcessor& machine = *m_Machines[index];
+			machine.Joypad.SetButtons(buttons != nullptr ? buttons[index] : 0);
+			machine.RunUntil(machine.GetCycles() + static_cast<U64>(frames) * CPpu::FRAME_CYCLES);
+			observe(index);
+		});
+	}
+
+	// The state of a machine becomes the one every machine is reset to
+	// The last frame is not part of a save state, it is kept next to the snapshot
+	[[nodiscard]] ESaveStateError TakeSnapshot(const size_t index)
+	{
+		m_Snapshot.resize(m_Machines[index]->GetSaveStateSize());
+		m_SnapshotFrame = m_Machines[index]->Ppu.GetFrame();
+		return m_Machines[index]->SaveState(m_Snapshot.data(), m_Snapshot.size());
+	}
+
+	// Loads the snapshot into a machine and observes it again
+	[[nodiscard]] ESaveStateError Reset(const size_t index)
+	{
+		if (m_Snapshot.empty())
+		{
+			return ESaveStateError::BadHeader;
+		}
+		const ESaveStateError error = m_Machines[index]->LoadState(m_Snapshot.data(), m_Snapshot.size());
+		if (error == ESaveStateError::None)
+		{
+			observe(index, true);
+		}
+		return error;
+	}
+
+	// Resets every machine on the pool, returns the first error
+	[[nodiscard]] ESaveStateError ResetAll()
+	{
+		std::vector<ESaveStateError> errors(m_Machines.size());
+		m_Pool.ParallelFor(m_Machines.size(), [this, &errors](const size_t index, U32) {
+			errors[index] = Reset(index);
+		});
+		const auto failed = std::find_if(errors.begin(), errors.end(), [](const ESaveStateError error) { return error != ESaveStateError::None; });
+		return failed == errors.end() ? ESaveStateError::None : *failed;
+	}
+
+private:
+	CThreadPool& m_Pool;
+	std::vector<std::unique_ptr<CProcessor>> m_Machines;
+	EObservation m_Observation = EObservation::Frame;
+	std::vector<SRamSlice> m_Slices;
+	size_t m_ObservationSize = 0;
+	std::vector<U8> m_Observations;
+	std::vector<U8> m_Snapshot;
+	CPpu::Frame m_SnapshotFrame{};
+
+	void setObservationSize(const size_t size, const U32 frameSkip)
+	{
+		m_ObservationSize = size;
+		m_Observations.assign(size * m_Machines.size(), 0);
+		for (const std::unique_ptr<CProcessor>& machine : m_Machines)
+		{
+			machine->Ppu.SetFrameSkip(frameSkip);
+		}
+	}
+
+	// After a reset the frame is the one of the snapshot
+	void observe(const size_t index, const bool reset = false)
+	{
+		CProcessor& machine = *m_Machines[index];
+		U8* observation = m_Observations.data() + index * m_ObservationSize;
+		if (m_Observation == EObservation::Frame)
+		{
+			const CPpu::Frame& frame = reset ? m_SnapshotFrame : machine.Ppu.GetFrame();
+			std::copy(frame.begin(), frame.end(), observation);
+			return;
+		}
+		for (const SRamSlice& slice : m_Slices)
+		{
+			for (U32 offset = 0; offset < slice.Size; ++offset)
+			{
+				*observation++ = machine.Bus.Read(static_cast<U16>(slice.Address + offset));
+			}
+		}
+	}
+};
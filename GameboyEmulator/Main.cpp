@@ -1,6 +1,273 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include "AudioOutput.h"
+#include "Cartridge.h"
+#include "FrameDump.h"
 #include "Processor.h"
 
-int main()
+namespace
 {
+	const char* getMbcName(const EMbcType mbcType)
+	{
+		switch (mbcType)
+		{
+		case EMbcType::Mbc1:
+			return "MBC1";
+		case EMbcType::Mbc3:
+			return "MBC3";
+		case EMbcType::Mbc5:
+			return "MBC5";
+		default:
+			return "none";
+		}
+	}
+
+	struct SOptions
+	{
+		const char* Rom = nullptr;
+		const char* TracePath = nullptr;
+		const char* DumpDirectory = nullptr;
+		EFrameDumpFormat DumpFormat = EFrameDumpFormat::Png;
+		// Every drawn frame is dumped even if that slows down the emulation
+		bool DumpComplete = false;
+		const char* WavPath = nullptr;
+		U64 Seconds = 1;
+		U32 FrameSkip = 1;
+	};
+
+	// False on unknown options, missing or invalid values and options that contradict each other
+	bool parseOptions(const int argc, char* argv[], SOptions& options)
+	{
+		if (argc < 2)
+		{
+			return false;
+		}
+		options.Rom = argv[1];
+		bool headless = false;
+		U32 frameSkip = 0;
+		U32 dumpEvery = 0;
+		for (int i = 2; i < argc; ++i)
+		{
+			const bool hasValue = i + 1 < argc;
+			if (std::strcmp(argv[i], "--headless") == 0)
+			{
+				headless = true;
+			}
+			else if (std::strcmp(argv[i], "--trace") == 0 && hasValue)
+			{
+				options.TracePath = argv[++i];
+			}
+			else if (std::strcmp(argv[i], "--seconds") == 0 && hasValue)
+			{
+				options.Seconds = std::strtoull(argv[++i], nullptr, 10);
+				if (options.Seconds == 0)
+				{
+					return false;
+				}
+			}
+			else if (std::strcmp(argv[i], "--wav") == 0 && hasValue)
+			{
+				options.WavPath = argv[++i];
+			}
+			else if (std::strcmp(argv[i], "--dump") == 0 && hasValue)
+			{
+				options.DumpDirectory = argv[++i];
+			}
+			else if (std::strcmp(argv[i], "--dump-format") == 0 && hasValue)
+			{
+				const char* format = argv[++i];
+				if (std::strcmp(format, "raw") == 0)
+				{
+					options.DumpFormat = EFrameDumpFormat::Raw;
+				}
+				else if (std::strcmp(format, "png") == 0)
+				{
+					options.DumpFormat = EFrameDumpFormat::Png;
+				}
+				else if (std::strcmp(format, "hash") == 0)
+				{
+					options.DumpFormat = EFrameDumpFormat::Hash;
+				}
+				else
+				{
+					return false;
+				}
+			}
+			else if (std::strcmp(argv[i], "--dump-complete") == 0)
+			{
+				options.DumpComplete = true;
+			}
+			else if (std::strcmp(argv[i], "--frameskip") == 0 && hasValue)
+			{
+				frameSkip = static_cast<U32>(std::strtoul(argv[++i], nullptr, 10));
+				if (frameSkip == 0)
+				{
+					return false;
+				}
+			}
+			else if (std::strcmp(argv[i], "--dump-every") == 0 && hasValue)
+			{
+				dumpEvery = static_cast<U32>(std::strtoul(argv[++i], nullptr, 10));
+				if (dumpEvery == 0)
+				{
+					return false;
+				}
+			}
+			else
+			{
+				return false;
+			}
+		}
+
+		// Only drawn frames are dumped, so dumping every n-th frame is drawing every n-th frame
+		// and a headless run has nothing to dump
+		const bool dumping = options.DumpDirectory != nullptr;
+		if (headless && (frameSkip != 0 || dumping))
+		{
+			return false;
+		}
+		if ((dumpEvery != 0 || options.DumpComplete) && !dumping)
+		{
+			return false;
+		}
+		if (dumpEvery != 0 && frameSkip != 0)
+		{
+			return false;
+		}
+		if (headless)
+		{
+			options.FrameSkip = CPpu::HEADLESS;
+		}
+		else
+		{
+			options.FrameSkip = std::max({ frameSkip, dumpEvery, 1u });
+		}
+		return true;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc == 3 && std::strcmp(argv[1], "--trace-to-text") == 0)
+	{
+		if (const ETraceError error = ConvertTraceToText(argv[2], stdout); error != ETraceError::None)
+		{
+			std::cerr << "Could not convert " << argv[2] << ": " << GetErrorMessage(error) << "\n";
+			return 1;
+		}
+		return 0;
+	}
+	SOptions options;
+	if (!parseOptions(argc, argv, options))
+	{
+		std::cerr << "Usage: GameboyEmulator <rom> [--trace <file>] [--seconds <n>] [--frameskip <n> | --headless]\n"
+			<< "                       [--wav <file>] [--dump <directory> [--dump-format raw | png | hash] [--dump-every <n>] [--dump-complete]]\n"
+			<< "       GameboyEmulator --trace-to-text <file>\n"
+			<< "Runs n seconds of emulated time as fast as possible, drawing every n-th frame or none\n"
+			<< "Drawn frames are dumped as files named by frame number or as hashes in hashes.txt, frames the\n"
+			<< "writer can not keep up with are dropped unless --dump-complete is given\n"
+			<< "--dump-every replaces --frameskip, --dump can not be used with --headless\n"
+			<< "The sound is written to a 48 kHz stereo WAV file\n";
+		return 1;
+	}
+
+	CCartridge cartridge;
+	if (const ECartridgeError error = cartridge.Open(options.Rom); error != ECartridgeError::None)
+	{
+		std::cerr << "Could not load " << options.Rom << ": " << GetErrorMessage(error) << "\n";
+		return 1;
+	}
+
+	const SCartridgeHeader& header = cartridge.GetHeader();
+	std::cout << "Title: " << header.Title << "\n"
+		<< "MBC: " << getMbcName(header.MbcType) << (header.HasBattery ? " + battery" : "") << (header.HasRtc ? " + RTC" : "") << "\n"
+		<< "ROM: " << header.RomSize / 1024 << " KB, RAM: " << header.RamSize / 1024 << " KB\n"
+		<< "Global checksum: " << (header.GlobalChecksumValid ? "ok" : "mismatch") << "\n";
+
+	CProcessor cpu;
+	cartridge.Insert(cpu.Bus);
+	cpu.Ppu.SetFrameSkip(options.FrameSkip);
+	// The fastest core, it runs the same as stepping
+	cpu.SetBlockCacheEnabled(true);
+	cpu.SetJitEnabled(true);
+	cpu.Reset();
+
+	CTraceRecorder trace;
+	if (options.TracePath != nullptr)
+	{
+		if (const ETraceError error = trace.Open(options.TracePath); error != ETraceError::None)
+		{
+			std::cerr << "Could not record to " << options.TracePath << ": " << GetErrorMessage(error) << "\n";
+			return 1;
+		}
+		cpu.SetTraceRecorder(&trace);
+	}
+
+	CFrameDumper dumper;
+	if (options.DumpDirectory != nullptr)
+	{
+		if (const EFrameDumpError error = dumper.Open(options.DumpDirectory, options.DumpFormat,
+			options.DumpComplete ? EFrameOverflow::Wait : EFrameOverflow::Drop); error != EFrameDumpError::None)
+		{
+			std::cerr << "Could not dump to " << options.DumpDirectory << ": " << GetErrorMessage(error) << "\n";
+			return 1;
+		}
+		cpu.Ppu.SetFrameSink(&dumper);
+	}
+
+	CWavWriter wav;
+	if (options.WavPath != nullptr)
+	{
+		if (const EWavError error = wav.Open(options.WavPath, cpu.Apu.GetSampleRate()); error != EWavError::None)
+		{
+			std::cerr << "Could not write to " << options.WavPath << ": " << GetErrorMessage(error) << "\n";
+			return 1;
+		}
+		cpu.Apu.SetSampleSink(&wav);
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+	cpu.RunUntil(options.Seconds * CProcessor::CLOCK_SPEED);
+	const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (trace.IsOpen())
+	{
+		cpu.SetTraceRecorder(nullptr);
+		if (const ETraceError error = trace.Close(); error != ETraceError::None)
+		{
+			std::cerr << "Could not record to " << options.TracePath << ": " << GetErrorMessage(error) << "\n";
+			return 1;
+		}
+		std::cout << "Traced " << trace.GetRecorded() << " instructions\n";
+	}
+	if (dumper.IsOpen())
+	{
+		cpu.Ppu.SetFrameSink(nullptr);
+		if (const EFrameDumpError error = dumper.Close(); error != EFrameDumpError::None)
+		{
+			std::cerr << "Could not dump to " << options.DumpDirectory << ": " << GetErrorMessage(error) << "\n";
+			return 1;
+		}
+		std::cout << "Dumped " << dumper.GetDumped() << " frames, dropped " << dumper.GetDropped() << "\n";
+	}
+	if (wav.IsOpen())
+	{
+		cpu.Apu.SetSampleSink(nullptr);
+		if (const EWavError error = wav.Close(); error != EWavError::None)
+		{
+			std::cerr << "Could not write to " << options.WavPath << ": " << GetErrorMessage(error) << "\n";
+			return 1;
+		}
+		std::cout << "Wrote " << wav.GetWritten() << " samples\n";
+	}
+	const CPpu::SStats& video = cpu.Ppu.GetStats();
+	std::cout << "Ran " << cpu.GetCycles() << " cycles, PC is at " << std::hex << cpu.Registers.PC << std::dec << "\n"
+		<< "Drew " << video.Frames - video.SkippedFrames << " of " << video.Frames << " frames\n"
+		<< "Took " << elapsed * 1000.0 << " ms, " << static_cast<double>(options.Seconds) / elapsed << "x real time\n";
+	if constexpr (PROFILER)
+	{
+		cpu.Profiler.Dump(std::cout, cpu.Scheduler);
+	}
 	return 0;
 }
@@ -0,0 +1,581 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <vector>
+#include "Helpers.h"
+
+enum class EMbcType : U8
+{
+	None,
+	Mbc1,
+	Mbc3,
+	Mbc5
+};
+
+// Bit positions in IE and IF
+enum class EInterrupt : U8
+{
+	VBlank,
+	LcdStat,
+	Timer,
+	Serial,
+	Joypad
+};
+
+// Components that own I/O registers in FF00-FF7F
+class IIoDevice
+{
+public:
+	virtual ~IIoDevice() = default;
+	virtual U8 ReadIo(U16 address) = 0;
+	virtual void WriteIo(U16 address, U8 value) = 0;
+};
+
+// Gets writes to watched pages before they are performed
+class IWriteWatcher
+{
+public:
+	virtual ~IWriteWatcher() = default;
+	virtual void OnWatchedWrite(U16 address) = 0;
+};
+
+// Memory map
+// 0000-3FFF ROM bank 0, 4000-7FFF switchable ROM bank
+// 8000-9FFF VRAM, A000-BFFF cartridge RAM, C000-DFFF WRAM, E000-FDFF echo of C000-DDFF
+// FE00-FE9F OAM, FEA0-FEFF unusable, FF00-FF7F I/O, FF80-FFFE HRAM, FFFF IE
+//
+// Every 256 byte page has a read and a write pointer, a null pointer sends the access
+// through the slow path (MBC registers, disabled cartridge RAM, OAM, I/O and HRAM)
+// Bank switching only updates the page pointers
+// Watched pages always take the slow path for writes so the watcher sees them, so does VRAM
+// while a video watcher is set, OAM always does
+class CMemoryBus
+{
+public:
+	static constexpr U32 PAGE_SIZE = 0x100;
+	static constexpr U32 PAGE_COUNT = 0x100;
+	static constexpr U32 ROM_BANK_SIZE = 0x4000;
+	static constexpr U32 RAM_BANK_SIZE = 0x2000;
+	static constexpr U16 VRAM_START = 0x8000;
+	static constexpr U16 VRAM_END = 0xA000;
+	static constexpr U16 OAM_START = 0xFE00;
+	static constexpr U16 OAM_END = 0xFEA0;
+
+	// MBC registers as written by the game
+	struct SMbcState
+	{
+		U16 RomBank = 1;
+		U8 RamBank = 0;
+		bool RamEnabled = false;
+		// MBC1 banking mode, 1 maps the upper bank bits to 0000-3FFF and cartridge RAM
+		U8 BankingMode = 0;
+	};
+
+	// Everything but the ROM and cartridge RAM, see SaveState.h
+	// The layout is part of the save state format, padding is explicit so every byte is written
+	struct SState
+	{
+		std::array<U8, 0x2000> Vram{};
+		std::array<U8, 0x2000> Wram{};
+		std::array<U8, 0xA0> Oam{};
+		std::array<U8, 0x7F> Hram{};
+		U8 Padding0 = 0;
+		std::array<U8, 0x80> Io{};
+		U8 InterruptFlag = 0;
+		U8 InterruptEnable = 0;
+		U8 MbcType = 0;
+		U8 RamBankCount = 0;
+		U16 RomBankCount = 0;
+		U16 RomBank = 0;
+		U8 RamBank = 0;
+		U8 RamEnabled = 0;
+		U8 BankingMode = 0;
+		std::array<U8, 5> Rtc{};
+	};
+
+	CMemoryBus()
+	{
+		mapFixedPages();
+	}
+
+	CMemoryBus(const CMemoryBus&) = delete;
+	CMemoryBus& operator=(const CMemoryBus&) = delete;
+
+	[[nodiscard]] U8 Read(const U16 address)
+	{
+		const U8* page = m_ReadPages[address >> 8];
+		if (page != nullptr)
+		{
+			return page[address & 0xFF];
+		}
+		return readSlow(address);
+	}
+
+	void Write(const U16 address, const U8 value)
+	{
+		U8* page = m_WritePages[address >> 8];
+		if (page != nullptr)
+		{
+			page[address & 0xFF] = value;
+			return;
+		}
+		writeSlow(address, value);
+	}
+
+	// The ROM is not copied and has to outlive the bus
+	// An image that does not end on a bank is copied and padded with FF up to the next bank
+	void LoadRom(const U8* rom, const size_t size, const EMbcType mbcType, const size_t ramSize)
+	{
+		const size_t banks = std::max<size_t>((size + ROM_BANK_SIZE - 1) / ROM_BANK_SIZE, 1);
+		if (size == banks * ROM_BANK_SIZE)
+		{
+			m_PaddedRom.clear();
+			m_Rom = rom;
+		}
+		else
+		{
+			m_PaddedRom.assign(banks * ROM_BANK_SIZE, 0xFF);
+			std::copy(rom, rom + size, m_PaddedRom.begin());
+			m_Rom = m_PaddedRom.data();
+		}
+		m_RomBankCount = static_cast<U16>(banks);
+		m_MbcType = mbcType;
+		m_Mbc = SMbcState{};
+		// Without an MBC any cartridge RAM is always enabled
+		m_Mbc.RamEnabled = mbcType == EMbcType::None;
+		m_CartridgeRam.assign(ramSize == 0 ? 0 : std::max<size_t>(ramSize, RAM_BANK_SIZE), 0);
+		m_RamBankCount = static_cast<U8>(m_CartridgeRam.size() / RAM_BANK_SIZE);
+		mapRomBanks();
+		mapRamBank();
+	}
+
+	void MapIo(const U16 first, const U16 last, IIoDevice* device)
+	{
+		for (U32 address = first; address <= last; ++address)
+		{
+			m_IoDevices[address & 0x7F] = device;
+		}
+	}
+
+	void RequestInterrupt(const EInterrupt interrupt)
+	{
+		m_InterruptFlag |= 1 << static_cast<U8>(interrupt);
+	}
+
+	void AcknowledgeInterrupt(const U8 bit)
+	{
+		m_InterruptFlag &= ~(1 << bit);
+	}
+
+	// Interrupts that are both requested and enabled
+	[[nodiscard]] U8 GetPendingInterrupts() const
+	{
+		return m_InterruptFlag & m_InterruptEnable & 0x1F;
+	}
+
+	[[nodiscard]] const SMbcState& GetMbcState() const
+	{
+		return m_Mbc;
+	}
+
+	[[nodiscard]] U16 GetRomBank() const
+	{
+		return static_cast<U16>(m_RomBank);
+	}
+
+	void SaveState(SState& state) const
+	{
+		state.Vram = m_Vram;
+		state.Wram = m_Wram;
+		state.Oam = m_Oam;
+		state.Hram = m_Hram;
+		state.Io = m_Io;
+		state.InterruptFlag = m_InterruptFlag;
+		state.InterruptEnable = m_InterruptEnable;
+		state.MbcType = static_cast<U8>(m_MbcType);
+		state.RamBankCount = m_RamBankCount;
+		state.RomBankCount = m_RomBankCount;
+		state.RomBank = m_Mbc.RomBank;
+		state.RamBank = m_Mbc.RamBank;
+		state.RamEnabled = m_Mbc.RamEnabled;
+		state.BankingMode = m_Mbc.BankingMode;
+		state.Rtc = m_Rtc;
+	}
+
+	// False without changing anything if the state was saved with a different kind of cartridge
+	// Memory is replaced behind the back of the write watcher
+	[[nodiscard]] bool LoadState(const SState& state)
+	{
+		if (state.MbcType != static_cast<U8>(m_MbcType) || state.RomBankCount != m_RomBankCount || state.RamBankCount != m_RamBankCount)
+		{
+			return false;
+		}
+		m_Vram = state.Vram;
+		m_Wram = state.Wram;
+		m_Oam = state.Oam;
+		m_Hram = state.Hram;
+		m_Io = state.Io;
+		m_InterruptFlag = state.InterruptFlag;
+		m_InterruptEnable = state.InterruptEnable;
+		m_Mbc.RomBank = state.RomBank;
+		m_Mbc.RamBank = state.RamBank;
+		m_Mbc.RamEnabled = state.RamEnabled != 0;
+		m_Mbc.BankingMode = state.BankingMode;
+		m_Rtc = state.Rtc;
+		mapRomBanks();
+		mapRamBank();
+		return true;
+	}
+
+	[[nodiscard]] size_t GetCartridgeRamSize() const
+	{
+		return m_CartridgeRam.size();
+	}
+
+	[[nodiscard]] const U8* GetCartridgeRam() const
+	{
+		return m_CartridgeRam.data();
+	}
+
+	[[nodiscard]] U8* GetCartridgeRam()
+	{
+		return m_CartridgeRam.data();
+	}
+
+	// Host memory behind a page for reads, null for pages that go through the slow path
+	[[nodiscard]] const U8* GetReadPage(const U8 page) const
+	{
+		return m_ReadPages[page];
+	}
+
+	// Changes every time a bank switch remaps pages
+	[[nodiscard]] U32 GetMapGeneration() const
+	{
+		return m_MapGeneration;
+	}
+
+	void SetWriteWatcher(IWriteWatcher* watcher)
+	{
+		m_WriteWatcher = watcher;
+	}
+
+	void WatchPage(const U8 page, const bool watch)
+	{
+		m_WatchedPages[page] = watch;
+		updateWritePage(page);
+	}
+
+	// Gets every write to VRAM and OAM before it is performed, independent of the write watcher
+	// An OAM DMA is reported as a single write to OAM_START
+	void SetVideoWatcher(IWriteWatcher* watcher)
+	{
+		m_VideoWatcher = watcher;
+		for (U32 page = VRAM_START >> 8; page < VRAM_END >> 8; ++page)
+		{
+			updateWritePage(page);
+		}
+	}
+
+	// The PPU reads VRAM and OAM without going through the bus
+	[[nodiscard]] const U8* GetVram() const
+	{
+		return m_Vram.data();
+	}
+
+	[[nodiscard]] const U8* GetOam() const
+	{
+		return m_Oam.data();
+	}
+
+private:
+	std::array<const U8*, PAGE_COUNT> m_ReadPages{};
+	std::array<U8*, PAGE_COUNT> m_WritePages{};
+	// Write pointers before watching is applied
+	std::array<U8*, PAGE_COUNT> m_WritablePages{};
+	std::array<bool, PAGE_COUNT> m_WatchedPages{};
+	IWriteWatcher* m_WriteWatcher = nullptr;
+	IWriteWatcher* m_VideoWatcher = nullptr;
+	U32 m_MapGeneration = 0;
+
+	const U8* m_Rom = nullptr;
+	// Backs m_Rom for images that do not end on a bank
+	std::vector<U8> m_PaddedRom;
+	U16 m_RomBankCount = 0;
+	U32 m_RomBank = 1;
+	EMbcType m_MbcType = EMbcType::None;
+	SMbcState m_Mbc{};
+	std::vector<U8> m_CartridgeRam;
+	U8 m_RamBankCount = 0;
+	// MBC3 RTC registers 08-0C, they are stored but the clock does not run
+	std::array<U8, 5> m_Rtc{};
+
+	std::array<U8, 0x2000> m_Vram{};
+	std::array<U8, 0x2000> m_Wram{};
+	std::array<U8, 0xA0> m_Oam{};
+	std::array<U8, 0x7F> m_Hram{};
+	std::array<U8, 0x80> m_Io{};
+	std::array<IIoDevice*, 0x80> m_IoDevices{};
+	U8 m_InterruptFlag = 0;
+	U8 m_InterruptEnable = 0;
+
+	void mapFixedPages()
+	{
+		for (U32 page = 0x80; page < 0xA0; ++page)
+		{
+			m_ReadPages[page] = &m_Vram[(page - 0x80) * PAGE_SIZE];
+			setWritePage(page, &m_Vram[(page - 0x80) * PAGE_SIZE]);
+		}
+		for (U32 page = 0xC0; page < 0xE0; ++page)
+		{
+			m_ReadPages[page] = &m_Wram[(page - 0xC0) * PAGE_SIZE];
+			setWritePage(page, &m_Wram[(page - 0xC0) * PAGE_SIZE]);
+		}
+		for (U32 page = 0xE0; page < 0xFE; ++page)
+		{
+			m_ReadPages[page] = &m_Wram[(page - 0xE0) * PAGE_SIZE];
+			setWritePage(page, &m_Wram[(page - 0xE0) * PAGE_SIZE]);
+		}
+	}
+
+	void setWritePage(const U32 page, U8* memory)
+	{
+		m_WritablePages[page] = memory;
+		updateWritePage(page);
+	}
+
+	void updateWritePage(const U32 page)
+	{
+		const bool videoWatched = m_VideoWatcher != nullptr && page >= VRAM_START >> 8 && page < VRAM_END >> 8;
+		m_WritePages[page] = m_WatchedPages[page] || videoWatched ? nullptr : m_WritablePages[page];
+	}
+
+	void mapRomBanks()
+	{
+		if (m_Rom == nullptr)
+		{
+			return;
+		}
+
+		U32 lowBank = 0;
+		U32 highBank = m_Mbc.RomBank;
+		if (m_MbcType == EMbcType::Mbc1)
+		{
+			// Bank 0 in the 5-bit register selects bank 1, upper bits come from the RAM bank register
+			const U32 upperBits = static_cast<U32>(m_Mbc.RamBank & 0b11) << 5;
+			highBank = upperBits | std::max<U32>(m_Mbc.RomBank & 0x1F, 1);
+			lowBank = m_Mbc.BankingMode == 1 ? upperBits : 0;
+		}
+		else if (m_MbcType == EMbcType::Mbc3)
+		{
+			highBank = std::max<U32>(m_Mbc.RomBank & 0x7F, 1);
+		}
+		else if (m_MbcType == EMbcType::None)
+		{
+			highBank = 1;
+		}
+		lowBank %= m_RomBankCount;
+		highBank %= m_RomBankCount;
+		m_RomBank = highBank;
+		++m_MapGeneration;
+
+		for (U32 page = 0; page < 0x40; ++page)
+		{
+			m_ReadPages[page] = m_Rom + lowBank * ROM_BANK_SIZE + page * PAGE_SIZE;
+			m_ReadPages[page + 0x40] = m_Rom + highBank * ROM_BANK_SIZE + page * PAGE_SIZE;
+		}
+	}
+
+	void mapRamBank()
+	{
+		U8* bank = nullptr;
+		const bool rtcSelected = m_MbcType == EMbcType::Mbc3 && m_Mbc.RamBank >= 0x08;
+		if (m_Mbc.RamEnabled && m_RamBankCount > 0 && !rtcSelected)
+		{
+			U32 ramBank = m_Mbc.RamBank;
+			if (m_MbcType == EMbcType::Mbc1 && m_Mbc.BankingMode == 0)
+			{
+				ramBank = 0;
+			}
+			bank = &m_CartridgeRam[(ramBank % m_RamBankCount) * RAM_BANK_SIZE];
+		}
+
+		for (U32 page = 0; page < 0x20; ++page)
+		{
+			U8* memory = bank == nullptr ? nullptr : bank + page * PAGE_SIZE;
+			m_ReadPages[page + 0xA0] = memory;
+			setWritePage(page + 0xA0, memory);
+		}
+		++m_MapGeneration;
+	}
+
+	U8 readSlow(const U16 address)
+	{
+		if (address >= 0xFF80 && address < 0xFFFF)
+		{
+			return m_Hram[address - 0xFF80];
+		}
+		if (address >= 0xFF00 && address < 0xFF80)
+		{
+			return readIo(address);
+		}
+		if (address == 0xFFFF)
+		{
+			return m_InterruptEnable;
+		}
+		if (address >= OAM_START && address < OAM_END)
+		{
+			return m_Oam[address - OAM_START];
+		}
+		if (address >= 0xA000 && address < 0xC000 && m_Mbc.RamEnabled && m_MbcType == EMbcType::Mbc3 && m_Mbc.RamBank >= 0x08 && m_Mbc.RamBank <= 0x0C)
+		{
+			return m_Rtc[m_Mbc.RamBank - 0x08];
+		}
+		// No ROM, disabled cartridge RAM and the unusable area
+		return 0xFF;
+	}
+
+	void writeSlow(const U16 address, const U8 value)
+	{
+		if (m_VideoWatcher != nullptr && ((address >= VRAM_START && address < VRAM_END) || (address >= OAM_START && address < OAM_END)))
+		{
+			m_VideoWatcher->OnWatchedWrite(address);
+		}
+		if (m_WatchedPages[address >> 8] && m_WriteWatcher != nullptr)
+		{
+			m_WriteWatcher->OnWatchedWrite(address);
+		}
+		// Only watched pages get here with memory behind them
+		if (U8* page = m_WritablePages[address >> 8])
+		{
+			page[address & 0xFF] = value;
+			return;
+		}
+
+		if (address < 0x8000)
+		{
+			writeMbc(address, value);
+		}
+		else if (address >= 0xFF80 && address < 0xFFFF)
+		{
+			m_Hram[address - 0xFF80] = value;
+		}
+		else if (address >= 0xFF00 && address < 0xFF80)
+		{
+			writeIo(address, value);
+		}
+		else if (address == 0xFFFF)
+		{
+			m_InterruptEnable = value;
+		}
+		else if (address >= OAM_START && address < OAM_END)
+		{
+			m_Oam[address - OAM_START] = value;
+		}
+		else if (address >= 0xA000 && address < 0xC000 && m_Mbc.RamEnabled && m_MbcType == EMbcType::Mbc3 && m_Mbc.RamBank >= 0x08 && m_Mbc.RamBank <= 0x0C)
+		{
+			m_Rtc[m_Mbc.RamBank - 0x08] = value;
+		}
+	}
+
+	U8 readIo(const U16 address)
+	{
+		if (IIoDevice* device = m_IoDevices[address & 0x7F])
+		{
+			return device->ReadIo(address);
+		}
+		if (address == 0xFF0F)
+		{
+			return m_InterruptFlag | 0xE0;
+		}
+		return m_Io[address & 0x7F];
+	}
+
+	void writeIo(const U16 address, const U8 value)
+	{
+		if (IIoDevice* device = m_IoDevices[address & 0x7F])
+		{
+			device->WriteIo(address, value);
+			return;
+		}
+		if (address == 0xFF0F)
+		{
+			m_InterruptFlag = value & 0x1F;
+			return;
+		}
+		m_Io[address & 0x7F] = value;
+		if (address == 0xFF46)
+		{
+			// OAM DMA, copied at once
+			if (m_VideoWatcher != nullptr)
+			{
+				m_VideoWatcher->OnWatchedWrite(OAM_START);
+			}
+			for (U16 i = 0; i < m_Oam.size(); ++i)
+			{
+				m_Oam[i] = Read(static_cast<U16>(value << 8 | i));
+			}
+		}
+	}
+
+	void writeMbc(const U16 address, const U8 value)
+	{
+		switch (m_MbcType)
+		{
+		case EMbcType::Mbc1:
+			if (address < 0x2000)
+			{
+				m_Mbc.RamEnabled = (value & 0x0F) == 0x0A;
+			}
+			else if (address < 0x4000)
+			{
+				m_Mbc.RomBank = value & 0x1F;
+			}
+			else if (address < 0x6000)
+			{
+				m_Mbc.RamBank = value & 0b11;
+			}
+			else
+			{
+				m_Mbc.BankingMode = value & 0b1;
+			}
+			break;
+		case EMbcType::Mbc3:
+			if (address < 0x2000)
+			{
+				m_Mbc.RamEnabled = (value & 0x0F) == 0x0A;
+			}
+			else if (address < 0x4000)
+			{
+				m_Mbc.RomBank = value & 0x7F;
+			}
+			else if (address < 0x6000)
+			{
+				m_Mbc.RamBank = value & 0x0F;
+			}
+			// 6000-7FFF latches the clock, it does not run so there is nothing to latch
+			break;
+		case EMbcType::Mbc5:
+			if (address < 0x2000)
+			{
+				m_Mbc.RamEnabled = (value & 0x0F) == 0x0A;
+			}
+			else if (address < 0x3000)
+			{
+				m_Mbc.RomBank = (m_Mbc.RomBank & 0x100) | value;
+			}
+			else if (address < 0x4000)
+			{
+				m_Mbc.RomBank = static_cast<U16>((value & 0b1) << 8 | (m_Mbc.RomBank & 0xFF));
+			}
+			else if (address < 0x6000)
+			{
+				m_Mbc.RamBank = value & 0x0F;
+			}
+			break;
+		default:
+			return;
+		}
+		mapRomBanks();
+		mapRamBank();
+	}
+};
@@ -1,6 +1,17 @@
 ﻿#pragma once
+#include "AluTables.h"
 #include "Helpers.h"
 
+// Arithmetic computes results and flags directly, Table reads them from SAluTables
+// Both are always available so they can be compared, GB_TABLE_ALU picks the default
+enum class EAluPath
+{
+	Arithmetic,
+	Table
+};
+
+constexpr EAluPath DEFAULT_ALU_PATH = TABLE_ALU ? EAluPath::Table : EAluPath::Arithmetic;
+
 class COperations
 {
 public:
@@ -9,78 +20,118 @@ public:
 	// Add the value to the value in register A making sure to handle overflow
 	// Update register F(flags)
 	// Write the updated value to register A
+	template<EAluPath Path = DEFAULT_ALU_PATH>
 	static void Add(const U8 value, SRegisters& registers) {
-		const U8 newValue = registers.A + value;
-		SRegisters::SFlagRegister fReg;
-		fReg.Zero = newValue == 0;
-		fReg.Subtraction = false;
-		fReg.HalfCarry = (registers.A & 0xF) + (value & 0xF) > 0xF;
-		fReg.Carry = DidOverflow(registers.A, value);
-		registers.SetFlags(fReg);
+		if constexpr (Path == EAluPath::Table)
+		{
+			registers.A = applyTableEntry(SAluTables::Get().Add[SAluTables::Index(registers.A, value, false)], registers);
+			return;
+		}
+		const U16 result = registers.A + value;
+		registers.RecordFlags(EFlagOp::Add, registers.A, value, result, [&] {
+			SRegisters::SFlagRegister fReg;
+			fReg.Zero = static_cast<U8>(result) == 0;
+			fReg.Subtraction = false;
+			fReg.HalfCarry = (registers.A & 0xF) + (value & 0xF) > 0xF;
+			fReg.Carry = DidOverflow(registers.A, value);
+			return fReg;
+		});
 
-		registers.A = newValue;
+		registers.A = static_cast<U8>(result);
 	}
+	// Z is not affected
 	// Half carry set if carry from bit 11
 	// Carry set if carry from bit 15
-	static void AddHL(const U16 value, SRegisters& registers) {
-		const U16 newValue = registers.GetHL() + value;
+	template<ERegisterTarget Source>
+	static void AddHL(SRegisters& registers) {
+		const U16 hl = registers.GetHL();
+		const U16 value = registers.GetPair<Source>();
+		const U16 newValue = hl + value;
 		SRegisters::SFlagRegister fReg;
-		fReg.Zero = newValue == 0;
+		fReg.Zero = registers.GetZero();
 		fReg.Subtraction = false;
-		fReg.HalfCarry = (registers.GetHL() & 0xFFF) + (value & 0xFFF) > 0xFFF;
-		fReg.Carry = DidOverflow(registers.GetHL(), value);
+		fReg.HalfCarry = (hl & 0xFFF) + (value & 0xFFF) > 0xFFF;
+		fReg.Carry = DidOverflow(hl, value);
 		registers.SetFlags(fReg);
 
 		registers.SetHL(newValue);
 	}
-	// Also add the carry flag
+	// Also add the incoming carry flag, H and C take the carry into account
+	template<EAluPath Path = DEFAULT_ALU_PATH>
 	static void AddC(const U8 value, SRegisters& registers) {
-		const U8 newValue = registers.A + value;
-		SRegisters::SFlagRegister fReg;
-		fReg.Zero = newValue == 0;
-		fReg.Subtraction = false;
-		fReg.HalfCarry = (registers.A & 0xF) + (value & 0xF) > 0xF;
-		fReg.Carry = DidOverflow(registers.A, value);
-		registers.SetFlags(fReg);
+		const U8 carry = registers.GetCarry() ? 1 : 0;
+		if constexpr (Path == EAluPath::Table)
+		{
+			registers.A = applyTableEntry(SAluTables::Get().Add[SAluTables::Index(registers.A, value, carry)], registers);
+			return;
+		}
+		const U16 result = registers.A + value + carry;
+		registers.RecordFlags(EFlagOp::Add, registers.A, value, result, [&] {
+			SRegisters::SFlagRegister fReg;
+			fReg.Zero = static_cast<U8>(result) == 0;
+			fReg.Subtraction = false;
+			fReg.HalfCarry = (registers.A & 0xF) + (value & 0xF) + carry > 0xF;
+			fReg.Carry = registers.A + value + carry > UINT8_MAX;
+			return fReg;
+		});
 
-		registers.A =  fReg.Carry ? newValue + 0b1 : newValue;
+		registers.A = static_cast<U8>(result);
 	}
 	// Sub instruction
+	template<EAluPath Path = DEFAULT_ALU_PATH>
 	static void Sub(const U8 value, SRegisters& registers)
 	{
-		const U8 newValue = registers.A - value;
-		SRegisters::SFlagRegister fReg;
-		fReg.Zero = newValue == 0;
-		fReg.Subtraction = true;
-		fReg.HalfCarry = (registers.A & 0xF) - (value & 0xF) < 0;
-		fReg.Carry = registers.A - value < 0;
-		registers.SetFlags(fReg);
+		if constexpr (Path == EAluPath::Table)
+		{
+			registers.A = applyTableEntry(SAluTables::Get().Sub[SAluTables::Index(registers.A, value, false)], registers);
+			return;
+		}
+		const U16 result = registers.A - value;
+		registers.RecordFlags(EFlagOp::Sub, registers.A, value, result, [&] {
+			SRegisters::SFlagRegister fReg;
+			fReg.Zero = static_cast<U8>(result) == 0;
+			fReg.Subtraction = true;
+			fReg.HalfCarry = (registers.A & 0xF) - (value & 0xF) < 0;
+			fReg.Carry = registers.A - value < 0;
+			return fReg;
+		});
 
-		registers.A = newValue;
+		registers.A = static_cast<U8>(result);
 	}
-	// Sub with carry
+	// Sub with the incoming carry flag
+	template<EAluPath Path = DEFAULT_ALU_PATH>
 	static void SubC(const U8 value, SRegisters& registers)
 	{
-		const U8 newValue = registers.A - value;
-		SRegisters::SFlagRegister fReg;
-		fReg.Zero = newValue == 0;
-		fReg.Subtraction = true;
-		fReg.HalfCarry = (registers.A & 0xF) - (value & 0xF) < 0;
-		fReg.Carry = registers.A - value < 0;
-		registers.SetFlags(fReg);
+		const U8 carry = registers.GetCarry() ? 1 : 0;
+		if constexpr (Path == EAluPath::Table)
+		{
+			registers.A = applyTableEntry(SAluTables::Get().Sub[SAluTables::Index(registers.A, value, carry)], registers);
+			return;
+		}
+		const U16 result = registers.A - value - carry;
+		registers.RecordFlags(EFlagOp::Sub, registers.A, value, result, [&] {
+			SRegisters::SFlagRegister fReg;
+			fReg.Zero = static_cast<U8>(result) == 0;
+			fReg.Subtraction = true;
+			fReg.HalfCarry = (registers.A & 0xF) - (value & 0xF) - carry < 0;
+			fReg.Carry = registers.A - value - carry < 0;
+			return fReg;
+		});
 
-		registers.A =  fReg.Carry ? newValue - 0b1 : newValue;
+		registers.A = static_cast<U8>(result);
 	}
 	// N, C flags are reset, H is set
 	static void AndOp(const U8 value, SRegisters& registers)
 	{
 		const U8 newValue = registers.A & value;
-		SRegisters::SFlagRegister fReg;
-		fReg.Zero = newValue == 0;
-		fReg.Subtraction = false;
-		fReg.HalfCarry = true;
-		fReg.Carry = false;
-		registers.SetFlags(fReg);
+		registers.RecordFlags(EFlagOp::And, registers.A, value, newValue, [&] {
+			SRegisters::SFlagRegister fReg;
+			fReg.Zero = newValue == 0;
+			fReg.Subtraction = false;
+			fReg.HalfCarry = true;
+			fReg.Carry = false;
+			return fReg;
+		});
 
 		registers.A = newValue;
 	}
@@ -88,12 +139,14 @@ public:
 	static void OrOp(const U8 value, SRegisters& registers)
 	{
 		const U8 newValue = registers.A | value;
-		SRegisters::SFlagRegister fReg;
-		fReg.Zero = newValue == 0;
-		fReg.Subtraction = false;
-		fReg.HalfCarry = false;
-		fReg.Carry = false;
-		registers.SetFlags(fReg);
+		registers.RecordFlags(EFlagOp::Or, registers.A, value, newValue, [&] {
+			SRegisters::SFlagRegister fReg;
+			fReg.Zero = newValue == 0;
+			fReg.Subtraction = false;
+			fReg.HalfCarry = false;
+			fReg.Carry = false;
+			return fReg;
+		});
 
 		registers.A = newValue;
 	}
@@ -101,143 +154,119 @@ public:
 	static void XorOp(const U8 value, SRegisters& registers)
 	{
 		const U8 newValue = registers.A ^ value;
-		SRegisters::SFlagRegister fReg;
-		fReg.Zero = newValue == 0;
-		fReg.Subtraction = false;
-		fReg.HalfCarry = false;
-		fReg.Carry = false;
-		registers.SetFlags(fReg);
+		registers.RecordFlags(EFlagOp::Or, registers.A, value, newValue, [&] {
+			SRegisters::SFlagRegister fReg;
+			fReg.Zero = newValue == 0;
+			fReg.Subtraction = false;
+			fReg.HalfCarry = false;
+			fReg.Carry = false;
+			return fReg;
+		});
 
 		registers.A = newValue;
 	}
 
+	template<EAluPath Path = DEFAULT_ALU_PATH>
 	static void Cp(const U8 value, SRegisters& registers)
 	{
-		SRegisters::SFlagRegister fReg;
-		fReg.Zero = registers.A == value;
-		fReg.Subtraction = true;
-		fReg.HalfCarry = (registers.A & 0xF) - (value & 0xF) < 0;
-		fReg.Carry = registers.A - value < 0;
-		registers.SetFlags(fReg);
+		if constexpr (Path == EAluPath::Table)
+		{
+			applyTableEntry(SAluTables::Get().Sub[SAluTables::Index(registers.A, value, false)], registers);
+			return;
+		}
+		registers.RecordFlags(EFlagOp::Sub, registers.A, value, static_cast<U16>(registers.A - value), [&] {
+			SRegisters::SFlagRegister fReg;
+			fReg.Zero = registers.A == value;
+			fReg.Subtraction = true;
+			fReg.HalfCarry = (registers.A & 0xF) - (value & 0xF) < 0;
+			fReg.Carry = registers.A - value < 0;
+			return fReg;
+		});
 	}
 
-	static void Inc(const U8 value, SRegisters& registers, const ERegisterTarget registerTarget)
+	// Inc, Dec and Swap have two forms
+	// The register form reads and writes the target register picked at compile time
+	// The value form returns the new value, it is used for (HL) targets
+	template<ERegisterTarget Target, EAluPath Path = DEFAULT_ALU_PATH>
+	static void Inc(SRegisters& registers)
 	{
-		const U8 newValue = value + 1;
-		SRegisters::SFlagRegister fReg;
-		fReg.Zero = newValue == 0;
-		fReg.Subtraction = false;
-		fReg.HalfCarry = (value & 0xF) + (1 & 0xF) > 0xF;
-		fReg.Carry = registers.GetFlags().Carry;
-		registers.SetFlags(fReg);
+		U8& target = registers.Register<Target>();
+		target = Inc<Path>(target, registers);
+	}
 
-		switch (registerTarget)
+	template<EAluPath Path = DEFAULT_ALU_PATH>
+	static U8 Inc(const U8 value, SRegisters& registers)
+	{
+		const U8 newValue = value + 1;
+		if constexpr (Path == EAluPath::Table)
+		{
+			applyTableEntry(SAluTables::Get().Inc[value], registers, registers.GetCarry());
+		}
+		else
 		{
-		case ERegisterTarget::A:
-			registers.A = newValue;
-			break;
-		case ERegisterTarget::B:
-			registers.B = newValue;
-			break;
-		case ERegisterTarget::C:
-			registers.C = newValue;
-			break;
-		case ERegisterTarget::D:
-			registers.D = newValue;
-			break;
-		case ERegisterTarget::E:
-			registers.E = newValue;
-			break;
-		case ERegisterTarget::H:
-			registers.H = newValue;
-			break;
-		case ERegisterTarget::L:
-			registers.L = newValue;
-			break;
-		default:
-			break;
+			registers.RecordFlags(EFlagOp::Inc, value, 1, newValue, [&] {
+				SRegisters::SFlagRegister fReg;
+				fReg.Zero = newValue == 0;
+				fReg.Subtraction = false;
+				fReg.HalfCarry = (value & 0xF) + (1 & 0xF) > 0xF;
+				fReg.Carry = registers.GetCarry();
+				return fReg;
+			});
 		}
+
+		return newValue;
 	}
 	
-	static void Dec(const U8 value, SRegisters& registers, const ERegisterTarget registerTarget)
+	template<ERegisterTarget Target, EAluPath Path = DEFAULT_ALU_PATH>
+	static void Dec(SRegisters& registers)
 	{
-		const U8 newValue = value - 1;
-		SRegisters::SFlagRegister fReg;
-		fReg.Zero = newValue == 0;
-		fReg.Subtraction = true;
-		fReg.HalfCarry = (value & 0xF) - (1 & 0xF) < 0;
-		fReg.Carry = registers.GetFlags().Carry;
-		registers.SetFlags(fReg);
+		U8& target = registers.Register<Target>();
+		target = Dec<Path>(target, registers);
+	}
 
-		switch (registerTarget)
+	template<EAluPath Path = DEFAULT_ALU_PATH>
+	static U8 Dec(const U8 value, SRegisters& registers)
+	{
+		const U8 newValue = value - 1;
+		if constexpr (Path == EAluPath::Table)
+		{
+			applyTableEntry(SAluTables::Get().Dec[value], registers, registers.GetCarry());
+		}
+		else
 		{
-		case ERegisterTarget::A:
-			registers.A = newValue;
-			break;
-		case ERegisterTarget::B:
-			registers.B = newValue;
-			break;
-		case ERegisterTarget::C:
-			registers.C = newValue;
-			break;
-		case ERegisterTarget::D:
-			registers.D = newValue;
-			break;
-		case ERegisterTarget::E:
-			registers.E = newValue;
-			break;
-		case ERegisterTarget::H:
-			registers.H = newValue;
-			break;
-		case ERegisterTarget::L:
-			registers.L = newValue;
-			break;
-		default:
-			break;
+			registers.RecordFlags(EFlagOp::Dec, value, 1, newValue, [&] {
+				SRegisters::SFlagRegister fReg;
+				fReg.Zero = newValue == 0;
+				fReg.Subtraction = true;
+				fReg.HalfCarry = (value & 0xF) - (1 & 0xF) < 0;
+				fReg.Carry = registers.GetCarry();
+				return fReg;
+			});
 		}
+
+		return newValue;
 	}
-	// TODO: No idea what to do with ADD SP, n
 
+	template<ERegisterTarget Target>
+	static void Inc16(SRegisters& registers)
+	{
+		registers.SetPair<Target>(registers.GetPair<Target>() + 1);
+	}
 
-	static void Inc16(const U16 value, SRegisters& registers, const ERegisterTarget registerTarget)
+	template<ERegisterTarget Target>
+	static void Dec16(SRegisters& registers)
 	{
-		const U16 newValue = value + 1;
-		switch (registerTarget)
-		{
-		case ERegisterTarget::BC:
-			registers.SetBC(newValue);
-			break;
-		case ERegisterTarget::DE:
-			registers.SetDE(newValue);
-			break;
-		case ERegisterTarget::HL:
-			registers.SetHL(newValue);
-			break;
-		default:
-			break;
-		}
+		registers.SetPair<Target>(registers.GetPair<Target>() - 1);
 	}
 
-	static void Dec16(const U16 value, SRegisters& registers, const ERegisterTarget registerTarget)
+	template<ERegisterTarget Target>
+	static void Swap(SRegisters& registers)
 	{
-		const U16 newValue = value - 1;
-		switch (registerTarget)
-		{
-		case ERegisterTarget::BC:
-			registers.SetBC(newValue);
-			break;
-		case ERegisterTarget::DE:
-			registers.SetDE(newValue);
-			break;
-		case ERegisterTarget::HL:
-			registers.SetHL(newValue);
-			break;
-		default:
-			break;
-		}
+		U8& target = registers.Register<Target>();
+		target = Swap(target, registers);
 	}
 
-	static void Swap(const U8 value, SRegisters& registers, const ERegisterTarget registerTarget)
+	static U8 Swap(const U8 value, SRegisters& registers)
 	{
 		const U8 newValue = (value & 0x0F) << 4 | (value & 0xF0) >> 4;
 		SRegisters::SFlagRegister fReg;
@@ -247,43 +276,56 @@ public:
 		fReg.Carry = false;
 		registers.SetFlags(fReg);
 
-		switch (registerTarget)
+		return newValue;
+	}
+
+	// Adjusts A to BCD after an addition or subtraction of two BCD values
+	// N is kept, H is reset, C is set if the adjustment carried
+	static void Daa(SRegisters& registers)
+	{
+		const SRegisters::SFlagRegister flags = registers.GetFlags();
+		U8 correction = 0;
+		bool carry = flags.Carry;
+		if (flags.HalfCarry || (!flags.Subtraction && (registers.A & 0xF) > 0x9))
+		{
+			correction |= 0x06;
+		}
+		if (flags.Carry || (!flags.Subtraction && registers.A > 0x99))
 		{
-		case ERegisterTarget::A:
-			registers.A = newValue;
-			break;
-		case ERegisterTarget::B:
-			registers.B = newValue;
-			break;
-		case ERegisterTarget::C:
-			registers.C = newValue;
-			break;
-		case ERegisterTarget::D:
-			registers.D = newValue;
-			break;
-		case ERegisterTarget::E:
-			registers.E = newValue;
-			break;
-		case ERegisterTarget::H:
-			registers.H = newValue;
-			break;
-		case ERegisterTarget::L:
-			registers.L = newValue;
-			break;
-		default:
-			break;
+			correction |= 0x60;
+			carry = true;
 		}
+		registers.A = flags.Subtraction ? registers.A - correction : registers.A + correction;
+
+		SRegisters::SFlagRegister fReg;
+		fReg.Zero = registers.A == 0;
+		fReg.Subtraction = flags.Subtraction;
+		fReg.HalfCarry = false;
+		fReg.Carry = carry;
+		registers.SetFlags(fReg);
 	}
 
-	// TODO: DAA
+	// SP + signed offset for ADD SP, e and LD HL, SP + e
+	// Z and N are reset, H and C come from the unsigned add of the low byte
+	static U16 AddSp(const U8 offset, SRegisters& registers)
+	{
+		SRegisters::SFlagRegister fReg;
+		fReg.Zero = false;
+		fReg.Subtraction = false;
+		fReg.HalfCarry = (registers.SP & 0xF) + (offset & 0xF) > 0xF;
+		fReg.Carry = (registers.SP & 0xFF) + offset > 0xFF;
+		registers.SetFlags(fReg);
+
+		return static_cast<U16>(registers.SP + static_cast<int8_t>(offset));
+	}
 
 	static void Cpl(SRegisters& registers)
 	{
 		SRegisters::SFlagRegister fReg;
-		fReg.Zero = registers.GetFlags().Zero;
+		fReg.Zero = registers.GetZero();
 		fReg.Subtraction = true;
 		fReg.HalfCarry = true;
-		fReg.Carry = registers.GetFlags().Carry;
+		fReg.Carry = registers.GetCarry();
 		registers.SetFlags(fReg);
 
 		registers.A = ~(registers.A);
@@ -292,20 +334,131 @@ public:
 	static void Ccf(SRegisters& registers)
 	{
 		SRegisters::SFlagRegister fReg;
-		fReg.Zero = registers.GetFlags().Zero;
+		fReg.Zero = registers.GetZero();
 		fReg.Subtraction = false;
 		fReg.HalfCarry = false;
-		fReg.Carry = !registers.GetFlags().Carry;
+		fReg.Carry = !registers.GetCarry();
 		registers.SetFlags(fReg);
 	}
 
 	static void Scf(SRegisters& registers)
 	{
 		SRegisters::SFlagRegister fReg;
-		fReg.Zero = registers.GetFlags().Zero;
+		fReg.Zero = registers.GetZero();
 		fReg.Subtraction = false;
 		fReg.HalfCarry = false;
 		fReg.Carry = true;
 		registers.SetFlags(fReg);
 	}
+
+	// Rotates on A, Z, N and H are always reset
+	// Bit 7 goes to carry and to bit 0
+	static void Rlca(SRegisters& registers)
+	{
+		const U8 value = registers.A;
+		registers.A = static_cast<U8>(value << 1 | value >> 7);
+		registers.SetFlags({ false, false, false, (value >> 7) != 0 });
+	}
+	// Bit 0 goes to carry and to bit 7
+	static void Rrca(SRegisters& registers)
+	{
+		const U8 value = registers.A;
+		registers.A = static_cast<U8>(value >> 1 | value << 7);
+		registers.SetFlags({ false, false, false, (value & 0b1) != 0 });
+	}
+	// Rotate through carry, old carry goes to bit 0
+	static void Rla(SRegisters& registers)
+	{
+		const U8 value = registers.A;
+		const U8 carry = registers.GetCarry() ? 1 : 0;
+		registers.A = static_cast<U8>(value << 1 | carry);
+		registers.SetFlags({ false, false, false, (value >> 7) != 0 });
+	}
+	// Rotate through carry, old carry goes to bit 7
+	static void Rra(SRegisters& registers)
+	{
+		const U8 value = registers.A;
+		const U8 carry = registers.GetCarry() ? 1 : 0;
+		registers.A = static_cast<U8>(value >> 1 | carry << 7);
+		registers.SetFlags({ false, false, false, (value & 0b1) != 0 });
+	}
+
+	// CB prefixed shifts and rotates return the new value, the caller writes it back
+	// Z is set if the result is 0, N and H are reset, C is the bit shifted out
+	static U8 Rlc(const U8 value, SRegisters& registers)
+	{
+		return rotateFlags(static_cast<U8>(value << 1 | value >> 7), value >> 7, registers);
+	}
+
+	static U8 Rrc(const U8 value, SRegisters& registers)
+	{
+		return rotateFlags(static_cast<U8>(value >> 1 | value << 7), value & 0b1, registers);
+	}
+
+	static U8 Rl(const U8 value, SRegisters& registers)
+	{
+		const U8 carry = registers.GetCarry() ? 1 : 0;
+		return rotateFlags(static_cast<U8>(value << 1 | carry), value >> 7, registers);
+	}
+
+	static U8 Rr(const U8 value, SRegisters& registers)
+	{
+		const U8 carry = registers.GetCarry() ? 1 : 0;
+		return rotateFlags(static_cast<U8>(value >> 1 | carry << 7), value & 0b1, registers);
+	}
+
+	static U8 Sla(const U8 value, SRegisters& registers)
+	{
+		return rotateFlags(static_cast<U8>(value << 1), value >> 7, registers);
+	}
+	// Bit 7 stays the same
+	static U8 Sra(const U8 value, SRegisters& registers)
+	{
+		return rotateFlags(static_cast<U8>(value >> 1 | (value & 0x80)), value & 0b1, registers);
+	}
+
+	static U8 Srl(const U8 value, SRegisters& registers)
+	{
+		return rotateFlags(static_cast<U8>(value >> 1), value & 0b1, registers);
+	}
+	// Z is set if the bit is 0, N is reset, H is set, C is not affected
+	static void Bit(const U8 bit, const U8 value, SRegisters& registers)
+	{
+		SRegisters::SFlagRegister fReg;
+		fReg.Zero = ((value >> bit) & 0b1) == 0;
+		fReg.Subtraction = false;
+		fReg.HalfCarry = true;
+		fReg.Carry = registers.GetCarry();
+		registers.SetFlags(fReg);
+	}
+	// Flags are not affected
+	static U8 Res(const U8 bit, const U8 value)
+	{
+		return value & ~(1 << bit);
+	}
+
+	static U8 Set(const U8 bit, const U8 value)
+	{
+		return value | 1 << bit;
+	}
+
+private:
+	// Writes F from a table entry and returns the result byte
+	// carry is or-ed in for INC and DEC which keep the old carry
+	static U8 applyTableEntry(const U16 entry, SRegisters& registers, const bool carry = false)
+	{
+		registers.SetF(static_cast<U8>(entry >> 8) | (carry ? SAluTables::CARRY_FLAG : 0));
+		return static_cast<U8>(entry);
+	}
+
+	static U8 rotateFlags(const U8 newValue, const U8 carry, SRegisters& registers)
+	{
+		SRegisters::SFlagRegister fReg;
+		fReg.Zero = newValue == 0;
+		fReg.Subtraction = false;
+		fReg.HalfCarry = false;
+		fReg.Carry = carry != 0;
+		registers.SetFlags(fReg);
+		return newValue;
+	}
 };
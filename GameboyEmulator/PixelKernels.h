@@ -0,0 +1,333 @@
+#pragma once
+#include <array>
+#include "Helpers.h"
+
+#if GB_SIMD
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+#endif
+
+// AVX2 code is compiled for its functions only, the rest of the build stays at the baseline
+#if GB_SIMD && defined(__GNUC__)
+#define GB_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define GB_TARGET_AVX2
+#endif
+
+enum class EPixelPath : U8
+{
+	Scalar,
+	Sse2,
+	Avx2
+};
+
+// Sprite pixels handed to MapShades, 0 is transparent
+// Bits 0-1 are the color index, SPRITE_PALETTE selects OBP1 and SPRITE_BEHIND hides the
+// pixel behind background colors 1-3
+constexpr U8 SPRITE_PALETTE = 1 << 2;
+constexpr U8 SPRITE_BEHIND = 1 << 3;
+
+// The per-pixel work of drawing a line, with SIMD versions of each function
+struct SPixelKernels
+{
+	// Turns rows of a tile's two bit-planes, low byte first, into 8 color indices per row
+	void (*DecodeRows)(const U8* planes, U32 rows, U8* indices);
+	// Combines background indices with sprite pixels and maps them through the palettes to shades
+	// palettes holds BGP, OBP0 and OBP1 from the low byte up, sprites may be null
+	void (*MapShades)(const U8* background, const U8* sprites, U32 count, U32 palettes, U8* shades);
+	// Looks up the color of each shade in colors, 0xAABBGGRR as RGBA bytes in memory
+	void (*ShadesToRgba)(const U8* shades, U32 count, const U32* colors, U32* rgba);
+};
+
+// The kernels are picked once for the host, every path gives the same output
+class CPixelKernels
+{
+public:
+	[[nodiscard]] static bool IsSupported(const EPixelPath path)
+	{
+		switch (path)
+		{
+		case EPixelPath::Scalar:
+			return true;
+		case EPixelPath::Sse2:
+			// Part of x86-64
+			return SIMD;
+		case EPixelPath::Avx2:
+			return SIMD && hasAvx2();
+		}
+		return false;
+	}
+
+	[[nodiscard]] static EPixelPath GetBestPath()
+	{
+		static const EPixelPath best = IsSupported(EPixelPath::Avx2) ? EPixelPath::Avx2
+			: IsSupported(EPixelPath::Sse2) ? EPixelPath::Sse2 : EPixelPath::Scalar;
+		return best;
+	}
+
+	// Unsupported paths fall back to scalar
+	[[nodiscard]] static const SPixelKernels& Get([[maybe_unused]] const EPixelPath path = GetBestPath())
+	{
+		static constexpr SPixelKernels SCALAR = { &decodeRowsScalar, &mapShadesScalar, &shadesToRgbaScalar };
+#if GB_SIMD
+		// Without a byte shuffle the compares to pick one of 4 colors cost more than the scalar table lookup
+		static constexpr SPixelKernels SSE2 = { &decodeRowsSse2, &mapShadesSse2, &shadesToRgbaScalar };
+		static constexpr SPixelKernels AVX2 = { &decodeRowsAvx2, &mapShadesAvx2, &shadesToRgbaAvx2 };
+		if (IsSupported(path))
+		{
+			if (path == EPixelPath::Avx2)
+			{
+				return AVX2;
+			}
+			if (path == EPixelPath::Sse2)
+			{
+				return SSE2;
+			}
+		}
+#endif
+		return SCALAR;
+	}
+
+	[[nodiscard]] static const char* GetName(const EPixelPath path)
+	{
+		switch (path)
+		{
+		case EPixelPath::Scalar:
+			return "scalar";
+		case EPixelPath::Sse2:
+			return "sse2";
+		case EPixelPath::Avx2:
+			return "avx2";
+		}
+		return "unknown";
+	}
+
+private:
+	static bool hasAvx2()
+	{
+#if GB_SIMD && defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+		{
+			return false;
+		}
+		__cpuid(info, 1);
+		// OSXSAVE, and the OS saves the YMM registers
+		if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 0b110) != 0b110)
+		{
+			return false;
+		}
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#elif GB_SIMD
+		return __builtin_cpu_supports("avx2");
+#else
+		return false;
+#endif
+	}
+
+	static void decodeRowsScalar(const U8* planes, const U32 rows, U8* indices)
+	{
+		for (U32 row = 0; row < rows; ++row)
+		{
+			const U8 low = planes[row * 2];
+			const U8 high = planes[row * 2 + 1];
+			for (U32 x = 0; x < 8; ++x)
+			{
+				const U32 bit = 7 - x;
+				indices[row * 8 + x] = static_cast<U8>(((high >> bit) & 1) << 1 | ((low >> bit) & 1));
+			}
+		}
+	}
+
+	[[nodiscard]] static U8 mapShade(const U8 background, const U8 sprite, const U32 palettes)
+	{
+		const U8 color = sprite & 0b11;
+		const bool visible = color != 0 && ((sprite & SPRITE_BEHIND) == 0 || background == 0);
+		// Palette entries are 2 bits, OBP0 starts at bit 8 and OBP1 at bit 16
+		const U32 entry = visible ? 4u + (sprite & SPRITE_PALETTE) + color : background;
+		return static_cast<U8>((palettes >> (entry * 2)) & 0b11);
+	}
+
+	static void mapShadesScalar(const U8* background, const U8* sprites, const U32 count, const U32 palettes, U8* shades)
+	{
+		for (U32 i = 0; i < count; ++i)
+		{
+			shades[i] = mapShade(background[i], sprites == nullptr ? 0 : sprites[i], palettes);
+		}
+	}
+
+	static void shadesToRgbaScalar(const U8* shades, const U32 count, const U32* colors, U32* rgba)
+	{
+		for (U32 i = 0; i < count; ++i)
+		{
+			rgba[i] = colors[shades[i] & 0b11];
+		}
+	}
+
+#if GB_SIMD
+	// Selects a where mask is set and b elsewhere
+	static __m128i select(const __m128i mask, const __m128i a, const __m128i b)
+	{
+		return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+	}
+
+	// 8 rows at a time, the low and high planes are split and each byte is repeated for
+	// its 8 pixels, then compared against the bit of each pixel
+	static void decodeRowsSse2(const U8* planes, const U32 rows, U8* indices)
+	{
+		const __m128i bits = _mm_set1_epi64x(0x0102040810204080ll);
+		const __m128i ones = _mm_set1_epi8(1);
+		const __m128i twos = _mm_set1_epi8(2);
+		const __m128i lowBytes = _mm_set1_epi16(0x00FF);
+		U32 row = 0;
+		for (; row + 8 <= rows; row += 8)
+		{
+			const __m128i pairs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes + row * 2));
+			const __m128i low = _mm_packus_epi16(_mm_and_si128(pairs, lowBytes), _mm_setzero_si128());
+			const __m128i high = _mm_packus_epi16(_mm_srli_epi16(pairs, 8), _mm_setzero_si128());
+			// Bytes doubled, rows 0-7
+			const __m128i low2 = _mm_unpacklo_epi8(low, low);
+			const __m128i high2 = _mm_unpacklo_epi8(high, high);
+			// Bytes times 4, rows 0-3 and 4-7
+			const __m128i low4[2] = { _mm_unpacklo_epi16(low2, low2), _mm_unpackhi_epi16(low2, low2) };
+			const __m128i high4[2] = { _mm_unpacklo_epi16(high2, high2), _mm_unpackhi_epi16(high2, high2) };
+			for (U32 half = 0; half < 2; ++half)
+			{
+				// Bytes times 8, two rows per register
+				const __m128i low8[2] = { _mm_unpacklo_epi32(low4[half], low4[half]), _mm_unpackhi_epi32(low4[half], low4[half]) };
+				const __m128i high8[2] = { _mm_unpacklo_epi32(high4[half], high4[half]), _mm_unpackhi_epi32(high4[half], high4[half]) };
+				for (U32 pair = 0; pair < 2; ++pair)
+				{
+					const __m128i lowSet = _mm_cmpeq_epi8(_mm_and_si128(low8[pair], bits), bits);
+					const __m128i highSet = _mm_cmpeq_epi8(_mm_and_si128(high8[pair], bits), bits);
+					const __m128i pixels = _mm_or_si128(_mm_and_si128(lowSet, ones), _mm_and_si128(highSet, twos));
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(indices + (row + half * 4 + pair * 2) * 8), pixels);
+				}
+			}
+		}
+		decodeRowsScalar(planes + row * 2, rows - row, indices + row * 8);
+	}
+
+	// Without pshufb the shade is picked from the four palette entries by the two index bits
+	static void mapShadesSse2(const U8* background, const U8* sprites, const U32 count, const U32 palettes, U8* shades)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i one = _mm_set1_epi8(1);
+		const __m128i two = _mm_set1_epi8(2);
+		const __m128i three = _mm_set1_epi8(3);
+		const __m128i paletteBit = _mm_set1_epi8(SPRITE_PALETTE);
+		const __m128i behindBit = _mm_set1_epi8(SPRITE_BEHIND);
+		__m128i entries[3][4];
+		for (U32 palette = 0; palette < 3; ++palette)
+		{
+			for (U32 entry = 0; entry < 4; ++entry)
+			{
+				entries[palette][entry] = _mm_set1_epi8(static_cast<char>((palettes >> (palette * 8 + entry * 2)) & 0b11));
+			}
+		}
+
+		U32 i = 0;
+		for (; i + 16 <= count; i += 16)
+		{
+			__m128i index = _mm_loadu_si128(reinterpret_cast<const __m128i*>(background + i));
+			__m128i entry[4] = { entries[0][0], entries[0][1], entries[0][2], entries[0][3] };
+			if (sprites != nullptr)
+			{
+				const __m128i sprite = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sprites + i));
+				const __m128i color = _mm_and_si128(sprite, three);
+				const __m128i inFront = _mm_or_si128(_mm_cmpeq_epi8(_mm_and_si128(sprite, behindBit), zero), _mm_cmpeq_epi8(index, zero));
+				const __m128i visible = _mm_andnot_si128(_mm_cmpeq_epi8(color, zero), inFront);
+				const __m128i obp1 = _mm_cmpeq_epi8(_mm_and_si128(sprite, paletteBit), paletteBit);
+				index = select(visible, color, index);
+				for (U32 e = 0; e < 4; ++e)
+				{
+					entry[e] = select(visible, select(obp1, entries[2][e], entries[1][e]), entry[e]);
+				}
+			}
+			const __m128i bit0 = _mm_cmpeq_epi8(_mm_and_si128(index, one), one);
+			const __m128i bit1 = _mm_cmpeq_epi8(_mm_and_si128(index, two), two);
+			const __m128i shade = select(bit1, select(bit0, entry[3], entry[2]), select(bit0, entry[1], entry[0]));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(shades + i), shade);
+		}
+		mapShadesScalar(background + i, sprites == nullptr ? nullptr : sprites + i, count - i, palettes, shades + i);
+	}
+
+	// 4 rows at a time, both lanes hold the same 8 bytes and a byte shuffle repeats each
+	// plane byte of two rows per lane
+	GB_TARGET_AVX2 static void decodeRowsAvx2(const U8* planes, const U32 rows, U8* indices)
+	{
+		const __m256i lowShuffle = _mm256_setr_epi8(
+			0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 2, 2, 2, 2,
+			4, 4, 4, 4, 4, 4, 4, 4, 6, 6, 6, 6, 6, 6, 6, 6);
+		const __m256i highShuffle = _mm256_setr_epi8(
+			1, 1, 1, 1, 1, 1, 1, 1, 3, 3, 3, 3, 3, 3, 3, 3,
+			5, 5, 5, 5, 5, 5, 5, 5, 7, 7, 7, 7, 7, 7, 7, 7);
+		const __m256i bits = _mm256_set1_epi64x(0x0102040810204080ll);
+		const __m256i ones = _mm256_set1_epi8(1);
+		const __m256i twos = _mm256_set1_epi8(2);
+		U32 row = 0;
+		for (; row + 4 <= rows; row += 4)
+		{
+			const __m256i pairs = _mm256_broadcastq_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(planes + row * 2)));
+			const __m256i lowSet = _mm256_cmpeq_epi8(_mm256_and_si256(_mm256_shuffle_epi8(pairs, lowShuffle), bits), bits);
+			const __m256i highSet = _mm256_cmpeq_epi8(_mm256_and_si256(_mm256_shuffle_epi8(pairs, highShuffle), bits), bits);
+			const __m256i pixels = _mm256_or_si256(_mm256_and_si256(lowSet, ones), _mm256_and_si256(highSet, twos));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(indices + row * 8), pixels);
+		}
+		decodeRowsScalar(planes + row * 2, rows - row, indices + row * 8);
+	}
+
+	// The three palettes are one 12 entry table for a byte shuffle, sprites index entries 4-11
+	GB_TARGET_AVX2 static void mapShadesAvx2(const U8* background, const U8* sprites, const U32 count, const U32 palettes, U8* shades)
+	{
+		alignas(16) std::array<U8, 16> table{};
+		for (U32 entry = 0; entry < 12; ++entry)
+		{
+			table[entry] = static_cast<U8>((palettes >> (entry * 2)) & 0b11);
+		}
+		const __m256i lookup = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(table.data())));
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i three = _mm256_set1_epi8(3);
+		const __m256i four = _mm256_set1_epi8(4);
+		const __m256i paletteBit = _mm256_set1_epi8(SPRITE_PALETTE);
+		const __m256i behindBit = _mm256_set1_epi8(SPRITE_BEHIND);
+
+		U32 i = 0;
+		for (; i + 32 <= count; i += 32)
+		{
+			__m256i entry = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(background + i));
+			if (sprites != nullptr)
+			{
+				const __m256i sprite = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(sprites + i));
+				const __m256i color = _mm256_and_si256(sprite, three);
+				const __m256i inFront = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_and_si256(sprite, behindBit), zero), _mm256_cmpeq_epi8(entry, zero));
+				const __m256i visible = _mm256_andnot_si256(_mm256_cmpeq_epi8(color, zero), inFront);
+				const __m256i spriteEntry = _mm256_add_epi8(_mm256_add_epi8(color, four), _mm256_and_si256(sprite, paletteBit));
+				entry = _mm256_blendv_epi8(entry, spriteEntry, visible);
+			}
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(shades + i), _mm256_shuffle_epi8(lookup, entry));
+		}
+		mapShadesScalar(background + i, sprites == nullptr ? nullptr : sprites + i, count - i, palettes, shades + i);
+	}
+
+	// The colors are a table for a cross lane permute, 8 pixels at a time
+	GB_TARGET_AVX2 static void shadesToRgbaAvx2(const U8* shades, const U32 count, const U32* colors, U32* rgba)
+	{
+		const __m256i table = _mm256_setr_epi32(
+			static_cast<int>(colors[0]), static_cast<int>(colors[1]), static_cast<int>(colors[2]), static_cast<int>(colors[3]),
+			0, 0, 0, 0);
+		const __m256i three = _mm256_set1_epi32(3);
+		U32 i = 0;
+		for (; i + 8 <= count; i += 8)
+		{
+			const __m256i shade = _mm256_and_si256(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(shades + i))), three);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(rgba + i), _mm256_permutevar8x32_epi32(table, shade));
+		}
+		shadesToRgbaScalar(shades + i, count - i, colors, rgba + i);
+	}
+#endif
+};
@@ -0,0 +1,683 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstring>
+#include "Helpers.h"
+#include "MemoryBus.h"
+#include "PixelKernels.h"
+#include "Scheduler.h"
+
+// LCD modes as reported in STAT
+enum class EPpuMode : U8
+{
+	HBlank,
+	VBlank,
+	OamScan,
+	Transfer
+};
+
+class IFrameSink;
+
+// LCD controller, FF40-FF45 and FF47-FF4B
+// Mode changes are scheduler events, a whole scanline is rendered when its transfer ends
+//
+// Tiles are kept decoded from their two bit-planes to one palette index per byte
+// A VRAM write marks the tile it hits dirty and the tile is decoded again the next time it is
+// drawn, so drawing a line is a copy of 8 bytes per tile and a palette lookup per pixel
+// Decoding and the palette lookup go through the SIMD kernels of the host, see CPixelKernels
+//
+// The sprites of every line are selected from OAM and ordered by priority in one pass, which
+// is done again only after OAM, OAM DMA or the sprite size changed
+//
+// With frame skipping the modes, LY, interrupts and the window line advance as always but
+// only every Nth frame is drawn, or none at all when headless
+class CPpu : public IIoDevice, public IWriteWatcher
+{
+public:
+	static constexpr U16 LCDC_ADDRESS = 0xFF40;
+	static constexpr U16 STAT_ADDRESS = 0xFF41;
+	static constexpr U16 SCY_ADDRESS = 0xFF42;
+	static constexpr U16 SCX_ADDRESS = 0xFF43;
+	static constexpr U16 LY_ADDRESS = 0xFF44;
+	static constexpr U16 LYC_ADDRESS = 0xFF45;
+	static constexpr U16 BGP_ADDRESS = 0xFF47;
+	static constexpr U16 OBP0_ADDRESS = 0xFF48;
+	static constexpr U16 OBP1_ADDRESS = 0xFF49;
+	static constexpr U16 WY_ADDRESS = 0xFF4A;
+	static constexpr U16 WX_ADDRESS = 0xFF4B;
+
+	static constexpr U32 SCREEN_WIDTH = 160;
+	static constexpr U32 SCREEN_HEIGHT = 144;
+	static constexpr U32 LINE_CYCLES = 456;
+	static constexpr U32 OAM_SCAN_CYCLES = 80;
+	// Fixed, the length changes with sprites and scrolling on hardware
+	static constexpr U32 TRANSFER_CYCLES = 172;
+	static constexpr U32 LINE_COUNT = 154;
+	static constexpr U32 FRAME_CYCLES = LINE_CYCLES * LINE_COUNT;
+	static constexpr U32 TILE_COUNT = 384;
+	static constexpr U32 SPRITE_COUNT = 40;
+	static constexpr U32 MAX_LINE_SPRITES = 10;
+	// Frame skip interval that draws no frames
+	static constexpr U32 HEADLESS = 0;
+
+	// Shades 0 (white) to 3 (black) after the palette, row after row
+	using Frame = std::array<U8, SCREEN_WIDTH * SCREEN_HEIGHT>;
+	using RgbaFrame = std::array<U32, SCREEN_WIDTH * SCREEN_HEIGHT>;
+	// Greens of the original screen, white to black
+	static constexpr std::array<U32, 4> DMG_COLORS = { 0xFFD0F8E0, 0xFF70C088, 0xFF566834, 0xFF201808 };
+
+	struct SStats
+	{
+		U64 Frames = 0;
+		// Frames that were not drawn because of frame skipping, they are part of Frames
+		U64 SkippedFrames = 0;
+		// Tile rows drawn from the cache and rows that had to be decoded first
+		U64 TileHits = 0;
+		U64 TileMisses = 0;
+		// VRAM writes that made a cached tile dirty
+		U64 TileInvalidations = 0;
+		// Times the sprite lines were built from OAM
+		U64 SpriteListBuilds = 0;
+		// Wall clock time spent drawing the last complete frame and all frames
+		U64 LastFrameRenderNs = 0;
+		U64 TotalRenderNs = 0;
+	};
+
+	// OAM indices of the sprites on a line, the first one has the highest priority
+	// A sprite left of another one comes first, OAM order decides between sprites at the same X
+	struct SSpriteLine
+	{
+		std::array<U8, MAX_LINE_SPRITES> Sprites{};
+		U8 Count = 0;
+	};
+
+	// Part of the save state format
+	struct SState
+	{
+		U8 Lcdc = 0;
+		U8 Stat = 0;
+		U8 Scy = 0;
+		U8 Scx = 0;
+		U8 Ly = 0;
+		U8 Lyc = 0;
+		U8 Bgp = 0;
+		U8 Obp0 = 0;
+		U8 Obp1 = 0;
+		U8 Wy = 0;
+		U8 Wx = 0;
+		U8 Mode = 0;
+		U8 WindowLine = 0;
+		U8 StatLine = 0;
+		std::array<U8, 2> Padding{};
+		U64 LineStart = 0;
+	};
+
+	CPpu(CScheduler& scheduler, CMemoryBus& bus, const U64& clock)
+		: m_Scheduler(scheduler), m_Bus(bus), m_Clock(clock)
+	{
+		m_Scheduler.SetCallback(EEvent::Ppu, &CPpu::onEvent, this);
+		m_TileDirty.fill(true);
+	}
+
+	CPpu(const CPpu&) = delete;
+	CPpu& operator=(const CPpu&) = delete;
+
+	U8 ReadIo(const U16 address) override
+	{
+		switch (address)
+		{
+		case LCDC_ADDRESS:
+			return m_Lcdc;
+		case STAT_ADDRESS:
+			return 0x80 | (m_Stat & STAT_SOURCES) | (m_Ly == m_Lyc ? STAT_COINCIDENCE : 0) | static_cast<U8>(m_Mode);
+		case SCY_ADDRESS:
+			return m_Scy;
+		case SCX_ADDRESS:
+			return m_Scx;
+		case LY_ADDRESS:
+			return m_Ly;
+		case LYC_ADDRESS:
+			return m_Lyc;
+		case BGP_ADDRESS:
+			return m_Bgp;
+		case OBP0_ADDRESS:
+			return m_Obp0;
+		case OBP1_ADDRESS:
+			return m_Obp1;
+		case WY_ADDRESS:
+			return m_Wy;
+		case WX_ADDRESS:
+			return m_Wx;
+		default:
+			return 0xFF;
+		}
+	}
+
+	void WriteIo(const U16 address, const U8 value) override
+	{
+		switch (address)
+		{
+		case LCDC_ADDRESS:
+		{
+			const bool wasEnabled = isEnabled();
+			if (((m_Lcdc ^ value) & LCDC_TALL_SPRITES) != 0)
+			{
+				m_SpritesDirty = true;
+			}
+			m_Lcdc = value;
+			if (wasEnabled && !isEnabled())
+			{
+				// LY stays at 0 and the mode at HBlank until the LCD is enabled again
+				m_Scheduler.Cancel(EEvent::Ppu);
+				m_Ly = 0;
+				m_Mode = EPpuMode::HBlank;
+				m_StatLine = false;
+			}
+			else if (!wasEnabled && isEnabled())
+			{
+				m_LineStart = m_Clock;
+				startFrame();
+				enterMode(EPpuMode::OamScan, m_LineStart + OAM_SCAN_CYCLES);
+			}
+			break;
+		}
+		case STAT_ADDRESS:
+			m_Stat = value & STAT_SOURCES;
+			updateStatLine();
+			break;
+		case SCY_ADDRESS:
+			m_Scy = value;
+			break;
+		case SCX_ADDRESS:
+			m_Scx = value;
+			break;
+		case LYC_ADDRESS:
+			m_Lyc = value;
+			updateStatLine();
+			break;
+		case BGP_ADDRESS:
+			m_Bgp = value;
+			break;
+		case OBP0_ADDRESS:
+			m_Obp0 = value;
+			break;
+		case OBP1_ADDRESS:
+			m_Obp1 = value;
+			break;
+		case WY_ADDRESS:
+			m_Wy = value;
+			break;
+		case WX_ADDRESS:
+			m_Wx = value;
+			break;
+		default:
+			// LY is read-only
+			break;
+		}
+	}
+
+	// Tile data writes make the tile dirty, tile map writes are read straight from VRAM
+	// OAM writes make the sprite lines dirty
+	void OnWatchedWrite(const U16 address) override
+	{
+		if (address >= CMemoryBus::OAM_START)
+		{
+			m_SpritesDirty = true;
+			return;
+		}
+		const U32 tile = (address - CMemoryBus::VRAM_START) / TILE_SIZE;
+		if (tile < TILE_COUNT && !m_TileDirty[tile])
+		{
+			m_TileDirty[tile] = true;
+			++m_Stats.TileInvalidations;
+		}
+	}
+
+	// The last complete frame, the next one is drawn into another buffer
+	[[nodiscard]] const Frame& GetFrame() const
+	{
+		return m_Frames[m_FrontFrame];
+	}
+
+	// The last complete frame with each shade replaced by its color
+	void GetFrameRgba(RgbaFrame& rgba, const std::array<U32, 4>& colors = DMG_COLORS) const
+	{
+		m_Kernels->ShadesToRgba(GetFrame().data(), static_cast<U32>(rgba.size()), colors.data(), rgba.data());
+	}
+
+	// The kernels of the best path for the host are used unless another one is set
+	void SetPixelPath(const EPixelPath path)
+	{
+		m_Kernels = &CPixelKernels::Get(path);
+	}
+
+	// Draws every interval-th frame starting with the next one, 1 draws all and HEADLESS none
+	// GetFrame keeps the last frame that was drawn
+	void SetFrameSkip(const U32 interval)
+	{
+		m_FrameSkip = interval;
+	}
+
+	[[nodiscard]] U32 GetFrameSkip() const
+	{
+		return m_FrameSkip;
+	}
+
+	// Gets every frame that is drawn as it is completed, null for none
+	void SetFrameSink(IFrameSink* sink)
+	{
+		m_FrameSink = sink;
+	}
+
+	// The sprites that are drawn on a line, built first if OAM changed since
+	[[nodiscard]] const SSpriteLine& GetSpriteLine(const U32 line)
+	{
+		updateSpriteLines();
+		return m_SpriteLines[line];
+	}
+
+	[[nodiscard]] EPpuMode GetMode() const
+	{
+		return m_Mode;
+	}
+
+	[[nodiscard]] const SStats& GetStats() const
+	{
+		return m_Stats;
+	}
+
+	void SaveState(SState& state) const
+	{
+		state.Lcdc = m_Lcdc;
+		state.Stat = m_Stat;
+		state.Scy = m_Scy;
+		state.Scx = m_Scx;
+		state.Ly = m_Ly;
+		state.Lyc = m_Lyc;
+		state.Bgp = m_Bgp;
+		state.Obp0 = m_Obp0;
+		state.Obp1 = m_Obp1;
+		state.Wy = m_Wy;
+		state.Wx = m_Wx;
+		state.Mode = static_cast<U8>(m_Mode);
+		state.WindowLine = m_WindowLine;
+		state.StatLine = m_StatLine;
+		state.LineStart = m_LineStart;
+	}
+
+	// The mode event is restored with the scheduler, VRAM and OAM were replaced so every tile is
+	// decoded and the sprite lines are built again
+	void LoadState(const SState& state)
+	{
+		m_Lcdc = state.Lcdc;
+		m_Stat = state.Stat;
+		m_Scy = state.Scy;
+		m_Scx = state.Scx;
+		m_Ly = state.Ly;
+		m_Lyc = state.Lyc;
+		m_Bgp = state.Bgp;
+		m_Obp0 = state.Obp0;
+		m_Obp1 = state.Obp1;
+		m_Wy = state.Wy;
+		m_Wx = state.Wx;
+		m_Mode = static_cast<EPpuMode>(state.Mode & 0b11);
+		m_WindowLine = state.WindowLine;
+		m_StatLine = state.StatLine != 0;
+		m_LineStart = state.LineStart;
+		m_TileDirty.fill(true);
+		m_SpritesDirty = true;
+		m_DrawFrame = shouldDrawFrame();
+	}
+
+private:
+	static constexpr U32 TILE_SIZE = 16;
+	static constexpr U8 STAT_SOURCES = 0b01111000;
+	static constexpr U8 STAT_COINCIDENCE = 0b100;
+	static constexpr U8 STAT_HBLANK_SOURCE = 1 << 3;
+	static constexpr U8 STAT_VBLANK_SOURCE = 1 << 4;
+	static constexpr U8 STAT_OAM_SOURCE = 1 << 5;
+	static constexpr U8 STAT_LYC_SOURCE = 1 << 6;
+	static constexpr U8 LCDC_BACKGROUND = 1 << 0;
+	static constexpr U8 LCDC_SPRITES = 1 << 1;
+	static constexpr U8 LCDC_TALL_SPRITES = 1 << 2;
+	static constexpr U8 LCDC_WINDOW = 1 << 5;
+	static constexpr U8 SPRITE_FLAG_PALETTE = 1 << 4;
+	static constexpr U8 SPRITE_FLAG_FLIP_X = 1 << 5;
+	static constexpr U8 SPRITE_FLAG_FLIP_Y = 1 << 6;
+	static constexpr U8 SPRITE_FLAG_BEHIND = 1 << 7;
+	static constexpr U32 VBLANK_LINE = SCREEN_HEIGHT;
+	// A line of tiles is one wider than the screen so any fine scroll is covered
+	static constexpr U32 LINE_TILES = SCREEN_WIDTH / 8 + 1;
+
+	CScheduler& m_Scheduler;
+	CMemoryBus& m_Bus;
+	const U64& m_Clock;
+
+	U8 m_Lcdc = 0;
+	U8 m_Stat = 0;
+	U8 m_Scy = 0;
+	U8 m_Scx = 0;
+	U8 m_Ly = 0;
+	U8 m_Lyc = 0;
+	U8 m_Bgp = 0;
+	U8 m_Obp0 = 0;
+	U8 m_Obp1 = 0;
+	U8 m_Wy = 0;
+	U8 m_Wx = 0;
+	EPpuMode m_Mode = EPpuMode::HBlank;
+	// Lines of the window drawn this frame, the window does not skip lines hidden by WX
+	U8 m_WindowLine = 0;
+	// STAT interrupts are requested when any enabled source becomes active and none was
+	bool m_StatLine = false;
+	U64 m_LineStart = 0;
+
+	// Palette index of each pixel of each tile, 8 bytes per row
+	std::array<std::array<U8, 64>, TILE_COUNT> m_Tiles{};
+	std::array<bool, TILE_COUNT> m_TileDirty{};
+	std::array<SSpriteLine, SCREEN_HEIGHT> m_SpriteLines{};
+	bool m_SpritesDirty = true;
+	std::array<Frame, 2> m_Frames{};
+	U8 m_FrontFrame = 0;
+	SStats m_Stats{};
+	U64 m_FrameRenderNs = 0;
+	U32 m_FrameSkip = 1;
+	// Whether the current frame is drawn
+	bool m_DrawFrame = true;
+	IFrameSink* m_FrameSink = nullptr;
+	const SPixelKernels* m_Kernels = &CPixelKernels::Get();
+
+	[[nodiscard]] bool isEnabled() const
+	{
+		return (m_Lcdc & 0x80) != 0;
+	}
+
+	void enterMode(const EPpuMode mode, const U64 nextEvent)
+	{
+		m_Mode = mode;
+		updateStatLine();
+		m_Scheduler.Schedule(EEvent::Ppu, nextEvent);
+	}
+
+	void updateStatLine()
+	{
+		if (!isEnabled())
+		{
+			return;
+		}
+		const bool line = ((m_Stat & STAT_LYC_SOURCE) != 0 && m_Ly == m_Lyc)
+			|| ((m_Stat & STAT_HBLANK_SOURCE) != 0 && m_Mode == EPpuMode::HBlank)
+			|| ((m_Stat & STAT_VBLANK_SOURCE) != 0 && m_Mode == EPpuMode::VBlank)
+			|| ((m_Stat & STAT_OAM_SOURCE) != 0 && m_Mode == EPpuMode::OamScan);
+		if (line && !m_StatLine)
+		{
+			m_Bus.RequestInterrupt(EInterrupt::LcdStat);
+		}
+		m_StatLine = line;
+	}
+
+	static void onEvent(void* context, const U64 timestamp)
+	{
+		static_cast<CPpu*>(context)->advance(timestamp);
+	}
+
+	void advance(const U64 timestamp)
+	{
+		switch (m_Mode)
+		{
+		case EPpuMode::OamScan:
+			enterMode(EPpuMode::Transfer, timestamp + TRANSFER_CYCLES);
+			break;
+		case EPpuMode::Transfer:
+			if (m_DrawFrame)
+			{
+				renderLine();
+			}
+			else if (isWindowOnLine())
+			{
+				// Part of the state, a skipped frame leaves it like a drawn one
+				++m_WindowLine;
+			}
+			enterMode(EPpuMode::HBlank, m_LineStart + LINE_CYCLES);
+			break;
+		case EPpuMode::HBlank:
+			m_LineStart = timestamp;
+			++m_Ly;
+			if (m_Ly == VBLANK_LINE)
+			{
+				finishFrame();
+				m_Bus.RequestInterrupt(EInterrupt::VBlank);
+				enterMode(EPpuMode::VBlank, m_LineStart + LINE_CYCLES);
+			}
+			else
+			{
+				enterMode(EPpuMode::OamScan, m_LineStart + OAM_SCAN_CYCLES);
+			}
+			break;
+		case EPpuMode::VBlank:
+			m_LineStart = timestamp;
+			if (++m_Ly == LINE_COUNT)
+			{
+				m_Ly = 0;
+				startFrame();
+				enterMode(EPpuMode::OamScan, m_LineStart + OAM_SCAN_CYCLES);
+			}
+			else
+			{
+				enterMode(EPpuMode::VBlank, m_LineStart + LINE_CYCLES);
+			}
+			break;
+		}
+	}
+
+	[[nodiscard]] bool shouldDrawFrame() const
+	{
+		return m_FrameSkip != HEADLESS && m_Stats.Frames % m_FrameSkip == 0;
+	}
+
+	void startFrame()
+	{
+		m_WindowLine = 0;
+		m_DrawFrame = shouldDrawFrame();
+	}
+
+	void finishFrame();
+
+	// The window is drawn from WX - 7 on lines from WY on, and only over the background
+	[[nodiscard]] bool isWindowOnLine() const
+	{
+		return (m_Lcdc & (LCDC_BACKGROUND | LCDC_WINDOW)) == (LCDC_BACKGROUND | LCDC_WINDOW)
+			&& m_Ly >= m_Wy && m_Wx < SCREEN_WIDTH + 7;
+	}
+
+	// BGP, OBP0 and OBP1 as MapShades takes them
+	[[nodiscard]] U32 getPalettes() const
+	{
+		return m_Bgp | m_Obp0 << 8 | m_Obp1 << 16;
+	}
+
+	// Decoded row of a tile, tile numbers are 0-383 from 8000
+	const U8* getTileRow(const U32 tile, const U32 row)
+	{
+		std::array<U8, 64>& pixels = m_Tiles[tile];
+		if (m_TileDirty[tile])
+		{
+			m_Kernels->DecodeRows(m_Bus.GetVram() + tile * TILE_SIZE, 8, pixels.data());
+			m_TileDirty[tile] = false;
+			++m_Stats.TileMisses;
+		}
+		else
+		{
+			++m_Stats.TileHits;
+		}
+		return &pixels[row * 8];
+	}
+
+	// Tile map entries index 8000-8FFF with LCDC bit 4 set, otherwise 9000-97FF as signed numbers
+	[[nodiscard]] U32 getTileNumber(const U8 index) const
+	{
+		return (m_Lcdc & 0x10) != 0 ? index : 256 + static_cast<int8_t>(index);
+	}
+
+	// Copies LINE_TILES tile rows of a tile map line into pixels
+	void fetchTiles(const U16 map, const U32 mapY, const U32 firstColumn, U8* pixels)
+	{
+		const U8* entries = m_Bus.GetVram() + map + (mapY / 8) * 32;
+		for (U32 i = 0; i < LINE_TILES; ++i)
+		{
+			const U8 index = entries[(firstColumn + i) & 31];
+			std::memcpy(pixels + i * 8, getTileRow(getTileNumber(index), mapY & 7), 8);
+		}
+	}
+
+	// Selects the first MAX_LINE_SPRITES sprites in OAM order on each line, sorted by X
+	void updateSpriteLines()
+	{
+		if (!m_SpritesDirty)
+		{
+			return;
+		}
+		m_SpritesDirty = false;
+		++m_Stats.SpriteListBuilds;
+		for (SSpriteLine& line : m_SpriteLines)
+		{
+			line.Count = 0;
+		}
+		const U8* oam = m_Bus.GetOam();
+		const int height = (m_Lcdc & LCDC_TALL_SPRITES) != 0 ? 16 : 8;
+		for (U8 sprite = 0; sprite < SPRITE_COUNT; ++sprite)
+		{
+			// OAM holds the top line plus 16 and the left edge plus 8
+			const int top = oam[sprite * 4] - 16;
+			const U8 x = oam[sprite * 4 + 1];
+			const int first = top < 0 ? 0 : top;
+			const int end = top + height < static_cast<int>(SCREEN_HEIGHT) ? top + height : SCREEN_HEIGHT;
+			for (int y = first; y < end; ++y)
+			{
+				SSpriteLine& line = m_SpriteLines[y];
+				if (line.Count == MAX_LINE_SPRITES)
+				{
+					continue;
+				}
+				U8 position = line.Count++;
+				for (; position > 0 && oam[line.Sprites[position - 1] * 4 + 1] > x; --position)
+				{
+					line.Sprites[position] = line.Sprites[position - 1];
+				}
+				line.Sprites[position] = sprite;
+			}
+		}
+	}
+
+	// Sprite pixels of the current line for MapShades, 8 pixels left of the screen first
+	// A pixel keeps the sprite with the highest priority that is not transparent there
+	bool drawSprites(std::array<U8, SCREEN_WIDTH + 16>& pixels)
+	{
+		updateSpriteLines();
+		const SSpriteLine& line = m_SpriteLines[m_Ly];
+		if (line.Count == 0)
+		{
+			return false;
+		}
+		pixels.fill(0);
+		const U8* oam = m_Bus.GetOam();
+		const bool tall = (m_Lcdc & LCDC_TALL_SPRITES) != 0;
+		for (U8 i = 0; i < line.Count; ++i)
+		{
+			const U8* entry = oam + line.Sprites[i] * 4;
+			const U8 x = entry[1];
+			// Hidden sprites still count against the limit of the line
+			if (x == 0 || x >= SCREEN_WIDTH + 8)
+			{
+				continue;
+			}
+			const U8 flags = entry[3];
+			U32 row = m_Ly + 16 - entry[0];
+			if ((flags & SPRITE_FLAG_FLIP_Y) != 0)
+			{
+				row = (tall ? 15 : 7) - row;
+			}
+			// Tall sprites are an even tile and the one after it
+			const U32 tile = tall ? (entry[2] & 0xFE) + row / 8 : entry[2];
+			const U8* colors = getTileRow(tile, row & 7);
+			const U8 attributes = ((flags & SPRITE_FLAG_PALETTE) != 0 ? SPRITE_PALETTE : 0)
+				| ((flags & SPRITE_FLAG_BEHIND) != 0 ? SPRITE_BEHIND : 0);
+			const bool flipX = (flags & SPRITE_FLAG_FLIP_X) != 0;
+			U8* out = pixels.data() + x;
+			for (U32 px = 0; px < 8; ++px)
+			{
+				const U8 color = colors[flipX ? 7 - px : px];
+				if (color != 0 && out[px] == 0)
+				{
+					out[px] = color | attributes;
+				}
+			}
+		}
+		return true;
+	}
+
+	void renderLine()
+	{
+		const auto start = std::chrono::steady_clock::now();
+		U8* line = m_Frames[m_FrontFrame ^ 1].data() + m_Ly * SCREEN_WIDTH;
+
+		// Palette indices, the window is drawn over the background
+		std::array<U8, LINE_TILES * 8> indices;
+		U32 offset = 0;
+		U32 palettes = getPalettes();
+		if ((m_Lcdc & LCDC_BACKGROUND) != 0)
+		{
+			fetchTiles((m_Lcdc & 0x08) != 0 ? 0x1C00 : 0x1800, static_cast<U8>(m_Scy + m_Ly), m_Scx / 8, indices.data());
+			offset = m_Scx & 7;
+
+			if (isWindowOnLine())
+			{
+				const int windowX = m_Wx - 7;
+				std::array<U8, LINE_TILES * 8> window;
+				fetchTiles((m_Lcdc & 0x40) != 0 ? 0x1C00 : 0x1800, m_WindowLine, 0, window.data());
+				++m_WindowLine;
+				// Written where the screen position of the window falls in the background line
+				const U32 screenX = windowX < 0 ? 0 : windowX;
+				const U32 skipped = screenX - windowX;
+				std::memcpy(indices.data() + offset + screenX, window.data() + skipped, SCREEN_WIDTH - screenX);
+			}
+		}
+		else
+		{
+			// Without the background the window is off too, sprites are drawn over white
+			indices.fill(0);
+			palettes &= ~0xFFu;
+		}
+
+		std::array<U8, SCREEN_WIDTH + 16> sprites;
+		const bool hasSprites = (m_Lcdc & LCDC_SPRITES) != 0 && drawSprites(sprites);
+		m_Kernels->MapShades(indices.data() + offset, hasSprites ? sprites.data() + 8 : nullptr, SCREEN_WIDTH, palettes, line);
+		m_FrameRenderNs += static_cast<U64>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+	}
+};
+
+// Receives the frames of a CPpu on the emulation thread
+class IFrameSink
+{
+public:
+	virtual ~IFrameSink() = default;
+	// number counts every frame since the PPU was created, skipped ones too
+	virtual void OnFrame(const CPpu::Frame& frame, U64 number) = 0;
+};
+
+inline void CPpu::finishFrame()
+{
+	const U64 number = m_Stats.Frames++;
+	if (!m_DrawFrame)
+	{
+		++m_Stats.SkippedFrames;
+		return;
+	}
+	m_FrontFrame ^= 1;
+	m_Stats.LastFrameRenderNs = m_FrameRenderNs;
+	m_Stats.TotalRenderNs += m_FrameRenderNs;
+	m_FrameRenderNs = 0;
+	if (m_FrameSink != nullptr)
+	{
+		m_FrameSink->OnFrame(GetFrame(), number);
+	}
+}
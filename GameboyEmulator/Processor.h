@@ -1,41 +1,337 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include "Apu.h"
+#include "BlockCache.h"
 #include "Helpers.h"
+#include "Jit.h"
+#include "Joypad.h"
+#include "MemoryBus.h"
+#include "Opcodes.h"
 #include "Operations.h"
+#include "Ppu.h"
+#include "Profiler.h"
+#include "SaveState.h"
+#include "Scheduler.h"
+#include "Timer.h"
+#include "Trace.h"
+
+// Halted waits for an interrupt, Locked is entered by the unused opcodes and is never left
+enum class ECpuMode : U8
+{
+	Running,
+	Halted,
+	Locked
+};
 
 // Gameboy CPU is an 8-bit CPU
 // Has 8 Registers
 class CProcessor
 {
 public:
+	// Clock cycles per second
+	static constexpr U32 CLOCK_SPEED = 4194304;
+
 	SRegisters Registers{};
+	CMemoryBus Bus;
+	CScheduler Scheduler;
+	CTimer Timer;
+	CPpu Ppu;
+	CApu Apu;
+	CJoypad Joypad;
+	// Only filled in with GB_PROFILER
+	CProfiler Profiler;
+
+	static const std::array<SOpcode, 256> OPCODE_TABLE;
+	static const std::array<OpcodeHandler, 256> CB_OPCODE_TABLE;
 
-	void Execute(const EInstruction instruction, const ERegisterTarget registerTarget)
+	CProcessor()
+		: Timer(Scheduler, Bus, m_Cycles), Ppu(Scheduler, Bus, m_Cycles), Apu(Scheduler, m_Cycles), Joypad(Bus)
 	{
-		switch (instruction)
+		Bus.MapIo(CJoypad::P1_ADDRESS, CJoypad::P1_ADDRESS, &Joypad);
+		Bus.MapIo(CTimer::DIV_ADDRESS, CTimer::TAC_ADDRESS, &Timer);
+		// FF46 is OAM DMA, done by the bus
+		Bus.MapIo(CPpu::LCDC_ADDRESS, CPpu::LYC_ADDRESS, &Ppu);
+		Bus.MapIo(CPpu::BGP_ADDRESS, CPpu::WX_ADDRESS, &Ppu);
+		Bus.SetVideoWatcher(&Ppu);
+		Bus.MapIo(CApu::NR10_ADDRESS, CApu::WAVE_LAST, &Apu);
+	}
+
+	// Register values left by the DMG boot ROM, execution starts at the cartridge entry point
+	// The boot ROM leaves the LCD and the APU on
+	void Reset()
+	{
+		Bus.Write(CApu::NR52_ADDRESS, 0x80);
+		Bus.Write(CApu::NR50_ADDRESS, 0x77);
+		Bus.Write(CApu::NR51_ADDRESS, 0xF3);
+		Bus.Write(CPpu::BGP_ADDRESS, 0xFC);
+		Bus.Write(CPpu::LCDC_ADDRESS, 0x91);
+		Registers = SRegisters{};
+		Registers.SetAF(0x01B0);
+		Registers.SetBC(0x0013);
+		Registers.SetDE(0x00D8);
+		Registers.SetHL(0x014D);
+		Registers.SP = 0xFFFE;
+		Registers.PC = 0x0100;
+		m_Ime = false;
+		m_ImeScheduled = false;
+		m_Mode = ECpuMode::Running;
+	}
+
+	// Services a pending interrupt or executes the next instruction, then fires the events that became due
+	// Returns the number of clock cycles taken
+	U8 Step()
+	{
+		const U8 cycles = executeNext();
+		m_Cycles += cycles;
+		if (m_Cycles >= Scheduler.GetNextTimestamp())
 		{
-		case EInstruction::ADDHL:
-		case EInstruction::INC16:
-		case EInstruction::DEC16:
-			do16BitOps(instruction, registerTarget);
-			break;
-		case EInstruction::ADD:
-		case EInstruction::ADDC:
-		case EInstruction::SUB:
-		case EInstruction::SUBC:
-		case EInstruction::AND:
-		case EInstruction::OR:
-		case EInstruction::XOR:
-		case EInstruction::CP:
-		case EInstruction::INC:
-		case EInstruction::DEC:
-		case EInstruction::CPL:
-		case EInstruction::SWAP:
-		case EInstruction::CCF:
-		case EInstruction::SCF:
-			do8BitOps(instruction, registerTarget);
-			break;
-		default:
-			break;
+			Scheduler.RunUntil(m_Cycles);
+		}
+		return cycles;
+	}
+
+	// Runs until the clock reaches target
+	// While halted nothing can happen before the next event so the clock skips straight to it
+	void RunUntil(const U64 target)
+	{
+		while (m_Cycles < target)
+		{
+			if (m_Mode == ECpuMode::Locked || (m_Mode == ECpuMode::Halted && Bus.GetPendingInterrupts() == 0))
+			{
+				const U64 wakeUp = std::min(target, Scheduler.GetNextTimestamp());
+				if constexpr (PROFILER)
+				{
+					Profiler.RecordHalted(wakeUp - m_Cycles);
+				}
+				m_Cycles = wakeUp;
+				Scheduler.RunUntil(m_Cycles);
+				continue;
+			}
+			if ((m_BlockCache != nullptr || THREADED_CORE) && !mustLeaveFastLoop(target))
+			{
+				if (m_BlockCache != nullptr)
+				{
+					runBlocks(target);
+				}
+#if GB_THREADED_CORE
+				else
+				{
+					runThreaded(target);
+				}
+#endif
+				if (m_Cycles >= Scheduler.GetNextTimestamp())
+				{
+					Scheduler.RunUntil(m_Cycles);
+				}
+				continue;
+			}
+			Step();
+		}
+	}
+
+	// RunUntil executes pre-decoded blocks from the cache while it is enabled
+	// Disabling the cache also disables the JIT
+	void SetBlockCacheEnabled(const bool enabled)
+	{
+		if (!enabled)
+		{
+			m_Jit.reset();
+			m_BlockCache.reset();
+		}
+		else if (m_BlockCache == nullptr)
+		{
+			m_BlockCache = std::make_unique<CBlockCache>(Bus);
+		}
+	}
+
+	[[nodiscard]] const CBlockCache* GetBlockCache() const
+	{
+		return m_BlockCache.get();
+	}
+
+	// Blocks translated while the JIT is enabled run their register-only instructions as native code
+	// Enabling it also enables the block cache, there is nothing to enable on hosts without GB_JIT
+	void SetJitEnabled(const bool enabled)
+	{
+		if (!JIT || enabled == (m_Jit != nullptr))
+		{
+			return;
+		}
+		SetBlockCacheEnabled(true);
+		// Blocks link to runs by index
+		m_BlockCache->Clear();
+		m_Jit.reset();
+		if (enabled)
+		{
+			m_Jit = std::make_unique<CJit>();
+		}
+	}
+
+	[[nodiscard]] const CJit* GetJit() const
+	{
+		return m_Jit.get();
+	}
+
+	// Differential testing, every native run is also interpreted and the interpreter result is kept
+	// GetJitMismatches counts the runs where the two disagreed
+	void SetJitVerify(const bool verify)
+	{
+		m_JitVerify = verify;
+	}
+
+	[[nodiscard]] U64 GetJitMismatches() const
+	{
+		return m_JitMismatches;
+	}
+
+	// The state before every instruction goes to recorder until it is set to null, the recorder must be open
+	// RunUntil steps one instruction at a time while tracing so no instruction is missed
+	void SetTraceRecorder(CTraceRecorder* recorder)
+	{
+		m_Trace = recorder;
+	}
+
+	// Size of the buffer SaveState writes, only changes when another cartridge is loaded
+	[[nodiscard]] size_t GetSaveStateSize() const
+	{
+		return sizeof(SSaveState) + Bus.GetCartridgeRamSize();
+	}
+
+	// Writes GetSaveStateSize bytes to buffer, the layout is in SaveState.h
+	[[nodiscard]] ESaveStateError SaveState(U8* buffer, const size_t size) const
+	{
+		const size_t stateSize = GetSaveStateSize();
+		if (size < stateSize)
+		{
+			return ESaveStateError::BufferTooSmall;
+		}
+		SSaveState state;
+		state.Header.Size = static_cast<U32>(stateSize);
+		state.Header.CartridgeRamSize = static_cast<U32>(Bus.GetCartridgeRamSize());
+		state.Cpu.A = Registers.A;
+		state.Cpu.F = Registers.GetF();
+		state.Cpu.B = Registers.B;
+		state.Cpu.C = Registers.C;
+		state.Cpu.D = Registers.D;
+		state.Cpu.E = Registers.E;
+		state.Cpu.H = Registers.H;
+		state.Cpu.L = Registers.L;
+		state.Cpu.SP = Registers.SP;
+		state.Cpu.PC = Registers.PC;
+		state.Cpu.Ime = m_Ime;
+		state.Cpu.ImeScheduled = m_ImeScheduled;
+		state.Cpu.Mode = static_cast<U8>(m_Mode);
+		state.Cpu.Cycles = m_Cycles;
+		Bus.SaveState(state.Bus);
+		Timer.SaveState(state.Timer);
+		Ppu.SaveState(state.Ppu);
+		Apu.SaveState(state.Apu);
+		Joypad.SaveState(state.Joypad);
+		Scheduler.SaveState(state.Scheduler);
+
+		std::memcpy(buffer, &state, sizeof(state));
+		if (Bus.GetCartridgeRamSize() != 0)
+		{
+			std::memcpy(buffer + sizeof(state), Bus.GetCartridgeRam(), Bus.GetCartridgeRamSize());
+		}
+		return ESaveStateError::None;
+	}
+
+	// Nothing is changed if an error is returned
+	// Translated blocks in RAM are dropped since memory is replaced without going through the bus,
+	// blocks in ROM check their bank when they are looked up and are kept
+	[[nodiscard]] ESaveStateError LoadState(const U8* buffer, const size_t size)
+	{
+		SSaveStateHeader header;
+		if (size < sizeof(header))
+		{
+			return ESaveStateError::BufferTooSmall;
+		}
+		std::memcpy(&header, buffer, sizeof(header));
+		if (header.Magic != SSaveStateHeader::MAGIC || header.Size != sizeof(SSaveState) + header.CartridgeRamSize)
+		{
+			return ESaveStateError::BadHeader;
+		}
+		if (header.Version != SSaveStateHeader::VERSION)
+		{
+			return ESaveStateError::UnsupportedVersion;
+		}
+		if (size < header.Size)
+		{
+			return ESaveStateError::BufferTooSmall;
+		}
+		if (header.CartridgeRamSize != Bus.GetCartridgeRamSize())
+		{
+			return ESaveStateError::CartridgeMismatch;
+		}
+		SSaveState state;
+		std::memcpy(&state, buffer, sizeof(state));
+		if (state.Cpu.Mode > static_cast<U8>(ECpuMode::Locked))
+		{
+			return ESaveStateError::BadHeader;
+		}
+		if (!Bus.LoadState(state.Bus))
+		{
+			return ESaveStateError::CartridgeMismatch;
+		}
+		if (header.CartridgeRamSize != 0)
+		{
+			std::memcpy(Bus.GetCartridgeRam(), buffer + sizeof(state), header.CartridgeRamSize);
+		}
+
+		Registers = SRegisters{};
+		Registers.A = state.Cpu.A;
+		Registers.SetF(state.Cpu.F);
+		Registers.B = state.Cpu.B;
+		Registers.C = state.Cpu.C;
+		Registers.D = state.Cpu.D;
+		Registers.E = state.Cpu.E;
+		Registers.H = state.Cpu.H;
+		Registers.L = state.Cpu.L;
+		Registers.SP = state.Cpu.SP;
+		Registers.PC = state.Cpu.PC;
+		m_Ime = state.Cpu.Ime != 0;
+		m_ImeScheduled = state.Cpu.ImeScheduled != 0;
+		m_Mode = static_cast<ECpuMode>(state.Cpu.Mode);
+		m_Cycles = state.Cpu.Cycles;
+		Timer.LoadState(state.Timer);
+		Ppu.LoadState(state.Ppu);
+		Apu.LoadState(state.Apu);
+		Joypad.LoadState(state.Joypad);
+		Scheduler.LoadState(state.Scheduler);
+		if (m_BlockCache != nullptr)
+		{
+			m_BlockCache->ClearWritable();
+		}
+		return ESaveStateError::None;
+	}
+
+	// Clock cycles since power on
+	[[nodiscard]] U64 GetCycles() const
+	{
+		return m_Cycles;
+	}
+
+	// Executes a single register instruction without fetching it from memory
+	// The instruction is encoded into its opcode and goes through the same tables as Step
+	void Execute(const EInstruction instruction, const ERegisterTarget registerTarget, const U8 bit = 0)
+	{
+		const U16 opcode = Encode(instruction, registerTarget, bit);
+		if (opcode == INVALID_OPCODE)
+		{
+			return;
+		}
+		if (opcode >> 8 == 0xCB)
+		{
+			CB_OPCODE_TABLE[opcode & 0xFF](*this, 0);
+		}
+		else
+		{
+			OPCODE_TABLE[opcode].Handler(*this, 0);
 		}
 	}
 
@@ -44,130 +340,985 @@ public:
 		return Registers;
 	}
 
-private:
-	void do8BitOps(const EInstruction instruction, const ERegisterTarget registerTarget)
+	[[nodiscard]] bool IsInterruptMasterEnabled() const
+	{
+		return m_Ime;
+	}
+
+	[[nodiscard]] ECpuMode GetMode() const
 	{
-		const auto value = getRegisterValueU8(registerTarget);
+		return m_Mode;
+	}
+
+	static constexpr U16 INVALID_OPCODE = 0xFFFF;
+
+	// Returns the opcode for an instruction and register pair
+	// CB prefixed opcodes have 0xCB in the high byte
+	[[nodiscard]] static constexpr U16 Encode(const EInstruction instruction, const ERegisterTarget registerTarget, const U8 bit = 0)
+	{
+		const U8 r8 = encodeR8(registerTarget);
+		const U8 r16 = encodeR16(registerTarget);
+		const bool hasR8 = r8 != INVALID_REGISTER;
+		const bool hasR16 = r16 != INVALID_REGISTER;
 		switch (instruction)
 		{
 		case EInstruction::ADD:
-			COperations::Add(value, Registers);
-			break;
+			return hasR8 ? 0x80 | r8 : INVALID_OPCODE;
 		case EInstruction::ADDC:
-			COperations::AddC(value, Registers);
-			break;
+			return hasR8 ? 0x88 | r8 : INVALID_OPCODE;
 		case EInstruction::SUB:
-			COperations::Sub(value, Registers);
-			break;
+			return hasR8 ? 0x90 | r8 : INVALID_OPCODE;
 		case EInstruction::SUBC:
-			COperations::SubC(value, Registers);
-			break;
+			return hasR8 ? 0x98 | r8 : INVALID_OPCODE;
 		case EInstruction::AND:
-			COperations::AndOp(value, Registers);
-			break;
-		case EInstruction::OR:
-			COperations::OrOp(value, Registers);
-			break;
+			return hasR8 ? 0xA0 | r8 : INVALID_OPCODE;
 		case EInstruction::XOR:
-			COperations::XorOp(value, Registers);
-			break;
+			return hasR8 ? 0xA8 | r8 : INVALID_OPCODE;
+		case EInstruction::OR:
+			return hasR8 ? 0xB0 | r8 : INVALID_OPCODE;
 		case EInstruction::CP:
-			COperations::Cp(value, Registers);
-			break;
+			return hasR8 ? 0xB8 | r8 : INVALID_OPCODE;
 		case EInstruction::INC:
-			COperations::Inc(value, Registers, registerTarget);
-			break;
+			return hasR8 ? 0x04 | r8 << 3 : INVALID_OPCODE;
 		case EInstruction::DEC:
-			COperations::Dec(value, Registers, registerTarget);
-			break;
-		case EInstruction::SWAP:
-			COperations::Swap(value, Registers, registerTarget);
-			break;
+			return hasR8 ? 0x05 | r8 << 3 : INVALID_OPCODE;
+		case EInstruction::ADDHL:
+			return hasR16 ? 0x09 | r16 << 4 : INVALID_OPCODE;
+		case EInstruction::INC16:
+			return hasR16 ? 0x03 | r16 << 4 : INVALID_OPCODE;
+		case EInstruction::DEC16:
+			return hasR16 ? 0x0B | r16 << 4 : INVALID_OPCODE;
+		case EInstruction::RRLA:
+			return 0x07;
+		case EInstruction::RRCA:
+			return 0x0F;
+		case EInstruction::RLA:
+			return 0x17;
+		case EInstruction::RRA:
+			return 0x1F;
 		case EInstruction::CPL:
-			COperations::Cpl(Registers);
-			break;
-		case EInstruction::CCF:
-			COperations::Ccf(Registers);
-			break;
+			return 0x2F;
 		case EInstruction::SCF:
-			COperations::Scf(Registers);
-			break;
+			return 0x37;
+		case EInstruction::CCF:
+			return 0x3F;
+		case EInstruction::RLC:
+			return hasR8 ? 0xCB00 | r8 : INVALID_OPCODE;
+		case EInstruction::RRC:
+			return hasR8 ? 0xCB08 | r8 : INVALID_OPCODE;
+		case EInstruction::RL:
+			return hasR8 ? 0xCB10 | r8 : INVALID_OPCODE;
+		case EInstruction::RR:
+			return hasR8 ? 0xCB18 | r8 : INVALID_OPCODE;
+		case EInstruction::SLA:
+			return hasR8 ? 0xCB20 | r8 : INVALID_OPCODE;
+		case EInstruction::SRA:
+			return hasR8 ? 0xCB28 | r8 : INVALID_OPCODE;
+		case EInstruction::SWAP:
+			return hasR8 ? 0xCB30 | r8 : INVALID_OPCODE;
+		case EInstruction::SRL:
+			return hasR8 ? 0xCB38 | r8 : INVALID_OPCODE;
+		case EInstruction::BIT:
+			return hasR8 ? 0xCB40 | (bit & 7) << 3 | r8 : INVALID_OPCODE;
+		case EInstruction::RESET:
+			return hasR8 ? 0xCB80 | (bit & 7) << 3 | r8 : INVALID_OPCODE;
+		case EInstruction::SET:
+			return hasR8 ? 0xCBC0 | (bit & 7) << 3 | r8 : INVALID_OPCODE;
 		default:
-			break;
+			return INVALID_OPCODE;
 		}
 	}
 
-	void do16BitOps(const EInstruction instruction, const ERegisterTarget registerTarget)
+private:
+	static constexpr U8 INVALID_REGISTER = 0xFF;
+
+	// Interrupt master enable
+	bool m_Ime = false;
+	bool m_ImeScheduled = false;
+	ECpuMode m_Mode = ECpuMode::Running;
+	U64 m_Cycles = 0;
+	std::unique_ptr<CBlockCache> m_BlockCache;
+	std::unique_ptr<CJit> m_Jit;
+	bool m_JitVerify = false;
+	U64 m_JitMismatches = 0;
+	CTraceRecorder* m_Trace = nullptr;
+
+	// Register order used by the opcode encoding, index 6 is (HL)
+	static constexpr ERegisterTarget R8_TARGETS[8] = {
+		ERegisterTarget::B, ERegisterTarget::C, ERegisterTarget::D, ERegisterTarget::E,
+		ERegisterTarget::H, ERegisterTarget::L, ERegisterTarget::UNK, ERegisterTarget::A
+	};
+	static constexpr ERegisterTarget R16_TARGETS[4] = {
+		ERegisterTarget::BC, ERegisterTarget::DE, ERegisterTarget::HL, ERegisterTarget::SP
+	};
+	// PUSH and POP use AF in place of SP
+	static constexpr ERegisterTarget R16_STACK_TARGETS[4] = {
+		ERegisterTarget::BC, ERegisterTarget::DE, ERegisterTarget::HL, ERegisterTarget::AF
+	};
+
+	[[nodiscard]] static constexpr U8 encodeR8(const ERegisterTarget registerTarget)
 	{
-		const auto value = getRegisterValueU16(registerTarget);
-		switch (instruction)
+		for (U8 i = 0; i < 8; ++i)
 		{
-		case EInstruction::ADDHL:
-			COperations::AddHL(value, Registers);
-			break;
-		case EInstruction::INC16:
-			COperations::Inc16(value, Registers, registerTarget);
-			break;
-		case EInstruction::DEC16:
-			COperations::Dec16(value, Registers, registerTarget);
-			break;
-		default:
-			break;
-		}
-	}
-
-	[[nodiscard]] U8 getRegisterValueU8(const ERegisterTarget registerTarget) const
-	{
-		U8 value = 0;
-		switch (registerTarget)
-		{
-		case ERegisterTarget::A:
-			value = Registers.A;
-			break;
-		case ERegisterTarget::B:
-			value = Registers.B;
-			break;
-		case ERegisterTarget::C:
-			value = Registers.C;
-			break;
-		case ERegisterTarget::D:
-			value = Registers.D;
-			break;
-		case ERegisterTarget::E:
-			value = Registers.E;
-			break;
-		case ERegisterTarget::H:
-			value = Registers.H;
-			break;
-		case ERegisterTarget::L:
-			value = Registers.L;
-			break;
-		default:
-			break;
+			if (i != 6 && R8_TARGETS[i] == registerTarget)
+			{
+				return i;
+			}
 		}
-		return value;
+		return INVALID_REGISTER;
 	}
 
-	[[nodiscard]] U16 getRegisterValueU16(const ERegisterTarget registerTarget) const
+	[[nodiscard]] static constexpr U8 encodeR16(const ERegisterTarget registerTarget)
 	{
-		U16 value = 0;
-		switch (registerTarget)
+		for (U8 i = 0; i < 4; ++i)
 		{
-		case ERegisterTarget::AF:
-			value = Registers.GetAF();
-			break;
-		case ERegisterTarget::BC:
-			value = Registers.GetBC();
-			break;
-		case ERegisterTarget::DE:
-			value = Registers.GetDE();
-			break;
-		case ERegisterTarget::HL:
-			value = Registers.GetHL();
-			break;
-		default:
-			break;
+			if (R16_TARGETS[i] == registerTarget)
+			{
+				return i;
+			}
+		}
+		return INVALID_REGISTER;
+	}
+
+	template<size_t... Opcodes>
+	static constexpr std::array<SOpcode, 256> makeOpcodeTable(std::index_sequence<Opcodes...>)
+	{
+		return { { SOpcode{ &execute<static_cast<U8>(Opcodes)>, OPCODE_LENGTHS[Opcodes] }... } };
+	}
+
+	template<size_t... Opcodes>
+	static constexpr std::array<OpcodeHandler, 256> makeCbOpcodeTable(std::index_sequence<Opcodes...>)
+	{
+		return { { &executeCb<static_cast<U8>(Opcodes)>... } };
+	}
+
+	// Opcodes are decoded at compile time as xxyyyzzz
+	// x selects the instruction group, y and z select the operation or register
+	template<U8 Opcode>
+	static U8 execute(CProcessor& cpu, [[maybe_unused]] const U16 operand)
+	{
+		constexpr U8 x = Opcode >> 6;
+		constexpr U8 y = (Opcode >> 3) & 0b111;
+		constexpr U8 z = Opcode & 0b111;
+		auto& registers = cpu.Registers;
+
+		if constexpr (Opcode == 0x00)
+		{
+			// NOP
+			return 4;
+		}
+		else if constexpr (Opcode == 0x08)
+		{
+			// LD (nn), SP
+			cpu.writeU16(operand, registers.SP);
+			return 20;
+		}
+		else if constexpr (Opcode == 0x10 || Opcode == 0x76)
+		{
+			// STOP / HALT, STOP also waits for an interrupt, a button press requests one
+			cpu.m_Mode = ECpuMode::Halted;
+			return 4;
+		}
+		else if constexpr (x == 0 && z == 0)
+		{
+			// JR e / JR cc, e
+			if constexpr (y >= 4)
+			{
+				if (!condition<y - 4>(registers))
+				{
+					return 8;
+				}
+			}
+			registers.PC = static_cast<U16>(registers.PC + static_cast<int8_t>(operand));
+			return 12;
+		}
+		else if constexpr (x == 0 && z == 1)
+		{
+			if constexpr ((y & 1) == 0)
+			{
+				// LD rr, nn
+				registers.SetPair<R16_TARGETS[y >> 1]>(operand);
+				return 12;
+			}
+			else
+			{
+				// ADD HL, rr
+				COperations::AddHL<R16_TARGETS[y >> 1]>(registers);
+				return 8;
+			}
+		}
+		else if constexpr (x == 0 && z == 2)
+		{
+			// LD (rr), A / LD A, (rr)
+			const U16 address = indirectAddress<(y >> 1)>(registers);
+			if constexpr ((y & 1) == 0)
+			{
+				cpu.writeU8(address, registers.A);
+			}
+			else
+			{
+				registers.A = cpu.readU8(address);
+			}
+			return 8;
+		}
+		else if constexpr (x == 0 && z == 3)
+		{
+			// INC rr / DEC rr
+			if constexpr ((y & 1) == 0)
+			{
+				COperations::Inc16<R16_TARGETS[y >> 1]>(registers);
+			}
+			else
+			{
+				COperations::Dec16<R16_TARGETS[y >> 1]>(registers);
+			}
+			return 8;
+		}
+		else if constexpr (x == 0 && (z == 4 || z == 5))
+		{
+			// INC r / DEC r
+			if constexpr (y == 6)
+			{
+				const U8 value = readR8<y>(cpu);
+				writeR8<y>(cpu, z == 4 ? COperations::Inc(value, registers) : COperations::Dec(value, registers));
+				return 12;
+			}
+			else if constexpr (z == 4)
+			{
+				COperations::Inc<R8_TARGETS[y]>(registers);
+			}
+			else
+			{
+				COperations::Dec<R8_TARGETS[y]>(registers);
+			}
+			return 4;
+		}
+		else if constexpr (x == 0 && z == 6)
+		{
+			// LD r, n
+			writeR8<y>(cpu, static_cast<U8>(operand));
+			return y == 6 ? 12 : 8;
+		}
+		else if constexpr (x == 0 && z == 7)
+		{
+			// Rotates on A and flag operations
+			if constexpr (y == 0)
+			{
+				COperations::Rlca(registers);
+			}
+			else if constexpr (y == 1)
+			{
+				COperations::Rrca(registers);
+			}
+			else if constexpr (y == 2)
+			{
+				COperations::Rla(registers);
+			}
+			else if constexpr (y == 3)
+			{
+				COperations::Rra(registers);
+			}
+			else if constexpr (y == 4)
+			{
+				COperations::Daa(registers);
+			}
+			else if constexpr (y == 5)
+			{
+				COperations::Cpl(registers);
+			}
+			else if constexpr (y == 6)
+			{
+				COperations::Scf(registers);
+			}
+			else
+			{
+				COperations::Ccf(registers);
+			}
+			return 4;
+		}
+		else if constexpr (x == 1)
+		{
+			// LD r, r'
+			writeR8<y>(cpu, readR8<z>(cpu));
+			return y == 6 || z == 6 ? 8 : 4;
+		}
+		else if constexpr (x == 2)
+		{
+			// ALU A, r
+			alu<y>(readR8<z>(cpu), registers);
+			return z == 6 ? 8 : 4;
+		}
+		else if constexpr (x == 3 && z == 0)
+		{
+			if constexpr (y < 4)
+			{
+				// RET cc
+				if (!condition<y>(registers))
+				{
+					return 8;
+				}
+				registers.PC = cpu.pop();
+				return 20;
+			}
+			else if constexpr (y == 4)
+			{
+				// LDH (n), A
+				cpu.writeU8(0xFF00 | operand, registers.A);
+				return 12;
+			}
+			else if constexpr (y == 5)
+			{
+				// ADD SP, e
+				registers.SP = COperations::AddSp(static_cast<U8>(operand), registers);
+				return 16;
+			}
+			else if constexpr (y == 6)
+			{
+				// LDH A, (n)
+				registers.A = cpu.readU8(0xFF00 | operand);
+				return 12;
+			}
+			else
+			{
+				// LD HL, SP + e
+				registers.SetHL(COperations::AddSp(static_cast<U8>(operand), registers));
+				return 12;
+			}
+		}
+		else if constexpr (x == 3 && z == 1)
+		{
+			if constexpr ((y & 1) == 0)
+			{
+				// POP rr, the low nibble of F always reads 0
+				constexpr ERegisterTarget target = R16_STACK_TARGETS[y >> 1];
+				const U16 value = cpu.pop();
+				registers.SetPair<target>(target == ERegisterTarget::AF ? value & 0xFFF0 : value);
+				return 12;
+			}
+			else if constexpr (y == 1 || y == 3)
+			{
+				// RET / RETI
+				registers.PC = cpu.pop();
+				if constexpr (y == 3)
+				{
+					cpu.m_Ime = true;
+				}
+				return 16;
+			}
+			else if constexpr (y == 5)
+			{
+				// JP HL
+				registers.PC = registers.GetHL();
+				return 4;
+			}
+			else
+			{
+				// LD SP, HL
+				registers.SP = registers.GetHL();
+				return 8;
+			}
+		}
+		else if constexpr (x == 3 && z == 2)
+		{
+			if constexpr (y < 4)
+			{
+				// JP cc, nn
+				if (!condition<y>(registers))
+				{
+					return 12;
+				}
+				registers.PC = operand;
+				return 16;
+			}
+			else if constexpr (y == 4)
+			{
+				// LD (C), A
+				cpu.writeU8(0xFF00 | registers.C, registers.A);
+				return 8;
+			}
+			else if constexpr (y == 5)
+			{
+				// LD (nn), A
+				cpu.writeU8(operand, registers.A);
+				return 16;
+			}
+			else if constexpr (y == 6)
+			{
+				// LD A, (C)
+				registers.A = cpu.readU8(0xFF00 | registers.C);
+				return 8;
+			}
+			else
+			{
+				// LD A, (nn)
+				registers.A = cpu.readU8(operand);
+				return 16;
+			}
+		}
+		else if constexpr (Opcode == 0xC3)
+		{
+			// JP nn
+			registers.PC = operand;
+			return 16;
+		}
+		else if constexpr (Opcode == 0xCB)
+		{
+			return CB_OPCODE_TABLE[operand & 0xFF](cpu, 0);
+		}
+		else if constexpr (Opcode == 0xF3 || Opcode == 0xFB)
+		{
+			// DI / EI, EI only takes effect after the next instruction and never clears IME
+			if constexpr (Opcode == 0xF3)
+			{
+				cpu.m_Ime = false;
+			}
+			cpu.m_ImeScheduled = Opcode == 0xFB;
+			return 4;
+		}
+		else if constexpr (x == 3 && z == 4 && y < 4)
+		{
+			// CALL cc, nn
+			if (!condition<y>(registers))
+			{
+				return 12;
+			}
+			cpu.push(registers.PC);
+			registers.PC = operand;
+			return 24;
+		}
+		else if constexpr (x == 3 && z == 5 && (y & 1) == 0)
+		{
+			// PUSH rr
+			cpu.push(registers.GetPair<R16_STACK_TARGETS[y >> 1]>());
+			return 16;
+		}
+		else if constexpr (Opcode == 0xCD)
+		{
+			// CALL nn
+			cpu.push(registers.PC);
+			registers.PC = operand;
+			return 24;
+		}
+		else if constexpr (x == 3 && z == 6)
+		{
+			// ALU A, n
+			alu<y>(static_cast<U8>(operand), registers);
+			return 8;
+		}
+		else if constexpr (x == 3 && z == 7)
+		{
+			// RST
+			cpu.push(registers.PC);
+			registers.PC = y * 8;
+			return 16;
+		}
+		else
+		{
+			// Unused opcodes (D3, DB, DD, E3, E4, EB, EC, ED, F4, FC, FD) lock up the CPU
+			cpu.m_Mode = ECpuMode::Locked;
+			return 4;
+		}
+	}
+
+	template<U8 Opcode>
+	static U8 executeCb(CProcessor& cpu, U16)
+	{
+		constexpr U8 x = Opcode >> 6;
+		constexpr U8 y = (Opcode >> 3) & 0b111;
+		constexpr U8 z = Opcode & 0b111;
+		auto& registers = cpu.Registers;
+		const U8 value = readR8<z>(cpu);
+
+		if constexpr (x == 0)
+		{
+			// Rotates and shifts
+			if constexpr (y == 0)
+			{
+				writeR8<z>(cpu, COperations::Rlc(value, registers));
+			}
+			else if constexpr (y == 1)
+			{
+				writeR8<z>(cpu, COperations::Rrc(value, registers));
+			}
+			else if constexpr (y == 2)
+			{
+				writeR8<z>(cpu, COperations::Rl(value, registers));
+			}
+			else if constexpr (y == 3)
+			{
+				writeR8<z>(cpu, COperations::Rr(value, registers));
+			}
+			else if constexpr (y == 4)
+			{
+				writeR8<z>(cpu, COperations::Sla(value, registers));
+			}
+			else if constexpr (y == 5)
+			{
+				writeR8<z>(cpu, COperations::Sra(value, registers));
+			}
+			else if constexpr (y == 6)
+			{
+				writeR8<z>(cpu, COperations::Swap(value, registers));
+			}
+			else
+			{
+				writeR8<z>(cpu, COperations::Srl(value, registers));
+			}
+		}
+		else if constexpr (x == 1)
+		{
+			COperations::Bit(y, value, registers);
+			return z == 6 ? 12 : 8;
+		}
+		else if constexpr (x == 2)
+		{
+			writeR8<z>(cpu, COperations::Res(y, value));
+		}
+		else
+		{
+			writeR8<z>(cpu, COperations::Set(y, value));
+		}
+		return z == 6 ? 16 : 8;
+	}
+
+	template<U8 Operation>
+	static void alu(const U8 value, SRegisters& registers)
+	{
+		if constexpr (Operation == 0)
+		{
+			COperations::Add(value, registers);
+		}
+		else if constexpr (Operation == 1)
+		{
+			COperations::AddC(value, registers);
+		}
+		else if constexpr (Operation == 2)
+		{
+			COperations::Sub(value, registers);
+		}
+		else if constexpr (Operation == 3)
+		{
+			COperations::SubC(value, registers);
+		}
+		else if constexpr (Operation == 4)
+		{
+			COperations::AndOp(value, registers);
+		}
+		else if constexpr (Operation == 5)
+		{
+			COperations::XorOp(value, registers);
+		}
+		else if constexpr (Operation == 6)
+		{
+			COperations::OrOp(value, registers);
+		}
+		else
+		{
+			COperations::Cp(value, registers);
+		}
+	}
+
+	// 8-bit operand by encoding index, registers index R8 directly and 6 reads and writes memory at HL
+	template<U8 Index>
+	static U8 readR8(CProcessor& cpu)
+	{
+		if constexpr (Index == 6)
+		{
+			return cpu.readU8(cpu.Registers.GetHL());
+		}
+		else
+		{
+			return cpu.Registers.R8[SRegisters::R8Index(Index)];
 		}
+	}
+
+	template<U8 Index>
+	static void writeR8(CProcessor& cpu, const U8 value)
+	{
+		if constexpr (Index == 6)
+		{
+			cpu.writeU8(cpu.Registers.GetHL(), value);
+		}
+		else
+		{
+			cpu.Registers.R8[SRegisters::R8Index(Index)] = value;
+		}
+	}
+
+	// Fetches the opcode at PC, decodes it through the dispatch table and executes it
+	U8 executeNext()
+	{
+		if (m_Mode == ECpuMode::Locked)
+		{
+			if constexpr (PROFILER)
+			{
+				Profiler.RecordHalted(4);
+			}
+			return 4;
+		}
+
+		if (const U8 pending = Bus.GetPendingInterrupts(); pending != 0)
+		{
+			// A pending interrupt ends HALT even when IME is off
+			m_Mode = ECpuMode::Running;
+			if (m_Ime)
+			{
+				const U8 cycles = serviceInterrupt(pending);
+				if constexpr (PROFILER)
+				{
+					Profiler.RecordInterrupt(cycles);
+				}
+				return cycles;
+			}
+		}
+		if (m_Mode == ECpuMode::Halted)
+		{
+			if constexpr (PROFILER)
+			{
+				Profiler.RecordHalted(4);
+			}
+			return 4;
+		}
+
+		// EI takes effect after the instruction following it, unless that instruction is DI
+		const bool enableIme = m_ImeScheduled;
+
+		if (m_Trace != nullptr)
+		{
+			traceInstruction();
+		}
+
+		const U16 pc = Registers.PC;
+		const U8 opcodeByte = readU8(pc);
+		const SOpcode& opcode = OPCODE_TABLE[opcodeByte];
+		U16 operand = 0;
+		if (opcode.Length == 2)
+		{
+			operand = readU8(pc + 1);
+		}
+		else if (opcode.Length == 3)
+		{
+			operand = readU16(pc + 1);
+		}
+		Registers.PC += opcode.Length;
+		const U8 cycles = opcode.Handler(*this, operand);
+		profileInstruction(pc, opcodeByte, operand, cycles);
+
+		if (enableIme && m_ImeScheduled)
+		{
+			m_Ime = true;
+			m_ImeScheduled = false;
+		}
+		return cycles;
+	}
+
+	// Compiled out without GB_PROFILER, the bank only matters for the switchable ROM area
+	void profileInstruction([[maybe_unused]] const U16 pc, [[maybe_unused]] const U8 opcode, [[maybe_unused]] const U16 operand,
+		[[maybe_unused]] const U8 cycles)
+	{
+		if constexpr (PROFILER)
+		{
+			const U16 bank = pc >= 0x4000 && pc < 0x8000 ? Bus.GetRomBank() : 0;
+			Profiler.RecordInstruction(pc, bank, opcode, static_cast<U8>(operand), cycles);
+		}
+	}
+
+	// The block and threaded loops only run plain instructions, everything else goes through Step:
+	// due events, interrupts that will be serviced, HALT and the EI delay
+	[[nodiscard]] bool mustLeaveFastLoop(const U64 target)
+	{
+		return m_Cycles >= std::min(target, Scheduler.GetNextTimestamp()) || m_Mode != ECpuMode::Running || m_ImeScheduled
+			|| (m_Ime && Bus.GetPendingInterrupts() != 0) || m_Trace != nullptr;
+	}
+
+	void traceInstruction()
+	{
+		STraceRecord record;
+		record.A = Registers.A;
+		record.F = Registers.GetF();
+		record.B = Registers.B;
+		record.C = Registers.C;
+		record.D = Registers.D;
+		record.E = Registers.E;
+		record.H = Registers.H;
+		record.L = Registers.L;
+		record.SP = Registers.SP;
+		record.PC = Registers.PC;
+		for (U16 i = 0; i < record.Memory.size(); ++i)
+		{
+			record.Memory[i] = Bus.Read(Registers.PC + i);
+		}
+		record.Cycles = m_Cycles;
+		m_Trace->Record(record);
+	}
+
+	const CBlockCache::SBlock& translateBlock(const U16 pc)
+	{
+		if (m_Jit != nullptr && !m_Jit->HasRoomForBlock())
+		{
+			m_Jit->Flush();
+			m_BlockCache->Clear();
+		}
+		CBlockCache::SBlock& block = m_BlockCache->Allocate(pc);
+		while (true)
+		{
+			const U16 address = static_cast<U16>(block.End);
+			const U8 opcode = readU8(address);
+			const U8 length = OPCODE_LENGTHS[opcode];
+			if (block.Count > 0 && !CBlockCache::Fits(block, length))
+			{
+				break;
+			}
+			U16 operand = 0;
+			if (length == 2)
+			{
+				operand = readU8(address + 1);
+			}
+			else if (length == 3)
+			{
+				operand = readU16(address + 1);
+			}
+			CBlockCache::Add(block, OPCODE_TABLE[opcode].Handler, operand, length, opcode);
+			if (CBlockCache::EndsBlock(opcode) || block.End >= 0x10000)
+			{
+				break;
+			}
+		}
+		if (m_Jit != nullptr)
+		{
+			m_Jit->CompileBlock(block);
+		}
+		return m_BlockCache->Commit(block);
+	}
+
+	// Runs blocks until something needs Step, a write drops a block or a bank switch remaps pages
+	// In the last two cases the current block may be stale and is left right away
+	void runBlocks(const U64 target)
+	{
+		do
+		{
+			// Code is not fetched from the I/O registers
+			if (Registers.PC >= 0xFE00 && Registers.PC < 0xFF80)
+			{
+				Step();
+				return;
+			}
+			const CBlockCache::SBlock* found = m_BlockCache->Find(Registers.PC);
+			const CBlockCache::SBlock& block = found != nullptr ? *found : translateBlock(Registers.PC);
+			const U32 generation = m_BlockCache->GetGeneration();
+			const U32 mapGeneration = Bus.GetMapGeneration();
+			for (U8 i = 0; i < block.Count; ++i)
+			{
+				const CBlockCache::SInstruction& instruction = block.Instructions[i];
+				if (instruction.NativeRun != CBlockCache::NO_NATIVE_RUN && m_Jit != nullptr)
+				{
+					// A run can not be left halfway, it is only taken if the interpreter would also
+					// start its last instruction before leaving
+					const CJit::SRun& run = m_Jit->GetRun(instruction.NativeRun);
+					if (m_Cycles + run.Cycles - run.LastCycles < std::min(target, Scheduler.GetNextTimestamp()))
+					{
+						runNative(run, &instruction);
+						i += run.Count - 1;
+						if (mustLeaveFastLoop(target))
+						{
+							return;
+						}
+						continue;
+					}
+				}
+				const U16 pc = Registers.PC;
+				Registers.PC += instruction.Length;
+				const U8 cycles = instruction.Handler(*this, instruction.Operand);
+				m_Cycles += cycles;
+				profileInstruction(pc, instruction.Opcode, instruction.Operand, cycles);
+				if (m_BlockCache->GetGeneration() != generation || Bus.GetMapGeneration() != mapGeneration)
+				{
+					return;
+				}
+				if (mustLeaveFastLoop(target))
+				{
+					return;
+				}
+			}
+		} while (!mustLeaveFastLoop(target));
+	}
+
+	void runNative(const CJit::SRun& run, const CBlockCache::SInstruction* instructions)
+	{
+		if constexpr (PROFILER)
+		{
+			U16 pc = Registers.PC;
+			for (U8 i = 0; i < run.Count; ++i)
+			{
+				profileInstruction(pc, instructions[i].Opcode, instructions[i].Operand, CJit::GetNativeCycles(instructions[i].Opcode, instructions[i].Operand));
+				pc += instructions[i].Length;
+			}
+		}
+		m_Cycles += run.Cycles;
+		if (!m_JitVerify)
+		{
+			Registers.SetF(run.Code(Registers.R8, Registers.GetF()));
+			Registers.PC += run.Length;
+			return;
+		}
+
+		SRegisters native = Registers;
+		native.SetF(run.Code(native.R8, native.GetF()));
+		for (U8 i = 0; i < run.Count; ++i)
+		{
+			Registers.PC += instructions[i].Length;
+			instructions[i].Handler(*this, instructions[i].Operand);
+		}
+		if (!std::equal(native.R8, native.R8 + 7, Registers.R8) || native.GetF() != Registers.GetF())
+		{
+			++m_JitMismatches;
+		}
+	}
+
+#if GB_THREADED_CORE
+
+	template<U8 Opcode>
+	U8 fetchAndExecute()
+	{
+		U16 operand = 0;
+		if constexpr (OPCODE_LENGTHS[Opcode] == 2)
+		{
+			operand = readU8(Registers.PC + 1);
+		}
+		else if constexpr (OPCODE_LENGTHS[Opcode] == 3)
+		{
+			operand = readU16(Registers.PC + 1);
+		}
+		const U16 pc = Registers.PC;
+		Registers.PC += OPCODE_LENGTHS[Opcode];
+		const U8 cycles = execute<Opcode>(*this, operand);
+		profileInstruction(pc, Opcode, operand, cycles);
+		return cycles;
+	}
+
+	// Threaded interpreter, every opcode has its own label that ends in its own indirect jump
+	// so the branch predictor sees 256 dispatch sites instead of the single one in Step
+#define GB_OPCODE_ROW(X, h) X(h, 0) X(h, 1) X(h, 2) X(h, 3) X(h, 4) X(h, 5) X(h, 6) X(h, 7) \
+	X(h, 8) X(h, 9) X(h, A) X(h, B) X(h, C) X(h, D) X(h, E) X(h, F)
+#define GB_OPCODES(X) GB_OPCODE_ROW(X, 0) GB_OPCODE_ROW(X, 1) GB_OPCODE_ROW(X, 2) GB_OPCODE_ROW(X, 3) \
+	GB_OPCODE_ROW(X, 4) GB_OPCODE_ROW(X, 5) GB_OPCODE_ROW(X, 6) GB_OPCODE_ROW(X, 7) \
+	GB_OPCODE_ROW(X, 8) GB_OPCODE_ROW(X, 9) GB_OPCODE_ROW(X, A) GB_OPCODE_ROW(X, B) \
+	GB_OPCODE_ROW(X, C) GB_OPCODE_ROW(X, D) GB_OPCODE_ROW(X, E) GB_OPCODE_ROW(X, F)
+#define GB_THREADED_LABEL(h, l) &&op_##h##l,
+#define GB_THREADED_HANDLER(h, l) \
+	op_##h##l: \
+		m_Cycles += fetchAndExecute<0x##h##l>(); \
+		if (mustLeaveFastLoop(target)) \
+		{ \
+			return; \
+		} \
+		goto *labels[readU8(Registers.PC)];
+
+	void runThreaded(const U64 target)
+	{
+		static void* const labels[256] = { GB_OPCODES(GB_THREADED_LABEL) };
+		goto *labels[readU8(Registers.PC)];
+		GB_OPCODES(GB_THREADED_HANDLER)
+	}
+
+#undef GB_THREADED_HANDLER
+#undef GB_THREADED_LABEL
+#undef GB_OPCODES
+#undef GB_OPCODE_ROW
+#endif
+
+	// NZ, Z, NC, C
+	template<U8 Condition>
+	static bool condition(const SRegisters& registers)
+	{
+		if constexpr (Condition == 0)
+		{
+			return !registers.GetZero();
+		}
+		else if constexpr (Condition == 1)
+		{
+			return registers.GetZero();
+		}
+		else if constexpr (Condition == 2)
+		{
+			return !registers.GetCarry();
+		}
+		else
+		{
+			return registers.GetCarry();
+		}
+	}
+
+	// Address for LD (rr), A and LD A, (rr), the last two are (HL+) and (HL-)
+	template<U8 Pair>
+	static U16 indirectAddress(SRegisters& registers)
+	{
+		if constexpr (Pair == 0)
+		{
+			return registers.GetBC();
+		}
+		else if constexpr (Pair == 1)
+		{
+			return registers.GetDE();
+		}
+		else
+		{
+			const U16 address = registers.GetHL();
+			registers.SetHL(Pair == 2 ? address + 1 : address - 1);
+			return address;
+		}
+	}
+
+	U8 serviceInterrupt(const U8 pending)
+	{
+		// Lowest bit has the highest priority
+		U8 bit = 0;
+		while (((pending >> bit) & 0b1) == 0)
+		{
+			++bit;
+		}
+		Bus.AcknowledgeInterrupt(bit);
+		m_Ime = false;
+		push(Registers.PC);
+		Registers.PC = 0x40 + bit * 8;
+		return 20;
+	}
+
+	[[nodiscard]] U8 readU8(const U16 address)
+	{
+		return Bus.Read(address);
+	}
+
+	[[nodiscard]] U16 readU16(const U16 address)
+	{
+		const U8 low = readU8(address);
+		return static_cast<U16>(readU8(address + 1) << 8 | low);
+	}
+
+	void writeU8(const U16 address, const U8 value)
+	{
+		Bus.Write(address, value);
+	}
+
+	void writeU16(const U16 address, const U16 value)
+	{
+		writeU8(address, value & 0xFF);
+		writeU8(address + 1, value >> 8);
+	}
+
+	void push(const U16 value)
+	{
+		Registers.SP -= 2;
+		writeU16(Registers.SP, value);
+	}
+
+	U16 pop()
+	{
+		const U16 value = readU16(Registers.SP);
+		Registers.SP += 2;
 		return value;
 	}
 };
+
+inline constexpr std::array<SOpcode, 256> CProcessor::OPCODE_TABLE = makeOpcodeTable(std::make_index_sequence<256>{});
+inline constexpr std::array<OpcodeHandler, 256> CProcessor::CB_OPCODE_TABLE = makeCbOpcodeTable(std::make_index_sequence<256>{});
@@ -0,0 +1,320 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <iomanip>
+#include <iterator>
+#include <ostream>
+#include <vector>
+#include "Helpers.h"
+#include "Scheduler.h"
+
+[[nodiscard]] inline const char* GetInstructionName(const EInstruction instruction)
+{
+	constexpr const char* NAMES[] = {
+		"ADD", "ADC", "ADD HL", "SUB", "SBC", "AND", "OR", "XOR", "CP", "INC", "DEC", "INC rr", "DEC rr",
+		"CCF", "SCF", "RRA", "RLA", "RRCA", "RLCA", "CPL", "BIT", "RES", "SET", "SRL", "RR", "RL", "RRC",
+		"RLC", "SRA", "SLA", "SWAP"
+	};
+	static_assert(std::size(NAMES) == static_cast<size_t>(EInstruction::SWAP) + 1, "One name per instruction");
+	return NAMES[static_cast<size_t>(instruction)];
+}
+
+// Execution counts and cycles by opcode, by EInstruction and by PC
+// CProcessor only calls into it when GB_PROFILER is set, otherwise the calls are compiled out
+// and the counters are never allocated
+// PCs in 4000-7FFF are counted per ROM bank, everything else by address
+class CProfiler
+{
+public:
+	static constexpr size_t INSTRUCTION_COUNT = static_cast<size_t>(EInstruction::SWAP) + 1;
+
+	struct SCounter
+	{
+		U64 Count = 0;
+		U64 Cycles = 0;
+	};
+
+	struct SHotSpot
+	{
+		U16 Bank = 0;
+		U16 Pc = 0;
+		SCounter Counter;
+	};
+
+	// Where the emulated cycles went
+	struct SSubsystemCycles
+	{
+		U64 Instructions = 0;
+		U64 Interrupts = 0;
+		// HALT, STOP and a locked CPU
+		U64 Halted = 0;
+	};
+
+	CProfiler()
+	{
+		if constexpr (PROFILER)
+		{
+			m_Pcs.resize(0x10000);
+		}
+	}
+
+	void RecordInstruction(const U16 pc, const U16 bank, const U8 opcode, const U8 cbOpcode, const U8 cycles)
+	{
+		add(m_Opcodes[opcode], cycles);
+		if (opcode == 0xCB)
+		{
+			add(m_CbOpcodes[cbOpcode], cycles);
+		}
+		add(getPcCounter(pc, bank), cycles);
+		m_Subsystems.Instructions += cycles;
+	}
+
+	void RecordInterrupt(const U8 cycles)
+	{
+		m_Subsystems.Interrupts += cycles;
+	}
+
+	void RecordHalted(const U64 cycles)
+	{
+		m_Subsystems.Halted += cycles;
+	}
+
+	void Reset()
+	{
+		m_Opcodes = {};
+		m_CbOpcodes = {};
+		std::fill(m_Pcs.begin(), m_Pcs.end(), SCounter{});
+		m_BankedPcs.clear();
+		m_Subsystems = {};
+	}
+
+	[[nodiscard]] const SCounter& GetOpcode(const U8 opcode) const
+	{
+		return m_Opcodes[opcode];
+	}
+
+	[[nodiscard]] const SCounter& GetCbOpcode(const U8 opcode) const
+	{
+		return m_CbOpcodes[opcode];
+	}
+
+	// Summed from the opcode counters, so it costs nothing while running
+	[[nodiscard]] SCounter GetInstruction(const EInstruction instruction) const
+	{
+		SCounter total;
+		for (U32 opcode = 0; opcode < 256; ++opcode)
+		{
+			if (INSTRUCTION_BY_OPCODE[opcode] == static_cast<U8>(instruction))
+			{
+				total.Count += m_Opcodes[opcode].Count;
+				total.Cycles += m_Opcodes[opcode].Cycles;
+			}
+			if (INSTRUCTION_BY_CB_OPCODE[opcode] == static_cast<U8>(instruction))
+			{
+				total.Count += m_CbOpcodes[opcode].Count;
+				total.Cycles += m_CbOpcodes[opcode].Cycles;
+			}
+		}
+		return total;
+	}
+
+	[[nodiscard]] const SSubsystemCycles& GetSubsystemCycles() const
+	{
+		return m_Subsystems;
+	}
+
+	// The count PCs that took the most cycles, most first
+	[[nodiscard]] std::vector<SHotSpot> GetHotSpots(const size_t count) const
+	{
+		std::vector<SHotSpot> spots;
+		const auto collect = [&spots](const std::vector<SCounter>& counters, const U16 bank, const U32 base) {
+			for (size_t i = 0; i < counters.size(); ++i)
+			{
+				if (counters[i].Count != 0)
+				{
+					spots.push_back({ bank, static_cast<U16>(base + i), counters[i] });
+				}
+			}
+		};
+		collect(m_Pcs, 0, 0);
+		for (size_t bank = 0; bank < m_BankedPcs.size(); ++bank)
+		{
+			collect(m_BankedPcs[bank], static_cast<U16>(bank), BANKED_START);
+		}
+
+		const auto hotter = [](const SHotSpot& left, const SHotSpot& right) {
+			return left.Counter.Cycles > right.Counter.Cycles;
+		};
+		const size_t kept = std::min(count, spots.size());
+		std::partial_sort(spots.begin(), spots.begin() + kept, spots.end(), hotter);
+		spots.resize(kept);
+		return spots;
+	}
+
+	// Hot PCs, the opcode and instruction histograms and the cycles by subsystem as text
+	void Dump(std::ostream& stream, const CScheduler& scheduler, const size_t top = 20) const
+	{
+		const std::ios_base::fmtflags flags = stream.flags();
+		const U64 total = m_Subsystems.Instructions + m_Subsystems.Interrupts + m_Subsystems.Halted;
+
+		stream << "Cycles by subsystem\n";
+		printShare(stream, "instructions", m_Subsystems.Instructions, total);
+		printShare(stream, "interrupts", m_Subsystems.Interrupts, total);
+		printShare(stream, "halted", m_Subsystems.Halted, total);
+		for (size_t event = 0; event < CScheduler::EVENT_COUNT; ++event)
+		{
+			stream << "  " << std::left << std::setw(16) << GetEventName(static_cast<EEvent>(event)) << std::right
+				<< std::setw(14) << scheduler.GetFiredCount(static_cast<EEvent>(event)) << " events\n";
+		}
+
+		stream << "Hot PCs\n";
+		for (const SHotSpot& spot : GetHotSpots(top))
+		{
+			stream << "  " << std::hex << std::setfill('0') << std::setw(3) << spot.Bank << ':' << std::setw(4) << spot.Pc
+				<< std::dec << std::setfill(' ') << std::setw(14) << spot.Counter.Count;
+			printShare(stream, "", spot.Counter.Cycles, m_Subsystems.Instructions);
+		}
+
+		stream << "Opcodes\n";
+		dumpOpcodes(stream, m_Opcodes, "", top);
+		dumpOpcodes(stream, m_CbOpcodes, "CB ", top);
+
+		stream << "Instructions\n";
+		for (size_t instruction = 0; instruction < INSTRUCTION_COUNT; ++instruction)
+		{
+			const SCounter counter = GetInstruction(static_cast<EInstruction>(instruction));
+			if (counter.Count != 0)
+			{
+				stream << "  " << std::left << std::setw(8) << GetInstructionName(static_cast<EInstruction>(instruction)) << std::right
+					<< std::setw(14) << counter.Count;
+				printShare(stream, "", counter.Cycles, m_Subsystems.Instructions);
+			}
+		}
+		stream.flags(flags);
+	}
+
+private:
+	static constexpr U16 BANKED_START = 0x4000;
+	static constexpr U16 BANKED_END = 0x8000;
+	static constexpr U8 NO_INSTRUCTION = 0xFF;
+
+	std::array<SCounter, 256> m_Opcodes{};
+	std::array<SCounter, 256> m_CbOpcodes{};
+	std::vector<SCounter> m_Pcs;
+	// Allocated the first time code in a bank runs
+	std::vector<std::vector<SCounter>> m_BankedPcs;
+	SSubsystemCycles m_Subsystems{};
+
+	static void add(SCounter& counter, const U8 cycles)
+	{
+		++counter.Count;
+		counter.Cycles += cycles;
+	}
+
+	SCounter& getPcCounter(const U16 pc, const U16 bank)
+	{
+		if (pc < BANKED_START || pc >= BANKED_END)
+		{
+			return m_Pcs[pc];
+		}
+		if (bank >= m_BankedPcs.size())
+		{
+			m_BankedPcs.resize(bank + 1);
+		}
+		std::vector<SCounter>& counters = m_BankedPcs[bank];
+		if (counters.empty())
+		{
+			counters.resize(BANKED_END - BANKED_START);
+		}
+		return counters[pc - BANKED_START];
+	}
+
+	// Count and cycles with their share of the total
+	static void printShare(std::ostream& stream, const char* name, const U64 cycles, const U64 total)
+	{
+		if (*name != '\0')
+		{
+			stream << "  " << std::left << std::setw(16) << name << std::right;
+		}
+		stream << std::setw(14) << cycles << " cycles " << std::fixed << std::setprecision(2) << std::setw(6)
+			<< (total == 0 ? 0.0 : 100.0 * static_cast<double>(cycles) / static_cast<double>(total)) << "%\n";
+	}
+
+	void dumpOpcodes(std::ostream& stream, const std::array<SCounter, 256>& counters, const char* prefix, const size_t top) const
+	{
+		std::array<U8, 256> opcodes{};
+		for (U32 i = 0; i < 256; ++i)
+		{
+			opcodes[i] = static_cast<U8>(i);
+		}
+		std::stable_sort(opcodes.begin(), opcodes.end(), [&counters](const U8 left, const U8 right) {
+			return counters[left].Count > counters[right].Count;
+		});
+		for (size_t i = 0; i < top && counters[opcodes[i]].Count != 0; ++i)
+		{
+			const U8 opcode = opcodes[i];
+			stream << "  " << prefix << std::hex << std::uppercase << std::setfill('0') << std::setw(2) << static_cast<U32>(opcode)
+				<< std::dec << std::nouppercase << std::setfill(' ') << std::setw(*prefix == '\0' ? 14 : 11) << counters[opcode].Count;
+			printShare(stream, "", counters[opcode].Cycles, m_Subsystems.Instructions);
+		}
+	}
+
+	// EInstruction of each opcode, NO_INSTRUCTION for loads, jumps and the rest
+	static constexpr std::array<U8, 256> makeInstructionTable(const bool cb)
+	{
+		constexpr EInstruction ALU[8] = {
+			EInstruction::ADD, EInstruction::ADDC, EInstruction::SUB, EInstruction::SUBC,
+			EInstruction::AND, EInstruction::XOR, EInstruction::OR, EInstruction::CP
+		};
+		// Index 4 is DAA which is skipped below
+		constexpr EInstruction ACCUMULATOR[8] = {
+			EInstruction::RRLA, EInstruction::RRCA, EInstruction::RLA, EInstruction::RRA,
+			EInstruction::CPL, EInstruction::CPL, EInstruction::SCF, EInstruction::CCF
+		};
+		constexpr EInstruction SHIFTS[8] = {
+			EInstruction::RLC, EInstruction::RRC, EInstruction::RL, EInstruction::RR,
+			EInstruction::SLA, EInstruction::SRA, EInstruction::SWAP, EInstruction::SRL
+		};
+		std::array<U8, 256> table{};
+		for (U32 opcode = 0; opcode < 256; ++opcode)
+		{
+			const U32 x = opcode >> 6;
+			const U32 y = (opcode >> 3) & 0b111;
+			const U32 z = opcode & 0b111;
+			U8 instruction = NO_INSTRUCTION;
+			if (cb)
+			{
+				constexpr EInstruction BIT_OPS[4] = { EInstruction::RLC, EInstruction::BIT, EInstruction::RESET, EInstruction::SET };
+				instruction = static_cast<U8>(x == 0 ? SHIFTS[y] : BIT_OPS[x]);
+			}
+			else if (x == 2 || (x == 3 && z == 6))
+			{
+				instruction = static_cast<U8>(ALU[y]);
+			}
+			else if (x == 0 && (z == 4 || z == 5))
+			{
+				instruction = static_cast<U8>(z == 4 ? EInstruction::INC : EInstruction::DEC);
+			}
+			else if (x == 0 && z == 1 && (y & 1) == 1)
+			{
+				instruction = static_cast<U8>(EInstruction::ADDHL);
+			}
+			else if (x == 0 && z == 3)
+			{
+				instruction = static_cast<U8>((y & 1) == 0 ? EInstruction::INC16 : EInstruction::DEC16);
+			}
+			else if (x == 0 && z == 7 && y != 4)
+			{
+				instruction = static_cast<U8>(ACCUMULATOR[y]);
+			}
+			table[opcode] = instruction;
+		}
+		return table;
+	}
+
+	static const std::array<U8, 256> INSTRUCTION_BY_OPCODE;
+	static const std::array<U8, 256> INSTRUCTION_BY_CB_OPCODE;
+};
+
+inline constexpr std::array<U8, 256> CProfiler::INSTRUCTION_BY_OPCODE = makeInstructionTable(false);
+inline constexpr std::array<U8, 256> CProfiler::INSTRUCTION_BY_CB_OPCODE = makeInstructionTable(true);
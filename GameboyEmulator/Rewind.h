@@ -0,0 +1,330 @@
+#pragma once
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <utility>
+#include <vector>
+#include "Helpers.h"
+#include "Processor.h"
+
+// Run-length coding of the XOR of a save state against a reference state
+// Unchanged bytes XOR to zero, a frame of emulation only touches a few hundred of them
+// Tokens are a byte with the top bit set for a run of literal bytes that follow the token,
+// clear for a run of zeros, and the run length - 1 in the low 7 bits
+// A zero run token of 7F is followed by the length of a long run as 16 bits
+class CDeltaCodec
+{
+public:
+	static constexpr size_t MAX_RUN = 0x80;
+	static constexpr size_t MAX_LONG_RUN = 0xFFFF;
+
+	// Worst case size of an encoded state of size bytes, single zeros are kept in literal runs
+	[[nodiscard]] static constexpr size_t GetMaxEncodedSize(const size_t size)
+	{
+		return size + (size + MAX_RUN - 1) / MAX_RUN * 3;
+	}
+
+	// Appends the encoding of state XOR reference to out, reference null encodes state itself
+	static void Encode(const U8* state, const U8* reference, const size_t size, std::vector<U8>& out)
+	{
+		const size_t start = out.size();
+		out.resize(start + GetMaxEncodedSize(size));
+		U8* const begin = out.data() + start;
+		U8* encoded = begin;
+		size_t position = 0;
+		while (position < size)
+		{
+			// Zero runs are found a word at a time, most of a delta is zero
+			size_t zeros = position;
+			while (zeros + sizeof(U64) <= size && loadXor(state, reference, zeros) == 0)
+			{
+				zeros += sizeof(U64);
+			}
+			while (zeros < size && byteXor(state, reference, zeros) == 0)
+			{
+				++zeros;
+			}
+			for (size_t run = zeros - position; run > 0;)
+			{
+				if (run < MAX_RUN)
+				{
+					*encoded++ = static_cast<U8>(run - 1);
+					break;
+				}
+				const size_t length = run < MAX_LONG_RUN ? run : MAX_LONG_RUN;
+				*encoded++ = LONG_ZERO_RUN;
+				*encoded++ = static_cast<U8>(length);
+				*encoded++ = static_cast<U8>(length >> 8);
+				run -= length;
+			}
+			position = zeros;
+
+			// A literal run ends at two zero bytes in a row, a single zero is cheaper to keep
+			size_t literals = position;
+			while (literals < size && literals - position < MAX_RUN
+				&& (byteXor(state, reference, literals) != 0
+					|| (literals + 1 < size && byteXor(state, reference, literals + 1) != 0)))
+			{
+				++literals;
+			}
+			if (literals > position)
+			{
+				*encoded++ = static_cast<U8>(0x80 | (literals - position - 1));
+				for (; position < literals; ++position)
+				{
+					*encoded++ = byteXor(state, reference, position);
+				}
+			}
+		}
+		out.resize(start + (encoded - begin));
+	}
+
+	// XORs the decoded bytes into state, which holds the reference or zeros
+	// False if the encoding does not cover exactly size bytes
+	[[nodiscard]] static bool Decode(const U8* encoded, const size_t encodedSize, U8* state, const size_t size)
+	{
+		const U8* const end = encoded + encodedSize;
+		size_t position = 0;
+		while (encoded < end)
+		{
+			const U8 token = *encoded++;
+			size_t length = (token & 0x7F) + 1u;
+			if (token == LONG_ZERO_RUN)
+			{
+				if (end - encoded < 2)
+				{
+					return false;
+				}
+				length = encoded[0] | encoded[1] << 8;
+				encoded += 2;
+			}
+			if (position + length > size)
+			{
+				return false;
+			}
+			if ((token & 0x80) != 0)
+			{
+				if (static_cast<size_t>(end - encoded) < length)
+				{
+					return false;
+				}
+				for (size_t i = 0; i < length; ++i)
+				{
+					state[position + i] ^= encoded[i];
+				}
+				encoded += length;
+			}
+			position += length;
+		}
+		return position == size;
+	}
+
+private:
+	static constexpr U8 LONG_ZERO_RUN = 0x7F;
+
+	[[nodiscard]] static U64 loadXor(const U8* state, const U8* reference, const size_t position)
+	{
+		U64 value;
+		std::memcpy(&value, state + position, sizeof(value));
+		if (reference != nullptr)
+		{
+			U64 previous;
+			std::memcpy(&previous, reference + position, sizeof(previous));
+			value ^= previous;
+		}
+		return value;
+	}
+
+	[[nodiscard]] static U8 byteXor(const U8* state, const U8* reference, const size_t position)
+	{
+		return reference == nullptr ? state[position] : state[position] ^ reference[position];
+	}
+};
+
+// The last snapshots of a CProcessor within a memory budget
+// Every KeyframeInterval-th snapshot is a keyframe, the others are stored as the delta to the
+// keyframe before them so stepping back decodes at most two snapshots, and the decoded keyframe
+// is kept for the steps after
+// The oldest keyframe is dropped together with its deltas when the budget is exceeded
+class CRewindBuffer
+{
+public:
+	static constexpr size_t DEFAULT_BUDGET = 8 << 20;
+	// One second of frames
+	static constexpr U32 DEFAULT_KEYFRAME_INTERVAL = 60;
+
+	explicit CRewindBuffer(const size_t budget = DEFAULT_BUDGET, const U32 keyframeInterval = DEFAULT_KEYFRAME_INTERVAL)
+		: m_Budget(budget), m_KeyframeInterval(keyframeInterval == 0 ? 1 : keyframeInterval)
+	{
+	}
+
+	void SetBudget(const size_t budget)
+	{
+		m_Budget = budget;
+		trim();
+	}
+
+	void Clear()
+	{
+		while (!m_Snapshots.empty())
+		{
+			dropOldest();
+		}
+	}
+
+	// Stores the current state of cpu as the newest snapshot
+	[[nodiscard]] ESaveStateError Push(const CProcessor& cpu)
+	{
+		const size_t size = cpu.GetSaveStateSize();
+		if (size != m_StateSize)
+		{
+			// Another cartridge, older snapshots can not be loaded any more
+			Clear();
+			m_StateSize = size;
+			m_State.resize(size);
+			m_Keyframe.resize(size);
+			m_KeyframeSequence = NO_SEQUENCE;
+		}
+		if (const ESaveStateError error = cpu.SaveState(m_State.data(), m_State.size()); error != ESaveStateError::None)
+		{
+			return error;
+		}
+
+		const bool keyframe = m_SinceKeyframe == 0;
+		SSnapshot snapshot;
+		if (!m_Free.empty())
+		{
+			snapshot.Data = std::move(m_Free.back());
+			m_Free.pop_back();
+			snapshot.Data.clear();
+		}
+		snapshot.Sequence = m_NextSequence++;
+		snapshot.Keyframe = keyframe;
+		if (keyframe)
+		{
+			CDeltaCodec::Encode(m_State.data(), nullptr, m_StateSize, snapshot.Data);
+			// The keyframe is what the next deltas are taken against
+			std::swap(m_State, m_Keyframe);
+			m_KeyframeSequence = snapshot.Sequence;
+		}
+		else
+		{
+			CDeltaCodec::Encode(m_State.data(), m_Keyframe.data(), m_StateSize, snapshot.Data);
+		}
+		m_SinceKeyframe = (m_SinceKeyframe + 1) % m_KeyframeInterval;
+		m_Usage += snapshot.Data.size();
+		m_Snapshots.push_back(std::move(snapshot));
+		trim();
+		return ESaveStateError::None;
+	}
+
+	// Loads the newest snapshot into cpu and removes it, false when there is none
+	bool StepBack(CProcessor& cpu)
+	{
+		if (m_Snapshots.empty())
+		{
+			return false;
+		}
+		size_t keyframe = m_Snapshots.size() - 1;
+		while (!m_Snapshots[keyframe].Keyframe)
+		{
+			--keyframe;
+		}
+		if (m_KeyframeSequence != m_Snapshots[keyframe].Sequence)
+		{
+			const std::vector<U8>& data = m_Snapshots[keyframe].Data;
+			std::fill(m_Keyframe.begin(), m_Keyframe.end(), U8{ 0 });
+			if (!CDeltaCodec::Decode(data.data(), data.size(), m_Keyframe.data(), m_StateSize))
+			{
+				return false;
+			}
+			m_KeyframeSequence = m_Snapshots[keyframe].Sequence;
+		}
+
+		const SSnapshot& newest = m_Snapshots.back();
+		m_State = m_Keyframe;
+		if (!newest.Keyframe && !CDeltaCodec::Decode(newest.Data.data(), newest.Data.size(), m_State.data(), m_StateSize))
+		{
+			return false;
+		}
+		if (cpu.LoadState(m_State.data(), m_State.size()) != ESaveStateError::None)
+		{
+			return false;
+		}
+
+		// The next push takes the place of the loaded snapshot in its group
+		m_SinceKeyframe = static_cast<U32>(m_Snapshots.size() - 1 - keyframe);
+		if (m_SinceKeyframe == 0)
+		{
+			m_KeyframeSequence = NO_SEQUENCE;
+		}
+		m_Usage -= newest.Data.size();
+		m_Free.push_back(std::move(m_Snapshots.back().Data));
+		m_Snapshots.pop_back();
+		return true;
+	}
+
+	[[nodiscard]] size_t GetCount() const
+	{
+		return m_Snapshots.size();
+	}
+
+	// Bytes held by the encoded snapshots
+	[[nodiscard]] size_t GetUsage() const
+	{
+		return m_Usage;
+	}
+
+private:
+	static constexpr U64 NO_SEQUENCE = ~0ull;
+
+	struct SSnapshot
+	{
+		std::vector<U8> Data;
+		U64 Sequence = 0;
+		bool Keyframe = false;
+	};
+
+	size_t m_Budget;
+	U32 m_KeyframeInterval;
+	std::deque<SSnapshot> m_Snapshots;
+	// Buffers of dropped snapshots, reused so pushing rarely allocates
+	std::vector<std::vector<U8>> m_Free;
+	size_t m_Usage = 0;
+	size_t m_StateSize = 0;
+	std::vector<U8> m_State;
+	// Decoded keyframe that m_KeyframeSequence names
+	std::vector<U8> m_Keyframe;
+	U64 m_KeyframeSequence = NO_SEQUENCE;
+	U64 m_NextSequence = 0;
+	// Snapshots pushed since the last keyframe
+	U32 m_SinceKeyframe = 0;
+
+	void trim()
+	{
+		while (m_Usage > m_Budget && !m_Snapshots.empty())
+		{
+			// A group goes as a whole, its deltas are useless without the keyframe
+			do
+			{
+				dropOldest();
+			} while (!m_Snapshots.empty() && !m_Snapshots.front().Keyframe);
+		}
+	}
+
+	void dropOldest()
+	{
+		SSnapshot& oldest = m_Snapshots.front();
+		if (oldest.Sequence == m_KeyframeSequence)
+		{
+			m_KeyframeSequence = NO_SEQUENCE;
+		}
+		m_Usage -= oldest.Data.size();
+		m_Free.push_back(std::move(oldest.Data));
+		m_Snapshots.pop_front();
+		if (m_Snapshots.empty())
+		{
+			m_SinceKeyframe = 0;
+		}
+	}
+};
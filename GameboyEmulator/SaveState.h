@@ -0,0 +1,98 @@
+#pragma once
+#include <array>
+#include "Apu.h"
+#include "Helpers.h"
+#include "Joypad.h"
+#include "MemoryBus.h"
+#include "Ppu.h"
+#include "Scheduler.h"
+#include "Timer.h"
+
+enum class ESaveStateError
+{
+	None,
+	BufferTooSmall,
+	BadHeader,
+	UnsupportedVersion,
+	CartridgeMismatch
+};
+
+[[nodiscard]] inline const char* GetErrorMessage(const ESaveStateError error)
+{
+	switch (error)
+	{
+	case ESaveStateError::None:
+		return "no error";
+	case ESaveStateError::BufferTooSmall:
+		return "buffer is smaller than the save state";
+	case ESaveStateError::BadHeader:
+		return "buffer does not hold a save state";
+	case ESaveStateError::UnsupportedVersion:
+		return "save state has an unsupported version";
+	case ESaveStateError::CartridgeMismatch:
+		return "save state was taken with a different cartridge";
+	default:
+		return "unknown error";
+	}
+}
+
+// Save states are an SSaveState followed by the cartridge RAM
+// Every field is at a fixed offset and written in host order, the emulator only builds
+// for little-endian hosts, VERSION changes whenever the layout does
+struct SSaveStateHeader
+{
+	static constexpr std::array<char, 4> MAGIC = { 'G', 'B', 'S', 'S' };
+	static constexpr U16 VERSION = 4;
+
+	std::array<char, 4> Magic = MAGIC;
+	U16 Version = VERSION;
+	U16 Padding = 0;
+	// Of the whole state including the cartridge RAM
+	U32 Size = 0;
+	U32 CartridgeRamSize = 0;
+};
+
+// Registers with F as the CPU would push it, so the state does not depend on GB_LAZY_FLAGS
+struct SCpuState
+{
+	U8 A = 0;
+	U8 F = 0;
+	U8 B = 0;
+	U8 C = 0;
+	U8 D = 0;
+	U8 E = 0;
+	U8 H = 0;
+	U8 L = 0;
+	U16 SP = 0;
+	U16 PC = 0;
+	U8 Ime = 0;
+	U8 ImeScheduled = 0;
+	// ECpuMode
+	U8 Mode = 0;
+	U8 Padding = 0;
+	U64 Cycles = 0;
+};
+
+struct SSaveState
+{
+	SSaveStateHeader Header;
+	SCpuState Cpu;
+	CMemoryBus::SState Bus;
+	CTimer::SState Timer;
+	CPpu::SState Ppu;
+	CApu::SState Apu;
+	CJoypad::SState Joypad;
+	CScheduler::SState Scheduler;
+};
+
+// No implicit padding, every byte of a state is written so equal states compare equal byte for byte
+static_assert(sizeof(SSaveStateHeader) == 16, "Save state layout changed, update VERSION");
+static_assert(sizeof(SCpuState) == 24, "Save state layout changed, update VERSION");
+static_assert(sizeof(CMemoryBus::SState) == 16816, "Save state layout changed, update VERSION");
+static_assert(sizeof(CTimer::SState) == 24, "Save state layout changed, update VERSION");
+static_assert(sizeof(CPpu::SState) == 24, "Save state layout changed, update VERSION");
+static_assert(sizeof(CApu::SChannel) == 24, "Save state layout changed, update VERSION");
+static_assert(sizeof(CApu::SState) == 48 + 24 * CApu::CHANNEL_COUNT + 24, "Save state layout changed, update VERSION");
+static_assert(sizeof(CJoypad::SState) == 8, "Save state layout changed, update VERSION");
+static_assert(sizeof(CScheduler::SState) == 8 * CScheduler::EVENT_COUNT, "Save state layout changed, update VERSION");
+static_assert(sizeof(SSaveState) == 16 + 24 + 16816 + 24 + 24 + sizeof(CApu::SState) + 8 + 8 * CScheduler::EVENT_COUNT, "Save state layout changed, update VERSION");
@@ -0,0 +1,248 @@
+#pragma once
+#include <array>
+#include <limits>
+#include "Helpers.h"
+
+// Things that happen at a known clock cycle
+enum class EEvent : U8
+{
+	TimerOverflow,
+	// The PPU moves to its next mode or line
+	Ppu,
+	// The APU frame sequencer steps and a batch of samples ends
+	ApuSequencer,
+	Count
+};
+
+[[nodiscard]] inline const char* GetEventName(const EEvent event)
+{
+	switch (event)
+	{
+	case EEvent::TimerOverflow:
+		return "timer overflow";
+	case EEvent::Ppu:
+		return "ppu mode";
+	case EEvent::ApuSequencer:
+		return "apu sequencer";
+	default:
+		return "unknown";
+	}
+}
+
+// Min-heap of pending events ordered by timestamp, each event is pending at most once
+// Components schedule their next interesting cycle and are otherwise only caught up when
+// their registers are accessed, so the CPU loop only compares against GetNextTimestamp
+class CScheduler
+{
+public:
+	using Callback = void (*)(void* context, U64 timestamp);
+
+	static constexpr U64 NEVER = std::numeric_limits<U64>::max();
+	static constexpr size_t EVENT_COUNT = static_cast<size_t>(EEvent::Count);
+
+	// Timestamp of every event, NEVER if it is not pending
+	// Part of the save state format
+	struct SState
+	{
+		std::array<U64, EVENT_COUNT> Timestamps{};
+	};
+
+	void SetCallback(const EEvent event, const Callback callback, void* context)
+	{
+		m_Callbacks[static_cast<size_t>(event)] = { callback, context };
+	}
+
+	// Replaces the timestamp if the event is already pending
+	void Schedule(const EEvent event, const U64 timestamp)
+	{
+		U8 position = m_Positions[static_cast<size_t>(event)];
+		if (position == NOT_SCHEDULED)
+		{
+			position = m_Count++;
+			m_Heap[position] = { timestamp, event };
+			m_Positions[static_cast<size_t>(event)] = position;
+			siftUp(position);
+		}
+		else
+		{
+			const U64 previous = m_Heap[position].Timestamp;
+			m_Heap[position].Timestamp = timestamp;
+			if (timestamp < previous)
+			{
+				siftUp(position);
+			}
+			else
+			{
+				siftDown(position);
+			}
+		}
+		updateNext();
+	}
+
+	void Cancel(const EEvent event)
+	{
+		const U8 position = m_Positions[static_cast<size_t>(event)];
+		if (position == NOT_SCHEDULED)
+		{
+			return;
+		}
+		removeAt(position);
+		updateNext();
+	}
+
+	[[nodiscard]] bool IsScheduled(const EEvent event) const
+	{
+		return m_Positions[static_cast<size_t>(event)] != NOT_SCHEDULED;
+	}
+
+	[[nodiscard]] U64 GetTimestamp(const EEvent event) const
+	{
+		const U8 position = m_Positions[static_cast<size_t>(event)];
+		return position == NOT_SCHEDULED ? NEVER : m_Heap[position].Timestamp;
+	}
+
+	[[nodiscard]] U64 GetNextTimestamp() const
+	{
+		return m_NextTimestamp;
+	}
+
+	// Number of times the event fired
+	[[nodiscard]] U64 GetFiredCount(const EEvent event) const
+	{
+		return m_Fired[static_cast<size_t>(event)];
+	}
+
+	void SaveState(SState& state) const
+	{
+		for (size_t event = 0; event < EVENT_COUNT; ++event)
+		{
+			state.Timestamps[event] = GetTimestamp(static_cast<EEvent>(event));
+		}
+	}
+
+	void LoadState(const SState& state)
+	{
+		for (size_t event = 0; event < EVENT_COUNT; ++event)
+		{
+			if (state.Timestamps[event] == NEVER)
+			{
+				Cancel(static_cast<EEvent>(event));
+			}
+			else
+			{
+				Schedule(static_cast<EEvent>(event), state.Timestamps[event]);
+			}
+		}
+	}
+
+	// Fires every event due at or before now in timestamp order
+	// Callbacks get the timestamp the event was scheduled for and may schedule again
+	void RunUntil(const U64 now)
+	{
+		while (m_NextTimestamp <= now)
+		{
+			const SEntry entry = m_Heap[0];
+			removeAt(0);
+			updateNext();
+			++m_Fired[static_cast<size_t>(entry.Event)];
+			const SCallback& callback = m_Callbacks[static_cast<size_t>(entry.Event)];
+			callback.Function(callback.Context, entry.Timestamp);
+		}
+	}
+
+private:
+	static constexpr U8 NOT_SCHEDULED = 0xFF;
+
+	struct SEntry
+	{
+		U64 Timestamp;
+		EEvent Event;
+	};
+
+	struct SCallback
+	{
+		Callback Function = nullptr;
+		void* Context = nullptr;
+	};
+
+	std::array<SEntry, EVENT_COUNT> m_Heap{};
+	std::array<U8, EVENT_COUNT> m_Positions = makeNotScheduled();
+	std::array<SCallback, EVENT_COUNT> m_Callbacks{};
+	std::array<U64, EVENT_COUNT> m_Fired{};
+	U8 m_Count = 0;
+	U64 m_NextTimestamp = NEVER;
+
+	static constexpr std::array<U8, EVENT_COUNT> makeNotScheduled()
+	{
+		std::array<U8, EVENT_COUNT> positions{};
+		for (U8& position : positions)
+		{
+			position = NOT_SCHEDULED;
+		}
+		return positions;
+	}
+
+	void updateNext()
+	{
+		m_NextTimestamp = m_Count == 0 ? NEVER : m_Heap[0].Timestamp;
+	}
+
+	void removeAt(const U8 position)
+	{
+		m_Positions[static_cast<size_t>(m_Heap[position].Event)] = NOT_SCHEDULED;
+		--m_Count;
+		if (position == m_Count)
+		{
+			return;
+		}
+		place(position, m_Heap[m_Count]);
+		siftUp(position);
+		siftDown(m_Positions[static_cast<size_t>(m_Heap[position].Event)]);
+	}
+
+	void place(const U8 position, const SEntry& entry)
+	{
+		m_Heap[position] = entry;
+		m_Positions[static_cast<size_t>(entry.Event)] = position;
+	}
+
+	void siftUp(U8 position)
+	{
+		const SEntry entry = m_Heap[position];
+		while (position > 0)
+		{
+			const U8 parent = (position - 1) / 2;
+			if (m_Heap[parent].Timestamp <= entry.Timestamp)
+			{
+				break;
+			}
+			place(position, m_Heap[parent]);
+			position = parent;
+		}
+		place(position, entry);
+	}
+
+	void siftDown(U8 position)
+	{
+		const SEntry entry = m_Heap[position];
+		while (true)
+		{
+			U8 child = position * 2 + 1;
+			if (child >= m_Count)
+			{
+				break;
+			}
+			if (child + 1 < m_Count && m_Heap[child + 1].Timestamp < m_Heap[child].Timestamp)
+			{
+				++child;
+			}
+			if (entry.Timestamp <= m_Heap[child].Timestamp)
+			{
+				break;
+			}
+			place(position, m_Heap[child]);
+			position = child;
+		}
+		place(position, entry);
+	}
+};
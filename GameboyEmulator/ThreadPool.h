@@ -0,0 +1,148 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Helpers.h"
+
+// Fixed set of threads that run the items of ParallelFor
+// Every worker starts on its own contiguous share of the items and takes them one at a time,
+// a worker whose share is used up steals from the shares of the others, so items that take
+// longer on one thread are picked up by the threads that are done instead of waiting for it
+// The calling thread is worker 0, a pool of n threads starts n - 1 of its own
+class CThreadPool
+{
+public:
+	using Body = std::function<void(size_t item, U32 worker)>;
+
+	explicit CThreadPool(const U32 threads = std::max(1u, std::thread::hardware_concurrency()))
+		: m_ThreadCount(std::max(1u, threads)), m_Shares(std::make_unique<SShare[]>(m_ThreadCount))
+	{
+		for (U32 worker = 1; worker < m_ThreadCount; ++worker)
+		{
+			m_Threads.emplace_back([this, worker] { run(worker); });
+		}
+	}
+
+	~CThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			m_Stopping = true;
+		}
+		m_Start.notify_all();
+		for (std::thread& thread : m_Threads)
+		{
+			thread.join();
+		}
+	}
+
+	CThreadPool(const CThreadPool&) = delete;
+	CThreadPool& operator=(const CThreadPool&) = delete;
+
+	[[nodiscard]] U32 GetThreadCount() const
+	{
+		return m_ThreadCount;
+	}
+
+	// Calls body for every item in [0, count) and returns when all calls returned
+	// The worker index is below GetThreadCount and lets the body use per-thread scratch space
+	void ParallelFor(const size_t count, const Body& body)
+	{
+		if (count == 0)
+		{
+			return;
+		}
+		for (U32 worker = 0; worker < m_ThreadCount; ++worker)
+		{
+			m_Shares[worker].Next.store(count * worker / m_ThreadCount, std::memory_order_relaxed);
+			m_Shares[worker].End = count * (worker + 1) / m_ThreadCount;
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			m_Body = &body;
+			m_Running = m_ThreadCount - 1;
+			++m_Job;
+		}
+		m_Start.notify_all();
+		work(0);
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		m_Done.wait(lock, [this] { return m_Running == 0; });
+		m_Body = nullptr;
+	}
+
+	// Items run by another worker than the one whose share they were in
+	[[nodiscard]] U64 GetStolen() const
+	{
+		return m_Stolen.load(std::memory_order_relaxed);
+	}
+
+private:
+	// Items are taken from the front, Next may run past End when it is empty
+	struct alignas(64) SShare
+	{
+		std::atomic<size_t> Next{ 0 };
+		size_t End = 0;
+	};
+
+	U32 m_ThreadCount;
+	std::unique_ptr<SShare[]> m_Shares;
+	std::vector<std::thread> m_Threads;
+	std::mutex m_Mutex;
+	std::condition_variable m_Start;
+	std::condition_variable m_Done;
+	const Body* m_Body = nullptr;
+	// Counts the ParallelFor calls, a worker runs each one once
+	U64 m_Job = 0;
+	// Own threads still working on the current job
+	U32 m_Running = 0;
+	bool m_Stopping = false;
+	std::atomic<U64> m_Stolen{ 0 };
+
+	void run(const U32 worker)
+	{
+		U64 job = 0;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_Mutex);
+				m_Start.wait(lock, [this, job] { return m_Stopping || m_Job != job; });
+				if (m_Stopping)
+				{
+					return;
+				}
+				job = m_Job;
+			}
+			work(worker);
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			if (--m_Running == 0)
+			{
+				m_Done.notify_one();
+			}
+		}
+	}
+
+	void work(const U32 worker)
+	{
+		const Body& body = *m_Body;
+		U64 stolen = 0;
+		for (U32 offset = 0; offset < m_ThreadCount; ++offset)
+		{
+			SShare& share = m_Shares[(worker + offset) % m_ThreadCount];
+			for (size_t item = share.Next.fetch_add(1, std::memory_order_relaxed); item < share.End;
+				item = share.Next.fetch_add(1, std::memory_order_relaxed))
+			{
+				body(item, worker);
+				stolen += offset != 0;
+			}
+		}
+		if (stolen != 0)
+		{
+			m_Stolen.fetch_add(stolen, std::memory_order_relaxed);
+		}
+	}
+};
@@ -0,0 +1,167 @@
+#pragma once
+#include <array>
+#include "Helpers.h"
+#include "MemoryBus.h"
+#include "Scheduler.h"
+
+// DIV, TIMA, TMA and TAC
+// Nothing is ticked per cycle, DIV is derived from the clock and TIMA is caught up
+// when it is accessed, an overflow event is scheduled for the cycle TIMA wraps
+class CTimer : public IIoDevice
+{
+public:
+	static constexpr U16 DIV_ADDRESS = 0xFF04;
+	static constexpr U16 TIMA_ADDRESS = 0xFF05;
+	static constexpr U16 TMA_ADDRESS = 0xFF06;
+	static constexpr U16 TAC_ADDRESS = 0xFF07;
+
+	// Cycles per TIMA increment by the TAC clock select bits
+	static constexpr U32 TIMA_PERIODS[4] = { 1024, 16, 64, 256 };
+
+	// Part of the save state format
+	struct SState
+	{
+		U64 DivOrigin = 0;
+		U64 TimaSync = 0;
+		U8 Tima = 0;
+		U8 Tma = 0;
+		U8 Tac = 0;
+		std::array<U8, 5> Padding{};
+	};
+
+	CTimer(CScheduler& scheduler, CMemoryBus& bus, const U64& clock)
+		: m_Scheduler(scheduler), m_Bus(bus), m_Clock(clock)
+	{
+		m_Scheduler.SetCallback(EEvent::TimerOverflow, &CTimer::onOverflow, this);
+	}
+
+	U8 ReadIo(const U16 address) override
+	{
+		switch (address)
+		{
+		case DIV_ADDRESS:
+			return static_cast<U8>(getCounter(m_Clock) >> 8);
+		case TIMA_ADDRESS:
+			catchUp(m_Clock);
+			return m_Tima;
+		case TMA_ADDRESS:
+			return m_Tma;
+		default:
+			return m_Tac | 0xF8;
+		}
+	}
+
+	void WriteIo(const U16 address, const U8 value) override
+	{
+		catchUp(m_Clock);
+		switch (address)
+		{
+		case DIV_ADDRESS:
+			// Any write resets the counter
+			m_DivOrigin = m_Clock;
+			break;
+		case TIMA_ADDRESS:
+			m_Tima = value;
+			break;
+		case TMA_ADDRESS:
+			m_Tma = value;
+			break;
+		default:
+			m_Tac = value & 0b111;
+			break;
+		}
+		scheduleOverflow();
+	}
+
+	void SaveState(SState& state) const
+	{
+		state.DivOrigin = m_DivOrigin;
+		state.TimaSync = m_TimaSync;
+		state.Tima = m_Tima;
+		state.Tma = m_Tma;
+		state.Tac = m_Tac;
+	}
+
+	// The overflow event is restored with the scheduler
+	void LoadState(const SState& state)
+	{
+		m_DivOrigin = state.DivOrigin;
+		m_TimaSync = state.TimaSync;
+		m_Tima = state.Tima;
+		m_Tma = state.Tma;
+		m_Tac = state.Tac;
+	}
+
+private:
+	CScheduler& m_Scheduler;
+	CMemoryBus& m_Bus;
+	const U64& m_Clock;
+
+	// DIV is the upper byte of a counter that started at m_DivOrigin
+	U64 m_DivOrigin = 0;
+	// TIMA is up to date as of m_TimaSync
+	U64 m_TimaSync = 0;
+	U8 m_Tima = 0;
+	U8 m_Tma = 0;
+	U8 m_Tac = 0;
+
+	[[nodiscard]] bool isEnabled() const
+	{
+		return (m_Tac & 0b100) != 0;
+	}
+
+	[[nodiscard]] U32 getPeriod() const
+	{
+		return TIMA_PERIODS[m_Tac & 0b11];
+	}
+
+	[[nodiscard]] U64 getCounter(const U64 timestamp) const
+	{
+		return timestamp - m_DivOrigin;
+	}
+
+	// TIMA increments when the counter crosses a multiple of the period
+	[[nodiscard]] U64 getTicks(const U64 timestamp) const
+	{
+		return getCounter(timestamp) / getPeriod();
+	}
+
+	void catchUp(const U64 now)
+	{
+		if (isEnabled())
+		{
+			U64 ticks = getTicks(now) - getTicks(m_TimaSync);
+			while (ticks > 0)
+			{
+				const U32 untilOverflow = 0x100 - m_Tima;
+				if (ticks < untilOverflow)
+				{
+					m_Tima += static_cast<U8>(ticks);
+					break;
+				}
+				ticks -= untilOverflow;
+				m_Tima = m_Tma;
+				m_Bus.RequestInterrupt(EInterrupt::Timer);
+			}
+		}
+		m_TimaSync = now;
+	}
+
+	void scheduleOverflow()
+	{
+		if (!isEnabled())
+		{
+			m_Scheduler.Cancel(EEvent::TimerOverflow);
+			return;
+		}
+		const U64 overflowTick = getTicks(m_TimaSync) + (0x100 - m_Tima);
+		m_Scheduler.Schedule(EEvent::TimerOverflow, m_DivOrigin + overflowTick * getPeriod());
+	}
+
+	static void onOverflow(void* context, const U64 timestamp)
+	{
+		CTimer& timer = *static_cast<CTimer*>(context);
+		timer.catchUp(timestamp);
+		timer.scheduleOverflow();
+	}
+};
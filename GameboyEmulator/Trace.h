@@ -0,0 +1,450 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Helpers.h"
+
+enum class ETraceError
+{
+	None,
+	OpenFailed,
+	WriteFailed,
+	BadHeader,
+	Truncated
+};
+
+[[nodiscard]] inline const char* GetErrorMessage(const ETraceError error)
+{
+	switch (error)
+	{
+	case ETraceError::None:
+		return "no error";
+	case ETraceError::OpenFailed:
+		return "could not open the file";
+	case ETraceError::WriteFailed:
+		return "could not write the file";
+	case ETraceError::BadHeader:
+		return "file is not a trace or has an unsupported version";
+	case ETraceError::Truncated:
+		return "file ends in the middle of a record";
+	default:
+		return "unknown error";
+	}
+}
+
+// CPU state before an instruction runs, the fields of the reference logs plus the clock
+// Memory holds the four bytes at PC
+struct STraceRecord
+{
+	U8 A = 0;
+	U8 F = 0;
+	U8 B = 0;
+	U8 C = 0;
+	U8 D = 0;
+	U8 E = 0;
+	U8 H = 0;
+	U8 L = 0;
+	U16 SP = 0;
+	U16 PC = 0;
+	std::array<U8, 4> Memory{};
+	U64 Cycles = 0;
+};
+
+static_assert(sizeof(STraceRecord) == 24, "The trace file layout depends on the record size");
+
+// What Record does when the writer thread falls behind
+enum class ETraceOverflow
+{
+	// Emulation waits for the writer, the trace is complete
+	Wait,
+	// The record is counted in GetDropped and thrown away
+	Drop
+};
+
+// Single producer, single consumer ring of trace records
+// Each side only writes its own index so no locks are needed
+class CTraceRing
+{
+public:
+	// Capacity is rounded up to a power of two
+	explicit CTraceRing(const size_t capacity)
+	{
+		size_t size = 1;
+		while (size < capacity)
+		{
+			size <<= 1;
+		}
+		m_Records.resize(size);
+		m_Mask = size - 1;
+	}
+
+	[[nodiscard]] bool TryPush(const STraceRecord& record)
+	{
+		const size_t head = m_Head.load(std::memory_order_relaxed);
+		if (head - m_CachedTail > m_Mask)
+		{
+			m_CachedTail = m_Tail.load(std::memory_order_acquire);
+			if (head - m_CachedTail > m_Mask)
+			{
+				return false;
+			}
+		}
+		m_Records[head & m_Mask] = record;
+		m_Head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Moves up to count records to records, returns how many were moved
+	size_t Pop(STraceRecord* records, const size_t count)
+	{
+		const size_t tail = m_Tail.load(std::memory_order_relaxed);
+		const size_t available = m_Head.load(std::memory_order_acquire) - tail;
+		const size_t popped = available < count ? available : count;
+		for (size_t i = 0; i < popped; ++i)
+		{
+			records[i] = m_Records[(tail + i) & m_Mask];
+		}
+		m_Tail.store(tail + popped, std::memory_order_release);
+		return popped;
+	}
+
+	[[nodiscard]] size_t GetCapacity() const
+	{
+		return m_Mask + 1;
+	}
+
+private:
+	std::vector<STraceRecord> m_Records;
+	size_t m_Mask = 0;
+	// On separate cache lines so the two threads do not share one
+	// The producer keeps its own copy of the tail and only reloads it when the ring looks full
+	alignas(64) std::atomic<size_t> m_Head{ 0 };
+	size_t m_CachedTail = 0;
+	alignas(64) std::atomic<size_t> m_Tail{ 0 };
+};
+
+// Trace files start with a header, then hold one encoded record after another
+// A record is stored as a 3 byte mask followed by the bytes the mask selects
+// The bytes are the record XORed with the previous one, with Cycles replaced by the
+// cycles since the previous record, so a typical instruction takes 8 to 12 bytes instead of 24
+class CTraceCodec
+{
+public:
+	static constexpr char MAGIC[4] = { 'G', 'B', 'T', 'R' };
+	static constexpr U16 VERSION = 1;
+	static constexpr size_t HEADER_SIZE = 8;
+	static constexpr size_t MASK_SIZE = 3;
+	static constexpr size_t MAX_ENCODED_SIZE = MASK_SIZE + sizeof(STraceRecord);
+
+	static void WriteHeader(U8* header)
+	{
+		std::memcpy(header, MAGIC, sizeof(MAGIC));
+		header[4] = static_cast<U8>(VERSION);
+		header[5] = static_cast<U8>(VERSION >> 8);
+		header[6] = static_cast<U8>(sizeof(STraceRecord));
+		header[7] = 0;
+	}
+
+	[[nodiscard]] static bool CheckHeader(const U8* header)
+	{
+		return std::memcmp(header, MAGIC, sizeof(MAGIC)) == 0 && (header[4] | header[5] << 8) == VERSION
+			&& header[6] == sizeof(STraceRecord);
+	}
+
+	// Returns the number of bytes written to out, at most MAX_ENCODED_SIZE
+	size_t Encode(const STraceRecord& record, U8* out)
+	{
+		STraceRecord delta = record;
+		delta.Cycles -= m_PreviousCycles;
+		m_PreviousCycles = record.Cycles;
+		std::array<U8, sizeof(STraceRecord)> bytes;
+		std::memcpy(bytes.data(), &delta, sizeof(delta));
+
+		U32 mask = 0;
+		size_t size = MASK_SIZE;
+		for (U32 i = 0; i < bytes.size(); ++i)
+		{
+			const U8 changed = bytes[i] ^ m_Previous[i];
+			if (changed != 0)
+			{
+				mask |= 1u << i;
+				out[size++] = changed;
+			}
+		}
+		out[0] = static_cast<U8>(mask);
+		out[1] = static_cast<U8>(mask >> 8);
+		out[2] = static_cast<U8>(mask >> 16);
+		m_Previous = bytes;
+		return size;
+	}
+
+	// Size of the record starting with mask
+	[[nodiscard]] static size_t GetEncodedSize(const U8* mask)
+	{
+		const U32 bits = mask[0] | mask[1] << 8 | mask[2] << 16;
+		size_t size = MASK_SIZE;
+		for (U32 i = 0; i < sizeof(STraceRecord); ++i)
+		{
+			size += (bits >> i) & 1;
+		}
+		return size;
+	}
+
+	// in must hold GetEncodedSize bytes
+	void Decode(const U8* in, STraceRecord& record)
+	{
+		const U32 mask = in[0] | in[1] << 8 | in[2] << 16;
+		size_t position = MASK_SIZE;
+		for (U32 i = 0; i < sizeof(STraceRecord); ++i)
+		{
+			if ((mask >> i) & 1)
+			{
+				m_Previous[i] ^= in[position++];
+			}
+		}
+		std::memcpy(&record, m_Previous.data(), sizeof(record));
+		record.Cycles += m_PreviousCycles;
+		m_PreviousCycles = record.Cycles;
+	}
+
+private:
+	// The previous record with Cycles as a delta
+	std::array<U8, sizeof(STraceRecord)> m_Previous{};
+	U64 m_PreviousCycles = 0;
+};
+
+// Records into a ring that a background thread drains to a file
+// Record never allocates, with ETraceOverflow::Wait it spins until the writer makes room
+class CTraceRecorder
+{
+public:
+	static constexpr size_t DEFAULT_CAPACITY = 1 << 16;
+
+	CTraceRecorder() = default;
+
+	~CTraceRecorder()
+	{
+		Close();
+	}
+
+	CTraceRecorder(const CTraceRecorder&) = delete;
+	CTraceRecorder& operator=(const CTraceRecorder&) = delete;
+
+	[[nodiscard]] ETraceError Open(const std::string& path, const ETraceOverflow overflow = ETraceOverflow::Wait,
+		const size_t capacity = DEFAULT_CAPACITY)
+	{
+		Close();
+		m_File = std::fopen(path.c_str(), "wb");
+		if (m_File == nullptr)
+		{
+			return ETraceError::OpenFailed;
+		}
+		std::array<U8, CTraceCodec::HEADER_SIZE> header;
+		CTraceCodec::WriteHeader(header.data());
+		m_Error = std::fwrite(header.data(), header.size(), 1, m_File) == 1 ? ETraceError::None : ETraceError::WriteFailed;
+
+		m_Ring = std::make_unique<CTraceRing>(capacity);
+		m_Overflow = overflow;
+		m_Recorded = 0;
+		m_Dropped = 0;
+		m_Stop.store(false, std::memory_order_relaxed);
+		m_Writer = std::thread([this] { write(); });
+		return m_Error;
+	}
+
+	// Waits until every record is written, returns the first write error
+	ETraceError Close()
+	{
+		if (m_File == nullptr)
+		{
+			return m_Error;
+		}
+		m_Stop.store(true, std::memory_order_release);
+		m_Writer.join();
+		if (std::fclose(m_File) != 0 && m_Error == ETraceError::None)
+		{
+			m_Error = ETraceError::WriteFailed;
+		}
+		m_File = nullptr;
+		m_Ring.reset();
+		return m_Error;
+	}
+
+	[[nodiscard]] bool IsOpen() const
+	{
+		return m_File != nullptr;
+	}
+
+	void Record(const STraceRecord& record)
+	{
+		while (!m_Ring->TryPush(record))
+		{
+			if (m_Overflow == ETraceOverflow::Drop)
+			{
+				++m_Dropped;
+				return;
+			}
+			std::this_thread::yield();
+		}
+		++m_Recorded;
+	}
+
+	[[nodiscard]] U64 GetRecorded() const
+	{
+		return m_Recorded;
+	}
+
+	[[nodiscard]] U64 GetDropped() const
+	{
+		return m_Dropped;
+	}
+
+private:
+	static constexpr size_t BATCH_SIZE = 1024;
+
+	std::FILE* m_File = nullptr;
+	std::unique_ptr<CTraceRing> m_Ring;
+	std::thread m_Writer;
+	std::atomic<bool> m_Stop{ false };
+	ETraceOverflow m_Overflow = ETraceOverflow::Wait;
+	// Written by the writer thread, read after it is joined
+	ETraceError m_Error = ETraceError::None;
+	U64 m_Recorded = 0;
+	U64 m_Dropped = 0;
+
+	// Runs on the writer thread
+	void write()
+	{
+		CTraceCodec codec;
+		std::vector<STraceRecord> records(BATCH_SIZE);
+		std::vector<U8> buffer(BATCH_SIZE * CTraceCodec::MAX_ENCODED_SIZE);
+		while (true)
+		{
+			// Read before popping, records pushed before Close are seen by the last pop
+			const bool stop = m_Stop.load(std::memory_order_acquire);
+			const size_t count = m_Ring->Pop(records.data(), records.size());
+			if (count == 0)
+			{
+				if (stop)
+				{
+					return;
+				}
+				std::this_thread::sleep_for(std::chrono::microseconds(200));
+				continue;
+			}
+
+			size_t size = 0;
+			for (size_t i = 0; i < count; ++i)
+			{
+				size += codec.Encode(records[i], buffer.data() + size);
+			}
+			if (m_Error == ETraceError::None && std::fwrite(buffer.data(), size, 1, m_File) != 1)
+			{
+				m_Error = ETraceError::WriteFailed;
+			}
+		}
+	}
+};
+
+// Reads the records of a trace file in order
+class CTraceReader
+{
+public:
+	CTraceReader() = default;
+
+	~CTraceReader()
+	{
+		if (m_File != nullptr)
+		{
+			std::fclose(m_File);
+		}
+	}
+
+	CTraceReader(const CTraceReader&) = delete;
+	CTraceReader& operator=(const CTraceReader&) = delete;
+
+	[[nodiscard]] ETraceError Open(const std::string& path)
+	{
+		m_File = std::fopen(path.c_str(), "rb");
+		if (m_File == nullptr)
+		{
+			return ETraceError::OpenFailed;
+		}
+		std::array<U8, CTraceCodec::HEADER_SIZE> header;
+		if (std::fread(header.data(), header.size(), 1, m_File) != 1 || !CTraceCodec::CheckHeader(header.data()))
+		{
+			return ETraceError::BadHeader;
+		}
+		return ETraceError::None;
+	}
+
+	// False at the end of the file or on an error, see GetError
+	[[nodiscard]] bool Next(STraceRecord& record)
+	{
+		std::array<U8, CTraceCodec::MAX_ENCODED_SIZE> encoded;
+		const size_t read = std::fread(encoded.data(), 1, CTraceCodec::MASK_SIZE, m_File);
+		if (read != CTraceCodec::MASK_SIZE)
+		{
+			m_Error = read == 0 ? ETraceError::None : ETraceError::Truncated;
+			return false;
+		}
+		const size_t rest = CTraceCodec::GetEncodedSize(encoded.data()) - CTraceCodec::MASK_SIZE;
+		if (std::fread(encoded.data() + CTraceCodec::MASK_SIZE, 1, rest, m_File) != rest)
+		{
+			m_Error = ETraceError::Truncated;
+			return false;
+		}
+		m_Codec.Decode(encoded.data(), record);
+		return true;
+	}
+
+	[[nodiscard]] ETraceError GetError() const
+	{
+		return m_Error;
+	}
+
+private:
+	std::FILE* m_File = nullptr;
+	CTraceCodec m_Codec;
+	ETraceError m_Error = ETraceError::None;
+};
+
+// One line in the format of the common reference CPU logs, without a newline
+// A:01 F:B0 B:00 C:13 D:00 E:D8 H:01 L:4D SP:FFFE PC:0100 PCMEM:00,C3,13,02
+inline size_t FormatTraceRecord(const STraceRecord& record, char* line, const size_t size)
+{
+	const int length = std::snprintf(line, size,
+		"A:%02X F:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X SP:%04X PC:%04X PCMEM:%02X,%02X,%02X,%02X",
+		record.A, record.F, record.B, record.C, record.D, record.E, record.H, record.L, record.SP, record.PC,
+		record.Memory[0], record.Memory[1], record.Memory[2], record.Memory[3]);
+	return length < 0 ? 0 : std::min(static_cast<size_t>(length), size - 1);
+}
+
+// Writes a trace file as a text log, one line per record
+[[nodiscard]] inline ETraceError ConvertTraceToText(const std::string& path, std::FILE* output)
+{
+	CTraceReader reader;
+	if (const ETraceError error = reader.Open(path); error != ETraceError::None)
+	{
+		return error;
+	}
+	STraceRecord record;
+	char line[96];
+	while (reader.Next(record))
+	{
+		const size_t length = FormatTraceRecord(record, line, sizeof(line) - 1);
+		line[length] = '\n';
+		if (std::fwrite(line, length + 1, 1, output) != 1)
+		{
+			return ETraceError::WriteFailed;
+		}
+	}
+	return reader.GetError();
+}
@@ -0,0 +1,203 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../GameboyEmulator/Helpers.h"
+
+// What one call of a benchmark did, Cycles is 0 for code that does not emulate the clock
+struct SWork
+{
+	U64 Operations = 0;
+	U64 Cycles = 0;
+};
+
+using BenchmarkFunction = std::function<SWork()>;
+
+enum class EOutputFormat
+{
+	Table,
+	Json,
+	Csv
+};
+
+struct SBenchmarkOptions
+{
+	// Untimed calls before the repetitions, also generate tables and fault pages in
+	int WarmUp = 1;
+	int Repetitions = 10;
+	// Only benchmarks whose name contains this run
+	std::string Filter;
+	EOutputFormat Format = EOutputFormat::Table;
+};
+
+// Per operation times over all repetitions of a benchmark
+struct SBenchmarkResult
+{
+	std::string Name;
+	int Repetitions = 0;
+	// Per repetition
+	U64 Operations = 0;
+	U64 Cycles = 0;
+	double MeanNs = 0;
+	double StdDevNs = 0;
+	double MinNs = 0;
+	double MaxNs = 0;
+
+	[[nodiscard]] double OperationsPerSecond() const
+	{
+		return MeanNs > 0 ? 1e9 / MeanNs : 0;
+	}
+
+	// Emulated clock cycles per wall clock microsecond
+	[[nodiscard]] double EmulatedMhz() const
+	{
+		return MeanNs > 0 && Operations > 0 ? static_cast<double>(Cycles) / (MeanNs * static_cast<double>(Operations)) * 1e3 : 0;
+	}
+
+	// Standard deviation relative to the mean in percent
+	[[nodiscard]] double Variation() const
+	{
+		return MeanNs > 0 ? StdDevNs / MeanNs * 100 : 0;
+	}
+};
+
+// Keeps results of benchmarked code alive without the compiler seeing through it
+inline void DoNotOptimize(const U64 value)
+{
+	static volatile U64 sink;
+	sink = sink + value;
+}
+
+// Named benchmarks run in the order they were added
+// Names are "group/name/variant" so a filter can pick a group
+class CBenchmarkRunner
+{
+public:
+	void Add(std::string name, BenchmarkFunction function)
+	{
+		m_Benchmarks.push_back({ std::move(name), std::move(function) });
+	}
+
+	[[nodiscard]] std::vector<SBenchmarkResult> Run(const SBenchmarkOptions& options) const
+	{
+		using Clock = std::chrono::steady_clock;
+		std::vector<SBenchmarkResult> results;
+		for (const SBenchmark& benchmark : m_Benchmarks)
+		{
+			if (benchmark.Name.find(options.Filter) == std::string::npos)
+			{
+				continue;
+			}
+			for (int i = 0; i < options.WarmUp; ++i)
+			{
+				benchmark.Function();
+			}
+
+			SBenchmarkResult result;
+			result.Name = benchmark.Name;
+			result.Repetitions = std::max(options.Repetitions, 1);
+			std::vector<double> times;
+			for (int i = 0; i < result.Repetitions; ++i)
+			{
+				const auto start = Clock::now();
+				const SWork work = benchmark.Function();
+				const std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+				result.Operations = work.Operations;
+				result.Cycles = work.Cycles;
+				times.push_back(elapsed.count() / static_cast<double>(std::max<U64>(work.Operations, 1)));
+			}
+
+			double sum = 0;
+			for (const double time : times)
+			{
+				sum += time;
+			}
+			result.MeanNs = sum / times.size();
+			double squares = 0;
+			for (const double time : times)
+			{
+				squares += (time - result.MeanNs) * (time - result.MeanNs);
+			}
+			result.StdDevNs = times.size() > 1 ? std::sqrt(squares / (times.size() - 1)) : 0;
+			result.MinNs = *std::min_element(times.begin(), times.end());
+			result.MaxNs = *std::max_element(times.begin(), times.end());
+			results.push_back(result);
+
+			if (options.Format == EOutputFormat::Table)
+			{
+				// Shows progress, machine-readable formats are written at the end
+				PrintRow(result, stdout);
+			}
+		}
+		return results;
+	}
+
+	static void PrintHeader(FILE* file)
+	{
+		std::fprintf(file, "%-36s %12s %8s %12s %16s %10s\n", "benchmark", "ns/op", "+-%", "min ns/op", "ops/s", "MHz");
+	}
+
+	static void PrintRow(const SBenchmarkResult& result, FILE* file)
+	{
+		std::fprintf(file, "%-36s %12.3f %8.2f %12.3f %16.0f ", result.Name.c_str(), result.MeanNs, result.Variation(), result.MinNs,
+			result.OperationsPerSecond());
+		if (result.Cycles == 0)
+		{
+			std::fprintf(file, "%10s\n", "-");
+		}
+		else
+		{
+			std::fprintf(file, "%10.1f\n", result.EmulatedMhz());
+		}
+	}
+
+	static void PrintCsv(const std::vector<SBenchmarkResult>& results, FILE* file)
+	{
+		std::fprintf(file, "name,repetitions,operations,cycles,mean_ns,stddev_ns,min_ns,max_ns,ops_per_second,emulated_mhz\n");
+		for (const SBenchmarkResult& result : results)
+		{
+			std::fprintf(file, "%s,%d,%llu,%llu,%.4f,%.4f,%.4f,%.4f,%.1f,%.3f\n", result.Name.c_str(), result.Repetitions,
+				static_cast<unsigned long long>(result.Operations), static_cast<unsigned long long>(result.Cycles), result.MeanNs,
+				result.StdDevNs, result.MinNs, result.MaxNs, result.OperationsPerSecond(), result.EmulatedMhz());
+		}
+	}
+
+	// The build options are included so results from different builds are not compared by accident
+	static void PrintJson(const std::vector<SBenchmarkResult>& results, FILE* file)
+	{
+		std::fprintf(file, "{\n  \"config\": { \"lazy_flags\": %s, \"table_alu\": %s, \"threaded_core\": %s, \"jit\": %s },\n",
+			boolName(LAZY_FLAGS), boolName(TABLE_ALU), boolName(THREADED_CORE), boolName(JIT));
+		std::fprintf(file, "  \"benchmarks\": [\n");
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const SBenchmarkResult& result = results[i];
+			std::fprintf(file,
+				"    { \"name\": \"%s\", \"repetitions\": %d, \"operations\": %llu, \"cycles\": %llu, \"mean_ns\": %.4f, "
+				"\"stddev_ns\": %.4f, \"min_ns\": %.4f, \"max_ns\": %.4f, \"ops_per_second\": %.1f, \"emulated_mhz\": %.3f }%s\n",
+				result.Name.c_str(), result.Repetitions, static_cast<unsigned long long>(result.Operations),
+				static_cast<unsigned long long>(result.Cycles), result.MeanNs, result.StdDevNs, result.MinNs, result.MaxNs,
+				result.OperationsPerSecond(), result.EmulatedMhz(), i + 1 < results.size() ? "," : "");
+		}
+		std::fprintf(file, "  ]\n}\n");
+	}
+
+private:
+	struct SBenchmark
+	{
+		std::string Name;
+		BenchmarkFunction Function;
+	};
+
+	std::vector<SBenchmark> m_Benchmarks;
+
+	static const char* boolName(const bool value)
+	{
+		return value ? "true" : "false";
+	}
+};
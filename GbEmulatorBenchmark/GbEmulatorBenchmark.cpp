@@ -0,0 +1,858 @@
+// Benchmarks for the emulator core, they do not depend on Visual Studio
+// g++ -std=c++17 -O2 GbEmulatorBenchmark.cpp -o GbEmulatorBenchmark
+// Add -DGB_THREADED_CORE=1 to measure the computed goto core, -DGB_JIT=0 builds without the JIT
+//
+// GbEmulatorBenchmark [--json | --csv] [--output file] [--filter text] [--repetitions n] [--warmup n]
+// Names are ops/<operation>, execute/<instruction>, stream/<program>/<core>, state/<save | load>
+// rewind/<push | stepback>, ppu/<frame | frame/dirty | frame/sprites>, pixels/<decode | shades | rgba | frame>/<path>
+// apu/<off | silent | tones | tones/nosink>, batch/<threads> and lanes/<instruction | diverged>/<path | execute>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../GameboyEmulator/Apu.h"
+#include "../GameboyEmulator/LaneAlu.h"
+#include "../GameboyEmulator/MachineBatch.h"
+#include "../GameboyEmulator/Operations.h"
+#include "../GameboyEmulator/Processor.h"
+#include "../GameboyEmulator/Rewind.h"
+#include "Benchmark.h"
+
+namespace
+{
+	constexpr size_t OPERAND_COUNT = 1 << 16;
+	constexpr U32 EXECUTE_COUNT = 1 << 16;
+	// One emulated second per call
+	constexpr U64 STREAM_CYCLES = CProcessor::CLOCK_SPEED;
+
+	// Runs one operation over all operands, every call depends on the registers left by the previous one
+	template<typename Operation>
+	void addOperation(CBenchmarkRunner& runner, const std::string& name, const std::vector<U8>& operands, Operation operation)
+	{
+		runner.Add("ops/" + name, [&operands, operation] {
+			SRegisters registers{};
+			for (const U8 value : operands)
+			{
+				operation(value, registers);
+			}
+			DoNotOptimize(registers.GetAF() ^ registers.GetBC() ^ registers.GetHL() ^ registers.SP);
+			return SWork{ operands.size(), 0 };
+		});
+	}
+
+	// Operations that have a table path are measured on both
+	template<EAluPath Path>
+	void addAluOperations(CBenchmarkRunner& runner, const std::vector<U8>& operands)
+	{
+		const std::string suffix = Path == EAluPath::Table ? "/table" : "/arith";
+		addOperation(runner, "ADD" + suffix, operands, [](const U8 value, SRegisters& registers) { COperations::Add<Path>(value, registers); });
+		addOperation(runner, "ADC" + suffix, operands, [](const U8 value, SRegisters& registers) { COperations::AddC<Path>(value, registers); });
+		addOperation(runner, "SUB" + suffix, operands, [](const U8 value, SRegisters& registers) { COperations::Sub<Path>(value, registers); });
+		addOperation(runner, "SBC" + suffix, operands, [](const U8 value, SRegisters& registers) { COperations::SubC<Path>(value, registers); });
+		addOperation(runner, "CP" + suffix, operands, [](const U8 value, SRegisters& registers) {
+			COperations::Cp<Path>(value, registers);
+			registers.A ^= value;
+		});
+		addOperation(runner, "INC" + suffix, operands, [](const U8 value, SRegisters& registers) {
+			registers.A = COperations::Inc<Path>(registers.A ^ value, registers);
+		});
+		addOperation(runner, "DEC" + suffix, operands, [](const U8 value, SRegisters& registers) {
+			registers.A = COperations::Dec<Path>(registers.A ^ value, registers);
+		});
+	}
+
+	void addOperations(CBenchmarkRunner& runner, const std::vector<U8>& operands)
+	{
+		addAluOperations<EAluPath::Arithmetic>(runner, operands);
+		addAluOperations<EAluPath::Table>(runner, operands);
+		addOperation(runner, "AND", operands, [](const U8 value, SRegisters& registers) {
+			registers.A += value;
+			COperations::AndOp(value | 0x81, registers);
+		});
+		addOperation(runner, "OR", operands, [](const U8 value, SRegisters& registers) { COperations::OrOp(value, registers); });
+		addOperation(runner, "XOR", operands, [](const U8 value, SRegisters& registers) { COperations::XorOp(value, registers); });
+		addOperation(runner, "ADDHL", operands, [](const U8 value, SRegisters& registers) {
+			registers.C = value;
+			COperations::AddHL<ERegisterTarget::BC>(registers);
+		});
+		addOperation(runner, "INC16", operands, [](const U8 value, SRegisters& registers) {
+			registers.C ^= value;
+			COperations::Inc16<ERegisterTarget::BC>(registers);
+		});
+		addOperation(runner, "DEC16", operands, [](const U8 value, SRegisters& registers) {
+			registers.C ^= value;
+			COperations::Dec16<ERegisterTarget::BC>(registers);
+		});
+		addOperation(runner, "ADDSP", operands, [](const U8 value, SRegisters& registers) {
+			registers.SP = COperations::AddSp(value, registers);
+		});
+		addOperation(runner, "DAA", operands, [](const U8 value, SRegisters& registers) {
+			registers.A ^= value;
+			COperations::Daa(registers);
+		});
+		addOperation(runner, "CPL", operands, [](const U8 value, SRegisters& registers) {
+			registers.A ^= value;
+			COperations::Cpl(registers);
+		});
+		addOperation(runner, "SCF", operands, [](const U8 value, SRegisters& registers) {
+			registers.A ^= value;
+			COperations::Scf(registers);
+		});
+		addOperation(runner, "CCF", operands, [](const U8 value, SRegisters& registers) {
+			registers.A ^= value;
+			COperations::Ccf(registers);
+		});
+		addOperation(runner, "RLCA", operands, [](const U8 value, SRegisters& registers) {
+			registers.A ^= value;
+			COperations::Rlca(registers);
+		});
+		addOperation(runner, "RRCA", operands, [](const U8 value, SRegisters& registers) {
+			registers.A ^= value;
+			COperations::Rrca(registers);
+		});
+		addOperation(runner, "RLA", operands, [](const U8 value, SRegisters& registers) {
+			registers.A ^= value;
+			COperations::Rla(registers);
+		});
+		addOperation(runner, "RRA", operands, [](const U8 value, SRegisters& registers) {
+			registers.A ^= value;
+			COperations::Rra(registers);
+		});
+		addOperation(runner, "RLC", operands, [](const U8 value, SRegisters& registers) { registers.A = COperations::Rlc(registers.A ^ value, registers); });
+		addOperation(runner, "RRC", operands, [](const U8 value, SRegisters& registers) { registers.A = COperations::Rrc(registers.A ^ value, registers); });
+		addOperation(runner, "RL", operands, [](const U8 value, SRegisters& registers) { registers.A = COperations::Rl(registers.A ^ value, registers); });
+		addOperation(runner, "RR", operands, [](const U8 value, SRegisters& registers) { registers.A = COperations::Rr(registers.A ^ value, registers); });
+		addOperation(runner, "SLA", operands, [](const U8 value, SRegisters& registers) { registers.A = COperations::Sla(registers.A ^ value, registers); });
+		addOperation(runner, "SRA", operands, [](const U8 value, SRegisters& registers) { registers.A = COperations::Sra(registers.A ^ value, registers); });
+		addOperation(runner, "SRL", operands, [](const U8 value, SRegisters& registers) { registers.A = COperations::Srl(registers.A ^ value, registers); });
+		addOperation(runner, "SWAP", operands, [](const U8 value, SRegisters& registers) { registers.A = COperations::Swap(registers.A ^ value, registers); });
+		addOperation(runner, "BIT", operands, [](const U8 value, SRegisters& registers) {
+			COperations::Bit(value & 0b111, registers.A, registers);
+			registers.A += value;
+		});
+		addOperation(runner, "RES", operands, [](const U8 value, SRegisters& registers) { registers.A = COperations::Res(value & 0b111, registers.A ^ value); });
+		addOperation(runner, "SET", operands, [](const U8 value, SRegisters& registers) { registers.A = COperations::Set(value & 0b111, registers.A ^ value); });
+	}
+
+	// Execute encodes the instruction and goes through the opcode tables like Step does
+	void addExecuteDispatch(CBenchmarkRunner& runner)
+	{
+		for (size_t index = 0; index <= static_cast<size_t>(EInstruction::SWAP); ++index)
+		{
+			const auto instruction = static_cast<EInstruction>(index);
+			const bool isPair = instruction == EInstruction::ADDHL || instruction == EInstruction::INC16 || instruction == EInstruction::DEC16;
+			const ERegisterTarget target = isPair ? ERegisterTarget::BC : ERegisterTarget::B;
+			runner.Add(std::string("execute/") + GetInstructionName(instruction), [instruction, target] {
+				auto cpu = std::make_unique<CProcessor>();
+				for (U32 i = 0; i < EXECUTE_COUNT; ++i)
+				{
+					cpu->Registers.B += static_cast<U8>(i);
+					cpu->Execute(instruction, target, 3);
+				}
+				DoNotOptimize(cpu->Registers.GetAF() ^ cpu->Registers.GetBC());
+				return SWork{ EXECUTE_COUNT, 0 };
+			});
+		}
+	}
+
+
+	// Timer that is ticked one cycle at a time after every instruction,
+	// the way the components would be driven without the scheduler
+	class CLockstepTimer : public IIoDevice
+	{
+	public:
+		explicit CLockstepTimer(CMemoryBus& bus)
+			: m_Bus(bus)
+		{
+		}
+
+		void Tick(const U32 cycles)
+		{
+			for (U32 i = 0; i < cycles; ++i)
+			{
+				const U16 previous = m_Counter++;
+				const U16 bit = static_cast<U16>(CTimer::TIMA_PERIODS[m_Tac & 0b11] >> 1);
+				if ((m_Tac & 0b100) != 0 && (previous & bit) != 0 && (m_Counter & bit) == 0 && ++m_Tima == 0)
+				{
+					m_Tima = m_Tma;
+					m_Bus.RequestInterrupt(EInterrupt::Timer);
+				}
+			}
+		}
+
+		U8 ReadIo(const U16 address) override
+		{
+			switch (address)
+			{
+			case CTimer::DIV_ADDRESS:
+				return static_cast<U8>(m_Counter >> 8);
+			case CTimer::TIMA_ADDRESS:
+				return m_Tima;
+			case CTimer::TMA_ADDRESS:
+				return m_Tma;
+			default:
+				return m_Tac | 0xF8;
+			}
+		}
+
+		void WriteIo(const U16 address, const U8 value) override
+		{
+			switch (address)
+			{
+			case CTimer::DIV_ADDRESS:
+				m_Counter = 0;
+				break;
+			case CTimer::TIMA_ADDRESS:
+				m_Tima = value;
+				break;
+			case CTimer::TMA_ADDRESS:
+				m_Tma = value;
+				break;
+			default:
+				m_Tac = value & 0b111;
+				break;
+			}
+		}
+
+	private:
+		CMemoryBus& m_Bus;
+		U16 m_Counter = 0;
+		U8 m_Tima = 0;
+		U8 m_Tma = 0;
+		U8 m_Tac = 0;
+	};
+
+	// Enables the timer at its fastest rate and spins on INC B / DEC C / JR
+	void loadTimerLoop(CProcessor& cpu)
+	{
+		const U8 program[] = { 0x3E, 0x05, 0xE0, 0x07, 0x04, 0x0D, 0x18, 0xFC };
+		for (U16 i = 0; i < sizeof(program); ++i)
+		{
+			cpu.Bus.Write(0xC000 + i, program[i]);
+		}
+		cpu.Registers.PC = 0xC000;
+	}
+
+	// Register-only arithmetic with a memory store and a branch per iteration
+	// loop: ADD A, B / ADC A, C / XOR D / INC E / RLCA / SUB E / LD H, A / SWAP H / OR H / DEC L / AND 7F / CP C
+	//       LD (DE), A / LD C, A / DEC B / JR NZ, loop / JR loop
+	void loadArithmeticLoop(CProcessor& cpu)
+	{
+		const U8 program[] = {
+			0x80, 0x89, 0xAA, 0x1C, 0x07, 0x93, 0x67, 0xCB, 0x34, 0xB4, 0x2D, 0xE6, 0x7F, 0xB9,
+			0x12, 0x4F, 0x05, 0x20, 0xED, 0x18, 0xEB
+		};
+		for (U16 i = 0; i < sizeof(program); ++i)
+		{
+			cpu.Bus.Write(0xC000 + i, program[i]);
+		}
+		cpu.Registers.PC = 0xC000;
+		cpu.Registers.SetDE(0xC100);
+	}
+
+	enum class ECore
+	{
+		Step,
+		RunUntil,
+		Lockstep,
+		Blocks,
+		Jit,
+		// RunUntil recording a trace file
+		Trace
+	};
+
+	using ProgramLoader = void (*)(CProcessor&);
+
+	// RunUntil does not count instructions, the count is scaled from the instructions per cycle Step measured
+	double measureInstructionsPerCycle(const ProgramLoader load)
+	{
+		auto cpu = std::make_unique<CProcessor>();
+		load(*cpu);
+		U64 instructions = 0;
+		while (cpu->GetCycles() < STREAM_CYCLES / 16)
+		{
+			cpu->Step();
+			++instructions;
+		}
+		return static_cast<double>(instructions) / static_cast<double>(cpu->GetCycles());
+	}
+
+	void addStream(CBenchmarkRunner& runner, const std::string& name, const ProgramLoader load, const ECore core)
+	{
+		const double instructionsPerCycle = measureInstructionsPerCycle(load);
+		runner.Add("stream/" + name, [load, core, instructionsPerCycle] {
+			auto cpu = std::make_unique<CProcessor>();
+			CLockstepTimer timer(cpu->Bus);
+			if (core == ECore::Lockstep)
+			{
+				cpu->Bus.MapIo(CTimer::DIV_ADDRESS, CTimer::TAC_ADDRESS, &timer);
+			}
+			cpu->SetBlockCacheEnabled(core == ECore::Blocks || core == ECore::Jit);
+			cpu->SetJitEnabled(core == ECore::Jit);
+			load(*cpu);
+			CTraceRecorder recorder;
+			const std::string tracePath = (std::filesystem::temp_directory_path() / "GbEmulatorBenchmark.trace").string();
+			if (core == ECore::Trace && recorder.Open(tracePath) == ETraceError::None)
+			{
+				cpu->SetTraceRecorder(&recorder);
+			}
+
+			if (core != ECore::Step && core != ECore::Lockstep)
+			{
+				cpu->RunUntil(STREAM_CYCLES);
+			}
+			else
+			{
+				while (cpu->GetCycles() < STREAM_CYCLES)
+				{
+					const U8 cycles = cpu->Step();
+					if (core == ECore::Lockstep)
+					{
+						timer.Tick(cycles);
+					}
+				}
+			}
+			if (recorder.IsOpen())
+			{
+				cpu->SetTraceRecorder(nullptr);
+				recorder.Close();
+				std::remove(tracePath.c_str());
+			}
+			DoNotOptimize(cpu->Registers.GetAF() ^ cpu->Registers.GetBC());
+			return SWork{ static_cast<U64>(static_cast<double>(cpu->GetCycles()) * instructionsPerCycle), cpu->GetCycles() };
+		});
+	}
+
+	void addStreams(CBenchmarkRunner& runner)
+	{
+		// RunUntil goes through the threaded core when it is built in
+		const std::string runName = THREADED_CORE ? "threaded" : "rununtil";
+		addStream(runner, "timer/step", &loadTimerLoop, ECore::Step);
+		addStream(runner, "timer/lockstep", &loadTimerLoop, ECore::Lockstep);
+		addStream(runner, "timer/" + runName, &loadTimerLoop, ECore::RunUntil);
+		addStream(runner, "timer/blocks", &loadTimerLoop, ECore::Blocks);
+		addStream(runner, "arith/step", &loadArithmeticLoop, ECore::Step);
+		addStream(runner, "arith/" + runName, &loadArithmeticLoop, ECore::RunUntil);
+		addStream(runner, "arith/blocks", &loadArithmeticLoop, ECore::Blocks);
+		if (JIT)
+		{
+			addStream(runner, "arith/jit", &loadArithmeticLoop, ECore::Jit);
+		}
+		addStream(runner, "arith/trace", &loadArithmeticLoop, ECore::Trace);
+	}
+
+	constexpr U32 STATE_COUNT = 1000;
+
+	// Save and load with the largest cartridge RAM an MBC5 supports, the buffers are allocated once
+	void addSaveStates(CBenchmarkRunner& runner)
+	{
+		static std::vector<U8> rom(2 * CMemoryBus::ROM_BANK_SIZE);
+		const auto makeCpu = [] {
+			auto cpu = std::make_unique<CProcessor>();
+			cpu->Bus.LoadRom(rom.data(), rom.size(), EMbcType::Mbc5, 16 * CMemoryBus::RAM_BANK_SIZE);
+			loadArithmeticLoop(*cpu);
+			cpu->RunUntil(10000);
+			return cpu;
+		};
+		runner.Add("state/save", [makeCpu] {
+			static std::unique_ptr<CProcessor> cpu = makeCpu();
+			static std::vector<U8> buffer(cpu->GetSaveStateSize());
+			for (U32 i = 0; i < STATE_COUNT; ++i)
+			{
+				const ESaveStateError error = cpu->SaveState(buffer.data(), buffer.size());
+				DoNotOptimize(static_cast<U64>(error) + buffer[i]);
+			}
+			return SWork{ STATE_COUNT, 0 };
+		});
+		runner.Add("state/load", [makeCpu] {
+			static std::unique_ptr<CProcessor> cpu = makeCpu();
+			static std::vector<U8> buffer(cpu->GetSaveStateSize());
+			static const ESaveStateError saved = cpu->SaveState(buffer.data(), buffer.size());
+			for (U32 i = 0; i < STATE_COUNT; ++i)
+			{
+				const ESaveStateError error = cpu->LoadState(buffer.data(), buffer.size());
+				DoNotOptimize(static_cast<U64>(error) + static_cast<U64>(saved) + cpu->Registers.A);
+			}
+			return SWork{ STATE_COUNT, 0 };
+		});
+	}
+
+	constexpr U64 FRAME_CYCLES = 70224;
+	constexpr U32 REWIND_FRAMES = 600;
+
+	// Ten seconds of frames of the arithmetic loop, which stores to memory every iteration
+	void addRewind(CBenchmarkRunner& runner)
+	{
+		// Includes loading each frame into the CPU, emulating it would take longer than pushing it
+		runner.Add("rewind/push", [] {
+			static auto cpu = std::make_unique<CProcessor>();
+			static const std::vector<std::vector<U8>> frames = [] {
+				std::vector<std::vector<U8>> states(REWIND_FRAMES);
+				loadArithmeticLoop(*cpu);
+				for (std::vector<U8>& state : states)
+				{
+					cpu->RunUntil(cpu->GetCycles() + FRAME_CYCLES);
+					state.resize(cpu->GetSaveStateSize());
+					DoNotOptimize(static_cast<U64>(cpu->SaveState(state.data(), state.size())));
+				}
+				return states;
+			}();
+			CRewindBuffer rewind;
+			for (const std::vector<U8>& frame : frames)
+			{
+				DoNotOptimize(static_cast<U64>(cpu->LoadState(frame.data(), frame.size())));
+				DoNotOptimize(static_cast<U64>(rewind.Push(*cpu)));
+			}
+			DoNotOptimize(rewind.GetUsage());
+			return SWork{ REWIND_FRAMES, 0 };
+		});
+		runner.Add("rewind/stepback", [] {
+			static auto cpu = std::make_unique<CProcessor>();
+			static const CRewindBuffer filled = [] {
+				CRewindBuffer rewind;
+				loadArithmeticLoop(*cpu);
+				for (U32 frame = 0; frame < REWIND_FRAMES; ++frame)
+				{
+					cpu->RunUntil(cpu->GetCycles() + FRAME_CYCLES);
+					DoNotOptimize(static_cast<U64>(rewind.Push(*cpu)));
+				}
+				return rewind;
+			}();
+			// Copying the buffer is small next to decoding every frame
+			CRewindBuffer rewind = filled;
+			for (U32 frame = 0; frame < REWIND_FRAMES; ++frame)
+			{
+				DoNotOptimize(rewind.StepBack(*cpu));
+			}
+			return SWork{ REWIND_FRAMES, 0 };
+		});
+	}
+
+	constexpr U32 PPU_FRAMES = 60;
+
+	// One second of frames of random tiles with the CPU halted, so the time is the PPU's
+	// Dirty writes a byte of 64 tiles before each frame, which are decoded again
+	// Sprites fills OAM with random sprites and copies it in with OAM DMA before each frame
+	void addPpu(CBenchmarkRunner& runner)
+	{
+		const auto addFrames = [&runner](const std::string& name, const U32 dirtyTiles, const bool sprites) {
+			// Each benchmark has its own processor, made once
+			std::shared_ptr<CProcessor> cpu = std::make_unique<CProcessor>();
+			std::mt19937 random(7);
+			for (U16 address = CMemoryBus::VRAM_START; address < 0x9C00; ++address)
+			{
+				cpu->Bus.Write(address, static_cast<U8>(random()));
+			}
+			// HALT / JR -3, no interrupt is enabled so the CPU stays halted
+			cpu->Bus.Write(0xC000, 0x76);
+			cpu->Bus.Write(0xC001, 0x18);
+			cpu->Bus.Write(0xC002, 0xFD);
+			cpu->Registers.PC = 0xC000;
+			cpu->Bus.Write(CPpu::BGP_ADDRESS, 0xE4);
+			cpu->Bus.Write(CPpu::OBP0_ADDRESS, 0xD2);
+			cpu->Bus.Write(CPpu::LCDC_ADDRESS, sprites ? 0x93 : 0x91);
+			for (U16 i = 0; i < CMemoryBus::OAM_END - CMemoryBus::OAM_START; ++i)
+			{
+				cpu->Bus.Write(0xC100 + i, sprites ? static_cast<U8>(random()) : 0);
+			}
+			runner.Add("ppu/" + name, [cpu, dirtyTiles, sprites] {
+				for (U32 frame = 0; frame < PPU_FRAMES; ++frame)
+				{
+					for (U32 tile = 0; tile < dirtyTiles; ++tile)
+					{
+						const U16 address = static_cast<U16>(CMemoryBus::VRAM_START + tile * 16 + frame % 16);
+						cpu->Bus.Write(address, static_cast<U8>(cpu->Bus.Read(address) + 1));
+					}
+					if (sprites)
+					{
+						cpu->Bus.Write(0xFF46, 0xC1);
+					}
+					cpu->RunUntil(cpu->GetCycles() + CPpu::FRAME_CYCLES);
+				}
+				DoNotOptimize(cpu->Ppu.GetFrame()[0] + cpu->Ppu.GetStats().TileMisses);
+				return SWork{ PPU_FRAMES, PPU_FRAMES * CPpu::FRAME_CYCLES };
+			});
+		};
+		addFrames("frame", 0, false);
+		addFrames("frame/dirty", 64, false);
+		addFrames("frame/sprites", 0, true);
+	}
+
+	constexpr U32 FRAME_PIXELS = CPpu::SCREEN_WIDTH * CPpu::SCREEN_HEIGHT;
+	constexpr U32 FRAME_TILE_ROWS = (CPpu::SCREEN_WIDTH / 8 + 1) * CPpu::SCREEN_HEIGHT;
+
+	// Inputs for a whole frame, one more tile per line than the screen is wide like the PPU decodes
+	struct SPixelFrame
+	{
+		std::vector<U8> Planes = std::vector<U8>(FRAME_TILE_ROWS * 2);
+		std::vector<U8> Indices = std::vector<U8>(FRAME_TILE_ROWS * 8);
+		// A sprite every 16 pixels, half of them behind the background
+		std::vector<U8> Sprites = std::vector<U8>(FRAME_PIXELS);
+		std::vector<U8> Shades = std::vector<U8>(FRAME_PIXELS);
+		std::vector<U32> Rgba = std::vector<U32>(FRAME_PIXELS);
+
+		SPixelFrame()
+		{
+			std::mt19937 random(11);
+			for (U8& plane : Planes)
+			{
+				plane = static_cast<U8>(random());
+			}
+			CPixelKernels::Get(EPixelPath::Scalar).DecodeRows(Planes.data(), FRAME_TILE_ROWS, Indices.data());
+			for (U32 i = 0; i < FRAME_PIXELS; ++i)
+			{
+				Sprites[i] = i % 16 < 8 ? static_cast<U8>(random() & 0b1111) : 0;
+			}
+		}
+	};
+
+	// Each kernel over a full frame on every path the host supports, 160x144 pixels per op
+	void addPixelKernels(CBenchmarkRunner& runner)
+	{
+		static SPixelFrame frame;
+		static const U32 colors[] = { 0xFFD0F8E0, 0xFF70C088, 0xFF566834, 0xFF201808 };
+		constexpr U32 palettes = 0xE4 | 0xD2 << 8 | 0x1B << 16;
+		for (const EPixelPath path : { EPixelPath::Scalar, EPixelPath::Sse2, EPixelPath::Avx2 })
+		{
+			if (!CPixelKernels::IsSupported(path))
+			{
+				continue;
+			}
+			const SPixelKernels& kernels = CPixelKernels::Get(path);
+			const std::string suffix = std::string("/") + CPixelKernels::GetName(path);
+			runner.Add("pixels/decode" + suffix, [&kernels] {
+				kernels.DecodeRows(frame.Planes.data(), FRAME_TILE_ROWS, frame.Indices.data());
+				DoNotOptimize(frame.Indices[FRAME_TILE_ROWS * 8 - 1]);
+				return SWork{ FRAME_PIXELS, 0 };
+			});
+			runner.Add("pixels/shades" + suffix, [&kernels] {
+				for (U32 y = 0; y < CPpu::SCREEN_HEIGHT; ++y)
+				{
+					const U32 line = y * CPpu::SCREEN_WIDTH;
+					kernels.MapShades(frame.Indices.data() + y * (CPpu::SCREEN_WIDTH + 8) + y % 8, frame.Sprites.data() + line,
+						CPpu::SCREEN_WIDTH, palettes, frame.Shades.data() + line);
+				}
+				DoNotOptimize(frame.Shades[FRAME_PIXELS - 1]);
+				return SWork{ FRAME_PIXELS, 0 };
+			});
+			runner.Add("pixels/rgba" + suffix, [&kernels] {
+				kernels.ShadesToRgba(frame.Shades.data(), FRAME_PIXELS, colors, frame.Rgba.data());
+				DoNotOptimize(frame.Rgba[FRAME_PIXELS - 1]);
+				return SWork{ FRAME_PIXELS, 0 };
+			});
+			// Decoding, sprites and palettes, then colors, a line at a time
+			runner.Add("pixels/frame" + suffix, [&kernels] {
+				constexpr U32 lineTiles = CPpu::SCREEN_WIDTH / 8 + 1;
+				for (U32 y = 0; y < CPpu::SCREEN_HEIGHT; ++y)
+				{
+					const U32 line = y * CPpu::SCREEN_WIDTH;
+					U8 indices[lineTiles * 8];
+					kernels.DecodeRows(frame.Planes.data() + y * lineTiles * 2, lineTiles, indices);
+					kernels.MapShades(indices + y % 8, frame.Sprites.data() + line, CPpu::SCREEN_WIDTH, palettes, frame.Shades.data() + line);
+					kernels.ShadesToRgba(frame.Shades.data() + line, CPpu::SCREEN_WIDTH, colors, frame.Rgba.data() + line);
+				}
+				DoNotOptimize(frame.Rgba[FRAME_PIXELS - 1]);
+				return SWork{ FRAME_PIXELS, 0 };
+			});
+		}
+	}
+
+	// Counts the samples and drops them
+	class CNullAudioSink : public IAudioSink
+	{
+	public:
+		void OnSamples(const SStereoSample* samples, const size_t count) override
+		{
+			DoNotOptimize(samples[count - 1].Left);
+			m_Samples += count;
+		}
+
+		[[nodiscard]] U64 GetSamples() const
+		{
+			return m_Samples;
+		}
+
+	private:
+		U64 m_Samples = 0;
+	};
+
+	// One emulated second with the CPU halted and the LCD off, so the time is the APU's
+	// Off has the APU powered off and is the cost of the rest, silent has it on with no channel playing
+	// Tones plays both squares, a wave and noise, without a sink the channels run but nothing is synthesized
+	void addApu(CBenchmarkRunner& runner)
+	{
+		const auto addSecond = [&runner](const std::string& name, const bool powered, const bool tones, const bool sink) {
+			std::shared_ptr<CProcessor> cpu = std::make_unique<CProcessor>();
+			std::shared_ptr<CNullAudioSink> samples = std::make_shared<CNullAudioSink>();
+			// HALT / JR -3, no interrupt is enabled so the CPU stays halted
+			cpu->Bus.Write(0xC000, 0x76);
+			cpu->Bus.Write(0xC001, 0x18);
+			cpu->Bus.Write(0xC002, 0xFD);
+			cpu->Registers.PC = 0xC000;
+			cpu->Bus.Write(CApu::NR52_ADDRESS, powered ? 0x80 : 0x00);
+			cpu->Bus.Write(CApu::NR50_ADDRESS, 0x77);
+			cpu->Bus.Write(CApu::NR51_ADDRESS, 0xFF);
+			if (tones)
+			{
+				// 440 Hz and 660 Hz squares, a 220 Hz saw and noise at 32 kHz, none of them stops
+				const auto play = [&cpu](const U16 nrx1, const U8 duty, const U8 envelope, const U32 frequency) {
+					cpu->Bus.Write(nrx1, duty);
+					cpu->Bus.Write(static_cast<U16>(nrx1 + 1), envelope);
+					cpu->Bus.Write(static_cast<U16>(nrx1 + 2), static_cast<U8>(frequency));
+					cpu->Bus.Write(static_cast<U16>(nrx1 + 3), static_cast<U8>(0x80 | frequency >> 8));
+				};
+				for (U16 i = 0; i < 16; ++i)
+				{
+					cpu->Bus.Write(static_cast<U16>(CApu::WAVE_START + i), static_cast<U8>(i * 0x11));
+				}
+				cpu->Bus.Write(CApu::NR30_ADDRESS, 0x80);
+				play(CApu::NR11_ADDRESS, 0x80, 0xF0, 2048 - 131072 / 440);
+				play(CApu::NR21_ADDRESS, 0x40, 0xA0, 2048 - 131072 / 660);
+				play(CApu::NR31_ADDRESS, 0x00, 0x20, 2048 - 65536 / 220);
+				cpu->Bus.Write(CApu::NR42_ADDRESS, 0x80);
+				cpu->Bus.Write(CApu::NR43_ADDRESS, 0x22);
+				cpu->Bus.Write(CApu::NR44_ADDRESS, 0x80);
+			}
+			if (sink)
+			{
+				cpu->Apu.SetSampleSink(samples.get());
+			}
+			runner.Add("apu/" + name, [cpu, samples] {
+				cpu->RunUntil(cpu->GetCycles() + CProcessor::CLOCK_SPEED);
+				DoNotOptimize(samples->GetSamples() + cpu->Apu.GetStats().Steps);
+				return SWork{ 1, CProcessor::CLOCK_SPEED };
+			});
+		};
+		addSecond("off", false, false, false);
+		addSecond("silent", true, false, true);
+		addSecond("tones", true, true, true);
+		addSecond("tones/nosink", true, true, false);
+	}
+
+	// 32 machines running a frame each with different input, on pools of 1, 2 and 4 threads
+	void addBatch(CBenchmarkRunner& runner)
+	{
+		constexpr size_t MACHINES = 32;
+		// Reads the directions, adds them to a sum in C000 and copies it along C001-C0FF
+		static const U8 PROGRAM[] = {
+			0x3E, 0x20, // LD A, 20
+			0xE0, 0x00, // LDH (00), A
+			0xF0, 0x00, // LDH A, (00)
+			0x2F, // CPL
+			0xE6, 0x0F, // AND 0F
+			0x21, 0x00, 0xC0, // LD HL, C000
+			0x86, // ADD A, (HL)
+			0x22, // LD (HL+), A
+			0x77, // LD (HL), A
+			0x2C, // INC L
+			0x20, 0xFC, // JR NZ, -4
+			0x18, 0xEC // JR -20
+		};
+		std::shared_ptr<std::vector<U8>> rom = std::make_shared<std::vector<U8>>(2 * CMemoryBus::ROM_BANK_SIZE);
+		std::copy(std::begin(PROGRAM), std::end(PROGRAM), rom->begin() + 0x100);
+		std::shared_ptr<std::vector<U8>> buttons = std::make_shared<std::vector<U8>>(MACHINES);
+		for (size_t i = 0; i < MACHINES; ++i)
+		{
+			(*buttons)[i] = static_cast<U8>(i & 0x0F);
+		}
+		for (const U32 threads : { 1u, 2u, 4u })
+		{
+			std::shared_ptr<CThreadPool> pool = std::make_shared<CThreadPool>(threads);
+			std::shared_ptr<CMachineBatch> batch = std::make_shared<CMachineBatch>(*pool, MACHINES, rom->data(), rom->size(), EMbcType::None, 0);
+			batch->ObserveRam({ { 0xC000, 0x100 } });
+			runner.Add("batch/" + std::to_string(threads), [rom, buttons, pool, batch] {
+				batch->Step(buttons->data());
+				DoNotOptimize(batch->GetObservation(MACHINES - 1)[0]);
+				return SWork{ MACHINES, MACHINES * CPpu::FRAME_CYCLES };
+			});
+		}
+	}
+
+	// One instruction on 32 lanes at a time through each kernel path, against 32 processors
+	// running it one after the other with Execute, the work is lane-ops
+	void addLanes(CBenchmarkRunner& runner)
+	{
+		constexpr U32 LANE_ROUNDS = 1 << 12;
+		constexpr U32 LANES = SLaneRegisters::LANES;
+		struct SLaneBenchmark
+		{
+			EInstruction Instruction;
+			const char* Name;
+		};
+		const SLaneBenchmark benchmarks[] = {
+			{ EInstruction::ADD, "ADD" }, { EInstruction::SUB, "SUB" }, { EInstruction::AND, "AND" },
+			{ EInstruction::OR, "OR" }, { EInstruction::XOR, "XOR" }, { EInstruction::CP, "CP" },
+			{ EInstruction::INC, "INC" }, { EInstruction::DEC, "DEC" }, { EInstruction::SWAP, "SWAP" },
+		};
+		std::shared_ptr<SLaneRegisters> start = std::make_shared<SLaneRegisters>();
+		std::mt19937 random(11);
+		for (U32 lane = 0; lane < LANES; ++lane)
+		{
+			start->SetLane(lane, SRegisters{});
+			start->A[lane] = static_cast<U8>(random());
+			start->B[lane] = static_cast<U8>(random());
+		}
+		const auto addPaths = [&runner, start](const std::string& name, const std::array<U16, LANES>& opcodes) {
+			for (const EPixelPath path : { EPixelPath::Scalar, EPixelPath::Sse2, EPixelPath::Avx2 })
+			{
+				if (!CPixelKernels::IsSupported(path))
+				{
+					continue;
+				}
+				runner.Add("lanes/" + name + "/" + CPixelKernels::GetName(path), [start, opcodes, path] {
+					const SLaneKernels& kernels = CLaneAlu::Get(path);
+					SLaneRegisters registers = *start;
+					bool executed = true;
+					for (U32 round = 0; round < LANE_ROUNDS; ++round)
+					{
+						executed &= CLaneAlu::Execute(opcodes, registers, kernels);
+					}
+					DoNotOptimize(registers.A[LANES - 1] ^ registers.F[0] ^ registers.B[0] ^ executed);
+					return SWork{ static_cast<U64>(LANE_ROUNDS) * LANES, 0 };
+				});
+			}
+		};
+		for (const SLaneBenchmark& benchmark : benchmarks)
+		{
+			const EInstruction instruction = benchmark.Instruction;
+			std::array<U16, LANES> opcodes;
+			opcodes.fill(CProcessor::Encode(instruction, ERegisterTarget::B));
+			addPaths(benchmark.Name, opcodes);
+			runner.Add(std::string("lanes/") + benchmark.Name + "/execute", [start, instruction] {
+				std::vector<std::unique_ptr<CProcessor>> cpus;
+				for (U32 lane = 0; lane < LANES; ++lane)
+				{
+					cpus.push_back(std::make_unique<CProcessor>());
+					cpus.back()->Registers = start->GetLane(lane);
+				}
+				for (U32 round = 0; round < LANE_ROUNDS; ++round)
+				{
+					for (const std::unique_ptr<CProcessor>& cpu : cpus)
+					{
+						cpu->Execute(instruction, ERegisterTarget::B);
+					}
+				}
+				DoNotOptimize(cpus.back()->Registers.GetAF() ^ cpus.front()->Registers.GetBC());
+				return SWork{ static_cast<U64>(LANE_ROUNDS) * LANES, 0 };
+			});
+		}
+		// A quarter of the lanes run SUB instead of ADD
+		std::array<U16, LANES> diverged;
+		for (U32 lane = 0; lane < LANES; ++lane)
+		{
+			diverged[lane] = CProcessor::Encode(lane % 4 == 3 ? EInstruction::SUB : EInstruction::ADD, ERegisterTarget::B);
+		}
+		addPaths("diverged", diverged);
+	}
+
+	[[nodiscard]] bool parseArguments(const int argc, char** argv, SBenchmarkOptions& options, std::string& output)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const char* argument = argv[i];
+			const bool hasValue = i + 1 < argc;
+			if (std::strcmp(argument, "--json") == 0)
+			{
+				options.Format = EOutputFormat::Json;
+			}
+			else if (std::strcmp(argument, "--csv") == 0)
+			{
+				options.Format = EOutputFormat::Csv;
+			}
+			else if (std::strcmp(argument, "--output") == 0 && hasValue)
+			{
+				output = argv[++i];
+			}
+			else if (std::strcmp(argument, "--filter") == 0 && hasValue)
+			{
+				options.Filter = argv[++i];
+			}
+			else if (std::strcmp(argument, "--repetitions") == 0 && hasValue)
+			{
+				options.Repetitions = std::atoi(argv[++i]);
+			}
+			else if (std::strcmp(argument, "--warmup") == 0 && hasValue)
+			{
+				options.WarmUp = std::atoi(argv[++i]);
+			}
+			else
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	SBenchmarkOptions options;
+	std::string output;
+	if (!parseArguments(argc, argv, options, output))
+	{
+		std::fprintf(stderr, "usage: %s [--json | --csv] [--output file] [--filter text] [--repetitions n] [--warmup n]\n", argv[0]);
+		return 1;
+	}
+
+	std::mt19937 random(1234);
+	std::vector<U8> operands(OPERAND_COUNT);
+	for (U8& operand : operands)
+	{
+		operand = static_cast<U8>(random());
+	}
+
+	CBenchmarkRunner runner;
+	addOperations(runner, operands);
+	addExecuteDispatch(runner);
+	addStreams(runner);
+	addSaveStates(runner);
+	addRewind(runner);
+	addPpu(runner);
+	addPixelKernels(runner);
+	addApu(runner);
+	addBatch(runner);
+	addLanes(runner);
+
+	// Opened before the run so that a bad path does not throw away the results
+	FILE* file = output.empty() ? stdout : std::fopen(output.c_str(), "w");
+	if (file == nullptr)
+	{
+		std::fprintf(stderr, "could not open %s\n", output.c_str());
+		return 1;
+	}
+
+	if (options.Format == EOutputFormat::Table)
+	{
+		std::printf("%s flags, %s ALU\n", LAZY_FLAGS ? "lazy" : "eager", TABLE_ALU ? "table" : "arithmetic");
+		CBenchmarkRunner::PrintHeader(stdout);
+	}
+	const std::vector<SBenchmarkResult> results = runner.Run(options);
+	if (options.Format == EOutputFormat::Json)
+	{
+		CBenchmarkRunner::PrintJson(results, file);
+	}
+	else if (options.Format == EOutputFormat::Csv)
+	{
+		CBenchmarkRunner::PrintCsv(results, file);
+	}
+	else if (file != stdout)
+	{
+		// The rows were already shown on stdout while running
+		std::fprintf(file, "%s flags, %s ALU\n", LAZY_FLAGS ? "lazy" : "eager", TABLE_ALU ? "table" : "arithmetic");
+		CBenchmarkRunner::PrintHeader(file);
+		for (const SBenchmarkResult& result : results)
+		{
+			CBenchmarkRunner::PrintRow(result, file);
+		}
+	}
+	if (file != stdout)
+	{
+		std::fclose(file);
+	}
+	return 0;
+}
@@ -0,0 +1,788 @@
+#pragma once
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../GameboyEmulator/Helpers.h"
+#include "../GameboyEmulator/Jit.h"
+#include "../GameboyEmulator/LaneAlu.h"
+#include "../GameboyEmulator/Processor.h"
+#include "../GameboyEmulator/ThreadPool.h"
+
+// The registers an ALU instruction reads and writes, F only uses its upper four bits
+struct SAluState
+{
+	U8 A = 0, F = 0, B = 0, C = 0, D = 0, E = 0, H = 0, L = 0;
+	U16 SP = 0;
+
+	[[nodiscard]] bool operator==(const SAluState& other) const
+	{
+		return A == other.A && F == other.F && B == other.B && C == other.C && D == other.D && E == other.E
+			&& H == other.H && L == other.L && SP == other.SP;
+	}
+
+	[[nodiscard]] bool operator!=(const SAluState& other) const
+	{
+		return !(*this == other);
+	}
+
+	[[nodiscard]] static SAluState FromRegisters(const SRegisters& registers)
+	{
+		return { registers.A, registers.GetF(), registers.B, registers.C, registers.D, registers.E, registers.H, registers.L, registers.SP };
+	}
+
+	// PC is left as it is
+	void ToRegisters(SRegisters& registers) const
+	{
+		registers.A = A;
+		registers.SetF(F);
+		registers.B = B;
+		registers.C = C;
+		registers.D = D;
+		registers.E = E;
+		registers.H = H;
+		registers.L = L;
+		registers.SP = SP;
+	}
+};
+
+// The implementations that are compared against the reference model
+enum class EAluSubject
+{
+	// CProcessor::Execute, the opcode tables with the flag mode and ALU path of the build
+	Execute,
+	// COperations with an explicit path, only the ops that have one
+	Arithmetic,
+	Table,
+	// Native code from CJit, only the instructions it compiles
+	Jit,
+	// CLaneAlu, 32 cases at a time, only lane ops
+	LanesScalar,
+	LanesSse2,
+	LanesAvx2
+};
+
+[[nodiscard]] inline const char* GetSubjectName(const EAluSubject subject)
+{
+	switch (subject)
+	{
+	case EAluSubject::Execute:
+		return "execute";
+	case EAluSubject::Arithmetic:
+		return "arithmetic";
+	case EAluSubject::Table:
+		return "table";
+	case EAluSubject::Jit:
+		return "jit";
+	case EAluSubject::LanesScalar:
+		return "lanes/scalar";
+	case EAluSubject::LanesSse2:
+		return "lanes/sse2";
+	case EAluSubject::LanesAvx2:
+		return "lanes/avx2";
+	default:
+		return "unknown";
+	}
+}
+
+// How the index of a case is turned into the input registers, the others keep fixed values
+enum class EAluSpace
+{
+	// The target register in bits 0-7, A in bits 8-15 and F in bits 16-19, 2^20 cases
+	// Instructions without an operand use B as the target, it has to stay the same
+	Operand8,
+	// The target is A, A in bits 0-7 and F in bits 8-11
+	Accumulator,
+	// The 16-bit target in bits 0-15 and F in bits 16-19, 2^20 cases
+	Pair,
+	// ADD HL, rr: HL in bits 0-15 and one of 16 operands picked to cover the carries in bits 16-19
+	// F changes with every case, it is only read for Z
+	AddPair,
+	// ADD HL, rr over every HL and rr, 2^32 cases
+	AddPairWide
+};
+
+// One instruction with one target, run over all of its cases
+struct SAluSweep
+{
+	EInstruction Instruction = EInstruction::ADD;
+	ERegisterTarget Target = ERegisterTarget::B;
+	U8 Bit = 0;
+	EAluSpace Space = EAluSpace::Operand8;
+
+	[[nodiscard]] U64 GetCaseCount() const
+	{
+		switch (Space)
+		{
+		case EAluSpace::Accumulator:
+			return 1 << 12;
+		case EAluSpace::AddPairWide:
+			return 1ull << 32;
+		default:
+			return 1 << 20;
+		}
+	}
+
+	// "ADD B", "BIT 3, A", "ADD HL, SP", "INC BC"
+	[[nodiscard]] std::string GetName() const
+	{
+		std::string name = GetInstructionName(Instruction);
+		// "INC rr" names the pair in place of rr
+		if (const size_t pair = name.find(" rr"); pair != std::string::npos)
+		{
+			return name.substr(0, pair + 1) + getTargetName(Target);
+		}
+		if (Instruction == EInstruction::BIT || Instruction == EInstruction::RESET || Instruction == EInstruction::SET)
+		{
+			name += " " + std::to_string(Bit) + ",";
+		}
+		else if (Instruction == EInstruction::ADDHL)
+		{
+			name += ",";
+		}
+		if (Target != ERegisterTarget::UNK)
+		{
+			name += std::string(" ") + getTargetName(Target);
+		}
+		return name;
+	}
+
+private:
+	[[nodiscard]] static const char* getTargetName(const ERegisterTarget target)
+	{
+		static constexpr const char* NAMES[] = { "A", "B", "C", "D", "E", "H", "L", "AF", "BC", "DE", "HL", "SP", "?" };
+		return NAMES[static_cast<size_t>(target)];
+	}
+};
+
+struct SAluMismatch
+{
+	SAluState Input;
+	SAluState Expected;
+	SAluState Actual;
+};
+
+// Mismatches of one subject on one sweep, Examples holds the ones with the lowest case index
+struct SAluResult
+{
+	EAluSubject Subject = EAluSubject::Execute;
+	SAluSweep Sweep;
+	U64 Cases = 0;
+	U64 Mismatches = 0;
+	std::vector<SAluMismatch> Examples;
+};
+
+// Runs every case of a list of sweeps through each subject and compares the registers
+// afterwards with the reference model, which follows the documented behavior of each
+// instruction and shares no code with the emulator
+// The cases are split into chunks run on a thread pool, each worker has its own processor
+// and JIT so nothing is shared while they run
+class CAluConformance
+{
+public:
+	static constexpr U64 CHUNK_CASES = 1 << 16;
+
+	explicit CAluConformance(CThreadPool& pool)
+		: m_Pool(pool), m_Workers(pool.GetThreadCount())
+	{
+	}
+
+	// Every 8-bit instruction on B and on A, BIT, RES and SET for every bit, and the 16-bit
+	// instructions on every pair they take
+	// wide runs ADD HL, rr over all HL and rr, 2^32 cases each
+	[[nodiscard]] static std::vector<SAluSweep> GetSweeps(const bool wide = false)
+	{
+		std::vector<SAluSweep> sweeps;
+		for (const EInstruction instruction : {
+			EInstruction::ADD, EInstruction::ADDC, EInstruction::SUB, EInstruction::SUBC, EInstruction::AND, EInstruction::OR,
+			EInstruction::XOR, EInstruction::CP, EInstruction::INC, EInstruction::DEC, EInstruction::SRL, EInstruction::RR,
+			EInstruction::RL, EInstruction::RRC, EInstruction::RLC, EInstruction::SRA, EInstruction::SLA, EInstruction::SWAP })
+		{
+			sweeps.push_back({ instruction, ERegisterTarget::B, 0, EAluSpace::Operand8 });
+			sweeps.push_back({ instruction, ERegisterTarget::A, 0, EAluSpace::Accumulator });
+		}
+		for (const EInstruction instruction : { EInstruction::BIT, EInstruction::RESET, EInstruction::SET })
+		{
+			for (U8 bit = 0; bit < 8; ++bit)
+			{
+				sweeps.push_back({ instruction, ERegisterTarget::B, bit, EAluSpace::Operand8 });
+				sweeps.push_back({ instruction, ERegisterTarget::A, bit, EAluSpace::Accumulator });
+			}
+		}
+		for (const EInstruction instruction : {
+			EInstruction::CCF, EInstruction::SCF, EInstruction::RRA, EInstruction::RLA, EInstruction::RRCA, EInstruction::RRLA, EInstruction::CPL })
+		{
+			sweeps.push_back({ instruction, ERegisterTarget::UNK, 0, EAluSpace::Operand8 });
+		}
+		for (const ERegisterTarget target : { ERegisterTarget::BC, ERegisterTarget::DE, ERegisterTarget::HL, ERegisterTarget::SP })
+		{
+			sweeps.push_back({ EInstruction::INC16, target, 0, EAluSpace::Pair });
+			sweeps.push_back({ EInstruction::DEC16, target, 0, EAluSpace::Pair });
+			const EAluSpace addSpace = target == ERegisterTarget::HL ? EAluSpace::Pair : wide ? EAluSpace::AddPairWide : EAluSpace::AddPair;
+			sweeps.push_back({ EInstruction::ADDHL, target, 0, addSpace });
+		}
+		return sweeps;
+	}
+
+	[[nodiscard]] static bool IsSupported(const EAluSubject subject, const SAluSweep& sweep)
+	{
+		const U16 opcode = CProcessor::Encode(sweep.Instruction, sweep.Target, sweep.Bit);
+		switch (subject)
+		{
+		case EAluSubject::Execute:
+			return opcode != CProcessor::INVALID_OPCODE;
+		case EAluSubject::Arithmetic:
+		case EAluSubject::Table:
+			return hasAluPath(sweep.Instruction);
+		case EAluSubject::Jit:
+			return JIT && opcode != CProcessor::INVALID_OPCODE
+				&& CJit::GetNativeCycles(static_cast<U8>(opcode >> 8 == 0xCB ? 0xCB : opcode), opcode & 0xFF) != 0;
+		default:
+			return CPixelKernels::IsSupported(getLanePath(subject)) && CLaneAlu::IsLaneOpcode(opcode);
+		}
+	}
+
+	[[nodiscard]] static SAluState GetInput(const SAluSweep& sweep, const U64 index)
+	{
+		SAluState state{ 0x00, 0x00, 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC, 0xDEF0 };
+		switch (sweep.Space)
+		{
+		case EAluSpace::Operand8:
+			if (sweep.Target != ERegisterTarget::UNK)
+			{
+				r8(state, sweep.Target) = static_cast<U8>(index);
+			}
+			else
+			{
+				state.B = static_cast<U8>(index);
+			}
+			state.A = static_cast<U8>(index >> 8);
+			state.F = static_cast<U8>(index >> 16 << 4);
+			break;
+		case EAluSpace::Accumulator:
+			state.A = static_cast<U8>(index);
+			state.F = static_cast<U8>(index >> 8 << 4);
+			break;
+		case EAluSpace::Pair:
+			setPair(state, sweep.Target, static_cast<U16>(index));
+			state.F = static_cast<U8>(index >> 16 << 4);
+			break;
+		case EAluSpace::AddPair:
+		{
+			static constexpr U16 OPERANDS[16] = {
+				0x0000, 0x0001, 0x000F, 0x0010, 0x00FF, 0x0100, 0x07FF, 0x0800,
+				0x0FFF, 0x1000, 0x7FFF, 0x8000, 0xF001, 0xFFFF, 0x1234, 0xEDCC
+			};
+			state.H = static_cast<U8>(index >> 8);
+			state.L = static_cast<U8>(index);
+			setPair(state, sweep.Target, OPERANDS[(index >> 16) & 0xF]);
+			state.F = mixedFlags(index);
+			break;
+		}
+		case EAluSpace::AddPairWide:
+			state.H = static_cast<U8>(index >> 8);
+			state.L = static_cast<U8>(index);
+			setPair(state, sweep.Target, static_cast<U16>(index >> 16));
+			state.F = mixedFlags(index);
+			break;
+		}
+		return state;
+	}
+
+	// The registers after the instruction as the hardware leaves them
+	[[nodiscard]] static SAluState Reference(const SAluSweep& sweep, SAluState state)
+	{
+		constexpr U8 Z = 0x80;
+		constexpr U8 N = 0x40;
+		constexpr U8 H = 0x20;
+		constexpr U8 C = 0x10;
+		const bool carryIn = (state.F & C) != 0;
+		const U8 keptZ = state.F & Z;
+		const U8 keptC = state.F & C;
+		const auto zero = [](const U32 value) { return (value & 0xFF) == 0 ? Z : 0; };
+		U8 unused = 0;
+		U8& target = sweep.Target <= ERegisterTarget::L ? r8(state, sweep.Target) : unused;
+		const U32 a = state.A;
+		const U32 value = target;
+
+		switch (sweep.Instruction)
+		{
+		case EInstruction::ADD:
+		case EInstruction::ADDC:
+		{
+			const U32 carry = sweep.Instruction == EInstruction::ADDC && carryIn ? 1 : 0;
+			const U32 sum = a + value + carry;
+			state.F = zero(sum) | ((a & 0xF) + (value & 0xF) + carry > 0xF ? H : 0) | (sum > 0xFF ? C : 0);
+			state.A = static_cast<U8>(sum);
+			break;
+		}
+		case EInstruction::SUB:
+		case EInstruction::SUBC:
+		case EInstruction::CP:
+		{
+			const int32_t carry = sweep.Instruction == EInstruction::SUBC && carryIn ? 1 : 0;
+			const int32_t difference = static_cast<int32_t>(a) - static_cast<int32_t>(value) - carry;
+			const int32_t lowDifference = static_cast<int32_t>(a & 0xF) - static_cast<int32_t>(value & 0xF) - carry;
+			state.F = zero(static_cast<U32>(difference)) | N | (lowDifference < 0 ? H : 0) | (difference < 0 ? C : 0);
+			if (sweep.Instruction != EInstruction::CP)
+			{
+				state.A = static_cast<U8>(difference);
+			}
+			break;
+		}
+		case EInstruction::AND:
+			state.A = static_cast<U8>(a & value);
+			state.F = zero(state.A) | H;
+			break;
+		case EInstruction::OR:
+			state.A = static_cast<U8>(a | value);
+			state.F = zero(state.A);
+			break;
+		case EInstruction::XOR:
+			state.A = static_cast<U8>(a ^ value);
+			state.F = zero(state.A);
+			break;
+		case EInstruction::INC:
+			target = static_cast<U8>(value + 1);
+			state.F = zero(target) | ((value & 0xF) == 0xF ? H : 0) | keptC;
+			break;
+		case EInstruction::DEC:
+			target = static_cast<U8>(value - 1);
+			state.F = zero(target) | N | ((value & 0xF) == 0 ? H : 0) | keptC;
+			break;
+		case EInstruction::CCF:
+			state.F = keptZ | (carryIn ? 0 : C);
+			break;
+		case EInstruction::SCF:
+			state.F = keptZ | C;
+			break;
+		case EInstruction::CPL:
+			state.A = static_cast<U8>(~a);
+			state.F = keptZ | N | H | keptC;
+			break;
+		// The rotates of A always reset Z
+		case EInstruction::RRLA:
+			state.A = static_cast<U8>(a << 1 | a >> 7);
+			state.F = a & 0x80 ? C : 0;
+			break;
+		case EInstruction::RRCA:
+			state.A = static_cast<U8>(a >> 1 | a << 7);
+			state.F = a & 0x01 ? C : 0;
+			break;
+		case EInstruction::RLA:
+			state.A = static_cast<U8>(a << 1 | (carryIn ? 1 : 0));
+			state.F = a & 0x80 ? C : 0;
+			break;
+		case EInstruction::RRA:
+			state.A = static_cast<U8>(a >> 1 | (carryIn ? 0x80 : 0));
+			state.F = a & 0x01 ? C : 0;
+			break;
+		case EInstruction::RLC:
+			target = static_cast<U8>(value << 1 | value >> 7);
+			state.F = zero(target) | (value & 0x80 ? C : 0);
+			break;
+		case EInstruction::RRC:
+			target = static_cast<U8>(value >> 1 | value << 7);
+			state.F = zero(target) | (value & 0x01 ? C : 0);
+			break;
+		case EInstruction::RL:
+			target = static_cast<U8>(value << 1 | (carryIn ? 1 : 0));
+			state.F = zero(target) | (value & 0x80 ? C : 0);
+			break;
+		case EInstruction::RR:
+			target = static_cast<U8>(value >> 1 | (carryIn ? 0x80 : 0));
+			state.F = zero(target) | (value & 0x01 ? C : 0);
+			break;
+		case EInstruction::SLA:
+			target = static_cast<U8>(value << 1);
+			state.F = zero(target) | (value & 0x80 ? C : 0);
+			break;
+		case EInstruction::SRA:
+			target = static_cast<U8>(value >> 1 | (value & 0x80));
+			state.F = zero(target) | (value & 0x01 ? C : 0);
+			break;
+		case EInstruction::SRL:
+			target = static_cast<U8>(value >> 1);
+			state.F = zero(target) | (value & 0x01 ? C : 0);
+			break;
+		case EInstruction::SWAP:
+			target = static_cast<U8>(value << 4 | value >> 4);
+			state.F = zero(target);
+			break;
+		case EInstruction::BIT:
+			state.F = ((value >> sweep.Bit) & 1 ? 0 : Z) | H | keptC;
+			break;
+		case EInstruction::RESET:
+			target = static_cast<U8>(value & ~(1u << sweep.Bit));
+			break;
+		case EInstruction::SET:
+			target = static_cast<U8>(value | 1u << sweep.Bit);
+			break;
+		case EInstruction::INC16:
+			setPair(state, sweep.Target, static_cast<U16>(getPair(state, sweep.Target) + 1));
+			break;
+		case EInstruction::DEC16:
+			setPair(state, sweep.Target, static_cast<U16>(getPair(state, sweep.Target) - 1));
+			break;
+		case EInstruction::ADDHL:
+		{
+			// Z is kept, H is the carry out of bit 11 and C out of bit 15
+			const U32 hl = getPair(state, ERegisterTarget::HL);
+			const U32 operand = getPair(state, sweep.Target);
+			const U32 sum = hl + operand;
+			state.F = keptZ | ((hl & 0xFFF) + (operand & 0xFFF) > 0xFFF ? H : 0) | (sum > 0xFFFF ? C : 0);
+			setPair(state, ERegisterTarget::HL, static_cast<U16>(sum));
+			break;
+		}
+		default:
+			break;
+		}
+		return state;
+	}
+
+	// One result per supported subject and sweep, in the order they were given
+	// The examples of a result are the first maxExamples mismatches by case index
+	[[nodiscard]] std::vector<SAluResult> Run(const std::vector<EAluSubject>& subjects, const std::vector<SAluSweep>& sweeps, const size_t maxExamples = 3)
+	{
+		struct SChunk
+		{
+			size_t Result;
+			U64 First;
+			U64 Count;
+		};
+		std::vector<SAluResult> results;
+		std::vector<SChunk> chunks;
+		for (const EAluSubject subject : subjects)
+		{
+			for (const SAluSweep& sweep : sweeps)
+			{
+				if (!IsSupported(subject, sweep))
+				{
+					continue;
+				}
+				SAluResult result;
+				result.Subject = subject;
+				result.Sweep = sweep;
+				result.Cases = sweep.GetCaseCount();
+				for (U64 first = 0; first < result.Cases; first += CHUNK_CASES)
+				{
+					chunks.push_back({ results.size(), first, std::min(CHUNK_CASES, result.Cases - first) });
+				}
+				results.push_back(result);
+			}
+		}
+
+		std::vector<SAluResult> chunkResults(chunks.size());
+		m_Pool.ParallelFor(chunks.size(), [&](const size_t index, const U32 worker) {
+			const SChunk& chunk = chunks[index];
+			const SAluResult& result = results[chunk.Result];
+			runChunk(result.Subject, result.Sweep, chunk.First, chunk.Count, maxExamples, getWorker(worker), chunkResults[index]);
+		});
+		for (size_t i = 0; i < chunks.size(); ++i)
+		{
+			SAluResult& result = results[chunks[i].Result];
+			result.Mismatches += chunkResults[i].Mismatches;
+			for (const SAluMismatch& mismatch : chunkResults[i].Examples)
+			{
+				if (result.Examples.size() < maxExamples)
+				{
+					result.Examples.push_back(mismatch);
+				}
+			}
+		}
+		return results;
+	}
+
+private:
+	// Scratch space of one thread of the pool
+	struct SWorker
+	{
+		std::unique_ptr<CProcessor> Cpu;
+		std::unique_ptr<CJit> Jit;
+		// Compiled run of each opcode, CB opcodes have 0xCB in the high byte
+		std::unordered_map<U16, U16> Runs;
+	};
+
+	CThreadPool& m_Pool;
+	std::vector<std::unique_ptr<SWorker>> m_Workers;
+
+	SWorker& getWorker(const U32 index)
+	{
+		if (m_Workers[index] == nullptr)
+		{
+			m_Workers[index] = std::make_unique<SWorker>();
+			m_Workers[index]->Cpu = std::make_unique<CProcessor>();
+		}
+		return *m_Workers[index];
+	}
+
+	[[nodiscard]] static bool hasAluPath(const EInstruction instruction)
+	{
+		switch (instruction)
+		{
+		case EInstruction::ADD:
+		case EInstruction::ADDC:
+		case EInstruction::SUB:
+		case EInstruction::SUBC:
+		case EInstruction::CP:
+		case EInstruction::INC:
+		case EInstruction::DEC:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	[[nodiscard]] static EPixelPath getLanePath(const EAluSubject subject)
+	{
+		return subject == EAluSubject::LanesAvx2 ? EPixelPath::Avx2 : subject == EAluSubject::LanesSse2 ? EPixelPath::Sse2 : EPixelPath::Scalar;
+	}
+
+	[[nodiscard]] static U8& r8(SAluState& state, const ERegisterTarget target)
+	{
+		switch (target)
+		{
+		case ERegisterTarget::A:
+			return state.A;
+		case ERegisterTarget::B:
+			return state.B;
+		case ERegisterTarget::C:
+			return state.C;
+		case ERegisterTarget::D:
+			return state.D;
+		case ERegisterTarget::E:
+			return state.E;
+		case ERegisterTarget::H:
+			return state.H;
+		default:
+			return state.L;
+		}
+	}
+
+	[[nodiscard]] static U16 getPair(const SAluState& state, const ERegisterTarget target)
+	{
+		switch (target)
+		{
+		case ERegisterTarget::BC:
+			return static_cast<U16>(state.B << 8 | state.C);
+		case ERegisterTarget::DE:
+			return static_cast<U16>(state.D << 8 | state.E);
+		case ERegisterTarget::HL:
+			return static_cast<U16>(state.H << 8 | state.L);
+		default:
+			return state.SP;
+		}
+	}
+
+	static void setPair(SAluState& state, const ERegisterTarget target, const U16 value)
+	{
+		const U8 high = static_cast<U8>(value >> 8);
+		const U8 low = static_cast<U8>(value);
+		switch (target)
+		{
+		case ERegisterTarget::BC:
+			state.B = high;
+			state.C = low;
+			break;
+		case ERegisterTarget::DE:
+			state.D = high;
+			state.E = low;
+			break;
+		case ERegisterTarget::HL:
+			state.H = high;
+			state.L = low;
+			break;
+		default:
+			state.SP = value;
+			break;
+		}
+	}
+
+	// Every flag value with every low byte of HL
+	[[nodiscard]] static U8 mixedFlags(const U64 index)
+	{
+		return static_cast<U8>(((index ^ index >> 8 ^ index >> 20) & 0xF) << 4);
+	}
+
+	static void runChunk(const EAluSubject subject, const SAluSweep& sweep, const U64 first, const U64 count, const size_t maxExamples,
+		SWorker& worker, SAluResult& result)
+	{
+		const auto check = [&](const SAluState& input, const SAluState& actual) {
+			const SAluState expected = Reference(sweep, input);
+			if (actual != expected)
+			{
+				++result.Mismatches;
+				if (result.Examples.size() < maxExamples)
+				{
+					result.Examples.push_back({ input, expected, actual });
+				}
+			}
+		};
+		const U16 opcode = CProcessor::Encode(sweep.Instruction, sweep.Target, sweep.Bit);
+		switch (subject)
+		{
+		case EAluSubject::Execute:
+		{
+			CProcessor& cpu = *worker.Cpu;
+			for (U64 index = first; index < first + count; ++index)
+			{
+				const SAluState input = GetInput(sweep, index);
+				input.ToRegisters(cpu.Registers);
+				cpu.Execute(sweep.Instruction, sweep.Target, sweep.Bit);
+				check(input, SAluState::FromRegisters(cpu.Registers));
+			}
+			break;
+		}
+		case EAluSubject::Arithmetic:
+			runPath<EAluPath::Arithmetic>(sweep, first, count, check);
+			break;
+		case EAluSubject::Table:
+			runPath<EAluPath::Table>(sweep, first, count, check);
+			break;
+		case EAluSubject::Jit:
+		{
+			const CJit::SRun* run = getRun(worker, opcode);
+			if (run == nullptr)
+			{
+				// Not compiled, which counts as failing every case
+				result.Mismatches += count;
+				break;
+			}
+			for (U64 index = first; index < first + count; ++index)
+			{
+				const SAluState input = GetInput(sweep, index);
+				SRegisters registers{};
+				input.ToRegisters(registers);
+				registers.SetF(run->Code(registers.R8, registers.GetF()));
+				check(input, SAluState::FromRegisters(registers));
+			}
+			break;
+		}
+		default:
+		{
+			const SLaneKernels& kernels = CLaneAlu::Get(getLanePath(subject));
+			std::array<U16, SLaneRegisters::LANES> opcodes;
+			opcodes.fill(opcode);
+			for (U64 index = first; index < first + count; index += SLaneRegisters::LANES)
+			{
+				const U32 lanes = static_cast<U32>(std::min<U64>(SLaneRegisters::LANES, first + count - index));
+				SLaneRegisters registers;
+				std::array<SAluState, SLaneRegisters::LANES> inputs;
+				for (U32 lane = 0; lane < lanes; ++lane)
+				{
+					SRegisters scalar{};
+					inputs[lane] = GetInput(sweep, index + lane);
+					inputs[lane].ToRegisters(scalar);
+					registers.SetLane(lane, scalar);
+				}
+				if (!CLaneAlu::Execute(opcodes, registers, kernels))
+				{
+					break;
+				}
+				for (U32 lane = 0; lane < lanes; ++lane)
+				{
+					// Lanes have no SP
+					SAluState actual = SAluState::FromRegisters(registers.GetLane(lane));
+					actual.SP = inputs[lane].SP;
+					check(inputs[lane], actual);
+				}
+			}
+			break;
+		}
+		}
+	}
+
+	template<EAluPath Path, typename TCheck>
+	static void runPath(const SAluSweep& sweep, const U64 first, const U64 count, TCheck check)
+	{
+		for (U64 index = first; index < first + count; ++index)
+		{
+			const SAluState input = GetInput(sweep, index);
+			SRegisters registers{};
+			input.ToRegisters(registers);
+			const ERegisterTarget target = sweep.Target;
+			U8& value = target == ERegisterTarget::A ? registers.A : registers.R8[SRegisters::R8Index(encodeR8(target))];
+			switch (sweep.Instruction)
+			{
+			case EInstruction::ADD:
+				COperations::Add<Path>(value, registers);
+				break;
+			case EInstruction::ADDC:
+				COperations::AddC<Path>(value, registers);
+				break;
+			case EInstruction::SUB:
+				COperations::Sub<Path>(value, registers);
+				break;
+			case EInstruction::SUBC:
+				COperations::SubC<Path>(value, registers);
+				break;
+			case EInstruction::CP:
+				COperations::Cp<Path>(value, registers);
+				break;
+			case EInstruction::INC:
+				value = COperations::Inc<Path>(value, registers);
+				break;
+			default:
+				value = COperations::Dec<Path>(value, registers);
+				break;
+			}
+			check(input, SAluState::FromRegisters(registers));
+		}
+	}
+
+	// Opcode encoding of the 8-bit registers, B C D E H L - A
+	[[nodiscard]] static U8 encodeR8(const ERegisterTarget target)
+	{
+		switch (target)
+		{
+		case ERegisterTarget::B:
+			return 0;
+		case ERegisterTarget::C:
+			return 1;
+		case ERegisterTarget::D:
+			return 2;
+		case ERegisterTarget::E:
+			return 3;
+		case ERegisterTarget::H:
+			return 4;
+		case ERegisterTarget::L:
+			return 5;
+		default:
+			return 7;
+		}
+	}
+
+	// Compiles the opcode followed by a NOP once per worker, a run needs two instructions
+	[[nodiscard]] static const CJit::SRun* getRun(SWorker& worker, const U16 opcode)
+	{
+		if (worker.Jit == nullptr)
+		{
+			worker.Jit = std::make_unique<CJit>();
+		}
+		CJit& jit = *worker.Jit;
+		const auto found = worker.Runs.find(opcode);
+		if (found != worker.Runs.end())
+		{
+			return &jit.GetRun(found->second);
+		}
+		if (!jit.IsAvailable() || !jit.HasRoomForBlock())
+		{
+			return nullptr;
+		}
+		const bool prefixed = opcode >> 8 == 0xCB;
+		CBlockCache::SBlock block;
+		block.Count = 2;
+		block.Instructions[0] = { nullptr, static_cast<U16>(prefixed ? opcode & 0xFF : 0), static_cast<U8>(prefixed ? 2 : 1),
+			static_cast<U8>(prefixed ? 0xCB : opcode), CBlockCache::NO_NATIVE_RUN };
+		block.Instructions[1] = { nullptr, 0, 1, 0x00, CBlockCache::NO_NATIVE_RUN };
+		jit.CompileBlock(block);
+		if (block.Instructions[0].NativeRun == CBlockCache::NO_NATIVE_RUN)
+		{
+			return nullptr;
+		}
+		worker.Runs[opcode] = block.Instructions[0].NativeRun;
+		return &jit.GetRun(block.Instructions[0].NativeRun);
+	}
+};
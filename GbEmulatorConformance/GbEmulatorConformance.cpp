@@ -0,0 +1,169 @@
+// Exhaustive conformance sweep of the ALU instructions, it does not depend on Visual Studio
+// g++ -std=c++17 -O2 -pthread GbEmulatorConformance.cpp -o GbEmulatorConformance
+// Add -DGB_LAZY_FLAGS=0 or -DGB_TABLE_ALU=1 to check the execute subject in those builds
+//
+// GbEmulatorConformance [--subject name]... [--filter text] [--threads n] [--examples n] [--wide] [--verbose]
+// Subjects are execute, arithmetic, table, jit, lanes/scalar, lanes/sse2 and lanes/avx2, all of
+// them run by default. Only failing sweeps are listed unless --verbose is given
+// Exits with 1 if any case differs from the reference model
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Conformance.h"
+
+namespace
+{
+	constexpr EAluSubject ALL_SUBJECTS[] = {
+		EAluSubject::Execute, EAluSubject::Arithmetic, EAluSubject::Table, EAluSubject::Jit,
+		EAluSubject::LanesScalar, EAluSubject::LanesSse2, EAluSubject::LanesAvx2
+	};
+
+	struct SOptions
+	{
+		std::vector<EAluSubject> Subjects;
+		// Only sweeps whose name contains this run
+		std::string Filter;
+		U32 Threads = std::max(1u, std::thread::hardware_concurrency());
+		size_t Examples = 3;
+		bool Wide = false;
+		bool Verbose = false;
+	};
+
+	[[nodiscard]] bool parseSubject(const char* name, std::vector<EAluSubject>& subjects)
+	{
+		for (const EAluSubject subject : ALL_SUBJECTS)
+		{
+			if (std::strcmp(name, GetSubjectName(subject)) == 0)
+			{
+				subjects.push_back(subject);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	[[nodiscard]] bool parseArguments(const int argc, char** argv, SOptions& options)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const char* argument = argv[i];
+			const bool hasValue = i + 1 < argc;
+			if (std::strcmp(argument, "--subject") == 0 && hasValue)
+			{
+				if (!parseSubject(argv[++i], options.Subjects))
+				{
+					return false;
+				}
+			}
+			else if (std::strcmp(argument, "--filter") == 0 && hasValue)
+			{
+				options.Filter = argv[++i];
+			}
+			else if (std::strcmp(argument, "--threads") == 0 && hasValue)
+			{
+				options.Threads = static_cast<U32>(std::max(1, std::atoi(argv[++i])));
+			}
+			else if (std::strcmp(argument, "--examples") == 0 && hasValue)
+			{
+				options.Examples = static_cast<size_t>(std::max(0, std::atoi(argv[++i])));
+			}
+			else if (std::strcmp(argument, "--wide") == 0)
+			{
+				options.Wide = true;
+			}
+			else if (std::strcmp(argument, "--verbose") == 0)
+			{
+				options.Verbose = true;
+			}
+			else
+			{
+				return false;
+			}
+		}
+		if (options.Subjects.empty())
+		{
+			options.Subjects.assign(std::begin(ALL_SUBJECTS), std::end(ALL_SUBJECTS));
+		}
+		return true;
+	}
+
+	// The whole input, then only the registers that came out wrong
+	void printMismatch(const SAluMismatch& mismatch)
+	{
+		const SAluState& input = mismatch.Input;
+		std::printf("    AF=%02X%02X BC=%02X%02X DE=%02X%02X HL=%02X%02X SP=%04X:", input.A, input.F, input.B, input.C, input.D, input.E,
+			input.H, input.L, input.SP);
+		const auto compare = [](const char* name, const unsigned expected, const unsigned actual, const int digits) {
+			if (expected != actual)
+			{
+				std::printf(" %s %0*X, got %0*X", name, digits, expected, digits, actual);
+			}
+		};
+		const SAluState& expected = mismatch.Expected;
+		const SAluState& actual = mismatch.Actual;
+		compare("A", expected.A, actual.A, 2);
+		compare("F", expected.F, actual.F, 2);
+		compare("B", expected.B, actual.B, 2);
+		compare("C", expected.C, actual.C, 2);
+		compare("D", expected.D, actual.D, 2);
+		compare("E", expected.E, actual.E, 2);
+		compare("H", expected.H, actual.H, 2);
+		compare("L", expected.L, actual.L, 2);
+		compare("SP", expected.SP, actual.SP, 4);
+		std::printf("\n");
+	}
+}
+
+int main(const int argc, char** argv)
+{
+	SOptions options;
+	if (!parseArguments(argc, argv, options))
+	{
+		std::fprintf(stderr,
+			"usage: %s [--subject name]... [--filter text] [--threads n] [--examples n] [--wide] [--verbose]\n", argv[0]);
+		return 2;
+	}
+
+	std::vector<SAluSweep> sweeps;
+	for (const SAluSweep& sweep : CAluConformance::GetSweeps(options.Wide))
+	{
+		if (sweep.GetName().find(options.Filter) != std::string::npos)
+		{
+			sweeps.push_back(sweep);
+		}
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+	CThreadPool pool(options.Threads);
+	CAluConformance conformance(pool);
+	const std::vector<SAluResult> results = conformance.Run(options.Subjects, sweeps, options.Examples);
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	U64 cases = 0;
+	U64 mismatches = 0;
+	U32 failed = 0;
+	for (const SAluResult& result : results)
+	{
+		cases += result.Cases;
+		mismatches += result.Mismatches;
+		failed += result.Mismatches != 0;
+		if (result.Mismatches == 0 && !options.Verbose)
+		{
+			continue;
+		}
+		std::printf("%-14s %-12s %10llu of %10llu cases differ\n", GetSubjectName(result.Subject), result.Sweep.GetName().c_str(),
+			static_cast<unsigned long long>(result.Mismatches), static_cast<unsigned long long>(result.Cases));
+		for (const SAluMismatch& mismatch : result.Examples)
+		{
+			printMismatch(mismatch);
+		}
+	}
+	std::printf("%zu sweeps, %llu cases, %llu mismatches in %u failing sweeps, %.2f s on %u threads\n", results.size(),
+		static_cast<unsigned long long>(cases), static_cast<unsigned long long>(mismatches), failed, elapsed.count(), pool.GetThreadCount());
+	return mismatches == 0 ? 0 : 1;
+}
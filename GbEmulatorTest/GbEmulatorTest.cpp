@@ -1,7 +1,22 @@
 #include "pch.h"
 #include "CppUnitTest.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
 
+#include "../GameboyEmulator/AudioOutput.h"
+#include "../GameboyEmulator/Cartridge.h"
+#include "../GameboyEmulator/FrameDump.h"
+#include "../GameboyEmulator/LaneAlu.h"
+#include "../GameboyEmulator/MachineBatch.h"
 #include "../GameboyEmulator/Processor.h"
+#include "../GameboyEmulator/Rewind.h"
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 
@@ -13,6 +28,16 @@ namespace GbEmulatorTest
 	public:
 		CProcessor Cpu;
 
+		// Copies a program to the start of WRAM and points PC at it
+		void loadProgram(const U8* program, const size_t size)
+		{
+			for (size_t i = 0; i < size; ++i)
+			{
+				Cpu.Bus.Write(static_cast<U16>(0xC000 + i), program[i]);
+			}
+			Cpu.Registers.PC = 0xC000;
+		}
+
 		TEST_METHOD(TestAdd)
 		{
 			Cpu.Registers.A = 250;
@@ -30,6 +55,7 @@ namespace GbEmulatorTest
 		}
 		TEST_METHOD(TestAddC)
 		{
+			Cpu.Execute(EInstruction::SCF, ERegisterTarget::UNK);
 			Cpu.Registers.A = 250;
 			Cpu.Registers.B = 10;
 
@@ -50,6 +76,15 @@ namespace GbEmulatorTest
 			Cpu.Execute(EInstruction::ADDHL, ERegisterTarget::BC);
 			Assert::AreEqual(4105, static_cast<int>(Cpu.Registers.GetHL()));
 			Assert::IsTrue(Cpu.Registers.GetFlags().HalfCarry);
+
+			// Z is kept, also when the sum is 0
+			Cpu.Registers.SetHL(0xFFF6);
+			Cpu.Execute(EInstruction::ADDHL, ERegisterTarget::BC);
+			Assert::AreEqual(0, static_cast<int>(Cpu.Registers.GetHL()));
+			Assert::IsFalse(Cpu.Registers.GetFlags().Zero);
+			Cpu.Execute(EInstruction::SUB, ERegisterTarget::A);
+			Cpu.Execute(EInstruction::ADDHL, ERegisterTarget::BC);
+			Assert::IsTrue(Cpu.Registers.GetFlags().Zero);
 		}
 		TEST_METHOD(TestSub)
 		{
@@ -69,6 +104,7 @@ namespace GbEmulatorTest
 		}
 		TEST_METHOD(TestSubC)
 		{
+			Cpu.Execute(EInstruction::SCF, ERegisterTarget::UNK);
 			Cpu.Registers.A = 8;
 			Cpu.Registers.B = 10;
 
@@ -177,5 +213,1378 @@ namespace GbEmulatorTest
 			Cpu.Execute(EInstruction::CCF, ERegisterTarget::UNK);
 			Assert::IsFalse(Cpu.Registers.GetFlags().Carry);
 		}
+
+		TEST_METHOD(TestRegisterPairs)
+		{
+			Cpu.Registers.SetHL(0x0800);
+			Cpu.Execute(EInstruction::ADDHL, ERegisterTarget::HL);
+			Assert::AreEqual(0x1000, static_cast<int>(Cpu.Registers.GetHL()));
+			Assert::IsTrue(Cpu.Registers.GetFlags().HalfCarry);
+
+			Cpu.Registers.SP = 0xFFFF;
+			Cpu.Execute(EInstruction::INC16, ERegisterTarget::SP);
+			Assert::AreEqual(0, static_cast<int>(Cpu.Registers.SP));
+			Cpu.Execute(EInstruction::DEC16, ERegisterTarget::DE);
+			Assert::AreEqual(0xFFFF, static_cast<int>(Cpu.Registers.GetDE()));
+			Assert::AreEqual(0xFF, static_cast<int>(Cpu.Registers.D));
+		}
+
+		TEST_METHOD(TestRegisterLayout)
+		{
+			const ERegisterTarget encodingOrder[] = {
+				ERegisterTarget::B, ERegisterTarget::C, ERegisterTarget::D, ERegisterTarget::E,
+				ERegisterTarget::H, ERegisterTarget::L
+			};
+			for (U8 encoding = 0; encoding < 6; ++encoding)
+			{
+				Cpu.Registers.R8[SRegisters::R8Index(encoding)] = encoding + 1;
+				Cpu.Execute(EInstruction::INC, encodingOrder[encoding]);
+			}
+			Cpu.Registers.R8[SRegisters::R8Index(7)] = 0x42;
+
+			Assert::AreEqual(0x0203, static_cast<int>(Cpu.Registers.GetBC()));
+			Assert::AreEqual(0x0405, static_cast<int>(Cpu.Registers.GetDE()));
+			Assert::AreEqual(0x0607, static_cast<int>(Cpu.Registers.GetHL()));
+			Assert::AreEqual(0x42, static_cast<int>(Cpu.Registers.A));
+
+			Cpu.Registers.SetDE(0xBEEF);
+			Assert::AreEqual(0xBE, static_cast<int>(Cpu.Registers.D));
+			Assert::AreEqual(0xEF, static_cast<int>(Cpu.Registers.E));
+		}
+
+		TEST_METHOD(TestFlagsAcrossOps)
+		{
+			// INC keeps the carry of the ADD before it
+			Cpu.Registers.A = 0xFF;
+			Cpu.Registers.B = 0x01;
+			Cpu.Registers.C = 0x0F;
+			Cpu.Execute(EInstruction::ADD, ERegisterTarget::B);
+			Cpu.Execute(EInstruction::INC, ERegisterTarget::C);
+			Assert::AreEqual(0x30, static_cast<int>(Cpu.Registers.GetAF() & 0xFF));
+
+			// ADC uses the carry from CP
+			Cpu.Registers.A = 0x01;
+			Cpu.Registers.B = 0x02;
+			Cpu.Execute(EInstruction::CP, ERegisterTarget::B);
+			Assert::AreEqual(0x70, static_cast<int>(Cpu.Registers.GetAF() & 0xFF));
+			Cpu.Execute(EInstruction::ADDC, ERegisterTarget::B);
+			Assert::AreEqual(4, static_cast<int>(Cpu.Registers.A));
+			Assert::AreEqual(0x00, static_cast<int>(Cpu.Registers.GetAF() & 0xFF));
+
+			Cpu.Registers.SetAF(0x12B0);
+			Assert::IsTrue(Cpu.Registers.GetFlags().Zero);
+			Assert::IsTrue(Cpu.Registers.GetFlags().HalfCarry);
+			Assert::IsTrue(Cpu.Registers.GetFlags().Carry);
+		}
+
+		TEST_METHOD(TestTableAlu)
+		{
+			for (int a = 0; a < 256; a += 7)
+			{
+				for (int value = 0; value < 256; value += 3)
+				{
+					SRegisters arithmetic{};
+					arithmetic.A = static_cast<U8>(a);
+					arithmetic.SetF(a & 1 ? 0x10 : 0x00);
+					SRegisters table = arithmetic;
+
+					COperations::SubC<EAluPath::Arithmetic>(static_cast<U8>(value), arithmetic);
+					COperations::SubC<EAluPath::Table>(static_cast<U8>(value), table);
+					Assert::AreEqual(arithmetic.GetAF(), table.GetAF());
+
+					COperations::AddC<EAluPath::Arithmetic>(static_cast<U8>(value), arithmetic);
+					COperations::AddC<EAluPath::Table>(static_cast<U8>(value), table);
+					Assert::AreEqual(arithmetic.GetAF(), table.GetAF());
+
+					arithmetic.A = COperations::Dec<EAluPath::Arithmetic>(static_cast<U8>(value), arithmetic);
+					table.A = COperations::Dec<EAluPath::Table>(static_cast<U8>(value), table);
+					Assert::AreEqual(arithmetic.GetAF(), table.GetAF());
+				}
+			}
+		}
+
+		TEST_METHOD(TestStep)
+		{
+			// ADD A, B / ADD A, 5 / SWAP A / INC (HL)
+			const U8 program[] = { 0x80, 0xC6, 0x05, 0xCB, 0x37, 0x34 };
+			loadProgram(program, sizeof(program));
+			Cpu.Registers.A = 10;
+			Cpu.Registers.B = 1;
+			Cpu.Registers.SetHL(0xC100);
+
+			Assert::AreEqual(4, static_cast<int>(Cpu.Step()));
+			Assert::AreEqual(11, static_cast<int>(Cpu.Registers.A));
+			Assert::AreEqual(8, static_cast<int>(Cpu.Step()));
+			Assert::AreEqual(16, static_cast<int>(Cpu.Registers.A));
+			Assert::IsTrue(Cpu.Registers.GetFlags().HalfCarry);
+			Assert::AreEqual(8, static_cast<int>(Cpu.Step()));
+			Assert::AreEqual(1, static_cast<int>(Cpu.Registers.A));
+			Assert::AreEqual(12, static_cast<int>(Cpu.Step()));
+			Assert::AreEqual(1, static_cast<int>(Cpu.Bus.Read(0xC100)));
+			Assert::AreEqual(0xC006, static_cast<int>(Cpu.Registers.PC));
+		}
+
+		TEST_METHOD(TestMemoryBus)
+		{
+			// Nothing mapped at 0000-7FFF without a cartridge
+			Assert::AreEqual(0xFF, static_cast<int>(Cpu.Bus.Read(0x0150)));
+
+			// E000-FDFF mirrors C000-DDFF
+			Cpu.Bus.Write(0xC123, 0x42);
+			Assert::AreEqual(0x42, static_cast<int>(Cpu.Bus.Read(0xE123)));
+			Cpu.Bus.Write(0xFDFF, 0x24);
+			Assert::AreEqual(0x24, static_cast<int>(Cpu.Bus.Read(0xDDFF)));
+
+			Cpu.Bus.Write(0xFF80, 0x11);
+			Cpu.Bus.Write(0xFFFF, 0x1F);
+			Assert::AreEqual(0x11, static_cast<int>(Cpu.Bus.Read(0xFF80)));
+			Assert::AreEqual(0x1F, static_cast<int>(Cpu.Bus.Read(0xFFFF)));
+
+			// OAM DMA from WRAM
+			Cpu.Bus.Write(0xC09F, 0x99);
+			Cpu.Bus.Write(0xFF46, 0xC0);
+			Assert::AreEqual(0x99, static_cast<int>(Cpu.Bus.Read(0xFE9F)));
+		}
+
+		TEST_METHOD(TestBankSwitching)
+		{
+			// 8 banks with the bank number in every byte
+			std::vector<U8> rom(8 * CMemoryBus::ROM_BANK_SIZE);
+			for (size_t i = 0; i < rom.size(); ++i)
+			{
+				rom[i] = static_cast<U8>(i / CMemoryBus::ROM_BANK_SIZE);
+			}
+			Cpu.Bus.LoadRom(rom.data(), rom.size(), EMbcType::Mbc1, 0x8000);
+
+			Assert::AreEqual(0, static_cast<int>(Cpu.Bus.Read(0x0000)));
+			Assert::AreEqual(1, static_cast<int>(Cpu.Bus.Read(0x4000)));
+			Cpu.Bus.Write(0x2000, 5);
+			Assert::AreEqual(5, static_cast<int>(Cpu.Bus.Read(0x7FFF)));
+			// Bank 0 selects bank 1
+			Cpu.Bus.Write(0x2000, 0);
+			Assert::AreEqual(1, static_cast<int>(Cpu.Bus.Read(0x4000)));
+
+			// Cartridge RAM is only there once enabled
+			Cpu.Bus.Write(0xA000, 0x12);
+			Assert::AreEqual(0xFF, static_cast<int>(Cpu.Bus.Read(0xA000)));
+			Cpu.Bus.Write(0x0000, 0x0A);
+			Cpu.Bus.Write(0xA000, 0x12);
+			Assert::AreEqual(0x12, static_cast<int>(Cpu.Bus.Read(0xA000)));
+			Cpu.Bus.Write(0x6000, 1);
+			Cpu.Bus.Write(0x4000, 1);
+			Assert::AreEqual(0, static_cast<int>(Cpu.Bus.Read(0xA000)));
+			Cpu.Bus.Write(0x4000, 0);
+			Assert::AreEqual(0x12, static_cast<int>(Cpu.Bus.Read(0xA000)));
+
+			Cpu.Bus.LoadRom(rom.data(), rom.size(), EMbcType::Mbc5, 0);
+			Cpu.Bus.Write(0x2000, 7);
+			Assert::AreEqual(7, static_cast<int>(Cpu.Bus.Read(0x4000)));
+			Cpu.Bus.Write(0x2000, 0);
+			Assert::AreEqual(0, static_cast<int>(Cpu.Bus.Read(0x4000)));
+
+			// A ROM shorter than a bank reads FF past its end, LD A, 42
+			std::vector<U8> small(0x100, 0x00);
+			small[0] = 0x3E;
+			small[1] = 0x42;
+			Cpu.Bus.LoadRom(small.data(), small.size(), EMbcType::None, 0);
+			Assert::AreEqual(0x3E, static_cast<int>(Cpu.Bus.Read(0x0000)));
+			Assert::AreEqual(0xFF, static_cast<int>(Cpu.Bus.Read(0x0100)));
+			Assert::AreEqual(0xFF, static_cast<int>(Cpu.Bus.Read(0x7FFF)));
+			Cpu.Registers.PC = 0x0000;
+			Cpu.Step();
+			Assert::AreEqual(0x42, static_cast<int>(Cpu.Registers.A));
+		}
+
+		TEST_METHOD(TestTimer)
+		{
+			// NOPs, with the timer ticking every 16 cycles
+			loadProgram(std::vector<U8>(0x100, 0x00).data(), 0x100);
+			Cpu.Bus.Write(CTimer::TMA_ADDRESS, 0x10);
+			Cpu.Bus.Write(CTimer::TIMA_ADDRESS, 0xFE);
+			Cpu.Bus.Write(CTimer::TAC_ADDRESS, 0b101);
+			Assert::AreEqual(static_cast<U64>(32), Cpu.Scheduler.GetTimestamp(EEvent::TimerOverflow));
+
+			for (int i = 0; i < 4; ++i)
+			{
+				Cpu.Step();
+			}
+			Assert::AreEqual(0xFF, static_cast<int>(Cpu.Bus.Read(CTimer::TIMA_ADDRESS)));
+			Assert::AreEqual(0, static_cast<int>(Cpu.Bus.Read(0xFF0F) & 0x1F));
+
+			// The overflow event reloads TMA and requests the interrupt without TIMA being read
+			for (int i = 0; i < 4; ++i)
+			{
+				Cpu.Step();
+			}
+			Assert::AreEqual(1 << static_cast<U8>(EInterrupt::Timer), static_cast<int>(Cpu.Bus.Read(0xFF0F) & 0x1F));
+			Assert::AreEqual(static_cast<U64>(32 + 0xF0 * 16), Cpu.Scheduler.GetTimestamp(EEvent::TimerOverflow));
+			Cpu.RunUntil(1000);
+			Assert::AreEqual(0x10 + (1000 - 32) / 16, static_cast<int>(Cpu.Bus.Read(CTimer::TIMA_ADDRESS)));
+
+			// DIV counts every 256 cycles from the last write
+			Assert::AreEqual(1000 / 256, static_cast<int>(Cpu.Bus.Read(CTimer::DIV_ADDRESS)));
+			Cpu.Bus.Write(CTimer::DIV_ADDRESS, 0x55);
+			Assert::AreEqual(0, static_cast<int>(Cpu.Bus.Read(CTimer::DIV_ADDRESS)));
+
+			Cpu.Bus.Write(CTimer::TAC_ADDRESS, 0);
+			Assert::IsFalse(Cpu.Scheduler.IsScheduled(EEvent::TimerOverflow));
+		}
+
+		TEST_METHOD(TestCartridgeHeader)
+		{
+			std::vector<U8> rom(0x10000);
+			const char title[] = "TETRIS";
+			std::copy(std::begin(title), std::end(title) - 1, rom.begin() + SCartridgeHeader::TITLE_ADDRESS);
+			rom[SCartridgeHeader::TYPE_ADDRESS] = 0x13;
+			rom[SCartridgeHeader::ROM_SIZE_ADDRESS] = 1;
+			rom[SCartridgeHeader::RAM_SIZE_ADDRESS] = 3;
+
+			SCartridgeHeader header;
+			Assert::IsTrue(CCartridge::ParseHeader(rom.data(), rom.size(), header) == ECartridgeError::HeaderChecksum);
+
+			U8 checksum = 0;
+			for (U16 address = SCartridgeHeader::TITLE_ADDRESS; address < SCartridgeHeader::HEADER_CHECKSUM_ADDRESS; ++address)
+			{
+				checksum = checksum - rom[address] - 1;
+			}
+			rom[SCartridgeHeader::HEADER_CHECKSUM_ADDRESS] = checksum;
+			Assert::IsTrue(CCartridge::ParseHeader(rom.data(), rom.size(), header) == ECartridgeError::None);
+			Assert::AreEqual(std::string("TETRIS"), header.Title);
+			Assert::IsTrue(header.MbcType == EMbcType::Mbc3);
+			Assert::IsTrue(header.HasBattery);
+			Assert::AreEqual(static_cast<size_t>(0x10000), header.RomSize);
+			Assert::AreEqual(static_cast<size_t>(0x8000), header.RamSize);
+			Assert::IsFalse(header.GlobalChecksumValid);
+
+			Assert::IsTrue(CCartridge::ParseHeader(rom.data(), 0x8000, header) == ECartridgeError::SizeMismatch);
+			Assert::IsTrue(CCartridge::ParseHeader(rom.data(), 0x100, header) == ECartridgeError::TooSmall);
+		}
+
+		TEST_METHOD(TestControlFlow)
+		{
+			// LD SP, D000 / LD BC, 1234 / PUSH BC / POP DE / CALL C00D / JR -2
+			// C00D: LD A, 0 / OR A / RET NZ / RET Z
+			const U8 program[] = {
+				0x31, 0x00, 0xD0, 0x01, 0x34, 0x12, 0xC5, 0xD1, 0xCD, 0x0D, 0xC0, 0x18, 0xFE,
+				0x3E, 0x00, 0xB7, 0xC0, 0xC8
+			};
+			loadProgram(program, sizeof(program));
+
+			int cycles = 0;
+			for (int i = 0; i < 10; ++i)
+			{
+				cycles += Cpu.Step();
+			}
+			Assert::AreEqual(12 + 12 + 16 + 12 + 24 + 8 + 4 + 8 + 20 + 12, cycles);
+			Assert::AreEqual(0x1234, static_cast<int>(Cpu.Registers.GetDE()));
+			Assert::AreEqual(0xD000, static_cast<int>(Cpu.Registers.SP));
+			Assert::AreEqual(0xC00B, static_cast<int>(Cpu.Registers.PC));
+		}
+
+		TEST_METHOD(TestRunUntilMatchesStep)
+		{
+			// LD SP, D000 / LD HL, C100 / LD B, 64 / LD A, 1
+			// loop: LD (HL+), A / SLA A / ADC A, 3 / PUSH BC / POP BC / DEC B / JR NZ, loop / JR -2
+			const U8 program[] = {
+				0x31, 0x00, 0xD0, 0x21, 0x00, 0xC1, 0x06, 0x40, 0x3E, 0x01,
+				0x22, 0xCB, 0x27, 0xCE, 0x03, 0xC5, 0xC1, 0x05, 0x20, 0xF6, 0x18, 0xFE
+			};
+			loadProgram(program, sizeof(program));
+			// RunUntil may go through the threaded core, Step never does
+			Cpu.RunUntil(5000);
+
+			CProcessor stepped;
+			CProcessor cached;
+			cached.SetBlockCacheEnabled(true);
+			for (U16 i = 0; i < sizeof(program); ++i)
+			{
+				stepped.Bus.Write(0xC000 + i, program[i]);
+				cached.Bus.Write(0xC000 + i, program[i]);
+			}
+			stepped.Registers.PC = 0xC000;
+			cached.Registers.PC = 0xC000;
+			while (stepped.GetCycles() < 5000)
+			{
+				stepped.Step();
+			}
+			cached.RunUntil(5000);
+
+			for (CProcessor* cpu : { &Cpu, &cached })
+			{
+				Assert::AreEqual(stepped.GetCycles(), cpu->GetCycles());
+				Assert::AreEqual(stepped.Registers.GetAF(), cpu->Registers.GetAF());
+				Assert::AreEqual(stepped.Registers.GetHL(), cpu->Registers.GetHL());
+				Assert::AreEqual(static_cast<int>(0xC014), static_cast<int>(cpu->Registers.PC));
+				for (U16 address = 0xC100; address < 0xC140; ++address)
+				{
+					Assert::AreEqual(stepped.Bus.Read(address), cpu->Bus.Read(address));
+				}
+			}
+		}
+
+		TEST_METHOD(TestBlockCache)
+		{
+			// LD B, 2 / LD HL, C007
+			// loop: LD A, 0 / NOP / LD (HL), 3C / DEC B / JR NZ, loop / JR -2
+			// The first pass replaces the NOP with INC A inside the running block
+			const U8 program[] = {
+				0x06, 0x02, 0x21, 0x07, 0xC0, 0x3E, 0x00, 0x00, 0x36, 0x3C, 0x05, 0x20, 0xF8, 0x18, 0xFE
+			};
+			loadProgram(program, sizeof(program));
+			Cpu.SetBlockCacheEnabled(true);
+			Cpu.RunUntil(400);
+
+			Assert::AreEqual(1, static_cast<int>(Cpu.Registers.A));
+			Assert::AreEqual(0xC00D, static_cast<int>(Cpu.Registers.PC));
+			const CBlockCache::SStats& stats = Cpu.GetBlockCache()->GetStats();
+			Assert::IsTrue(stats.Invalidations >= 1);
+			Assert::IsTrue(stats.Hits > 0);
+
+			// LD HL, E009 / LD B, 2 / JR +0 / loop: LD A, 0 / NOP / DEC B / JR Z, done / LD (HL), 3C / JR loop / done: JR -2
+			// The loop block is decoded before its NOP is replaced through the WRAM mirror at E000
+			U8 mirrored[] = {
+				0x21, 0x09, 0xE0, 0x06, 0x02, 0x18, 0x00, 0x3E, 0x00, 0x00, 0x05, 0x28, 0x04, 0x36, 0x3C, 0x18, 0xF6, 0x18, 0xFE
+			};
+			loadProgram(mirrored, sizeof(mirrored));
+			Cpu.RunUntil(Cpu.GetCycles() + 400);
+			Assert::AreEqual(1, static_cast<int>(Cpu.Registers.A));
+			Assert::AreEqual(0xC011, static_cast<int>(Cpu.Registers.PC));
+
+			// And the other way around, run from the mirror and written at C009
+			mirrored[2] = 0xC0;
+			loadProgram(mirrored, sizeof(mirrored));
+			Cpu.Registers.PC = 0xE000;
+			Cpu.RunUntil(Cpu.GetCycles() + 400);
+			Assert::AreEqual(1, static_cast<int>(Cpu.Registers.A));
+			Assert::AreEqual(0xE011, static_cast<int>(Cpu.Registers.PC));
+
+			// Code in the switchable bank is decoded again after a bank switch
+			std::vector<U8> rom(4 * CMemoryBus::ROM_BANK_SIZE);
+			const U8 bank1[] = { 0x3E, 0x11, 0xC9 };
+			const U8 bank2[] = { 0x3E, 0x22, 0xC9 };
+			std::copy(std::begin(bank1), std::end(bank1), rom.begin() + CMemoryBus::ROM_BANK_SIZE);
+			std::copy(std::begin(bank2), std::end(bank2), rom.begin() + 2 * CMemoryBus::ROM_BANK_SIZE);
+			Cpu.Bus.LoadRom(rom.data(), rom.size(), EMbcType::Mbc1, 0);
+
+			// LD SP, D000 / CALL 4000 / LD B, A / LD A, 2 / LD (2000), A / CALL 4000 / LD C, A / JR -2
+			const U8 switcher[] = {
+				0x31, 0x00, 0xD0, 0xCD, 0x00, 0x40, 0x47, 0x3E, 0x02, 0xEA, 0x00, 0x20, 0xCD, 0x00, 0x40, 0x4F, 0x18, 0xFE
+			};
+			loadProgram(switcher, sizeof(switcher));
+			Cpu.RunUntil(Cpu.GetCycles() + 400);
+			Assert::AreEqual(0x11, static_cast<int>(Cpu.Registers.B));
+			Assert::AreEqual(0x22, static_cast<int>(Cpu.Registers.C));
+		}
+
+		TEST_METHOD(TestJit)
+		{
+			if (!JIT)
+			{
+				return;
+			}
+			// Random straight-line register code, every native run is checked against the interpreter
+			// and the end state against Step
+			U32 seed = 12345;
+			const auto next = [&seed] {
+				seed = seed * 1664525 + 1013904223;
+				return static_cast<U8>(seed >> 24);
+			};
+			for (int program = 0; program < 200; ++program)
+			{
+				std::vector<U8> code;
+				while (code.size() < 48)
+				{
+					const U8 opcode = next();
+					const U8 operand = next();
+					if (CJit::GetNativeCycles(opcode, operand) == 0)
+					{
+						continue;
+					}
+					code.push_back(opcode);
+					for (U8 i = 1; i < OPCODE_LENGTHS[opcode]; ++i)
+					{
+						code.push_back(i == 1 ? operand : next());
+					}
+				}
+				// JR -2
+				code.push_back(0x18);
+				code.push_back(0xFE);
+
+				CProcessor stepped;
+				CProcessor native;
+				native.SetJitEnabled(true);
+				native.SetJitVerify(true);
+				for (CProcessor* cpu : { &stepped, &native })
+				{
+					for (size_t i = 0; i < code.size(); ++i)
+					{
+						cpu->Bus.Write(static_cast<U16>(0xC000 + i), code[i]);
+					}
+					cpu->Registers.PC = 0xC000;
+				}
+				for (U8 i = 0; i < 7; ++i)
+				{
+					const U8 value = next();
+					stepped.Registers.R8[i] = value;
+					native.Registers.R8[i] = value;
+				}
+				const U8 f = next() & 0xF0;
+				stepped.Registers.SetF(f);
+				native.Registers.SetF(f);
+
+				while (stepped.GetCycles() < 600)
+				{
+					stepped.Step();
+				}
+				native.RunUntil(600);
+				Assert::AreEqual(0ull, static_cast<unsigned long long>(native.GetJitMismatches()));
+				Assert::AreEqual(stepped.GetCycles(), native.GetCycles());
+				Assert::AreEqual(stepped.Registers.GetAF(), native.Registers.GetAF());
+				Assert::AreEqual(stepped.Registers.GetBC(), native.Registers.GetBC());
+				Assert::AreEqual(stepped.Registers.GetDE(), native.Registers.GetDE());
+				Assert::AreEqual(stepped.Registers.GetHL(), native.Registers.GetHL());
+				Assert::IsTrue(native.GetJit()->GetStats().Runs > 0);
+			}
+
+			// LD B, 3 / LD HL, C007
+			// loop: XOR A / INC A / INC A / LD (HL), 3D / DEC B / JR NZ, loop / JR -2
+			// The second INC A is in a native run and is replaced by DEC A after the first pass
+			const U8 program[] = {
+				0x06, 0x03, 0x21, 0x07, 0xC0, 0xAF, 0x3C, 0x3C, 0x36, 0x3D, 0x05, 0x20, 0xF8, 0x18, 0xFE
+			};
+			loadProgram(program, sizeof(program));
+			Cpu.SetJitEnabled(true);
+			Cpu.SetJitVerify(true);
+			Cpu.RunUntil(400);
+			Assert::AreEqual(0, static_cast<int>(Cpu.Registers.A));
+			Assert::AreEqual(0xC00D, static_cast<int>(Cpu.Registers.PC));
+			Assert::AreEqual(0ull, static_cast<unsigned long long>(Cpu.GetJitMismatches()));
+			Assert::IsTrue(Cpu.GetBlockCache()->GetStats().Invalidations >= 1);
+		}
+
+		TEST_METHOD(TestProfiler)
+		{
+			if (!PROFILER)
+			{
+				return;
+			}
+			// LD B, 4 / loop: INC A / SWAP A / DEC B / JR NZ, loop / JR -2
+			const U8 program[] = { 0x06, 0x04, 0x3C, 0xCB, 0x37, 0x05, 0x20, 0xFA, 0x18, 0xFE };
+			loadProgram(program, sizeof(program));
+			for (int i = 0; i < 17; ++i)
+			{
+				Cpu.Step();
+			}
+
+			Assert::AreEqual(4ull, static_cast<unsigned long long>(Cpu.Profiler.GetOpcode(0x3C).Count));
+			Assert::AreEqual(32ull, static_cast<unsigned long long>(Cpu.Profiler.GetCbOpcode(0x37).Cycles));
+			Assert::AreEqual(4ull, static_cast<unsigned long long>(Cpu.Profiler.GetInstruction(EInstruction::SWAP).Count));
+			Assert::AreEqual(4ull, static_cast<unsigned long long>(Cpu.Profiler.GetInstruction(EInstruction::DEC).Count));
+			Assert::AreEqual(116ull, static_cast<unsigned long long>(Cpu.Profiler.GetSubsystemCycles().Instructions));
+
+			// JR NZ is taken three times
+			const std::vector<CProfiler::SHotSpot> spots = Cpu.Profiler.GetHotSpots(2);
+			Assert::AreEqual(size_t{ 2 }, spots.size());
+			Assert::AreEqual(0xC006, static_cast<int>(spots[0].Pc));
+			Assert::AreEqual(44ull, static_cast<unsigned long long>(spots[0].Counter.Cycles));
+			Assert::AreEqual(0xC003, static_cast<int>(spots[1].Pc));
+		}
+
+		TEST_METHOD(TestTrace)
+		{
+			// LD B, 3 / loop: INC A / DEC B / JR NZ, loop / JR -2
+			const U8 program[] = { 0x06, 0x03, 0x3C, 0x05, 0x20, 0xFC, 0x18, 0xFE };
+			loadProgram(program, sizeof(program));
+			Cpu.Registers.SP = 0xFFFE;
+			Cpu.SetBlockCacheEnabled(true);
+
+			const std::string path = (std::filesystem::temp_directory_path() / "GbEmulatorTestTrace.bin").string();
+			CTraceRecorder recorder;
+			// A small ring makes the writer fall behind
+			Assert::IsTrue(recorder.Open(path, ETraceOverflow::Wait, 4) == ETraceError::None);
+			Cpu.SetTraceRecorder(&recorder);
+			Cpu.RunUntil(100);
+			Cpu.SetTraceRecorder(nullptr);
+			Assert::IsTrue(recorder.Close() == ETraceError::None);
+			Assert::AreEqual(0ull, static_cast<unsigned long long>(recorder.GetDropped()));
+
+			CTraceReader reader;
+			Assert::IsTrue(reader.Open(path) == ETraceError::None);
+			STraceRecord record;
+			U64 count = 0;
+			while (reader.Next(record))
+			{
+				if (count == 1)
+				{
+					char line[96];
+					FormatTraceRecord(record, line, sizeof(line));
+					Assert::AreEqual(std::string("A:00 F:00 B:03 C:00 D:00 E:00 H:00 L:00 SP:FFFE PC:C002 PCMEM:3C,05,20,FC"), std::string(line));
+					Assert::AreEqual(8ull, static_cast<unsigned long long>(record.Cycles));
+				}
+				++count;
+			}
+			Assert::IsTrue(reader.GetError() == ETraceError::None);
+			Assert::AreEqual(static_cast<unsigned long long>(recorder.GetRecorded()), static_cast<unsigned long long>(count));
+			// The last record is the first instruction to end past the target
+			Assert::AreEqual(0xC006, static_cast<int>(record.PC));
+			Assert::IsTrue(record.Cycles < 100);
+			std::remove(path.c_str());
+
+			// Records that do not fit are counted when dropping
+			CTraceRing ring(4);
+			for (int i = 0; i < 4; ++i)
+			{
+				Assert::IsTrue(ring.TryPush(record));
+			}
+			Assert::IsFalse(ring.TryPush(record));
+			STraceRecord popped[2];
+			Assert::AreEqual(size_t{ 2 }, ring.Pop(popped, 2));
+			Assert::IsTrue(ring.TryPush(record));
+		}
+
+		TEST_METHOD(TestSaveState)
+		{
+			// Timer at 16 cycles per tick with the interrupt enabled, the handler at 0050 counts in B
+			// LD A, 05 / LDH (07), A / LD A, 04 / LDH (FF), A / EI / loop: INC C / LD (HL+), A / JR loop
+			const U8 program[] = { 0x3E, 0x05, 0xE0, 0x07, 0x3E, 0x04, 0xE0, 0xFF, 0xFB, 0x0C, 0x22, 0x18, 0xFC };
+			loadProgram(program, sizeof(program));
+			// INC B / RETI
+			std::vector<U8> rom(2 * CMemoryBus::ROM_BANK_SIZE);
+			rom[0x40] = 0xD9;
+			rom[0x50] = 0x04;
+			rom[0x51] = 0xD9;
+			Cpu.Bus.LoadRom(rom.data(), rom.size(), EMbcType::Mbc1, CMemoryBus::RAM_BANK_SIZE);
+			Cpu.Registers.SP = 0xD000;
+			Cpu.Registers.SetHL(0xC100);
+			Cpu.SetBlockCacheEnabled(true);
+			Cpu.RunUntil(3000);
+
+			std::vector<U8> saved(Cpu.GetSaveStateSize());
+			Assert::IsTrue(Cpu.SaveState(saved.data(), saved.size()) == ESaveStateError::None);
+			Cpu.RunUntil(20000);
+			std::vector<U8> expected(saved.size());
+			Assert::IsTrue(Cpu.SaveState(expected.data(), expected.size()) == ESaveStateError::None);
+			Assert::IsTrue(Cpu.Registers.B > 0);
+
+			// Running again from the loaded state ends in exactly the same state
+			Assert::IsTrue(Cpu.LoadState(saved.data(), saved.size()) == ESaveStateError::None);
+			Assert::IsTrue(Cpu.GetCycles() >= 3000 && Cpu.GetCycles() < 3024);
+			Cpu.RunUntil(20000);
+			std::vector<U8> actual(saved.size());
+			Assert::IsTrue(Cpu.SaveState(actual.data(), actual.size()) == ESaveStateError::None);
+			Assert::IsTrue(expected == actual);
+
+			Assert::IsTrue(Cpu.SaveState(actual.data(), actual.size() - 1) == ESaveStateError::BufferTooSmall);
+			Assert::IsTrue(Cpu.LoadState(saved.data(), saved.size() - 1) == ESaveStateError::BufferTooSmall);
+			saved[0] = 'X';
+			Assert::IsTrue(Cpu.LoadState(saved.data(), saved.size()) == ESaveStateError::BadHeader);
+
+			CProcessor other;
+			Assert::IsTrue(other.LoadState(actual.data(), actual.size()) == ESaveStateError::CartridgeMismatch);
+		}
+
+		TEST_METHOD(TestRewind)
+		{
+			// Random bytes with runs of zeros of every length survive the codec
+			std::vector<U8> reference(20000);
+			std::vector<U8> state(reference.size());
+			U32 seed = 99;
+			for (size_t i = 0; i < state.size(); ++i)
+			{
+				seed = seed * 1664525 + 1013904223;
+				reference[i] = static_cast<U8>(seed >> 24);
+				state[i] = (seed >> 8) % 1000 < i % 1000 ? reference[i] : static_cast<U8>(seed >> 16);
+			}
+			std::vector<U8> encoded;
+			CDeltaCodec::Encode(state.data(), reference.data(), state.size(), encoded);
+			Assert::IsTrue(encoded.size() <= CDeltaCodec::GetMaxEncodedSize(state.size()));
+			std::vector<U8> decoded = reference;
+			Assert::IsTrue(CDeltaCodec::Decode(encoded.data(), encoded.size(), decoded.data(), decoded.size()));
+			Assert::IsTrue(decoded == state);
+
+			// LD A, 05 / LDH (07), A / loop: INC C / LD (HL+), A / ADD A, C / JR loop
+			const U8 program[] = { 0x3E, 0x05, 0xE0, 0x07, 0x0C, 0x22, 0x81, 0x18, 0xFB };
+			loadProgram(program, sizeof(program));
+			Cpu.Registers.SetHL(0xC100);
+
+			CRewindBuffer rewind(CRewindBuffer::DEFAULT_BUDGET, 8);
+			std::vector<std::vector<U8>> expected;
+			for (int frame = 0; frame < 50; ++frame)
+			{
+				Cpu.RunUntil(Cpu.GetCycles() + 1000);
+				Assert::IsTrue(rewind.Push(Cpu) == ESaveStateError::None);
+				expected.emplace_back(Cpu.GetSaveStateSize());
+				Assert::IsTrue(Cpu.SaveState(expected.back().data(), expected.back().size()) == ESaveStateError::None);
+			}
+			Assert::IsTrue(rewind.GetUsage() < 50 * Cpu.GetSaveStateSize() / 10);
+
+			// Going back and forth keeps the groups consistent
+			std::vector<U8> actual(Cpu.GetSaveStateSize());
+			for (int frame = 49; frame >= 20; --frame)
+			{
+				Assert::IsTrue(rewind.StepBack(Cpu));
+				Assert::IsTrue(Cpu.SaveState(actual.data(), actual.size()) == ESaveStateError::None);
+				Assert::IsTrue(actual == expected[frame]);
+			}
+			// Running on from frame 20 ends up in frame 21 again
+			Cpu.RunUntil(Cpu.GetCycles() + 1000);
+			Assert::IsTrue(rewind.Push(Cpu) == ESaveStateError::None);
+			Assert::IsTrue(rewind.StepBack(Cpu));
+			Assert::IsTrue(Cpu.SaveState(actual.data(), actual.size()) == ESaveStateError::None);
+			Assert::IsTrue(actual == expected[21]);
+			for (int frame = 19; frame >= 0; --frame)
+			{
+				Assert::IsTrue(rewind.StepBack(Cpu));
+				Assert::IsTrue(Cpu.SaveState(actual.data(), actual.size()) == ESaveStateError::None);
+				Assert::IsTrue(actual == expected[frame]);
+			}
+			Assert::IsFalse(rewind.StepBack(Cpu));
+
+			// Whole groups are dropped to stay in the budget
+			for (int frame = 0; frame < 50; ++frame)
+			{
+				Cpu.RunUntil(Cpu.GetCycles() + 1000);
+				Assert::IsTrue(rewind.Push(Cpu) == ESaveStateError::None);
+			}
+			const size_t usage = rewind.GetUsage();
+			rewind.SetBudget(usage / 2);
+			Assert::IsTrue(rewind.GetUsage() <= usage / 2);
+			Assert::IsTrue(rewind.GetCount() > 0 && rewind.GetCount() % 8 == 50 % 8);
+			Assert::IsTrue(rewind.StepBack(Cpu));
+		}
+
+		TEST_METHOD(TestPpu)
+		{
+			// JR -2
+			const U8 program[] = { 0x18, 0xFE };
+			loadProgram(program, sizeof(program));
+			// Tile 1 has its rows alternating between shades 1 and 2 of the palette, then 3 and 0
+			for (U16 row = 0; row < 8; ++row)
+			{
+				Cpu.Bus.Write(0x8010 + row * 2, row % 2 == 0 ? 0xFF : 0xF0);
+				Cpu.Bus.Write(0x8011 + row * 2, row % 2 == 0 ? 0x00 : 0xFF);
+			}
+			// Tile map 9800 shows tile 1 in the first column
+			for (U16 y = 0; y < 32; ++y)
+			{
+				Cpu.Bus.Write(0x9800 + y * 32, 0x01);
+			}
+			Cpu.Bus.Write(CPpu::BGP_ADDRESS, 0xE4);
+			Cpu.Bus.Write(CPpu::LYC_ADDRESS, 5);
+			// LYC interrupt source
+			Cpu.Bus.Write(CPpu::STAT_ADDRESS, 0x40);
+			Cpu.Bus.Write(CPpu::LCDC_ADDRESS, 0x91);
+
+			Cpu.RunUntil(CPpu::LINE_CYCLES * 4 + 100);
+			Assert::AreEqual(4, static_cast<int>(Cpu.Bus.Read(CPpu::LY_ADDRESS)));
+			Assert::IsTrue(Cpu.Ppu.GetMode() == EPpuMode::Transfer);
+			Assert::AreEqual(0, static_cast<int>(Cpu.Bus.Read(0xFF0F) & 0x03));
+			Cpu.RunUntil(CPpu::LINE_CYCLES * 5 + 10);
+			Assert::AreEqual(0x02, static_cast<int>(Cpu.Bus.Read(0xFF0F) & 0x03));
+			Cpu.RunUntil(CPpu::LINE_CYCLES * 144 + 10);
+			Assert::IsTrue(Cpu.Ppu.GetMode() == EPpuMode::VBlank);
+			Assert::AreEqual(0x03, static_cast<int>(Cpu.Bus.Read(0xFF0F) & 0x03));
+			Assert::AreEqual(1ull, static_cast<unsigned long long>(Cpu.Ppu.GetStats().Frames));
+
+			const CPpu::Frame& frame = Cpu.Ppu.GetFrame();
+			for (U32 y = 0; y < 8; ++y)
+			{
+				for (U32 x = 0; x < 8; ++x)
+				{
+					const U8 expected = y % 2 == 0 ? 1 : (x < 4 ? 3 : 2);
+					Assert::AreEqual(static_cast<int>(expected), static_cast<int>(frame[y * CPpu::SCREEN_WIDTH + x]));
+				}
+			}
+			Assert::AreEqual(0, static_cast<int>(frame[8]));
+			// Tiles 0 and 1 are decoded once and drawn from the cache after that
+			Assert::AreEqual(2ull, static_cast<unsigned long long>(Cpu.Ppu.GetStats().TileMisses));
+			Assert::AreEqual(144ull * 21 - 2, static_cast<unsigned long long>(Cpu.Ppu.GetStats().TileHits));
+
+			// Scrolling by 4 and changing the tile shows up in the next frame
+			Cpu.Bus.Write(CPpu::SCX_ADDRESS, 4);
+			Cpu.Bus.Write(0x8010, 0x00);
+			Cpu.Bus.Write(0x8012, 0x00);
+			Assert::AreEqual(1ull, static_cast<unsigned long long>(Cpu.Ppu.GetStats().TileInvalidations));
+			Cpu.RunUntil(CPpu::FRAME_CYCLES + CPpu::LINE_CYCLES * 144 + 10);
+			Assert::AreEqual(2ull, static_cast<unsigned long long>(Cpu.Ppu.GetStats().Frames));
+			Assert::AreEqual(0, static_cast<int>(Cpu.Ppu.GetFrame()[0]));
+			// Row 1 is now all shade 2, of which 4 pixels are left after scrolling
+			Assert::AreEqual(2, static_cast<int>(Cpu.Ppu.GetFrame()[CPpu::SCREEN_WIDTH]));
+			Assert::AreEqual(2, static_cast<int>(Cpu.Ppu.GetFrame()[CPpu::SCREEN_WIDTH + 3]));
+			Assert::AreEqual(0, static_cast<int>(Cpu.Ppu.GetFrame()[CPpu::SCREEN_WIDTH + 4]));
+		}
+
+		TEST_METHOD(TestSprites)
+		{
+			// JR -2
+			const U8 program[] = { 0x18, 0xFE };
+			loadProgram(program, sizeof(program));
+			// 12 sprites on line 0, only the first 10 in OAM order are drawn, left to right
+			const U8 xs[] = { 50, 20, 50, 103, 104, 105, 106, 107, 108, 109, 110, 111 };
+			for (U16 sprite = 0; sprite < 12; ++sprite)
+			{
+				Cpu.Bus.Write(CMemoryBus::OAM_START + sprite * 4, 16);
+				Cpu.Bus.Write(CMemoryBus::OAM_START + sprite * 4 + 1, xs[sprite]);
+			}
+			const CPpu::SSpriteLine& line = Cpu.Ppu.GetSpriteLine(0);
+			const U8 expected[] = { 1, 0, 2, 3, 4, 5, 6, 7, 8, 9 };
+			Assert::AreEqual(10, static_cast<int>(line.Count));
+			Assert::IsTrue(std::equal(std::begin(expected), std::end(expected), line.Sprites.begin()));
+			Assert::AreEqual(0, static_cast<int>(Cpu.Ppu.GetSpriteLine(8).Count));
+			Assert::AreEqual(1ull, static_cast<unsigned long long>(Cpu.Ppu.GetStats().SpriteListBuilds));
+
+			// Tile 2 has color 1 on its left half, tile 3 background color 1 on its first 2 pixels
+			for (U16 row = 0; row < 8; ++row)
+			{
+				Cpu.Bus.Write(0x8020 + row * 2, 0xF0);
+				Cpu.Bus.Write(0x8030 + row * 2, 0xC0);
+			}
+			Cpu.Bus.Write(0x9800 + 2 * 32, 0x03);
+			// A flipped sprite on line 8 and one behind the background on line 16, copied by OAM DMA
+			const U8 oam[] = { 24, 8, 2, 0x20, 32, 8, 2, 0x90 };
+			for (U16 i = 0; i < 0xA0; ++i)
+			{
+				Cpu.Bus.Write(0xC100 + i, i < sizeof(oam) ? oam[i] : 0);
+			}
+			Cpu.Bus.Write(0xFF46, 0xC1);
+			Assert::AreEqual(1, static_cast<int>(Cpu.Ppu.GetSpriteLine(8).Count));
+			Assert::AreEqual(0, static_cast<int>(Cpu.Ppu.GetSpriteLine(0).Count));
+			Assert::AreEqual(2ull, static_cast<unsigned long long>(Cpu.Ppu.GetStats().SpriteListBuilds));
+
+			Cpu.Bus.Write(CPpu::BGP_ADDRESS, 0xE4);
+			Cpu.Bus.Write(CPpu::OBP0_ADDRESS, 0xE4);
+			Cpu.Bus.Write(CPpu::OBP1_ADDRESS, 0x1B);
+			Cpu.Bus.Write(CPpu::LCDC_ADDRESS, 0x93);
+			Cpu.RunUntil(CPpu::LINE_CYCLES * 144 + 10);
+			const CPpu::Frame& frame = Cpu.Ppu.GetFrame();
+			const U8 line8[] = { 0, 0, 0, 0, 1, 1, 1, 1, 0 };
+			const U8 line16[] = { 1, 1, 2, 2, 0, 0, 0, 0, 0 };
+			for (U32 x = 0; x < 9; ++x)
+			{
+				Assert::AreEqual(static_cast<int>(line8[x]), static_cast<int>(frame[8 * CPpu::SCREEN_WIDTH + x]));
+				Assert::AreEqual(static_cast<int>(line16[x]), static_cast<int>(frame[16 * CPpu::SCREEN_WIDTH + x]));
+			}
+			// Nothing in OAM changed while drawing
+			Assert::AreEqual(2ull, static_cast<unsigned long long>(Cpu.Ppu.GetStats().SpriteListBuilds));
+		}
+
+		TEST_METHOD(TestFrameSkip)
+		{
+			// EI, then counts frames in B: INC B / HALT until VBlank / store B, LY and STAT to C100-C102
+			// The VBlank handler at 40 is RETI
+			const U8 program[] = {
+				0xFB, 0x04, 0x76, 0x78, 0xEA, 0x00, 0xC1, 0xF0, 0x44, 0xEA, 0x01, 0xC1, 0xF0, 0x41, 0xEA, 0x02, 0xC1, 0x18, 0xEE
+			};
+			const auto setUp = [&program](CProcessor& cpu, const U32 frameSkip) {
+				for (U16 i = 0; i < sizeof(program); ++i)
+				{
+					cpu.Bus.Write(0xC000 + i, program[i]);
+				}
+				cpu.Registers.PC = 0xC000;
+				cpu.Registers.SP = 0xD000;
+				cpu.Bus.Write(0xFFFF, 1 << static_cast<U8>(EInterrupt::VBlank));
+				for (U16 row = 0; row < 8; ++row)
+				{
+					cpu.Bus.Write(0x8000 + row * 2, 0xFF);
+				}
+				// The window map at 9C00 starts with the blank tile 1
+				cpu.Bus.Write(0x9C00, 0x01);
+				cpu.Bus.Write(CPpu::BGP_ADDRESS, 0xE4);
+				cpu.Bus.Write(CPpu::WX_ADDRESS, 87);
+				// Applies from the next frame, which starts when the LCD is turned on
+				cpu.Ppu.SetFrameSkip(frameSkip);
+				cpu.Bus.Write(CPpu::LCDC_ADDRESS, 0xF1);
+			};
+			std::vector<U8> rom(2 * CMemoryBus::ROM_BANK_SIZE);
+			rom[0x40] = 0xD9;
+			Cpu.Bus.LoadRom(rom.data(), rom.size(), EMbcType::None, 0);
+			setUp(Cpu, 1);
+			auto skipping = std::make_unique<CProcessor>();
+			skipping->Bus.LoadRom(rom.data(), rom.size(), EMbcType::None, 0);
+			setUp(*skipping, 3);
+			auto headless = std::make_unique<CProcessor>();
+			headless->Bus.LoadRom(rom.data(), rom.size(), EMbcType::None, 0);
+			setUp(*headless, CPpu::HEADLESS);
+
+			// The CPU sees the same LY, STAT and interrupts, so all three end in the same state
+			const U64 end = CPpu::FRAME_CYCLES * 7 + 1000;
+			Cpu.RunUntil(end);
+			skipping->RunUntil(end);
+			headless->RunUntil(end);
+			std::vector<U8> expected(Cpu.GetSaveStateSize()), actual(expected.size());
+			Assert::IsTrue(Cpu.SaveState(expected.data(), expected.size()) == ESaveStateError::None);
+			Assert::IsTrue(skipping->SaveState(actual.data(), actual.size()) == ESaveStateError::None);
+			Assert::IsTrue(actual == expected);
+			Assert::IsTrue(headless->SaveState(actual.data(), actual.size()) == ESaveStateError::None);
+			Assert::IsTrue(actual == expected);
+			Assert::AreEqual(7, static_cast<int>(Cpu.Bus.Read(0xC100)));
+			Assert::AreEqual(144, static_cast<int>(Cpu.Bus.Read(0xC101)));
+
+			// Frames 0, 3 and 6 of 7 are drawn
+			Assert::AreEqual(7ull, static_cast<unsigned long long>(skipping->Ppu.GetStats().Frames));
+			Assert::AreEqual(4ull, static_cast<unsigned long long>(skipping->Ppu.GetStats().SkippedFrames));
+			Assert::AreEqual(7ull, static_cast<unsigned long long>(headless->Ppu.GetStats().SkippedFrames));
+			Assert::AreEqual(0ull, static_cast<unsigned long long>(Cpu.Ppu.GetStats().SkippedFrames));
+			Assert::IsTrue(skipping->Ppu.GetFrame() == Cpu.Ppu.GetFrame());
+			// Background on the left, window from x 80
+			Assert::AreEqual(1, static_cast<int>(Cpu.Ppu.GetFrame()[0]));
+			Assert::AreEqual(0, static_cast<int>(Cpu.Ppu.GetFrame()[80]));
+			Assert::AreEqual(0ull, static_cast<unsigned long long>(headless->Ppu.GetStats().TileMisses));
+		}
+
+		TEST_METHOD(TestPixelKernels)
+		{
+			const SPixelKernels& scalar = CPixelKernels::Get(EPixelPath::Scalar);
+			// Planes F0 / CC give 3 3 1 1 2 2 0 0
+			const U8 planes[] = { 0xF0, 0xCC };
+			U8 row[8];
+			scalar.DecodeRows(planes, 1, row);
+			const U8 expectedRow[] = { 3, 3, 1, 1, 2, 2, 0, 0 };
+			Assert::IsTrue(std::equal(std::begin(row), std::end(row), std::begin(expectedRow)));
+
+			// BGP E4, OBP0 1B reversed and OBP1 all black
+			const U32 palettes = 0xE4 | 0x1B << 8 | 0xFF << 16;
+			const U8 background[] = { 0, 2, 0, 2, 1, 3 };
+			const U8 sprites[] = { 1, 1, 1 | SPRITE_BEHIND, 1 | SPRITE_BEHIND, 2 | SPRITE_PALETTE, 0 };
+			U8 shades[6];
+			scalar.MapShades(background, sprites, 6, palettes, shades);
+			const U8 expectedShades[] = { 2, 2, 2, 2, 3, 3 };
+			Assert::IsTrue(std::equal(std::begin(shades), std::end(shades), std::begin(expectedShades)));
+
+			// Every path matches scalar, the lengths leave a tail for the scalar code
+			constexpr U32 COUNT = 173;
+			std::vector<U8> planeData(COUNT * 2), indices(COUNT), spriteData(COUNT);
+			U32 seed = 1;
+			const auto next = [&seed] {
+				seed = seed * 1103515245 + 12345;
+				return static_cast<U8>(seed >> 16);
+			};
+			for (U32 i = 0; i < COUNT; ++i)
+			{
+				planeData[i * 2] = next();
+				planeData[i * 2 + 1] = next();
+				indices[i] = next() & 0b11;
+				spriteData[i] = next() & 0b1111;
+			}
+			const U32 colors[] = { 0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000 };
+			const auto run = [&](const SPixelKernels& kernels) {
+				std::vector<U8> decoded(COUNT * 8), mapped(COUNT), background(COUNT);
+				std::vector<U32> rgba(COUNT);
+				kernels.DecodeRows(planeData.data(), COUNT, decoded.data());
+				kernels.MapShades(indices.data(), spriteData.data(), COUNT, palettes, mapped.data());
+				kernels.MapShades(indices.data(), nullptr, COUNT, palettes, background.data());
+				kernels.ShadesToRgba(mapped.data(), COUNT, colors, rgba.data());
+				return std::make_tuple(decoded, mapped, background, rgba);
+			};
+			const auto expected = run(scalar);
+			for (const EPixelPath path : { EPixelPath::Sse2, EPixelPath::Avx2 })
+			{
+				if (CPixelKernels::IsSupported(path))
+				{
+					Assert::IsTrue(run(CPixelKernels::Get(path)) == expected);
+				}
+			}
+		}
+
+		TEST_METHOD(TestFrameExchange)
+		{
+			auto frame = std::make_unique<CPpu::Frame>();
+			CFrameExchange dropping;
+			Assert::IsTrue(dropping.TryAcquire() == nullptr);
+			frame->fill(1);
+			dropping.OnFrame(*frame, 0);
+			frame->fill(2);
+			dropping.OnFrame(*frame, 1);
+			// Only the newest frame is taken, the one before it was replaced
+			const SPublishedFrame* newest = dropping.TryAcquire();
+			Assert::IsTrue(newest != nullptr);
+			Assert::AreEqual(1ull, static_cast<unsigned long long>(newest->Number));
+			Assert::AreEqual(2, static_cast<int>(newest->Pixels[0]));
+			Assert::IsTrue(dropping.TryAcquire() == nullptr);
+			Assert::AreEqual(1ull, static_cast<unsigned long long>(dropping.GetDropped()));
+
+			// A waiting producer hands over every frame in order and none is torn
+			constexpr U64 COUNT = 200;
+			CFrameExchange waiting(EFrameOverflow::Wait);
+			std::thread producer([&waiting] {
+				auto pixels = std::make_unique<CPpu::Frame>();
+				for (U64 i = 0; i < COUNT; ++i)
+				{
+					pixels->fill(static_cast<U8>(i));
+					waiting.OnFrame(*pixels, i);
+				}
+				waiting.Close();
+			});
+			U64 received = 0;
+			bool ordered = true;
+			while (const SPublishedFrame* published = waiting.Acquire())
+			{
+				const U8 value = static_cast<U8>(published->Number);
+				ordered = ordered && published->Number == received
+					&& std::all_of(published->Pixels.begin(), published->Pixels.end(), [value](const U8 pixel) { return pixel == value; });
+				++received;
+			}
+			producer.join();
+			Assert::IsTrue(ordered);
+			Assert::AreEqual(COUNT, received);
+			Assert::AreEqual(0ull, static_cast<unsigned long long>(waiting.GetDropped()));
+		}
+
+		TEST_METHOD(TestFrameDumper)
+		{
+			const std::filesystem::path directory = std::filesystem::temp_directory_path() / "GbEmulatorTestFrames";
+			std::filesystem::remove_all(directory);
+			auto frame = std::make_unique<CPpu::Frame>();
+			std::vector<U64> hashes;
+			CFrameDumper dumper;
+			Assert::IsTrue(dumper.Open(directory.string(), EFrameDumpFormat::Hash, EFrameOverflow::Wait) == EFrameDumpError::None);
+			for (U64 i = 0; i < 5; ++i)
+			{
+				frame->fill(static_cast<U8>(i & 0b11));
+				(*frame)[i] = 3;
+				hashes.push_back(CFrameDumper::HashFrame(*frame));
+				dumper.OnFrame(*frame, i * 2);
+			}
+			Assert::IsTrue(dumper.Close() == EFrameDumpError::None);
+			Assert::AreEqual(5ull, static_cast<unsigned long long>(dumper.GetDumped()));
+			Assert::AreEqual(0ull, static_cast<unsigned long long>(dumper.GetDropped()));
+			// Different frames hash differently
+			std::vector<U64> unique = hashes;
+			std::sort(unique.begin(), unique.end());
+			Assert::IsTrue(std::unique(unique.begin(), unique.end()) == unique.end());
+
+			FILE* file = std::fopen((directory / "hashes.txt").string().c_str(), "r");
+			Assert::IsTrue(file != nullptr);
+			for (U64 i = 0; i < hashes.size(); ++i)
+			{
+				unsigned long long number = 0, hash = 0;
+				Assert::AreEqual(2, std::fscanf(file, "%llu %llx", &number, &hash));
+				Assert::AreEqual(static_cast<unsigned long long>(i * 2), number);
+				Assert::IsTrue(hash == hashes[i]);
+			}
+			std::fclose(file);
+
+			// A 2 bit palette image in a stored zlib block
+			Assert::IsTrue(dumper.Open(directory.string(), EFrameDumpFormat::Png) == EFrameDumpError::None);
+			dumper.OnFrame(*frame, 7);
+			Assert::IsTrue(dumper.Close() == EFrameDumpError::None);
+			const std::vector<U8> png = CFrameDumper::EncodePng(*frame);
+			const std::filesystem::path pngPath = directory / "frame_000007.png";
+			Assert::IsTrue(std::filesystem::file_size(pngPath) == png.size());
+			const U8 signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+			Assert::IsTrue(std::equal(std::begin(signature), std::end(signature), png.begin()));
+			// IHDR: 160 x 144, bit depth 2, color type 3
+			Assert::AreEqual(160, png[16] << 24 | png[17] << 16 | png[18] << 8 | png[19]);
+			Assert::AreEqual(144, png[20] << 24 | png[21] << 16 | png[22] << 8 | png[23]);
+			Assert::AreEqual(2, static_cast<int>(png[24]));
+			Assert::AreEqual(3, static_cast<int>(png[25]));
+			std::filesystem::remove_all(directory);
+		}
+
+		TEST_METHOD(TestApu)
+		{
+			// Registers are cleared and read-only while the APU is off, write-only bits read as 1
+			Assert::AreEqual(0x70, static_cast<int>(Cpu.Bus.Read(CApu::NR52_ADDRESS)));
+			Cpu.Bus.Write(CApu::NR50_ADDRESS, 0x77);
+			Assert::AreEqual(0x00, static_cast<int>(Cpu.Bus.Read(CApu::NR50_ADDRESS)));
+			Cpu.Bus.Write(CApu::NR52_ADDRESS, 0x80);
+			Cpu.Bus.Write(CApu::NR50_ADDRESS, 0x77);
+			Cpu.Bus.Write(CApu::NR51_ADDRESS, 0x11);
+			Cpu.Bus.Write(CApu::NR11_ADDRESS, 0x80 | 20);
+			Assert::AreEqual(0xBF, static_cast<int>(Cpu.Bus.Read(CApu::NR11_ADDRESS)));
+			Assert::AreEqual(0xFF, static_cast<int>(Cpu.Bus.Read(CApu::NR13_ADDRESS)));
+			Cpu.Bus.Write(CApu::WAVE_START, 0x5A);
+			Assert::AreEqual(0x5A, static_cast<int>(Cpu.Bus.Read(CApu::WAVE_START)));
+
+			struct SCollector : IAudioSink
+			{
+				std::vector<SStereoSample> Samples;
+				double Ratio = 1.0;
+
+				void OnSamples(const SStereoSample* samples, const size_t count) override
+				{
+					Samples.insert(Samples.end(), samples, samples + count);
+				}
+
+				double GetRateRatio() const override
+				{
+					return Ratio;
+				}
+			};
+			SCollector collector;
+			Cpu.Apu.SetSampleSink(&collector);
+
+			// A 440 Hz square at half duty with a length of 44 / 256 s, HALT / JR -3 meanwhile
+			const U8 program[] = { 0x76, 0x18, 0xFD };
+			loadProgram(program, sizeof(program));
+			constexpr U32 FREQUENCY = 2048 - 131072 / 440;
+			Cpu.Bus.Write(CApu::NR12_ADDRESS, 0xF0);
+			Cpu.Bus.Write(CApu::NR13_ADDRESS, FREQUENCY & 0xFF);
+			Cpu.Bus.Write(CApu::NR14_ADDRESS, 0xC0 | FREQUENCY >> 8);
+			Assert::AreEqual(0xF1, static_cast<int>(Cpu.Bus.Read(CApu::NR52_ADDRESS)));
+			Cpu.RunUntil(CProcessor::CLOCK_SPEED / 8);
+			Assert::AreEqual(0xF1, static_cast<int>(Cpu.Bus.Read(CApu::NR52_ADDRESS)));
+			Cpu.RunUntil(CProcessor::CLOCK_SPEED / 4);
+			Assert::AreEqual(0xF0, static_cast<int>(Cpu.Bus.Read(CApu::NR52_ADDRESS)));
+
+			// A quarter second is 12000 samples at 48 kHz, the square crosses zero twice a period
+			Assert::AreEqual(static_cast<size_t>(12000), collector.Samples.size());
+			int crossings = 0;
+			int peak = 0;
+			for (size_t i = 1200; i < 6000; ++i)
+			{
+				crossings += (collector.Samples[i - 1].Left < 0) != (collector.Samples[i].Left < 0);
+				peak = std::max(peak, static_cast<int>(collector.Samples[i].Left));
+				Assert::AreEqual(static_cast<int>(collector.Samples[i].Left), static_cast<int>(collector.Samples[i].Right));
+			}
+			Assert::IsTrue(crossings >= 86 && crossings <= 90);
+			// Level 15 at volume 8, half of it above the DC level with some ringing
+			Assert::IsTrue(peak > 3000 && peak < 9000);
+			// Silent after the length ran out
+			Assert::AreEqual(0, static_cast<int>(collector.Samples.back().Left) / 64);
+
+			// The sink asks for 1% more samples
+			collector.Samples.clear();
+			collector.Ratio = 1.01;
+			Cpu.RunUntil(CProcessor::CLOCK_SPEED / 2);
+			Assert::IsTrue(collector.Samples.size() >= 12115 && collector.Samples.size() <= 12125);
+
+			// Power off clears the registers but not the wave RAM
+			Cpu.Bus.Write(CApu::NR52_ADDRESS, 0);
+			Assert::AreEqual(0x00, static_cast<int>(Cpu.Bus.Read(CApu::NR50_ADDRESS)));
+			Assert::AreEqual(0x5A, static_cast<int>(Cpu.Bus.Read(CApu::WAVE_START)));
+			Cpu.Apu.SetSampleSink(nullptr);
+			Assert::AreEqual(static_cast<U64>(CProcessor::CLOCK_SPEED / 2 / CApu::SEQUENCER_PERIOD), Cpu.Apu.GetStats().Batches);
+		}
+
+		TEST_METHOD(TestAudioOutput)
+		{
+			CAudioRing ring(100);
+			Assert::AreEqual(static_cast<size_t>(128), ring.GetCapacity());
+			// Empty, the APU is asked for more samples
+			Assert::IsTrue(ring.GetRateRatio() > 1.0);
+			std::vector<SStereoSample> samples(100);
+			for (size_t i = 0; i < samples.size(); ++i)
+			{
+				samples[i] = { static_cast<int16_t>(i), static_cast<int16_t>(-static_cast<int>(i)) };
+			}
+			ring.OnSamples(samples.data(), samples.size());
+			ring.OnSamples(samples.data(), samples.size());
+			Assert::AreEqual(static_cast<U64>(72), ring.GetOverflowed());
+			Assert::IsTrue(ring.GetRateRatio() < 1.0);
+			std::vector<SStereoSample> read(150);
+			Assert::AreEqual(static_cast<size_t>(128), ring.Read(read.data(), read.size()));
+			Assert::AreEqual(static_cast<U64>(22), ring.GetUnderflowed());
+			Assert::AreEqual(99, static_cast<int>(read[99].Left));
+			Assert::AreEqual(0, static_cast<int>(read[100].Left));
+			Assert::AreEqual(-27, static_cast<int>(read[127].Right));
+
+			// Read while it is written, every sample arrives once and in order
+			constexpr int COUNT = 100000;
+			CAudioRing threaded(256);
+			std::thread producer([&threaded] {
+				for (int i = 0; i < COUNT;)
+				{
+					const SStereoSample sample = { static_cast<int16_t>(i), 0 };
+					if (threaded.GetSize() < threaded.GetCapacity())
+					{
+						threaded.OnSamples(&sample, 1);
+						++i;
+					}
+				}
+			});
+			int received = 0;
+			bool ordered = true;
+			while (received < COUNT)
+			{
+				SStereoSample sample;
+				if (threaded.Read(&sample, 1) == 1)
+				{
+					ordered = ordered && sample.Left == static_cast<int16_t>(received);
+					++received;
+				}
+			}
+			producer.join();
+			Assert::IsTrue(ordered);
+			Assert::AreEqual(static_cast<U64>(0), threaded.GetOverflowed());
+
+			const std::string path = (std::filesystem::temp_directory_path() / "GbEmulatorTestAudio.wav").string();
+			CWavWriter wav;
+			Assert::IsTrue(wav.Open(path, 48000) == EWavError::None);
+			wav.OnSamples(samples.data(), samples.size());
+			Assert::IsTrue(wav.Close() == EWavError::None);
+			Assert::AreEqual(static_cast<U64>(100), wav.GetWritten());
+			FILE* file = std::fopen(path.c_str(), "rb");
+			Assert::IsTrue(file != nullptr);
+			std::vector<U8> bytes(CWavWriter::HEADER_SIZE + 400 + 1);
+			Assert::AreEqual(bytes.size() - 1, std::fread(bytes.data(), 1, bytes.size(), file));
+			std::fclose(file);
+			std::remove(path.c_str());
+			const auto readU32 = [&bytes](const size_t offset) {
+				return static_cast<U32>(bytes[offset] | bytes[offset + 1] << 8 | bytes[offset + 2] << 16 | bytes[offset + 3] << 24);
+			};
+			Assert::IsTrue(std::equal(bytes.begin(), bytes.begin() + 4, "RIFF"));
+			Assert::AreEqual(36u + 400u, readU32(4));
+			Assert::AreEqual(48000u, readU32(24));
+			Assert::AreEqual(400u, readU32(40));
+			// Second sample, left then right
+			Assert::AreEqual(1, bytes[48] | bytes[49] << 8);
+			Assert::AreEqual(0xFFFF, bytes[50] | bytes[51] << 8);
+		}
+
+		TEST_METHOD(TestJoypad)
+		{
+			Cpu.Joypad.SetButtons(CJoypad::BUTTON_RIGHT | CJoypad::BUTTON_A);
+			// Nothing selected
+			Assert::AreEqual(0xFF, static_cast<int>(Cpu.Bus.Read(CJoypad::P1_ADDRESS)));
+			Assert::AreEqual(0, Cpu.Bus.Read(0xFF0F) & 1 << static_cast<U8>(EInterrupt::Joypad));
+			// Selecting the directions shows Right, a button that is down now requests the interrupt
+			Cpu.Bus.Write(CJoypad::P1_ADDRESS, 0x20);
+			Assert::AreEqual(0xEE, static_cast<int>(Cpu.Bus.Read(CJoypad::P1_ADDRESS)));
+			Assert::AreNotEqual(0, Cpu.Bus.Read(0xFF0F) & 1 << static_cast<U8>(EInterrupt::Joypad));
+			Cpu.Bus.Write(0xFF0F, 0);
+			Cpu.Bus.Write(CJoypad::P1_ADDRESS, 0x10);
+			Assert::AreEqual(0xDE, static_cast<int>(Cpu.Bus.Read(CJoypad::P1_ADDRESS)));
+			// Releasing does not request it, pressing Start does
+			Cpu.Bus.Write(0xFF0F, 0);
+			Cpu.Joypad.SetButtons(0);
+			Assert::AreEqual(0xDF, static_cast<int>(Cpu.Bus.Read(CJoypad::P1_ADDRESS)));
+			Assert::AreEqual(0, Cpu.Bus.Read(0xFF0F) & 1 << static_cast<U8>(EInterrupt::Joypad));
+			Cpu.Joypad.SetButtons(CJoypad::BUTTON_START | CJoypad::BUTTON_DOWN);
+			Assert::AreEqual(0xD7, static_cast<int>(Cpu.Bus.Read(CJoypad::P1_ADDRESS)));
+			Assert::AreNotEqual(0, Cpu.Bus.Read(0xFF0F) & 1 << static_cast<U8>(EInterrupt::Joypad));
+		}
+
+		TEST_METHOD(TestThreadPool)
+		{
+			CThreadPool pool(4);
+			Assert::AreEqual(4u, pool.GetThreadCount());
+			constexpr size_t COUNT = 1000;
+			std::vector<std::atomic<int>> runs(COUNT);
+			std::atomic<bool> badWorker{ false };
+			// The first item holds up worker 0, the others take over the rest of its share
+			pool.ParallelFor(COUNT, [&](const size_t item, const U32 worker) {
+				if (item == 0)
+				{
+					std::this_thread::sleep_for(std::chrono::milliseconds(50));
+				}
+				runs[item].fetch_add(1);
+				badWorker = badWorker || worker >= 4;
+			});
+			Assert::IsTrue(std::all_of(runs.begin(), runs.end(), [](const std::atomic<int>& count) { return count == 1; }));
+			Assert::IsFalse(badWorker);
+			Assert::IsTrue(pool.GetStolen() > 0);
+
+			// Fewer items than threads and no items at all
+			std::atomic<size_t> sum{ 0 };
+			pool.ParallelFor(3, [&sum](const size_t item, U32) { sum += item + 1; });
+			pool.ParallelFor(0, [&sum](size_t, U32) { sum += 100; });
+			Assert::AreEqual(static_cast<size_t>(6), sum.load());
+		}
+
+		TEST_METHOD(TestMachineBatch)
+		{
+			// Selects the directions, stores them active-high to C000 and counts the reads in C001
+			const U8 program[] = {
+				0x21, 0x01, 0xC0, // LD HL, C001
+				0x3E, 0x20, // LD A, 20
+				0xE0, 0x00, // LDH (00), A
+				0xF0, 0x00, // LDH A, (00)
+				0x2F, // CPL
+				0xE6, 0x0F, // AND 0F
+				0xEA, 0x00, 0xC0, // LD (C000), A
+				0x34, // INC (HL)
+				0x18, 0xF2 // JR -14
+			};
+			std::vector<U8> rom(2 * CMemoryBus::ROM_BANK_SIZE);
+			std::copy(std::begin(program), std::end(program), rom.begin() + 0x100);
+			CThreadPool pool(3);
+			CMachineBatch batch(pool, 4, rom.data(), rom.size(), EMbcType::None, 0);
+			Assert::AreEqual(static_cast<size_t>(4), batch.GetCount());
+			Assert::AreEqual(sizeof(CPpu::Frame), batch.GetObservationSize());
+
+			batch.ObserveRam({ { 0xC000, 2 } });
+			Assert::AreEqual(static_cast<size_t>(2), batch.GetObservationSize());
+			const U8 buttons[] = { 0, CJoypad::BUTTON_RIGHT, CJoypad::BUTTON_LEFT | CJoypad::BUTTON_A, CJoypad::BUTTON_RIGHT };
+			batch.Step(buttons);
+			for (size_t i = 0; i < batch.GetCount(); ++i)
+			{
+				Assert::AreEqual(buttons[i] & 0x0F, static_cast<int>(batch.GetObservation(i)[0]));
+				// Every machine ran the same number of loops
+				Assert::AreEqual(static_cast<int>(batch.GetObservation(0)[1]), static_cast<int>(batch.GetObservation(i)[1]));
+			}
+			Assert::IsTrue(batch.GetObservations() + 2 == batch.GetObservation(1));
+			Assert::IsTrue(batch.GetMachine(1).GetCycles() >= CPpu::FRAME_CYCLES);
+
+			// Machines with the same input end in the same state whichever thread ran them
+			batch.Step(buttons, 3);
+			std::vector<U8> first(batch.GetMachine(1).GetSaveStateSize()), second(first.size());
+			Assert::IsTrue(batch.GetMachine(1).SaveState(first.data(), first.size()) == ESaveStateError::None);
+			Assert::IsTrue(batch.GetMachine(3).SaveState(second.data(), second.size()) == ESaveStateError::None);
+			Assert::IsTrue(first == second);
+
+			// Reset to the state of machine 2
+			Assert::IsTrue(batch.Reset(0) == ESaveStateError::BadHeader);
+			Assert::IsTrue(batch.TakeSnapshot(2) == ESaveStateError::None);
+			const std::vector<U8> snapshot(batch.GetObservation(2), batch.GetObservation(2) + 2);
+			batch.Step(nullptr);
+			Assert::AreEqual(0, static_cast<int>(batch.GetObservation(2)[0]));
+			Assert::IsTrue(batch.ResetAll() == ESaveStateError::None);
+			for (size_t i = 0; i < batch.GetCount(); ++i)
+			{
+				Assert::IsTrue(std::equal(snapshot.begin(), snapshot.end(), batch.GetObservation(i)));
+			}
+			batch.ObserveFrames();
+			batch.Step(nullptr);
+			Assert::IsTrue(std::equal(batch.GetObservation(0), batch.GetObservation(1), batch.GetObservation(3)));
+		}
+
+		TEST_METHOD(TestLaneAlu)
+		{
+			U32 seed = 7;
+			const auto next = [&seed] {
+				seed = seed * 1103515245 + 12345;
+				return static_cast<U8>(seed >> 16);
+			};
+			SLaneRegisters start;
+			for (U32 lane = 0; lane < SLaneRegisters::LANES; ++lane)
+			{
+				for (const U8 encoding : { 0, 1, 2, 3, 4, 5, 7 })
+				{
+					start.R8(encoding)[lane] = next();
+				}
+				start.F[lane] = next() & 0xF0;
+			}
+			// Lane 3 tests the zero and wrap cases
+			start.A[3] = 0xFF;
+			start.B[3] = 0x01;
+			start.C[3] = 0x00;
+
+			// Every lane against CProcessor::Execute on its own registers
+			const auto expect = [](const SLaneRegisters& registers, const std::array<U16, SLaneRegisters::LANES>& opcodes, const EInstruction* instructions, const ERegisterTarget* targets) {
+				SLaneRegisters expected = registers;
+				CProcessor cpu;
+				for (U32 lane = 0; lane < SLaneRegisters::LANES; ++lane)
+				{
+					Assert::IsTrue(CProcessor::Encode(instructions[lane], targets[lane]) == opcodes[lane]);
+					cpu.Registers = registers.GetLane(lane);
+					cpu.Execute(instructions[lane], targets[lane]);
+					expected.SetLane(lane, cpu.Registers);
+				}
+				return expected;
+			};
+			const auto equal = [](const SLaneRegisters& left, const SLaneRegisters& right) {
+				return left.A == right.A && left.F == right.F && left.B == right.B && left.C == right.C
+					&& left.D == right.D && left.E == right.E && left.H == right.H && left.L == right.L;
+			};
+
+			const EInstruction instructions[] = {
+				EInstruction::ADD, EInstruction::SUB, EInstruction::AND, EInstruction::OR, EInstruction::XOR,
+				EInstruction::CP, EInstruction::INC, EInstruction::DEC, EInstruction::SWAP
+			};
+			const ERegisterTarget targets[] = { ERegisterTarget::A, ERegisterTarget::B, ERegisterTarget::C, ERegisterTarget::L };
+			for (const EPixelPath path : { EPixelPath::Scalar, EPixelPath::Sse2, EPixelPath::Avx2 })
+			{
+				const SLaneKernels& kernels = CLaneAlu::Get(path);
+				for (const EInstruction instruction : instructions)
+				{
+					for (const ERegisterTarget target : targets)
+					{
+						std::array<U16, SLaneRegisters::LANES> opcodes;
+						opcodes.fill(CProcessor::Encode(instruction, target));
+						std::vector<EInstruction> laneInstructions(SLaneRegisters::LANES, instruction);
+						std::vector<ERegisterTarget> laneTargets(SLaneRegisters::LANES, target);
+						SLaneRegisters registers = start;
+						Assert::IsTrue(CLaneAlu::Execute(opcodes, registers, kernels));
+						Assert::IsTrue(equal(registers, expect(start, opcodes, laneInstructions.data(), laneTargets.data())));
+					}
+				}
+
+				// Diverged lanes, a different instruction in every lane
+				std::array<U16, SLaneRegisters::LANES> opcodes;
+				std::vector<EInstruction> laneInstructions(SLaneRegisters::LANES);
+				std::vector<ERegisterTarget> laneTargets(SLaneRegisters::LANES);
+				for (U32 lane = 0; lane < SLaneRegisters::LANES; ++lane)
+				{
+					laneInstructions[lane] = instructions[lane % std::size(instructions)];
+					laneTargets[lane] = targets[lane % std::size(targets)];
+					opcodes[lane] = CProcessor::Encode(laneInstructions[lane], laneTargets[lane]);
+				}
+				SLaneRegisters registers = start;
+				Assert::IsTrue(CLaneAlu::Execute(opcodes, registers, kernels));
+				Assert::IsTrue(equal(registers, expect(start, opcodes, laneInstructions.data(), laneTargets.data())));
+
+				// ADC is not a lane op, nothing runs
+				opcodes[5] = CProcessor::Encode(EInstruction::ADDC, ERegisterTarget::B);
+				registers = start;
+				Assert::IsFalse(CLaneAlu::Execute(opcodes, registers, kernels));
+				Assert::IsTrue(equal(registers, start));
+			}
+		}
+
+		TEST_METHOD(TestInterrupts)
+		{
+			// EI / NOP / NOP
+			const U8 program[] = { 0xFB, 0x00, 0x00 };
+			loadProgram(program, sizeof(program));
+			Cpu.Registers.SP = 0xD000;
+			Cpu.Bus.Write(0xFFFF, 1 << static_cast<U8>(EInterrupt::Timer));
+			Cpu.Bus.RequestInterrupt(EInterrupt::Timer);
+
+			// The instruction after EI still runs before the interrupt
+			Cpu.Step();
+			Cpu.Step();
+			Assert::AreEqual(0xC002, static_cast<int>(Cpu.Registers.PC));
+			Assert::AreEqual(20, static_cast<int>(Cpu.Step()));
+			Assert::AreEqual(0x50, static_cast<int>(Cpu.Registers.PC));
+			Assert::IsFalse(Cpu.IsInterruptMasterEnabled());
+			Assert::AreEqual(0, static_cast<int>(Cpu.Bus.GetPendingInterrupts()));
+
+			// EI with IME already set does not hold back an interrupt at the next instruction
+			Cpu.Registers.PC = 0xC000;
+			Cpu.Step();
+			Cpu.Step();
+			Assert::IsTrue(Cpu.IsInterruptMasterEnabled());
+			Cpu.Registers.PC = 0xC000;
+			Cpu.Step();
+			Cpu.Bus.RequestInterrupt(EInterrupt::Timer);
+			Assert::AreEqual(20, static_cast<int>(Cpu.Step()));
+			Assert::AreEqual(0x50, static_cast<int>(Cpu.Registers.PC));
+
+			// HALT is left once an interrupt is pending, even with IME off
+			Cpu.Registers.PC = 0xC000;
+			Cpu.Bus.Write(0xC000, 0x76);
+			Cpu.Step();
+			Assert::IsTrue(Cpu.GetMode() == ECpuMode::Halted);
+			Cpu.Step();
+			Assert::AreEqual(0xC001, static_cast<int>(Cpu.Registers.PC));
+			Cpu.Bus.RequestInterrupt(EInterrupt::Timer);
+			Cpu.Step();
+			Assert::IsTrue(Cpu.GetMode() == ECpuMode::Running);
+		}
+
+		TEST_METHOD(TestCbOps)
+		{
+			Cpu.Registers.C = 0b1000'0001;
+			Cpu.Execute(EInstruction::RLC, ERegisterTarget::C);
+			Assert::AreEqual(0b0000'0011, static_cast<int>(Cpu.Registers.C));
+			Assert::IsTrue(Cpu.Registers.GetFlags().Carry);
+
+			Cpu.Execute(EInstruction::RR, ERegisterTarget::C);
+			Assert::AreEqual(0b1000'0001, static_cast<int>(Cpu.Registers.C));
+			Assert::IsTrue(Cpu.Registers.GetFlags().Carry);
+
+			Cpu.Execute(EInstruction::SRL, ERegisterTarget::C);
+			Assert::AreEqual(0b0100'0000, static_cast<int>(Cpu.Registers.C));
+
+			Cpu.Execute(EInstruction::BIT, ERegisterTarget::C, 6);
+			Assert::IsFalse(Cpu.Registers.GetFlags().Zero);
+			Cpu.Execute(EInstruction::RESET, ERegisterTarget::C, 6);
+			Assert::AreEqual(0, static_cast<int>(Cpu.Registers.C));
+			Cpu.Execute(EInstruction::BIT, ERegisterTarget::C, 6);
+			Assert::IsTrue(Cpu.Registers.GetFlags().Zero);
+			Cpu.Execute(EInstruction::SET, ERegisterTarget::C, 3);
+			Assert::AreEqual(8, static_cast<int>(Cpu.Registers.C));
+		}
 	};
 }